@@ -0,0 +1,75 @@
+#ifndef _LAT_HIST_H
+#define _LAT_HIST_H
+
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Log-linear latency histogram shared by the benchmarks: 16 sub-buckets per
+ * power of two, so percentiles are within ~6% and memory is fixed.
+ */
+#define SUB_BITS 4
+#define SUB_BUCKETS (1 << SUB_BITS)
+#define HIST_BUCKETS (64 * SUB_BUCKETS)
+
+struct hist {
+	uint64_t count;
+	uint64_t total_ns;
+	uint64_t max_ns;
+	uint64_t bucket[HIST_BUCKETS];
+};
+
+static inline uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static inline int hist_index(uint64_t v) {
+	if (v < SUB_BUCKETS)
+		return v;
+	int exp = 63 - __builtin_clzll(v);
+	int sub = (v >> (exp - SUB_BITS)) & (SUB_BUCKETS - 1);
+	return (exp - SUB_BITS + 1) * SUB_BUCKETS + sub;
+}
+
+static inline uint64_t hist_value(int idx) {
+	if (idx < SUB_BUCKETS)
+		return idx;
+	int exp = idx / SUB_BUCKETS + SUB_BITS - 1;
+	uint64_t sub = idx % SUB_BUCKETS;
+	// midpoint of the bucket
+	return ((SUB_BUCKETS + sub) << (exp - SUB_BITS)) + (1ull << (exp - SUB_BITS)) / 2;
+}
+
+static inline void hist_add(struct hist *h, uint64_t ns) {
+	h->count++;
+	h->total_ns += ns;
+	if (ns > h->max_ns)
+		h->max_ns = ns;
+	h->bucket[hist_index(ns)]++;
+}
+
+static inline void hist_merge(struct hist *into, const struct hist *h) {
+	into->count += h->count;
+	into->total_ns += h->total_ns;
+	if (h->max_ns > into->max_ns)
+		into->max_ns = h->max_ns;
+	for (int i = 0; i < HIST_BUCKETS; i++)
+		into->bucket[i] += h->bucket[i];
+}
+
+static inline uint64_t hist_pct(const struct hist *h, double pct) {
+	if (h->count == 0)
+		return 0;
+	uint64_t want = (uint64_t)(h->count * pct / 100.0);
+	uint64_t seen = 0;
+	for (int i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->bucket[i];
+		if (seen > want)
+			return hist_value(i);
+	}
+	return h->max_ns;
+}
+
+#endif
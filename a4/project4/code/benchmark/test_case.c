@@ -211,6 +211,162 @@ int main(int argc, char **argv) {
 	printf("TEST 10: Large file read Success \n");
 	close(fd);	
 
+
+	/* TEST 11: rename error test */
+	mkdir(TESTDIR "/ren", DIRPERM);
+	mkdir(TESTDIR "/ren/a", DIRPERM);
+	mkdir(TESTDIR "/ren/a/b", DIRPERM);
+	mkdir(TESTDIR "/ren/x", DIRPERM);
+	mkdir(TESTDIR "/ren/x/y", DIRPERM);
+	if ((fd = creat(TESTDIR "/ren/f", FILEPERM)) < 0) {
+		perror("creat");
+		printf("TEST 11: Rename error failure \n");
+		exit(1);
+	}
+	close(fd);
+
+	if (rename(TESTDIR "/ren/a", TESTDIR "/ren/a/b/c") == 0 || errno != EINVAL) {
+		printf("TEST 11: Rename into own subdirectory did not fail with EINVAL \n");
+		exit(1);
+	}
+	if (rename(TESTDIR "/ren/a", TESTDIR "/ren/x") == 0 || errno != ENOTEMPTY) {
+		printf("TEST 11: Rename over non-empty directory did not fail with ENOTEMPTY \n");
+		exit(1);
+	}
+	if (rename(TESTDIR "/ren/f", TESTDIR "/ren/a") == 0 || errno != EISDIR) {
+		printf("TEST 11: Rename of file over directory did not fail with EISDIR \n");
+		exit(1);
+	}
+	if (rename(TESTDIR "/ren/a", TESTDIR "/ren/f") == 0 || errno != ENOTDIR) {
+		printf("TEST 11: Rename of directory over file did not fail with ENOTDIR \n");
+		exit(1);
+	}
+	printf("TEST 11: Rename error success \n");
+
+
+	/* TEST 12: rename and link count test */
+	if (link(TESTDIR "/ren/f", TESTDIR "/ren/g") < 0) {
+		perror("link");
+		printf("TEST 12: Link failure \n");
+		exit(1);
+	}
+
+	/* Renaming a file over another name of itself changes nothing */
+	if (rename(TESTDIR "/ren/f", TESTDIR "/ren/g") < 0 || stat(TESTDIR "/ren/f", &st) < 0
+		|| stat(TESTDIR "/ren/g", &st) < 0 || st.st_nlink != 2) {
+		printf("TEST 12: Rename over own hard link failure \n");
+		exit(1);
+	}
+
+	/* Overwriting one of two names leaves the other with one link */
+	if ((fd = creat(TESTDIR "/ren/h", FILEPERM)) < 0 || close(fd) < 0
+		|| link(TESTDIR "/ren/h", TESTDIR "/ren/h2") < 0
+		|| (fd = creat(TESTDIR "/ren/k", FILEPERM)) < 0 || close(fd) < 0) {
+		perror("creat");
+		printf("TEST 12: Link count failure \n");
+		exit(1);
+	}
+	struct stat k_st;
+	stat(TESTDIR "/ren/k", &k_st);
+	if (rename(TESTDIR "/ren/k", TESTDIR "/ren/h") < 0) {
+		perror("rename");
+		printf("TEST 12: Rename overwrite failure \n");
+		exit(1);
+	}
+	if (stat(TESTDIR "/ren/h2", &st) < 0 || st.st_nlink != 1) {
+		printf("TEST 12: Overwritten file link count failure \n");
+		exit(1);
+	}
+	if (stat(TESTDIR "/ren/h", &st) < 0 || st.st_ino != k_st.st_ino || st.st_nlink != 1
+		|| stat(TESTDIR "/ren/k", &st) == 0) {
+		printf("TEST 12: Renamed file link count failure \n");
+		exit(1);
+	}
+	printf("TEST 12: Rename and link count success \n");
+
+	unlink(TESTDIR "/ren/f");
+	unlink(TESTDIR "/ren/g");
+	unlink(TESTDIR "/ren/h");
+	unlink(TESTDIR "/ren/h2");
+	rmdir(TESTDIR "/ren/a/b");
+	rmdir(TESTDIR "/ren/a");
+	rmdir(TESTDIR "/ren/x/y");
+	rmdir(TESTDIR "/ren/x");
+	rmdir(TESTDIR "/ren");
+
+
+	/* TEST 13: clone test, the clone shares the source's blocks until written */
+	mkdir(TESTDIR "/clone", DIRPERM);
+	if ((fd = creat(TESTDIR "/clone/src", FILEPERM)) < 0) {
+		perror("creat");
+		printf("TEST 13: Clone source create failure \n");
+		exit(1);
+	}
+	for (i = 0; i < ITERS; i++) {
+		memset(buf, 0x61 + i % 26, BLOCKSIZE);
+		if (write(fd, buf, BLOCKSIZE) != BLOCKSIZE) {
+			printf("TEST 13: Clone source write failure \n");
+			exit(1);
+		}
+	}
+	close(fd);
+
+	/* paths in the clone command are relative to the mount point */
+	const char *clone_cmd = "/clone/src /clone/copy\n";
+	if ((fd = open(TESTDIR "/.tfs_clone", O_WRONLY)) < 0
+		|| write(fd, clone_cmd, strlen(clone_cmd)) != (ssize_t)strlen(clone_cmd)) {
+		perror("clone");
+		printf("TEST 13: Clone failure \n");
+		exit(1);
+	}
+	close(fd);
+
+	/* Write to the clone, the source must not see it */
+	memset(buf, 'Z', BLOCKSIZE);
+	if ((fd = open(TESTDIR "/clone/copy", O_WRONLY)) < 0 || pwrite(fd, buf, BLOCKSIZE, 3*BLOCKSIZE) != BLOCKSIZE) {
+		perror("pwrite");
+		printf("TEST 13: Clone write failure \n");
+		exit(1);
+	}
+	close(fd);
+
+	if ((fd = open(TESTDIR "/clone/src", O_RDONLY)) < 0) {
+		perror("open");
+		exit(1);
+	}
+	for (i = 0; i < ITERS; i++) {
+		if (pread(fd, buf, BLOCKSIZE, i*BLOCKSIZE) != BLOCKSIZE || buf[0] != 0x61 + i % 26
+			|| buf[BLOCKSIZE - 1] != 0x61 + i % 26) {
+			printf("TEST 13: Clone source changed by a write to the clone \n");
+			exit(1);
+		}
+	}
+	close(fd);
+
+	/* The clone keeps the shared blocks once the source is gone */
+	if (unlink(TESTDIR "/clone/src") < 0) {
+		perror("unlink");
+		printf("TEST 13: Clone source unlink failure \n");
+		exit(1);
+	}
+	if ((fd = open(TESTDIR "/clone/copy", O_RDONLY)) < 0) {
+		perror("open");
+		exit(1);
+	}
+	for (i = 0; i < ITERS; i++) {
+		char expect = i == 3 ? 'Z' : 0x61 + i % 26;
+		if (pread(fd, buf, BLOCKSIZE, i*BLOCKSIZE) != BLOCKSIZE || buf[0] != expect
+			|| buf[BLOCKSIZE - 1] != expect) {
+			printf("TEST 13: Clone read after source unlink failure \n");
+			exit(1);
+		}
+	}
+	close(fd);
+	printf("TEST 13: Clone success \n");
+
+	unlink(TESTDIR "/clone/copy");
+	rmdir(TESTDIR "/clone");
+
 	//end timer
 	gettimeofday(&end,NULL);
 	//find difference
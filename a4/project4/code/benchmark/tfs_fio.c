@@ -0,0 +1,284 @@
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/types.h>
+#include <pthread.h>
+#include <time.h>
+#include <limits.h>
+
+#include "lat_hist.h"
+#include "../libtfs.h"
+
+/* You need to change this macro to your TFS mount point*/
+#define TESTDIR "/tmp/ds1576/mountdir"
+
+/*
+ * Parameterized data-path benchmark, in the spirit of fio.
+ *
+ * Every thread lays out its own file of -s bytes, then issues -b sized I/Os
+ * against it for -w seconds of warm-up and -T seconds of measurement. The
+ * result is printed as JSON on stdout.
+ *
+ * usage: tfs_fio [-d dir | -i image] [-s file_size] [-b io_size] [-p seq|rand|mixed]
+ *                [-r read_pct] [-t threads] [-T seconds] [-w warmup_seconds]
+ *                [-D] [-k]
+ *   sizes accept a k/m/g suffix
+ *   -i  mount image in-process through libtfs instead of going through a
+ *       FUSE mount, which measures the file system without FUSE and the kernel
+ *   -D  drop the page cache (needs root) after layout and after warm-up
+ *   -k  keep the test files afterwards
+ */
+
+#define MAX_THREADS 256
+
+enum pattern { PAT_SEQ, PAT_RAND, PAT_MIXED };
+
+struct worker {
+	pthread_t tid;
+	int id;
+	int fd;
+	struct tfs_file *file;		/* with -i */
+	char path[PATH_MAX];
+	char *buf;
+	uint64_t rng;
+	uint64_t next_off;
+	struct hist rd;
+	struct hist wr;
+	int err;
+};
+
+static const char *dir = TESTDIR;
+static const char *image;
+static uint64_t file_size = 16 * 1024 * 1024;
+static uint64_t io_size = 4096;
+static enum pattern pattern = PAT_SEQ;
+static int read_pct = 100;
+static int nthreads = 1;
+static int duration = 10;
+static int warmup = 2;
+static int drop = 0;
+static int keep = 0;
+
+static struct worker workers[MAX_THREADS];
+static volatile int phase_stop;
+static volatile int measuring;
+
+static inline uint64_t xorshift(uint64_t *s) {
+	uint64_t x = *s;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return *s = x;
+}
+
+static uint64_t parse_size(const char *s) {
+	char *end;
+	uint64_t v = strtoull(s, &end, 10);
+	switch (*end) {
+	case 'g': case 'G': v <<= 10;	/* fall through */
+	case 'm': case 'M': v <<= 10;	/* fall through */
+	case 'k': case 'K': v <<= 10;
+	}
+	return v;
+}
+
+static void usage(const char *prog) {
+	fprintf(stderr, "usage: %s [-d dir | -i image] [-s file_size] [-b io_size] [-p seq|rand|mixed] "
+		"[-r read_pct] [-t threads] [-T seconds] [-w warmup_seconds] [-D] [-k]\n", prog);
+	exit(1);
+}
+
+static void drop_caches() {
+	for (int i = 0; i < nthreads; i++) {
+		fsync(workers[i].fd);
+		posix_fadvise(workers[i].fd, 0, 0, POSIX_FADV_DONTNEED);
+	}
+	sync();
+	int fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+	if (fd < 0 || write(fd, "3", 1) != 1)
+		fprintf(stderr, "warning: could not drop page cache (not root?)\n");
+	if (fd >= 0)
+		close(fd);
+}
+
+/* I/O on a worker's file, through the mount or through libtfs */
+static ssize_t file_io(struct worker *w, int is_read, uint64_t off) {
+	if (image == NULL)
+		return is_read ? pread(w->fd, w->buf, io_size, off) : pwrite(w->fd, w->buf, io_size, off);
+	int ret = is_read ? tfs_pread(w->file, w->buf, io_size, off) : tfs_pwrite(w->file, w->buf, io_size, off);
+	if (ret < 0) {
+		errno = -ret;
+		return -1;
+	}
+	return ret;
+}
+
+static uint64_t next_offset(struct worker *w) {
+	uint64_t nblocks = file_size / io_size;
+	int random = pattern == PAT_RAND || (pattern == PAT_MIXED && (xorshift(&w->rng) & 1));
+	if (random)
+		w->next_off = (xorshift(&w->rng) % nblocks) * io_size;
+	uint64_t off = w->next_off;
+	w->next_off += io_size;
+	if (w->next_off + io_size > file_size)
+		w->next_off = 0;
+	return off;
+}
+
+static void *run(void *arg) {
+	struct worker *w = arg;
+	while (!phase_stop) {
+		uint64_t off = next_offset(w);
+		int is_read = (int)(xorshift(&w->rng) % 100) < read_pct;
+		uint64_t start = now_ns();
+		ssize_t ret = file_io(w, is_read, off);
+		uint64_t ns = now_ns() - start;
+		if (ret != (ssize_t)io_size) {
+			perror(is_read ? "pread" : "pwrite");
+			w->err = 1;
+			break;
+		}
+		if (measuring)
+			hist_add(is_read ? &w->rd : &w->wr, ns);
+	}
+	return NULL;
+}
+
+/* Run every worker for the given number of seconds */
+static void run_phase(int seconds, int measure) {
+	phase_stop = 0;
+	measuring = measure;
+	for (int i = 0; i < nthreads; i++)
+		pthread_create(&workers[i].tid, NULL, run, &workers[i]);
+	sleep(seconds);
+	phase_stop = 1;
+	for (int i = 0; i < nthreads; i++)
+		pthread_join(workers[i].tid, NULL);
+}
+
+static void layout(struct worker *w) {
+	snprintf(w->path, sizeof(w->path), "%s/fio.%d", image ? "" : dir, w->id);
+	int ret = image ? tfs_open(w->path, O_RDWR | O_CREAT, 0666, &w->file) : 0;
+	if (ret < 0 || (image == NULL && (w->fd = open(w->path, O_RDWR | O_CREAT, 0666)) < 0)) {
+		errno = ret < 0 ? -ret : errno;
+		perror("open");
+		exit(1);
+	}
+	w->buf = malloc(io_size);
+	memset(w->buf, 0x61 + w->id % 26, io_size);
+	for (uint64_t off = 0; off + io_size <= file_size; off += io_size) {
+		if (file_io(w, 0, off) != (ssize_t)io_size) {
+			perror("layout");
+			exit(1);
+		}
+	}
+	w->rng = 0x9E3779B97F4A7C15ull * (w->id + 1);
+}
+
+static void print_hist(const char *name, const struct hist *h, double secs, int last) {
+	printf("    \"%s\": {\n", name);
+	printf("      \"ops\": %lu,\n", h->count);
+	printf("      \"iops\": %.1f,\n", h->count / secs);
+	printf("      \"bw_MBps\": %.2f,\n", h->count * io_size / secs / (1024 * 1024));
+	printf("      \"lat_ns\": { \"mean\": %lu, \"p50\": %lu, \"p99\": %lu, \"p999\": %lu, \"max\": %lu }\n",
+		h->count ? h->total_ns / h->count : 0, hist_pct(h, 50), hist_pct(h, 99),
+		hist_pct(h, 99.9), h->max_ns);
+	printf("    }%s\n", last ? "" : ",");
+}
+
+int main(int argc, char **argv) {
+	int c;
+	while ((c = getopt(argc, argv, "d:i:s:b:p:r:t:T:w:Dk")) != -1) {
+		switch (c) {
+		case 'd': dir = optarg; break;
+		case 'i': image = optarg; break;
+		case 's': file_size = parse_size(optarg); break;
+		case 'b': io_size = parse_size(optarg); break;
+		case 'p':
+			if (strcmp(optarg, "seq") == 0)
+				pattern = PAT_SEQ;
+			else if (strcmp(optarg, "rand") == 0)
+				pattern = PAT_RAND;
+			else if (strcmp(optarg, "mixed") == 0)
+				pattern = PAT_MIXED;
+			else
+				usage(argv[0]);
+			break;
+		case 'r': read_pct = atoi(optarg); break;
+		case 't': nthreads = atoi(optarg); break;
+		case 'T': duration = atoi(optarg); break;
+		case 'w': warmup = atoi(optarg); break;
+		case 'D': drop = 1; break;
+		case 'k': keep = 1; break;
+		default: usage(argv[0]);
+		}
+	}
+	if (io_size == 0 || file_size < io_size || nthreads < 1 || nthreads > MAX_THREADS
+		|| read_pct < 0 || read_pct > 100 || duration < 1 || warmup < 0)
+		usage(argv[0]);
+	// there is no page cache in front of libtfs
+	if (image != NULL) {
+		drop = 0;
+		if (tfs_mount(image) < 0)
+			exit(1);
+	}
+
+	for (int i = 0; i < nthreads; i++) {
+		workers[i].id = i;
+		layout(&workers[i]);
+	}
+	if (drop)
+		drop_caches();
+	if (warmup > 0)
+		run_phase(warmup, 0);
+	if (drop)
+		drop_caches();
+
+	uint64_t start = now_ns();
+	run_phase(duration, 1);
+	double secs = (now_ns() - start) / 1e9;
+
+	struct hist *rd = calloc(1, sizeof(struct hist));
+	struct hist *wr = calloc(1, sizeof(struct hist));
+	struct hist *all = calloc(1, sizeof(struct hist));
+	int err = 0;
+	for (int i = 0; i < nthreads; i++) {
+		hist_merge(rd, &workers[i].rd);
+		hist_merge(wr, &workers[i].wr);
+		err |= workers[i].err;
+		if (image != NULL) {
+			tfs_close(workers[i].file);
+			if (!keep)
+				tfs_unlink(workers[i].path);
+		} else {
+			close(workers[i].fd);
+			if (!keep)
+				unlink(workers[i].path);
+		}
+	}
+	if (image != NULL)
+		tfs_unmount();
+	hist_merge(all, rd);
+	hist_merge(all, wr);
+
+	static const char *pat_names[] = { "seq", "rand", "mixed" };
+	printf("{\n");
+	printf("  \"config\": { \"dir\": \"%s\", \"in_process\": %s, \"file_size\": %lu, \"io_size\": %lu, \"pattern\": \"%s\", "
+		"\"read_pct\": %d, \"threads\": %d, \"duration_s\": %d, \"warmup_s\": %d, \"drop_caches\": %s },\n",
+		image ? image : dir, image ? "true" : "false", file_size, io_size, pat_names[pattern], read_pct, nthreads, duration, warmup,
+		drop ? "true" : "false");
+	printf("  \"runtime_s\": %.3f,\n", secs);
+	printf("  \"errors\": %s,\n", err ? "true" : "false");
+	printf("  \"results\": {\n");
+	print_hist("read", rd, secs, 0);
+	print_hist("write", wr, secs, 0);
+	print_hist("total", all, secs, 1);
+	printf("  }\n}\n");
+	return err;
+}
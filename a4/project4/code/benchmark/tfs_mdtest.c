@@ -0,0 +1,304 @@
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <limits.h>
+
+#include "lat_hist.h"
+
+/* You need to change this macro to your TFS mount point*/
+#define TESTDIR "/tmp/ds1576/mountdir"
+
+/*
+ * Concurrent metadata benchmark, in the spirit of mdtest.
+ *
+ * -n processes each create -i directories and -i files, then stat, list,
+ * unlink and remove them, with all processes running each phase at the same
+ * time. Items are spread over the leaves of a directory tree with fan-out -f
+ * and depth -z. In private mode every process gets its own tree, in shared
+ * mode all processes work in one tree, which is the contended case. Per
+ * phase ops/sec and latency percentiles are printed as JSON.
+ *
+ * usage: tfs_mdtest [-d dir] [-n procs] [-i items] [-f fanout] [-z depth]
+ *                   [-m private|shared|both]
+ */
+
+#define MAX_PROCS 256
+#define FSPATHLEN 512
+#define FILEPERM 0666
+#define DIRPERM 0755
+
+enum phase { PH_TREE, PH_MKDIR, PH_CREATE, PH_STAT, PH_READDIR, PH_UNLINK, PH_RMDIR, PH_UNTREE, NUM_PHASES };
+static const char *phase_names[NUM_PHASES] = {
+	"tree_create", "mkdir", "create", "stat", "readdir", "unlink", "rmdir", "tree_remove"
+};
+
+/* lives in a shared mapping so the parent can merge the children's results */
+struct shared {
+	pthread_barrier_t barrier;
+	uint64_t phase_ns[NUM_PHASES];
+	uint64_t start_ns[MAX_PROCS][NUM_PHASES];	/* when each process began and finished a phase */
+	uint64_t end_ns[MAX_PROCS][NUM_PHASES];
+	struct hist lat[MAX_PROCS][NUM_PHASES];
+	int errors[MAX_PROCS];
+};
+
+static const char *dir = TESTDIR;
+static int nprocs = 1;
+static int items = 1000;
+static int fanout = 10;
+static int depth = 1;
+static int nleaves;
+static struct shared *sh;
+
+static void usage(const char *prog) {
+	fprintf(stderr, "usage: %s [-d dir] [-n procs] [-i items] [-f fanout] [-z depth] "
+		"[-m private|shared|both]\n", prog);
+	exit(1);
+}
+
+/* Path of the tree root used by a process */
+static void tree_root(char *path, int shared, int rank) {
+	if (shared)
+		snprintf(path, FSPATHLEN, "%s/mdtest.shared", dir);
+	else
+		snprintf(path, FSPATHLEN, "%s/mdtest.%d", dir, rank);
+}
+
+/* Path of leaf directory number leaf: one "d<n>" component per level */
+static void leaf_path(char *path, const char *root, int leaf) {
+	int len = snprintf(path, FSPATHLEN, "%s", root);
+	int div = 1;
+	for (int l = 1; l < depth; l++)
+		div *= fanout;
+	for (int l = 0; l < depth; l++) {
+		len += snprintf(path + len, FSPATHLEN - len, "/d%d", (leaf / div) % fanout);
+		div /= fanout;
+	}
+}
+
+/* Directories of the tree in creation order (parents first), or removal order */
+static int tree_walk(const char *root, int rank, struct hist *h, int remove) {
+	char path[FSPATHLEN];
+	int errors = 0;
+	int levels_n[depth + 1];
+	levels_n[0] = 1;
+	for (int l = 1; l <= depth; l++)
+		levels_n[l] = levels_n[l - 1] * fanout;
+
+	for (int step = 0; step <= depth; step++) {
+		int l = remove ? depth - step : step;
+		for (int n = 0; n < levels_n[l]; n++) {
+			// a node at level l is the prefix of leaf n * fanout^(depth-l)
+			int len = snprintf(path, FSPATHLEN, "%s", root);
+			int div = levels_n[l] / fanout;
+			for (int k = 0; k < l; k++) {
+				len += snprintf(path + len, FSPATHLEN - len, "/d%d", (n / div) % fanout);
+				div /= fanout;
+			}
+			uint64_t start = now_ns();
+			int ret = remove ? rmdir(path) : mkdir(path, DIRPERM);
+			hist_add(h, now_ns() - start);
+			if (ret < 0) {
+				perror(remove ? "rmdir" : "mkdir");
+				errors++;
+			}
+		}
+	}
+	return errors;
+}
+
+static int run_phase(enum phase ph, int shared, int rank) {
+	char root[FSPATHLEN], leaf[FSPATHLEN], path[FSPATHLEN + 64];
+	struct hist *h = &sh->lat[rank][ph];
+	struct stat st;
+	int errors = 0;
+
+	tree_root(root, shared, rank);
+	if (ph == PH_TREE || ph == PH_UNTREE) {
+		// one process builds and removes the shared tree
+		if (shared && rank != 0)
+			return 0;
+		return tree_walk(root, rank, h, ph == PH_UNTREE);
+	}
+	if (ph == PH_READDIR) {
+		for (int l = 0; l < nleaves; l++) {
+			leaf_path(leaf, root, l);
+			uint64_t start = now_ns();
+			DIR *d = opendir(leaf);
+			if (d == NULL) {
+				perror("opendir");
+				errors++;
+				continue;
+			}
+			while (readdir(d) != NULL)
+				;
+			closedir(d);
+			hist_add(h, now_ns() - start);
+		}
+		return errors;
+	}
+
+	// the stat phase stats each item's file and then its directory
+	int kinds = ph == PH_STAT ? 2 : 1;
+	for (int n = 0; n < items * kinds; n++) {
+		int i = n / kinds;
+		int is_dir = ph == PH_MKDIR || ph == PH_RMDIR || (ph == PH_STAT && n % 2);
+		leaf_path(leaf, root, i % nleaves);
+		snprintf(path, sizeof(path), "%s/%s.%d.%d", leaf, is_dir ? "dir" : "file", rank, i);
+		uint64_t start = now_ns();
+		int ret = 0;
+		switch (ph) {
+		case PH_MKDIR:
+			ret = mkdir(path, DIRPERM);
+			break;
+		case PH_CREATE:
+			ret = creat(path, FILEPERM);
+			if (ret >= 0)
+				ret = close(ret);
+			break;
+		case PH_STAT:
+			ret = stat(path, &st);
+			break;
+		case PH_UNLINK:
+			ret = unlink(path);
+			break;
+		case PH_RMDIR:
+			ret = rmdir(path);
+			break;
+		default:
+			break;
+		}
+		hist_add(h, now_ns() - start);
+		if (ret < 0) {
+			perror(phase_names[ph]);
+			errors++;
+		}
+	}
+	return errors;
+}
+
+/*
+ * Every process runs each phase between two barriers and records when it
+ * began and finished. A phase lasts from the first process to begin to the
+ * last to finish, so waking from a barrier is not counted.
+ */
+static void child(int shared, int rank) {
+	for (int ph = 0; ph < NUM_PHASES; ph++) {
+		pthread_barrier_wait(&sh->barrier);
+		sh->start_ns[rank][ph] = now_ns();
+		sh->errors[rank] += run_phase(ph, shared, rank);
+		sh->end_ns[rank][ph] = now_ns();
+		pthread_barrier_wait(&sh->barrier);
+	}
+	exit(0);
+}
+
+static void run(int shared, int last) {
+	memset(sh->lat, 0, sizeof(sh->lat));
+	memset(sh->errors, 0, sizeof(sh->errors));
+	pthread_barrierattr_t attr;
+	pthread_barrierattr_init(&attr);
+	pthread_barrierattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_barrier_init(&sh->barrier, &attr, nprocs + 1);
+
+	for (int p = 0; p < nprocs; p++) {
+		pid_t pid = fork();
+		if (pid < 0) {
+			perror("fork");
+			exit(1);
+		}
+		if (pid == 0)
+			child(shared, p);
+	}
+	for (int ph = 0; ph < NUM_PHASES; ph++) {
+		pthread_barrier_wait(&sh->barrier);
+		pthread_barrier_wait(&sh->barrier);
+	}
+	for (int p = 0; p < nprocs; p++)
+		wait(NULL);
+	pthread_barrier_destroy(&sh->barrier);
+	for (int ph = 0; ph < NUM_PHASES; ph++) {
+		uint64_t first = UINT64_MAX, last = 0;
+		for (int p = 0; p < nprocs; p++) {
+			if (sh->start_ns[p][ph] < first)
+				first = sh->start_ns[p][ph];
+			if (sh->end_ns[p][ph] > last)
+				last = sh->end_ns[p][ph];
+		}
+		sh->phase_ns[ph] = last - first;
+	}
+
+	int errors = 0;
+	for (int p = 0; p < nprocs; p++)
+		errors += sh->errors[p];
+	printf("    \"%s\": {\n", shared ? "shared" : "private");
+	printf("      \"errors\": %d,\n", errors);
+	for (int ph = 0; ph < NUM_PHASES; ph++) {
+		struct hist *h = calloc(1, sizeof(struct hist));
+		for (int p = 0; p < nprocs; p++)
+			hist_merge(h, &sh->lat[p][ph]);
+		double secs = sh->phase_ns[ph] / 1e9;
+		printf("      \"%s\": { \"ops\": %lu, \"seconds\": %.6f, \"ops_per_sec\": %.1f, "
+			"\"lat_ns\": { \"mean\": %lu, \"p50\": %lu, \"p99\": %lu, \"p999\": %lu, \"max\": %lu } }%s\n",
+			phase_names[ph], h->count, secs, secs > 0 ? h->count / secs : 0.0,
+			h->count ? h->total_ns / h->count : 0, hist_pct(h, 50), hist_pct(h, 99),
+			hist_pct(h, 99.9), h->max_ns, ph == NUM_PHASES - 1 ? "" : ",");
+		free(h);
+	}
+	printf("    }%s\n", last ? "" : ",");
+}
+
+int main(int argc, char **argv) {
+	int c, do_private = 1, do_shared = 1;
+	while ((c = getopt(argc, argv, "d:n:i:f:z:m:")) != -1) {
+		switch (c) {
+		case 'd': dir = optarg; break;
+		case 'n': nprocs = atoi(optarg); break;
+		case 'i': items = atoi(optarg); break;
+		case 'f': fanout = atoi(optarg); break;
+		case 'z': depth = atoi(optarg); break;
+		case 'm':
+			do_private = strcmp(optarg, "private") == 0 || strcmp(optarg, "both") == 0;
+			do_shared = strcmp(optarg, "shared") == 0 || strcmp(optarg, "both") == 0;
+			if (!do_private && !do_shared)
+				usage(argv[0]);
+			break;
+		default: usage(argv[0]);
+		}
+	}
+	if (nprocs < 1 || nprocs > MAX_PROCS || items < 1 || fanout < 1 || depth < 0)
+		usage(argv[0]);
+	nleaves = 1;
+	for (int l = 0; l < depth; l++)
+		nleaves *= fanout;
+
+	sh = mmap(NULL, sizeof(struct shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (sh == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+
+	printf("{\n");
+	printf("  \"config\": { \"dir\": \"%s\", \"procs\": %d, \"items\": %d, \"fanout\": %d, \"depth\": %d },\n",
+		dir, nprocs, items, fanout, depth);
+	printf("  \"results\": {\n");
+	fflush(stdout);
+	if (do_private)
+		run(0, !do_shared);
+	fflush(stdout);
+	if (do_shared)
+		run(1, 1);
+	printf("  }\n}\n");
+	return 0;
+}
@@ -0,0 +1,641 @@
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/types.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <limits.h>
+
+#include "lat_hist.h"
+#include "../libtfs.h"
+#include "../stats.h"
+#include "../optrace.h"
+
+/* You need to change this macro to your TFS mount point*/
+#define TESTDIR "/tmp/ds1576/mountdir"
+
+/*
+ * Replays the call trace tfs writes at unmount when it is started with
+ * TFS_OPTRACE=<file>.
+ *
+ * Files and directories the trace uses without having made them are made
+ * first, files as long as the furthest read of them. Then every call is
+ * made again, by default one at a time in the order the calls started and
+ * as fast as they complete, which gives the same result on every run.
+ * With -p each recorded thread gets a thread that makes its calls in
+ * order, a call waiting for the calls that had returned when it was made,
+ * and with -r a call waits for the time it started at. Past MAX_THREADS
+ * recorded threads share replayers, recorded thread t going to replayer
+ * (t - 1) % MAX_THREADS, which makes their calls in start order. Each call's
+ * latency is put next to the recorded one, per operation, as JSON.
+ *
+ * usage: tfs_replay [-d dir | -i image] [-p] [-r] <tracefile>
+ *   -i  replay against image in-process through libtfs, on a fresh image
+ *       the trace was not recorded on
+ *   -p  replay the recorded threads in parallel
+ *   -r  keep the recorded timing instead of replaying at full speed
+ */
+
+#define MAX_THREADS 1024
+
+enum { H_PENDING, H_OPEN, H_FAILED, H_CLOSED };
+
+struct call {
+	struct optrace_rec rec;
+	char *path;
+	char *path2;
+	uint64_t seq;				/* position in the file, breaks start_ns ties */
+	uint64_t after;				/* calls that had returned when it started */
+	uint64_t end_rank;			/* place in the order calls returned in */
+};
+
+/* what a recorded open file became in the replay */
+struct handle {
+	int fd;
+	struct tfs_file *file;		/* with -i */
+	int state;					/* H_ stage the replay is at */
+	int opened;					/* the trace holds its open */
+	uint32_t uses;				/* reads and writes the trace makes of it */
+	uint32_t done;				/* of those, replayed */
+};
+
+struct replayer {
+	pthread_t tid;
+	struct hist rec_lat[NUM_OPS];
+	struct hist lat[NUM_OPS];
+	uint64_t mismatches[NUM_OPS];
+};
+
+static const char *dir = TESTDIR;
+static const char *image;
+static int parallel;
+static int realtime;
+
+static struct optrace_hdr hdr;
+static struct call *calls;
+static uint64_t ncalls;
+static struct handle *handles;
+static uint32_t max_file;
+static char *data;
+static uint32_t max_size;
+static uint64_t replay_start;
+static int prepare_errors;
+
+/*
+ * With -p a call waits for every call that had returned when it was made,
+ * so the threads keep the order the recording saw between them. Calls
+ * finish in any order, returned counts those in the order they returned
+ * in that are done with none missing before them.
+ */
+static pthread_mutex_t order_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t order_cond = PTHREAD_COND_INITIALIZER;
+static char *done;
+static uint64_t returned;
+
+static struct replayer replayers[MAX_THREADS];
+static int nreplayers;
+
+static void usage(const char *prog) {
+	fprintf(stderr, "usage: %s [-d dir | -i image] [-p] [-r] <tracefile>\n", prog);
+	exit(1);
+}
+
+static char *read_path(FILE *in, uint16_t len) {
+	char *p = malloc(len + 1);
+	if (len > 0 && fread(p, len, 1, in) != 1) {
+		free(p);
+		return NULL;
+	}
+	p[len] = 0;
+	return p;
+}
+
+static int by_start(const void *a, const void *b) {
+	const struct call *x = a, *y = b;
+	if (x->rec.start_ns != y->rec.start_ns)
+		return x->rec.start_ns < y->rec.start_ns ? -1 : 1;
+	return x->seq < y->seq ? -1 : (x->seq > y->seq);
+}
+
+static int by_return(const void *a, const void *b) {
+	const struct call *x = *(const struct call **)a, *y = *(const struct call **)b;
+	uint64_t xe = x->rec.start_ns + x->rec.lat_ns, ye = y->rec.start_ns + y->rec.lat_ns;
+	if (xe != ye)
+		return xe < ye ? -1 : 1;
+	return x->seq < y->seq ? -1 : (x->seq > y->seq);
+}
+
+static void load(const char *path) {
+	FILE *in = fopen(path, "r");
+	if (in == NULL || fread(&hdr, sizeof(hdr), 1, in) != 1 || hdr.magic != OPTRACE_MAGIC) {
+		fprintf(stderr, "%s: not an op trace\n", path);
+		exit(1);
+	}
+	if (hdr.version != OPTRACE_VERSION) {
+		fprintf(stderr, "%s: op trace version %u, expected %u\n", path, hdr.version, OPTRACE_VERSION);
+		exit(1);
+	}
+	// a process that never unmounted left records but no count, read to the end
+	uint64_t cap = hdr.nrecs ? hdr.nrecs : 1024;
+	calls = malloc(cap * sizeof(struct call));
+	for (ncalls = 0;; ncalls++) {
+		if (ncalls == cap)
+			calls = realloc(calls, (cap *= 2) * sizeof(struct call));
+		struct call *c = &calls[ncalls];
+		if (fread(&c->rec, sizeof(c->rec), 1, in) != 1)
+			break;
+		c->path = read_path(in, c->rec.path_len);
+		c->path2 = read_path(in, c->rec.path2_len);
+		uint32_t pad = optrace_rec_len(&c->rec) - sizeof(c->rec) - c->rec.path_len - c->rec.path2_len;
+		if (c->path == NULL || c->path2 == NULL || fseek(in, pad, SEEK_CUR) < 0
+			|| c->rec.op >= NUM_OPS || c->rec.thread == 0)
+			break;
+		c->seq = ncalls;
+		if (c->rec.file > max_file)
+			max_file = c->rec.file;
+		if (c->rec.size > max_size)
+			max_size = c->rec.size;
+		if (c->rec.thread > hdr.threads)
+			hdr.threads = c->rec.thread;
+	}
+	fclose(in);
+	if (ncalls != hdr.nrecs)
+		fprintf(stderr, "%s: %lu calls in the trace, its header says %lu\n", path, ncalls, hdr.nrecs);
+	qsort(calls, ncalls, sizeof(struct call), by_start);
+
+	// number the calls in the order they returned, and count for each call those back before it started
+	uint64_t *ends = malloc((ncalls + 1) * sizeof(uint64_t));
+	struct call **by_end = malloc((ncalls + 1) * sizeof(struct call *));
+	for (uint64_t i = 0; i < ncalls; i++)
+		by_end[i] = &calls[i];
+	qsort(by_end, ncalls, sizeof(struct call *), by_return);
+	for (uint64_t i = 0; i < ncalls; i++) {
+		by_end[i]->end_rank = i;
+		ends[i] = by_end[i]->rec.start_ns + by_end[i]->rec.lat_ns;
+	}
+	for (uint64_t i = 0, k = 0; i < ncalls; i++) {
+		while (k < ncalls && ends[k] < calls[i].rec.start_ns)
+			k++;
+		calls[i].after = k;
+	}
+	free(by_end);
+	free(ends);
+	done = calloc(ncalls + 1, 1);
+
+	handles = calloc(max_file + 1, sizeof(struct handle));
+	for (uint64_t i = 0; i < ncalls; i++) {
+		struct call *c = &calls[i];
+		if (c->rec.op == OP_READ || c->rec.op == OP_WRITE || c->rec.op == OP_FSYNC)
+			handles[c->rec.file].uses++;
+		if ((c->rec.op == OP_OPEN || c->rec.op == OP_CREATE) && c->rec.file != 0)
+			handles[c->rec.file].opened = 1;
+	}
+	data = malloc(max_size + 1);
+	memset(data, 0x61, max_size + 1);
+}
+
+/*
+ * The calls, through the mount or through libtfs. Each returns what the
+ * file system call would, 0 or a byte count, or -errno.
+ */
+static char *full_path(const char *path, char *buf) {
+	snprintf(buf, PATH_MAX, "%s%s", dir, path);
+	return buf;
+}
+
+static int sys_ret(long ret) {
+	return ret < 0 ? -errno : (int)ret;
+}
+
+static int no_fill(void *ctx, const char *name, const struct stat *st, off_t off) {
+	return 0;
+}
+
+static int list_dir(const char *path, int read_all) {
+	DIR *d = opendir(path);
+	if (d == NULL)
+		return -errno;
+	while (read_all && readdir(d) != NULL)
+		;
+	closedir(d);
+	return 0;
+}
+
+static int replay_open(struct call *c) {
+	struct tfs_file *file = NULL;
+	char p[PATH_MAX];
+	int fd = -1, ret;
+	if (image != NULL)
+		ret = tfs_open(c->path, c->rec.flags, c->rec.mode, &file);
+	else
+		ret = sys_ret(fd = open(full_path(c->path, p), c->rec.flags, c->rec.mode));
+	// an open that failed when recorded has nothing to close it
+	if (ret >= 0 && c->rec.file == 0) {
+		if (image != NULL)
+			tfs_close(file);
+		else
+			close(fd);
+	}
+	else if (c->rec.file != 0) {
+		struct handle *h = &handles[c->rec.file];
+		h->file = file;
+		h->fd = fd;
+		__atomic_store_n(&h->state, ret >= 0 ? H_OPEN : H_FAILED, __ATOMIC_RELEASE);
+	}
+	return ret < 0 ? ret : 0;
+}
+
+/*
+ * Reads and writes of a file opened by another thread wait for the open,
+ * NULL if it failed
+ */
+static struct handle *handle_of(struct call *c) {
+	struct handle *h = &handles[c->rec.file];
+	if (!h->opened)
+		return NULL;
+	int state;
+	while ((state = __atomic_load_n(&h->state, __ATOMIC_ACQUIRE)) == H_PENDING)
+		sched_yield();
+	return state == H_OPEN ? h : NULL;
+}
+
+static int replay_io(struct call *c) {
+	struct handle *h = handle_of(c);
+	if (h == NULL) {
+		__atomic_add_fetch(&handles[c->rec.file].done, 1, __ATOMIC_RELEASE);
+		return -EBADF;
+	}
+	int is_read = c->rec.op == OP_READ;
+	char *buf = is_read ? malloc(c->rec.size) : data;
+	int ret;
+	if (image != NULL)
+		ret = is_read ? tfs_pread(h->file, buf, c->rec.size, c->rec.offset)
+			: tfs_pwrite(h->file, buf, c->rec.size, c->rec.offset);
+	else
+		ret = sys_ret(is_read ? pread(h->fd, buf, c->rec.size, c->rec.offset)
+			: pwrite(h->fd, buf, c->rec.size, c->rec.offset));
+	if (is_read)
+		free(buf);
+	__atomic_add_fetch(&h->done, 1, __ATOMIC_RELEASE);
+	return ret;
+}
+
+static int replay_fsync(struct call *c) {
+	struct handle *h = handle_of(c);
+	if (h == NULL) {
+		__atomic_add_fetch(&handles[c->rec.file].done, 1, __ATOMIC_RELEASE);
+		return -EBADF;
+	}
+	int ret = image != NULL ? tfs_fsync(h->file, 0) : sys_ret(fsync(h->fd));
+	__atomic_add_fetch(&h->done, 1, __ATOMIC_RELEASE);
+	return ret;
+}
+
+/* and a close waits for all of them, the handle must outlive them */
+static int replay_close(struct call *c) {
+	struct handle *h = handle_of(c);
+	if (h == NULL)
+		return -EBADF;
+	while (__atomic_load_n(&h->done, __ATOMIC_ACQUIRE) < h->uses)
+		sched_yield();
+	h->state = H_CLOSED;
+	if (image != NULL)
+		return tfs_close(h->file);
+	return sys_ret(close(h->fd));
+}
+
+static int replay_call(struct call *c) {
+	char p[PATH_MAX], p2[PATH_MAX];
+	struct stat st;
+	struct statvfs sv;
+	// the recorded times are not in the trace, the call sets them to now
+	struct timespec now[2] = { { 0, UTIME_NOW }, { 0, UTIME_NOW } };
+
+	switch (c->rec.op) {
+	case OP_CREATE:
+	case OP_OPEN:
+		return replay_open(c);
+	case OP_READ:
+	case OP_WRITE:
+		return replay_io(c);
+	case OP_FSYNC:
+		return replay_fsync(c);
+	case OP_RELEASE:
+		return replay_close(c);
+	}
+	if (image != NULL) {
+		switch (c->rec.op) {
+		case OP_GETATTR:	return tfs_getattr(c->path, &st);
+		case OP_OPENDIR:	return tfs_opendir(c->path);
+		case OP_READDIR:	return tfs_readdir(c->path, no_fill, NULL);
+		case OP_MKDIR:		return tfs_mkdir(c->path, c->rec.mode);
+		case OP_RMDIR:		return tfs_rmdir(c->path);
+		case OP_UNLINK:		return tfs_unlink(c->path);
+		case OP_RENAME:		return tfs_rename(c->path, c->path2);
+		case OP_LINK:		return tfs_link(c->path, c->path2);
+		case OP_CHMOD:		return tfs_chmod(c->path, c->rec.mode);
+		case OP_UTIMENS:	return tfs_utimens(c->path, now);
+		case OP_TRUNCATE:	return tfs_truncate(c->path, c->rec.offset);
+		case OP_STATFS:		return tfs_statfs(&sv);
+		}
+		return -ENOSYS;
+	}
+	full_path(c->path, p);
+	switch (c->rec.op) {
+	case OP_GETATTR:	return sys_ret(lstat(p, &st));
+	case OP_OPENDIR:	return list_dir(p, 0);
+	case OP_READDIR:	return list_dir(p, 1);
+	case OP_MKDIR:		return sys_ret(mkdir(p, c->rec.mode));
+	case OP_RMDIR:		return sys_ret(rmdir(p));
+	case OP_UNLINK:		return sys_ret(unlink(p));
+	case OP_RENAME:		return sys_ret(rename(p, full_path(c->path2, p2)));
+	case OP_LINK:		return sys_ret(link(p, full_path(c->path2, p2)));
+	case OP_CHMOD:		return sys_ret(chmod(p, c->rec.mode));
+	case OP_UTIMENS:	return sys_ret(utimensat(AT_FDCWD, p, now, AT_SYMLINK_NOFOLLOW));
+	case OP_TRUNCATE:	return sys_ret(truncate(p, c->rec.offset));
+	case OP_STATFS:		return sys_ret(statvfs(dir, &sv));
+	}
+	return -ENOSYS;
+}
+
+/*
+ * Make what the trace finds in place. A path whose first call succeeds
+ * without making it was there before the trace started; it is a directory
+ * if it was listed or removed as one, or if another such path is under it.
+ */
+struct prior {
+	const char *path;
+	int is_dir;
+	uint64_t size;
+	int made;					/* by the trace, with its first call */
+};
+
+static int by_path(const void *a, const void *b) {
+	return strcmp(((const struct prior *)a)->path, ((const struct prior *)b)->path);
+}
+
+static struct prior *find_prior(struct prior *p, size_t n, const char *path) {
+	struct prior key = { path };
+	return bsearch(&key, p, n, sizeof(struct prior), by_path);
+}
+
+static int prepare_one(const char *path, int is_dir, uint64_t size) {
+	char p[PATH_MAX];
+	if (image != NULL) {
+		if (is_dir)
+			return tfs_mkdir(path, 0755);
+		struct tfs_file *file;
+		int ret = tfs_open(path, O_RDWR | O_CREAT, 0644, &file);
+		if (ret < 0)
+			return ret;
+		for (uint64_t off = 0; ret >= 0 && off < size; off += max_size + 1) {
+			uint64_t n = size - off < max_size + 1 ? size - off : max_size + 1;
+			ret = tfs_pwrite(file, data, n, off);
+		}
+		tfs_close(file);
+		return ret < 0 ? ret : 0;
+	}
+	full_path(path, p);
+	if (is_dir)
+		return sys_ret(mkdir(p, 0755));
+	int fd = open(p, O_RDWR | O_CREAT, 0644);
+	if (fd < 0)
+		return -errno;
+	int ret = 0;
+	for (uint64_t off = 0; ret >= 0 && off < size; off += max_size + 1) {
+		uint64_t n = size - off < max_size + 1 ? size - off : max_size + 1;
+		ret = sys_ret(pwrite(fd, data, n, off));
+	}
+	close(fd);
+	return ret < 0 ? ret : 0;
+}
+
+static void prepare() {
+	struct prior *p = calloc(2 * ncalls + 1, sizeof(struct prior));
+	size_t n = 0;
+	for (uint64_t i = 0; i < ncalls; i++) {
+		if (calls[i].rec.path_len > 0)
+			p[n++].path = calls[i].path;
+		if (calls[i].rec.path2_len > 0)
+			p[n++].path = calls[i].path2;
+	}
+	qsort(p, n, sizeof(struct prior), by_path);
+	size_t m = 0;
+	for (size_t i = 0; i < n; i++)
+		if (m == 0 || strcmp(p[m - 1].path, p[i].path) != 0)
+			p[m++] = p[i];
+	n = m;
+
+	// a path's first call decides whether it was there, -1 until it is seen
+	char *seen = malloc(n);
+	memset(seen, -1, n);
+	const char **file_path = calloc(max_file + 1, sizeof(char *));
+	for (uint64_t i = 0; i < ncalls; i++) {
+		struct call *c = &calls[i];
+		if (c->rec.op == OP_READ && file_path[c->rec.file] != NULL) {
+			struct prior *f = find_prior(p, n, file_path[c->rec.file]);
+			if (!f->made && c->rec.offset + c->rec.size > f->size)
+				f->size = c->rec.offset + c->rec.size;
+		}
+		if (c->rec.path_len == 0)
+			continue;
+		struct prior *f = find_prior(p, n, c->path);
+		if ((c->rec.op == OP_OPEN || c->rec.op == OP_CREATE) && c->rec.ret == 0)
+			file_path[c->rec.file] = f->path;
+		// the target of a rename or link is made by it
+		if (c->rec.path2_len > 0) {
+			struct prior *to = find_prior(p, n, c->path2);
+			if (seen[to - p] < 0) {
+				seen[to - p] = 0;
+				to->made = 1;
+			}
+		}
+		if (seen[f - p] >= 0)
+			continue;
+		// a failed call does not say the path was there
+		seen[f - p] = c->rec.ret >= 0;
+		f->made = c->rec.op == OP_MKDIR || c->rec.op == OP_CREATE;
+		if (c->rec.op == OP_OPENDIR || c->rec.op == OP_READDIR || c->rec.op == OP_RMDIR)
+			f->is_dir = 1;
+	}
+	// the parents of every path are directories
+	for (size_t i = 0; i < n; i++) {
+		char parent[PATH_MAX];
+		snprintf(parent, sizeof(parent), "%s", p[i].path);
+		char *slash;
+		while ((slash = strrchr(parent, '/')) != NULL && slash != parent) {
+			*slash = 0;
+			struct prior *d = find_prior(p, n, parent);
+			if (d != NULL)
+				d->is_dir = 1;
+		}
+	}
+	// sorted by path, so a directory is made before what is under it
+	for (size_t i = 0; i < n; i++) {
+		if ((seen[i] != 1 && !p[i].made) || strcmp(p[i].path, "/") == 0)
+			continue;
+		// parents no call names have to be there for the path to be
+		char parent[PATH_MAX];
+		snprintf(parent, sizeof(parent), "%s", p[i].path);
+		for (char *slash = strchr(parent + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+			*slash = 0;
+			if (find_prior(p, n, parent) == NULL)
+				prepare_one(parent, 1, 0);
+			*slash = '/';
+		}
+		if (p[i].made)
+			continue;
+		int ret = prepare_one(p[i].path, p[i].is_dir, p[i].is_dir ? 0 : p[i].size);
+		if (ret < 0 && ret != -EEXIST)
+			prepare_errors++;
+	}
+	free(file_path);
+	free(seen);
+	free(p);
+}
+
+static void wait_until(uint64_t start_ns) {
+	uint64_t at = replay_start + start_ns;
+	struct timespec ts = { at / 1000000000ull, at % 1000000000ull };
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+static void wait_returned(const struct call *c) {
+	pthread_mutex_lock(&order_lock);
+	while (returned < c->after)
+		pthread_cond_wait(&order_cond, &order_lock);
+	pthread_mutex_unlock(&order_lock);
+}
+
+static void set_returned(const struct call *c) {
+	pthread_mutex_lock(&order_lock);
+	done[c->end_rank] = 1;
+	while (returned < ncalls && done[returned])
+		returned++;
+	pthread_cond_broadcast(&order_cond);
+	pthread_mutex_unlock(&order_lock);
+}
+
+static void *run(void *arg) {
+	struct replayer *r = arg;
+	uint64_t first = ncalls > 0 ? calls[0].rec.start_ns : 0;
+	for (uint64_t i = 0; i < ncalls; i++) {
+		struct call *c = &calls[i];
+		if (parallel && &replayers[(c->rec.thread - 1) % MAX_THREADS] != r)
+			continue;
+		if (realtime)
+			wait_until(c->rec.start_ns - first);
+		if (parallel)
+			wait_returned(c);
+		uint64_t start = now_ns();
+		int ret = replay_call(c);
+		uint64_t ns = now_ns() - start;
+		if (parallel)
+			set_returned(c);
+		hist_add(&r->lat[c->rec.op], ns);
+		hist_add(&r->rec_lat[c->rec.op], c->rec.lat_ns);
+		// an error is compared by its errno, a success by its byte count
+		if (ret != c->rec.ret)
+			r->mismatches[c->rec.op]++;
+	}
+	return NULL;
+}
+
+static void print_lat(const char *name, const struct hist *h) {
+	printf("\"%s\": { \"mean\": %lu, \"p50\": %lu, \"p99\": %lu, \"max\": %lu }",
+		name, h->count ? h->total_ns / h->count : 0, hist_pct(h, 50), hist_pct(h, 99), h->max_ns);
+}
+
+static double diff_pct(uint64_t replay, uint64_t recorded) {
+	return recorded ? 100.0 * ((double)replay - (double)recorded) / recorded : 0;
+}
+
+int main(int argc, char **argv) {
+	int c;
+	while ((c = getopt(argc, argv, "d:i:pr")) != -1) {
+		switch (c) {
+		case 'd': dir = optarg; break;
+		case 'i': image = optarg; break;
+		case 'p': parallel = 1; break;
+		case 'r': realtime = 1; break;
+		default: usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1)
+		usage(argv[0]);
+	load(argv[optind]);
+	if (image != NULL && tfs_mount(image) < 0)
+		exit(1);
+	prepare();
+
+	// one replayer per recorded thread, numbered from 1, or MAX_THREADS shared between them
+	nreplayers = parallel ? (hdr.threads < MAX_THREADS ? hdr.threads : MAX_THREADS) : 1;
+
+	replay_start = now_ns();
+	for (int i = 0; i < nreplayers; i++)
+		pthread_create(&replayers[i].tid, NULL, run, &replayers[i]);
+	for (int i = 0; i < nreplayers; i++)
+		pthread_join(replayers[i].tid, NULL);
+	double secs = (now_ns() - replay_start) / 1e9;
+
+	// what the trace left open is closed, so the unmount finds no open files
+	for (uint32_t f = 1; f <= max_file; f++) {
+		if (handles[f].state != H_OPEN)
+			continue;
+		if (image != NULL)
+			tfs_close(handles[f].file);
+		else
+			close(handles[f].fd);
+	}
+	if (image != NULL)
+		tfs_unmount();
+
+	uint64_t total = 0, mismatches = 0;
+	printf("{\n");
+	printf("  \"config\": { \"trace\": \"%s\", \"target\": \"%s\", \"in_process\": %s, \"parallel\": %s, \"realtime\": %s },\n",
+		argv[optind], image ? image : dir, image ? "true" : "false", parallel ? "true" : "false", realtime ? "true" : "false");
+	printf("  \"ops\": {\n");
+	int first = 1;
+	for (int op = 0; op < NUM_OPS; op++) {
+		struct hist rec = { 0 }, rep = { 0 };
+		uint64_t mis = 0;
+		for (int i = 0; i < nreplayers; i++) {
+			hist_merge(&rec, &replayers[i].rec_lat[op]);
+			hist_merge(&rep, &replayers[i].lat[op]);
+			mis += replayers[i].mismatches[op];
+		}
+		if (rep.count == 0)
+			continue;
+		total += rep.count;
+		mismatches += mis;
+		printf("%s    \"%s\": {\n", first ? "" : ",\n", stats_op_name(op));
+		printf("      \"calls\": %lu,\n", rep.count);
+		printf("      \"ret_mismatches\": %lu,\n", mis);
+		printf("      ");
+		print_lat("recorded_ns", &rec);
+		printf(",\n      ");
+		print_lat("replay_ns", &rep);
+		printf(",\n      \"diff_pct\": { \"mean\": %.1f, \"p50\": %.1f, \"p99\": %.1f }\n",
+			diff_pct(rep.count ? rep.total_ns / rep.count : 0, rec.count ? rec.total_ns / rec.count : 0),
+			diff_pct(hist_pct(&rep, 50), hist_pct(&rec, 50)), diff_pct(hist_pct(&rep, 99), hist_pct(&rec, 99)));
+		printf("    }");
+		first = 0;
+	}
+	printf("\n  },\n");
+	printf("  \"calls\": %lu,\n", total);
+	printf("  \"ret_mismatches\": %lu,\n", mismatches);
+	printf("  \"prepare_errors\": %d,\n", prepare_errors);
+	printf("  \"runtime_s\": %.3f\n", secs);
+	printf("}\n");
+	return 0;
+}
@@ -0,0 +1,219 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stddef.h>
+
+#include "../trace.h"
+#include "../stats.h"
+
+/*
+ * Offline analyzer for the block I/O trace tfs writes at unmount when it is
+ * started with TFS_TRACE=<file>.
+ *
+ * usage: trace_report <tracefile> [top_n]
+ */
+
+#define DEFAULT_TOP 20
+#define SEEK_BUCKETS 33
+
+enum { CL_SUPER, CL_IBITMAP, CL_DBITMAP, CL_INODE, CL_DATA, NUM_CLASSES };
+static const char *class_names[NUM_CLASSES] = { "super", "ibitmap", "dbitmap", "inode", "data" };
+
+struct trace_hdr hdr;
+struct trace_rec *recs;
+
+static int block_class(uint32_t block) {
+	if (block == 0)
+		return CL_SUPER;
+	// every block group repeats group 0's layout
+	if (hdr.group_blks && block >= hdr.i_bitmap_blk)
+		block = hdr.i_bitmap_blk + (block - hdr.i_bitmap_blk) % hdr.group_blks;
+	if (block == hdr.i_bitmap_blk)
+		return CL_IBITMAP;
+	if (block == hdr.d_bitmap_blk)
+		return CL_DBITMAP;
+	if (block >= hdr.i_start_blk && block < hdr.d_start_blk)
+		return CL_INODE;
+	return CL_DATA;
+}
+
+/* by call, then block, then place in the trace */
+static int by_call(const void *a, const void *b) {
+	const struct trace_rec *x = *(const struct trace_rec **)a;
+	const struct trace_rec *y = *(const struct trace_rec **)b;
+	if (x->call != y->call)
+		return x->call < y->call ? -1 : 1;
+	if (x->block != y->block)
+		return x->block < y->block ? -1 : 1;
+	return x < y ? -1 : (x > y);
+}
+
+static int by_block(const void *a, const void *b) {
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+	return x < y ? -1 : (x > y);
+}
+
+struct hot {
+	uint32_t block;
+	uint64_t count;
+};
+
+static int by_count(const void *a, const void *b) {
+	const struct hot *x = a, *y = b;
+	if (x->count != y->count)
+		return x->count > y->count ? -1 : 1;
+	return x->block < y->block ? -1 : (x->block > y->block);
+}
+
+static void report_pattern(uint64_t n) {
+	uint64_t seq = 0, same = 0, random = 0, total_dist = 0;
+	uint64_t hist[SEEK_BUCKETS] = {0};
+
+	for (uint64_t i = 1; i < n; i++) {
+		uint32_t prev = recs[i - 1].block, cur = recs[i].block;
+		if (cur == prev) {
+			same++;
+			continue;
+		}
+		if (cur == prev + 1) {
+			seq++;
+			hist[0]++;
+			continue;
+		}
+		uint64_t dist = cur > prev ? cur - prev - 1 : prev - cur + 1;
+		int b = 64 - __builtin_clzll(dist);
+		if (b >= SEEK_BUCKETS)
+			b = SEEK_BUCKETS - 1;
+		hist[b]++;
+		total_dist += dist;
+		random++;
+	}
+	printf("\naccess pattern (consecutive requests)\n");
+	printf("  sequential      %lu\n", seq);
+	printf("  same block      %lu\n", same);
+	printf("  random          %lu\n", random);
+	printf("  mean seek       %.1f blocks\n", random ? (double)total_dist / random : 0.0);
+	printf("  seek distance histogram (blocks skipped, [2^(n-1), 2^n))\n");
+	for (int b = 0; b < SEEK_BUCKETS; b++) {
+		if (hist[b])
+			printf("    %2d: %lu\n", b, hist[b]);
+	}
+}
+
+/* Block reads/writes per FUSE call, and how many writes rewrote a block the same call read */
+static void report_ops(uint64_t n) {
+	uint64_t calls[NUM_OPS] = {0}, reads[NUM_OPS] = {0}, writes[NUM_OPS] = {0};
+	uint64_t rmw[NUM_OPS] = {0}, meta[NUM_OPS] = {0};
+	struct trace_rec **byc = malloc(n * sizeof(struct trace_rec *));
+	for (uint64_t i = 0; i < n; i++)
+		byc[i] = &recs[i];
+	qsort(byc, n, sizeof(struct trace_rec *), by_call);
+
+	for (uint64_t i = 0; i < n; ) {
+		uint64_t end = i;
+		while (end < n && byc[end]->call == byc[i]->call)
+			end++;
+		int op = byc[i]->fuse_op < NUM_OPS ? byc[i]->fuse_op : OP_NONE;
+		calls[op]++;
+		// a call's I/O to one block is together and in trace order
+		int read_before = 0;
+		for (uint64_t j = i; j < end; j++) {
+			if (j > i && byc[j]->block != byc[j - 1]->block)
+				read_before = 0;
+			if (block_class(byc[j]->block) != CL_DATA)
+				meta[op]++;
+			if (byc[j]->rw == TRACE_READ) {
+				reads[op]++;
+				read_before = 1;
+				continue;
+			}
+			writes[op]++;
+			if (read_before)
+				rmw[op]++;
+		}
+		i = end;
+	}
+	free(byc);
+
+	printf("\nper operation (op \"none\" is I/O outside any FUSE call, e.g. mkfs)\n");
+	printf("  %-12s %10s %10s %10s %10s %10s %8s\n", "op", "calls", "reads", "writes", "blks/call", "rmw", "meta%");
+	for (int op = 0; op < NUM_OPS; op++) {
+		if (calls[op] == 0)
+			continue;
+		uint64_t total = reads[op] + writes[op];
+		printf("  %-12s %10lu %10lu %10lu %10.2f %10lu %7.1f%%\n", stats_op_name(op), calls[op],
+			reads[op], writes[op], (double)total / calls[op], rmw[op], 100.0 * meta[op] / total);
+	}
+}
+
+static void report_hot(uint64_t n, int top) {
+	uint32_t *blocks = malloc(n * sizeof(uint32_t));
+	struct hot *hot = malloc(n * sizeof(struct hot));
+	uint64_t nhot = 0;
+	for (uint64_t i = 0; i < n; i++)
+		blocks[i] = recs[i].block;
+	qsort(blocks, n, sizeof(uint32_t), by_block);
+	for (uint64_t i = 0; i < n; ) {
+		uint64_t end = i;
+		while (end < n && blocks[end] == blocks[i])
+			end++;
+		hot[nhot].block = blocks[i];
+		hot[nhot].count = end - i;
+		nhot++;
+		i = end;
+	}
+	qsort(hot, nhot, sizeof(struct hot), by_count);
+
+	printf("\nhot blocks (%lu distinct)\n", nhot);
+	for (uint64_t i = 0; i < nhot && i < top; i++)
+		printf("  %10u %-8s %lu\n", hot[i].block, class_names[block_class(hot[i].block)], hot[i].count);
+	free(blocks);
+	free(hot);
+}
+
+int main(int argc, char **argv) {
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s <tracefile> [top_n]\n", argv[0]);
+		exit(1);
+	}
+	int top = argc > 2 ? atoi(argv[2]) : DEFAULT_TOP;
+
+	FILE *in = fopen(argv[1], "r");
+	if (in == NULL) {
+		perror("open trace");
+		exit(1);
+	}
+	// version 1 headers end before group_blks, from images without block groups
+	size_t v1_size = offsetof(struct trace_hdr, group_blks);
+	if (fread(&hdr, v1_size, 1, in) != 1 || hdr.magic != TRACE_MAGIC || hdr.version < 1 || hdr.version > TRACE_VERSION
+		|| (hdr.version > 1 && fread((char *)&hdr + v1_size, sizeof(hdr) - v1_size, 1, in) != 1)) {
+		fprintf(stderr, "%s: not a tfs trace\n", argv[1]);
+		exit(1);
+	}
+	recs = malloc((hdr.nrecs ? hdr.nrecs : 1) * sizeof(struct trace_rec));
+	uint64_t n = fread(recs, sizeof(struct trace_rec), hdr.nrecs, in);
+	fclose(in);
+
+	uint64_t reads = 0, writes = 0, cls[NUM_CLASSES][2] = {{0}};
+	for (uint64_t i = 0; i < n; i++) {
+		if (recs[i].rw == TRACE_READ)
+			reads++;
+		else
+			writes++;
+		cls[block_class(recs[i].block)][recs[i].rw == TRACE_WRITE]++;
+	}
+	printf("records         %lu (%lu dropped)\n", n, hdr.dropped);
+	printf("duration        %.3f ms\n", n ? (recs[n - 1].ts_ns - recs[0].ts_ns) / 1e6 : 0.0);
+	printf("reads/writes    %lu / %lu\n", reads, writes);
+	printf("\nby block class       reads     writes\n");
+	for (int c = 0; c < NUM_CLASSES; c++)
+		printf("  %-12s %10lu %10lu\n", class_names[c], cls[c][0], cls[c][1]);
+
+	report_pattern(n);
+	report_ops(n);
+	report_hot(n, top);
+	free(recs);
+	return 0;
+}
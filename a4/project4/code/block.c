@@ -9,34 +9,164 @@
  *
  */
 
+#define _GNU_SOURCE
+
 #include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 
 #include "block.h"
+#include "stats.h"
+#include "trace.h"
+#include "log.h"
+#include "ram.h"
 
 //Disk size set to 32MB
 #define DISK_SIZE	32*1024*1024
 
 int diskfile = -1;
 
+//Set while the disk is open with O_DIRECT, which wants aligned buffers
+static int direct;
+
+//Free block buffers a thread keeps for reuse, linked through the buffers
+#define POOL_MAX 64
+static __thread void* pool;
+static __thread int pool_n;
+//A thread that pooled a buffer has its pool drained when it exits
+static __thread int pool_keyed;
+static pthread_key_t pool_key;
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+
+static void pool_exit(void *arg) {
+    while (pool != NULL) {
+		void *buf = pool;
+		pool = *(void**)buf;
+		free(buf);
+    }
+    pool_n = 0;
+    pool_keyed = 0;
+}
+
+static void pool_key_init() {
+    pthread_key_create(&pool_key, pool_exit);
+}
+
+void *blk_alloc() {
+    void *buf = pool;
+    if (buf != NULL) {
+		pool = *(void**)buf;
+		pool_n--;
+		return buf;
+    }
+    if (posix_memalign(&buf, BLOCK_SIZE, BLOCK_SIZE) != 0) {
+		perror("blk_alloc failed");
+		exit(EXIT_FAILURE);
+    }
+    return buf;
+}
+
+void blk_free(void *buf) {
+    if (buf == NULL)
+		return;
+    if (pool_n == POOL_MAX) {
+		free(buf);
+		return;
+    }
+    if (!pool_keyed) {
+		pthread_once(&pool_once, pool_key_init);
+		pthread_setspecific(pool_key, &pool);
+		pool_keyed = 1;
+    }
+    *(void**)buf = pool;
+    pool = buf;
+    pool_n++;
+}
+
+//An aligned stand-in for a caller's buffer of len bytes, from the pool if it is one block
+static void *bounce_get(size_t len) {
+    void *buf;
+    if (len == BLOCK_SIZE)
+		return blk_alloc();
+    if (posix_memalign(&buf, BLOCK_SIZE, len) != 0) {
+		perror("bounce buffer failed");
+		exit(EXIT_FAILURE);
+    }
+    return buf;
+}
+
+static void bounce_put(void *buf, size_t len) {
+    if (len == BLOCK_SIZE)
+		blk_free(buf);
+    else
+		free(buf);
+}
+
+static int aligned(const void *buf) {
+    return ((uintptr_t)buf & (BLOCK_SIZE - 1)) == 0;
+}
+
+//pread and pwrite of whole blocks, through an aligned buffer when O_DIRECT needs one,
+//or copies to and from the volume while it is in memory
+static ssize_t disk_read(void *buf, size_t len, off_t off) {
+    if (ram_active)
+		return ram_read(off / BLOCK_SIZE, len / BLOCK_SIZE, buf);
+    if (!direct || aligned(buf))
+		return pread(diskfile, buf, len, off);
+    void *bounce = bounce_get(len);
+    ssize_t ret = pread(diskfile, bounce, len, off);
+    if (ret > 0)
+		memcpy(buf, bounce, ret);
+    bounce_put(bounce, len);
+    return ret;
+}
+
+static ssize_t disk_write(const void *buf, size_t len, off_t off) {
+    if (ram_active)
+		return ram_write(off / BLOCK_SIZE, buf);
+    if (!direct || aligned(buf))
+		return pwrite(diskfile, buf, len, off);
+    void *bounce = bounce_get(len);
+    memcpy(bounce, buf, len);
+    ssize_t ret = pwrite(diskfile, bounce, len, off);
+    bounce_put(bounce, len);
+    return ret;
+}
+
+//Open the disk file, with O_DIRECT if TFS_DIRECT is set and the file system takes it
+static int disk_open(const char* diskfile_path, int flags) {
+    direct = getenv(DIRECT_ENV) != NULL;
+    int fd = open(diskfile_path, flags | (direct ? O_DIRECT : 0), S_IRUSR | S_IWUSR);
+    if (fd < 0 && direct && errno == EINVAL) {
+		fprintf(stderr, "%s: no O_DIRECT here, going through the page cache\n", diskfile_path);
+		direct = 0;
+		fd = open(diskfile_path, flags, S_IRUSR | S_IWUSR);
+    }
+    return fd;
+}
+
 //Creates a file which is your new emulated disk
 void dev_init(const char* diskfile_path) {
     if (diskfile >= 0) {
 		return;
     }
     
-    diskfile = open(diskfile_path, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+    diskfile = disk_open(diskfile_path, O_CREAT | O_RDWR);
     if (diskfile < 0) {
 		perror("disk_open failed");
 		exit(EXIT_FAILURE);
     }
 	
     ftruncate(diskfile, DISK_SIZE);
+    if (getenv(RAM_ENV) != NULL)
+		ram_load(diskfile);
 }
 
 //Function to open the disk file
@@ -45,24 +175,34 @@ int dev_open(const char* diskfile_path) {
 		return 0;
     }
     
-    diskfile = open(diskfile_path, O_RDWR, S_IRUSR | S_IWUSR);
+    diskfile = disk_open(diskfile_path, O_RDWR);
     if (diskfile < 0) {
 		perror("disk_open failed");
 		return -1;
     }
+    if (getenv(RAM_ENV) != NULL)
+		ram_load(diskfile);
 	return 0;
 }
 
 void dev_close() {
     if (diskfile >= 0) {
+		ram_unload();
 		close(diskfile);
+		diskfile = -1;
     }
 }
 
-//Read a block from the disk
+//Read a block from the disk, or its newest copy in the log
 int bio_read(const int block_num, void *buf) {
     int retstat = 0;
-    retstat = pread(diskfile, buf, BLOCK_SIZE, block_num*BLOCK_SIZE);
+    if (log_active && log_read(block_num, buf))
+		retstat = BLOCK_SIZE;
+    else
+		retstat = disk_read(buf, BLOCK_SIZE, (off_t)block_num*BLOCK_SIZE);
+    stats_blk_read(retstat > 0 ? retstat : 0);
+    if (trace_enabled)
+		trace_record(block_num, TRACE_READ);
     if (retstat <= 0) {
 		memset (buf, 0, BLOCK_SIZE);
 		if (retstat < 0)
@@ -72,13 +212,82 @@ int bio_read(const int block_num, void *buf) {
     return retstat;
 }
 
-//Write a block to the disk
+//Read n consecutive blocks with a single pread
+int bio_read_run(const int block_num, int n, void *buf) {
+    ssize_t retstat = 0;
+    size_t len = (size_t)n*BLOCK_SIZE;
+    retstat = disk_read(buf, len, (off_t)block_num*BLOCK_SIZE);
+    stats_blk_read(retstat > 0 ? retstat : 0);
+    if (trace_enabled) {
+		for (int i = 0; i < n; i++)
+			trace_record(block_num + i, TRACE_READ);
+    }
+    if (retstat < (ssize_t)len) {
+		size_t got = retstat > 0 ? retstat : 0;
+		memset((char*)buf + got, 0, len - got);
+		if (retstat < 0)
+			perror("block_read failed");
+    }
+    if (log_active)
+		log_read_run(block_num, n, buf);
+
+    return retstat;
+}
+
+//Write a block to the disk, or append it to the log
 int bio_write(const int block_num, const void *buf) {
     int retstat = 0;
-    retstat = pwrite(diskfile, buf, BLOCK_SIZE, block_num*BLOCK_SIZE);
+    if (log_active)
+		retstat = log_write(block_num, buf);
+    else
+		retstat = disk_write(buf, BLOCK_SIZE, (off_t)block_num*BLOCK_SIZE);
+    stats_blk_write(retstat > 0 ? retstat : 0);
+    if (trace_enabled)
+		trace_record(block_num, TRACE_WRITE);
     if (retstat < 0) {
 		    perror("block_write failed");
     }
     return retstat;
 }
 
+
+//Read a block from the disk, past the log
+int dev_read(int block_num, void *buf) {
+    int retstat = disk_read(buf, BLOCK_SIZE, (off_t)block_num*BLOCK_SIZE);
+    if (retstat <= 0)
+		memset(buf, 0, BLOCK_SIZE);
+    return retstat;
+}
+
+//Write cnt blocks, one per iovec, from block_num on with a single pwritev
+int dev_writev(int block_num, const struct iovec *iov, int cnt) {
+    ssize_t retstat = 0;
+    int all_aligned = 1;
+    for (int i = 0; i < cnt && direct; i++)
+		all_aligned &= aligned(iov[i].iov_base);
+    if (all_aligned && !ram_active)
+		retstat = pwritev(diskfile, iov, cnt, (off_t)block_num*BLOCK_SIZE);
+    else {
+		for (int i = 0; i < cnt && retstat >= 0; i++) {
+			ssize_t ret = disk_write(iov[i].iov_base, BLOCK_SIZE, (off_t)(block_num + i)*BLOCK_SIZE);
+			retstat = ret < 0 ? ret : retstat + ret;
+		}
+    }
+    if (retstat < 0)
+		perror("block_write failed");
+    return retstat;
+}
+
+//Have the host start reading n blocks into its page cache without waiting for them,
+//returns -1 if there is no page cache under the volume to fill
+int dev_prefetch(int block_num, int n) {
+    if (ram_active || direct)
+		return -1;
+    posix_fadvise(diskfile, (off_t)block_num*BLOCK_SIZE, (off_t)n*BLOCK_SIZE, POSIX_FADV_WILLNEED);
+    return 0;
+}
+
+void dev_sync() {
+    if (!ram_active && fdatasync(diskfile) < 0)
+		perror("fdatasync failed");
+}
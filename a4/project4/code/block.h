@@ -12,12 +12,35 @@
 #ifndef _BLOCK_H_
 #define _BLOCK_H_
 
+#include <sys/uio.h>
+
 #define BLOCK_SIZE 4096
 
+/*
+ * set TFS_DIRECT in the environment of tfs to open the disk file with
+ * O_DIRECT, so its blocks are not cached a second time in the host's page
+ * cache. Buffers handed to the bio_ calls had best come from blk_alloc(),
+ * others are copied through one.
+ */
+#define DIRECT_ENV "TFS_DIRECT"
+
 void dev_init(const char* diskfile_path);
 int dev_open(const char* diskfile_path);
 void dev_close();
+
+/* a BLOCK_SIZE aligned block buffer, kept for reuse by blk_free() */
+void *blk_alloc();
+void blk_free(void *buf);
+
 int bio_read(const int block_num, void *buf);
+int bio_read_run(const int block_num, int n, void *buf);
 int bio_write(const int block_num, const void *buf);
 
+/* the disk itself, under the log (log.c) */
+int dev_read(int block_num, void *buf);
+int dev_writev(int block_num, const struct iovec *iov, int cnt);
+void dev_sync();
+/* start reading blocks into the host's page cache, -1 if the volume has none */
+int dev_prefetch(int block_num, int n);
+
 #endif
@@ -0,0 +1,233 @@
+/*
+ *  Copyright (C) 2020 CS416 Rutgers CS
+ *	Tiny File System
+ *	File:	clone.c
+ *
+ *	Clones files and directory trees without copying their data. A cloned
+ *	file gets inodes and indirect pages of its own, but its pointers name
+ *	the source's data blocks, each of which counts one owner more. Only a
+ *	block that cannot take another owner is copied. Writes to a shared
+ *	block copy it first (tfs_write()), and freeing one drops an owner
+ *	(free_blk_list()), so a clone costs metadata writes only. A file is
+ *	cloned under its inode lock, so no write or release moves its
+ *	pointers meanwhile.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "block.h"
+#include "tfs.h"
+#include "clone.h"
+#include "frag.h"
+#include "scratch.h"
+
+struct clone_status {
+	int			ran;
+	int			error;				/* 0 or the errno the clone stopped with */
+	char		src[PATH_MAX];
+	char		dst[PATH_MAX];
+	uint32_t	files;
+	uint32_t	dirs;
+	uint64_t	blocks_shared;
+	uint64_t	blocks_copied;		/* blocks that could not take another owner */
+	double		seconds;
+};
+
+static struct clone_status status;
+static pthread_mutex_t status_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Give the clone block blk: the block itself with one owner more, or a copy
+ * if it cannot be shared. Returns the block or -1 when the disk is full.
+ */
+static int clone_blk(int blk, uint16_t owner, struct clone_status *st) {
+	char buf[BLOCK_SIZE];
+	if (share_blk(blk) == 0) {
+		st->blocks_shared++;
+		return blk;
+	}
+	int copy = get_avail_blkno(owner);
+	if (copy < 0)
+		return -1;
+	bio_read(blk, buf);
+	bio_write(copy, buf);
+	st->blocks_copied++;
+	return copy;
+}
+
+/*
+ * Point the new, empty inode dst at src's data, with indirect pages of its own
+ */
+static int clone_file(const struct inode *src, struct inode *dst, struct clone_status *st) {
+	int page[PTRS_PER_BLK];
+	int ret = 0;
+	// a packed file's run is copied, runs are never shared
+	if (is_packed(src) && frag_clone(src, dst) < 0)
+		ret = -ENOSPC;
+	for (int i = 0; i < NUM_DIRECT && ret == 0 && !is_packed(src); i++) {
+		// a compressed cluster's marker is copied as it is
+		if (src->direct_ptr[i] < 0) {
+			dst->direct_ptr[i] = src->direct_ptr[i];
+			continue;
+		}
+		dst->direct_ptr[i] = clone_blk(src->direct_ptr[i], dst->ino, st);
+		if (dst->direct_ptr[i] < 0) {
+			dst->direct_ptr[i] = -1;
+			ret = -ENOSPC;
+		}
+	}
+	for (int j = 0; j < NUM_INDIRECT && ret == 0; j++) {
+		if (src->indirect_ptr[j] == -1)
+			continue;
+		int page_blk = get_avail_blkno(dst->ino);
+		if (page_blk < 0) {
+			ret = -ENOSPC;
+			break;
+		}
+		bio_read(src->indirect_ptr[j], page);
+		for (int k = 0; k < PTRS_PER_BLK; k++) {
+			if (page[k] == 0 || page[k] == COMPRESSED_ADDR)
+				continue;
+			page[k] = ret == 0 ? clone_blk(page[k], dst->ino, st) : -1;
+			if (page[k] < 0) {
+				page[k] = 0;
+				ret = -ENOSPC;
+			}
+		}
+		bio_write(page_blk, page);
+		dst->indirect_ptr[j] = page_blk;
+	}
+	// a clone cut short by a full disk keeps what it got, the rest reads as holes
+	dst->size = src->size;
+	writei(dst->ino, dst);
+	return ret;
+}
+
+/*
+ * Clone src as dst, a directory with everything under it
+ */
+static int clone_path(const char *src, const char *dst, struct clone_status *st) {
+	struct inode from, to;
+	char block[BLOCK_SIZE];
+	// what the lookups below take from the scratch arena goes back per file
+	struct scratch_mark mark = scratch_mark();
+	int ret = -ENOENT;
+	if (get_node_by_path(src, ROOT_INO, &from) == 0)
+		ret = new_node(dst, from.mode, &to);
+	scratch_release(mark);
+	if (ret < 0)
+		return ret;
+	if (!S_ISDIR(from.mode)) {
+		st->files++;
+		// the source may have been written or unlinked since the lookup, its
+		// pointers are read again and held still until they are all shared
+		uint16_t inos[2] = { from.ino, to.ino };
+		lock_inodes(inos, 2);
+		readi(from.ino, &from);
+		if (from.valid && from.link > 0 && !S_ISDIR(from.mode))
+			ret = clone_file(&from, &to, st);
+		else
+			ret = -ENOENT;
+		unlock_inodes(inos, 2);
+		return ret;
+	}
+	st->dirs++;
+
+	char *child_src = scratch_alloc(PATH_MAX), *child_dst = scratch_alloc(PATH_MAX);
+	// the root's children are "/name", not "//name"
+	const char *src_dir = strcmp(src, "/") == 0 ? "" : src;
+	for (int i = 0; i < NUM_DIRECT && ret == 0; i++) {
+		if (from.direct_ptr[i] == -1)
+			continue;
+		bio_read(from.direct_ptr[i], block);
+		struct dirent *d = (struct dirent *)block;
+		struct dirent *end = (struct dirent *)(block + BLOCK_SIZE);
+		for (; d < end && !dirblk_bad(block, d) && ret == 0; d = NEXT_DIRENT(d)) {
+			if (d->ino == 0)
+				continue;
+			if (snprintf(child_src, PATH_MAX, "%s/%.*s", src_dir, d->name_len, d->name) >= PATH_MAX
+				|| snprintf(child_dst, PATH_MAX, "%s/%.*s", dst, d->name_len, d->name) >= PATH_MAX) {
+				ret = -ENAMETOOLONG;
+				break;
+			}
+			ret = clone_path(child_src, child_dst, st);
+		}
+	}
+	scratch_release(mark);
+	return ret;
+}
+
+/*
+ * Clone SRC as DST. Runs in the writer's FUSE call, which holds fs_lock for
+ * reading like any other, so the defragmenter waits for it.
+ */
+int clone_command(const char *buf, size_t len) {
+	char *cmd = strndup(buf, len);
+	char *save = NULL;
+	char *src = strtok_r(cmd, " \t\n", &save);
+	char *dst = strtok_r(NULL, " \t\n", &save);
+	if (src == NULL || dst == NULL || strtok_r(NULL, " \t\n", &save) != NULL
+		|| src[0] != '/' || dst[0] != '/' || strlen(src) >= PATH_MAX || strlen(dst) >= PATH_MAX) {
+		free(cmd);
+		return -EINVAL;
+	}
+
+	struct clone_status st;
+	struct timespec start, end;
+	memset(&st, 0, sizeof(st));
+	st.ran = 1;
+	strcpy(st.src, src);
+	strcpy(st.dst, dst);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	// a tree cannot be cloned into itself
+	size_t src_len = strlen(src);
+	if (strcmp(src, "/") == 0 || (strncmp(dst, src, src_len) == 0 && (dst[src_len] == '/' || dst[src_len] == '\0')))
+		st.error = EINVAL;
+	else
+		st.error = -clone_path(src, dst, &st);
+	// the reference tables are written once for the whole clone
+	flush_refs();
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	st.seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	pthread_mutex_lock(&status_lock);
+	status = st;
+	pthread_mutex_unlock(&status_lock);
+	free(cmd);
+	return -st.error;
+}
+
+char *clone_render(size_t *len) {
+	char *text = NULL;
+	FILE *out = open_memstream(&text, len);
+	if (out == NULL)
+		return NULL;
+	pthread_mutex_lock(&status_lock);
+	struct clone_status s = status;
+	pthread_mutex_unlock(&status_lock);
+
+	if (!s.ran) {
+		fprintf(out, "state idle\n");
+		fclose(out);
+		return text;
+	}
+	fprintf(out, "src %s\n", s.src);
+	fprintf(out, "dst %s\n", s.dst);
+	fprintf(out, "result %s\n", s.error ? strerror(s.error) : "ok");
+	fprintf(out, "files %u\n", s.files);
+	fprintf(out, "directories %u\n", s.dirs);
+	fprintf(out, "blocks_shared %lu\n", s.blocks_shared);
+	fprintf(out, "blocks_copied %lu\n", s.blocks_copied);
+	fprintf(out, "seconds %.6f\n", s.seconds);
+	fclose(out);
+	return text;
+}
@@ -0,0 +1,27 @@
+/*
+ *  Copyright (C) 2020 CS416 Rutgers CS
+ *	Tiny File System
+ *	File:	clone.h
+ *
+ */
+
+#ifndef _CLONE_H
+#define _CLONE_H
+
+#include <stddef.h>
+
+/*
+ * control file of the cloner in the mount root:
+ *	echo SRC DST > /.tfs_clone		clone the file or directory tree SRC as DST
+ *	cat /.tfs_clone					what the last clone did
+ * SRC and DST are paths in the mount and DST must not exist. The clone shares
+ * SRC's data blocks, a block is copied by the first write to it from either side.
+ */
+#define CLONE_NAME "/.tfs_clone"
+
+/* run a clone written to the control file, returns 0 or -errno */
+int clone_command(const char *buf, size_t len);
+/* render the result of the last clone as text, returns a malloc'd buffer */
+char *clone_render(size_t *len);
+
+#endif
@@ -0,0 +1,350 @@
+/*
+ *  Copyright (C) 2020 CS416 Rutgers CS
+ *	Tiny File System
+ *	File:	compress.c
+ *
+ *	Compressed clusters. A writer's dirty clusters are compressed when it
+ *	closes the file, the nearest thing tfs has to writeback since every
+ *	write goes straight to disk. A read decompresses the whole cluster, a
+ *	write to a compressed cluster first turns it back into raw blocks. The
+ *	codec writes the LZ4 block format, greedy with one hash probe per
+ *	position, which is fast enough to run inline.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "block.h"
+#include "tfs.h"
+#include "stats.h"
+#include "compress.h"
+#include "scratch.h"
+#include "dedup.h"
+
+#define LZ_MIN_MATCH 4
+#define LZ_LAST_LITERALS 5			/* a block ends in at least this many literals */
+#define LZ_MFLIMIT 12				/* and no match starts this close to its end */
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 12
+#define LZ_SKIP_TRIGGER 6			/* probe less often the longer nothing matches */
+
+#define CLUSTER_BYTES (CLUSTER_BLKS * BLOCK_SIZE)
+
+static int enabled;
+
+static inline uint32_t lz_hash(uint32_t v) {
+	return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static uint8_t *put_len(uint8_t *op, int len) {
+	for (; len >= 255; len -= 255)
+		*op++ = 255;
+	*op++ = len;
+	return op;
+}
+
+/*
+ * One sequence: lit_len literals, then a match of mlen bytes offset back,
+ * or none when mlen is 0. Returns the new output position, NULL if it
+ * would not fit before oend.
+ */
+static uint8_t *put_seq(uint8_t *op, uint8_t *oend, const uint8_t *lit, int lit_len, int offset, int mlen) {
+	if (oend - op < 1 + lit_len / 255 + 1 + lit_len + 2 + mlen / 255 + 1)
+		return NULL;
+	uint8_t *token = op++;
+	*token = (lit_len < 15 ? lit_len : 15) << 4;
+	if (lit_len >= 15)
+		op = put_len(op, lit_len - 15);
+	memcpy(op, lit, lit_len);
+	op += lit_len;
+	if (mlen == 0)
+		return op;
+	*op++ = offset & 0xff;
+	*op++ = offset >> 8;
+	mlen -= LZ_MIN_MATCH;
+	*token |= mlen < 15 ? mlen : 15;
+	if (mlen >= 15)
+		op = put_len(op, mlen - 15);
+	return op;
+}
+
+int lz_compress(const void *src, int n, void *dst, int cap) {
+	const uint8_t *in = src, *end = in + n;
+	const uint8_t *ip = in, *anchor = in;
+	const uint8_t *match_limit = end - LZ_MFLIMIT;
+	uint8_t *op = dst, *oend = op + cap;
+	int table[1 << LZ_HASH_BITS];
+	memset(table, 0xff, sizeof(table));
+
+	while (n > LZ_MFLIMIT && ip < match_limit) {
+		uint32_t v, cv;
+		memcpy(&v, ip, 4);
+		uint32_t h = lz_hash(v);
+		int cand = table[h];
+		table[h] = ip - in;
+		if (cand < 0 || ip - in - cand > LZ_MAX_OFFSET || (memcpy(&cv, in + cand, 4), cv != v)) {
+			ip += 1 + ((ip - anchor) >> LZ_SKIP_TRIGGER);
+			continue;
+		}
+		const uint8_t *m = in + cand;
+		const uint8_t *p = ip + LZ_MIN_MATCH, *q = m + LZ_MIN_MATCH;
+		while (p < end - LZ_LAST_LITERALS && *p == *q) {
+			p++;
+			q++;
+		}
+		op = put_seq(op, oend, anchor, ip - anchor, ip - m, p - ip);
+		if (op == NULL)
+			return -1;
+		ip = anchor = p;
+	}
+	op = put_seq(op, oend, anchor, end - anchor, 0, 0);
+	return op == NULL ? -1 : op - (uint8_t *)dst;
+}
+
+static int get_len(const uint8_t **ip, const uint8_t *iend, int *len) {
+	uint8_t b;
+	do {
+		if (*ip >= iend)
+			return -1;
+		b = *(*ip)++;
+		*len += b;
+	} while (b == 255);
+	return 0;
+}
+
+int lz_decompress(const void *src, int n, void *dst, int cap) {
+	const uint8_t *ip = src, *iend = ip + n;
+	uint8_t *op = dst, *oend = op + cap;
+	while (ip < iend) {
+		int token = *ip++;
+		int lit_len = token >> 4;
+		if (lit_len == 15 && get_len(&ip, iend, &lit_len) < 0)
+			return -1;
+		if (lit_len > iend - ip || lit_len > oend - op)
+			return -1;
+		memcpy(op, ip, lit_len);
+		op += lit_len;
+		ip += lit_len;
+		// the last sequence has no match
+		if (ip == iend)
+			break;
+		if (iend - ip < 2)
+			return -1;
+		int offset = ip[0] | ip[1] << 8;
+		ip += 2;
+		int mlen = token & 15;
+		if (mlen == 15 && get_len(&ip, iend, &mlen) < 0)
+			return -1;
+		mlen += LZ_MIN_MATCH;
+		if (offset == 0 || offset > op - (uint8_t *)dst || mlen > oend - op)
+			return -1;
+		// a match may overlap the bytes it produces, so copy forwards
+		for (const uint8_t *m = op - offset; mlen > 0; mlen--)
+			*op++ = *m++;
+	}
+	return op - (uint8_t *)dst;
+}
+
+void compress_init() {
+	enabled = getenv(COMPRESS_ENV) != NULL;
+}
+
+int compress_enabled() {
+	return enabled;
+}
+
+int cluster_ptrs(const struct inode *inode, uint32_t c, int *ptrs) {
+	uint32_t idx = c * CLUSTER_BLKS;
+	if (idx < NUM_DIRECT) {
+		memcpy(ptrs, &inode->direct_ptr[idx], CLUSTER_BLKS * sizeof(int));
+		return 0;
+	}
+	idx -= NUM_DIRECT;
+	uint32_t j = idx / PTRS_PER_BLK;
+	for (int i = 0; i < CLUSTER_BLKS; i++)
+		ptrs[i] = -1;
+	if (j >= NUM_INDIRECT || inode->indirect_ptr[j] == -1)
+		return 0;
+	int page[PTRS_PER_BLK];
+	if (bio_read(inode->indirect_ptr[j], page) < 0)
+		return -1;
+	for (int i = 0; i < CLUSTER_BLKS; i++) {
+		int p = page[idx % PTRS_PER_BLK + i];
+		ptrs[i] = p == 0 ? -1 : p;
+	}
+	return 0;
+}
+
+/*
+ * Point cluster c at ptrs. A cluster past the direct pointers lies in an
+ * indirect page that exists already, since the cluster held blocks before.
+ */
+static int set_cluster_ptrs(struct inode *inode, uint32_t c, const int *ptrs) {
+	uint32_t idx = c * CLUSTER_BLKS;
+	if (idx < NUM_DIRECT) {
+		memcpy(&inode->direct_ptr[idx], ptrs, CLUSTER_BLKS * sizeof(int));
+		return 0;
+	}
+	idx -= NUM_DIRECT;
+	int page[PTRS_PER_BLK];
+	int page_blk = inode->indirect_ptr[idx / PTRS_PER_BLK];
+	if (bio_read(page_blk, page) < 0)
+		return -1;
+	for (int i = 0; i < CLUSTER_BLKS; i++)
+		page[idx % PTRS_PER_BLK + i] = ptrs[i] == -1 ? 0 : ptrs[i];
+	return bio_write(page_blk, page) < 0 ? -1 : 0;
+}
+
+/*
+ * Free blocks a cluster no longer uses. They are zeroed first, as
+ * release_inode() does, so a block reused by a partial write never shows
+ * this file's bytes; a block a clone still uses is left as it is.
+ */
+static void drop_blks(const int *blks, int n) {
+	char zero[BLOCK_SIZE];
+	memset(zero, 0, BLOCK_SIZE);
+	for (int i = 0; i < n; i++) {
+		if (dedup_own(blks[i]))
+			bio_write(blks[i], zero);
+	}
+	free_blk_list(blks, n);
+}
+
+int cluster_read(const int *ptrs, void *buf) {
+	struct scratch_mark mark = scratch_mark();
+	char *packed = scratch_blks(CLUSTER_BLKS);
+	int n = 0;
+	for (int i = 1; i < CLUSTER_BLKS && ptrs[i] != -1; i++) {
+		if (bio_read(ptrs[i], packed + n * BLOCK_SIZE) < 0)
+			break;
+		n++;
+	}
+	struct cluster_hdr *hdr = (struct cluster_hdr *)packed;
+	int ret = -1;
+	if (n > 0 && hdr->magic == CLUSTER_MAGIC && hdr->clen <= n * BLOCK_SIZE - sizeof(struct cluster_hdr)
+		&& lz_decompress(hdr + 1, hdr->clen, buf, CLUSTER_BYTES) == CLUSTER_BYTES)
+		ret = 0;
+	scratch_release(mark);
+	if (ret == 0)
+		stats_cluster_read();
+	return ret;
+}
+
+int cluster_expand(struct inode *inode, uint32_t c, const int *ptrs) {
+	struct scratch_mark mark = scratch_mark();
+	char *buf = scratch_blks(CLUSTER_BLKS);
+	int raw[CLUSTER_BLKS], n = 0;
+	if (cluster_read(ptrs, buf) < 0) {
+		scratch_release(mark);
+		return -1;
+	}
+	for (; n < CLUSTER_BLKS; n++) {
+		raw[n] = get_avail_blkno(inode->ino);
+		if (raw[n] < 0)
+			break;
+		bio_write(raw[n], buf + n * BLOCK_SIZE);
+	}
+	scratch_release(mark);
+	if (n < CLUSTER_BLKS) {
+		free_blk_list(raw, n);
+		return -1;
+	}
+	if (set_cluster_ptrs(inode, c, raw) < 0)
+		return -1;
+	int old[CLUSTER_BLKS], n_old = 0;
+	for (int i = 1; i < CLUSTER_BLKS && ptrs[i] != -1; i++)
+		old[n_old++] = ptrs[i];
+	drop_blks(old, n_old);
+	stats_cluster_expand();
+	return 0;
+}
+
+int cluster_pack(struct inode *inode, uint32_t c) {
+	int ptrs[CLUSTER_BLKS];
+	if (cluster_ptrs(inode, c, ptrs) < 0)
+		return -1;
+	// a cluster with a hole, or a block shared with a clone, stays raw
+	for (int i = 0; i < CLUSTER_BLKS; i++) {
+		if (ptrs[i] < 0 || blk_refs(ptrs[i]) > 0)
+			return 0;
+	}
+	struct scratch_mark mark = scratch_mark();
+	char *buf = scratch_blks(CLUSTER_BLKS), *packed = scratch_blks(CLUSTER_BLKS);
+	for (int i = 0; i < CLUSTER_BLKS; i++)
+		bio_read(ptrs[i], buf + i * BLOCK_SIZE);
+	// it must fit the blocks after the marker with at least one block to spare
+	struct cluster_hdr *hdr = (struct cluster_hdr *)packed;
+	int cap = (CLUSTER_BLKS - 1) * BLOCK_SIZE - sizeof(struct cluster_hdr);
+	int clen = lz_compress(buf, CLUSTER_BYTES, hdr + 1, cap);
+	int ret = 0;
+	if (clen < 0) {
+		stats_cluster_pack(0);
+		goto out;
+	}
+	hdr->magic = CLUSTER_MAGIC;
+	hdr->clen = clen;
+	int n = (sizeof(struct cluster_hdr) + clen + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	memset(packed + sizeof(struct cluster_hdr) + clen, 0, n * BLOCK_SIZE - sizeof(struct cluster_hdr) - clen);
+	// the compressed copy goes to new blocks, the raw ones stay valid until the pointers move
+	int new_ptrs[CLUSTER_BLKS];
+	new_ptrs[0] = COMPRESSED_ADDR;
+	for (int i = 1; i < CLUSTER_BLKS; i++)
+		new_ptrs[i] = -1;
+	for (int i = 0; i < n; i++) {
+		new_ptrs[i + 1] = get_avail_blkno(inode->ino);
+		if (new_ptrs[i + 1] < 0) {
+			free_blk_list(new_ptrs + 1, i);
+			ret = -1;
+			goto out;
+		}
+		bio_write(new_ptrs[i + 1], packed + i * BLOCK_SIZE);
+	}
+	if (set_cluster_ptrs(inode, c, new_ptrs) < 0) {
+		ret = -1;
+		goto out;
+	}
+	drop_blks(ptrs, CLUSTER_BLKS);
+	stats_cluster_pack(1);
+	ret = 1;
+out:
+	scratch_release(mark);
+	return ret;
+}
+
+struct dirty_clusters *dirty_open(uint16_t ino) {
+	struct dirty_clusters *d = malloc(sizeof(struct dirty_clusters));
+	d->ino = ino;
+	pthread_mutex_init(&d->lock, NULL);
+	d->first = UINT32_MAX;
+	d->last = 0;
+	return d;
+}
+
+void dirty_mark(struct dirty_clusters *d, uint32_t first, uint32_t last) {
+	pthread_mutex_lock(&d->lock);
+	if (first < d->first)
+		d->first = first;
+	if (last > d->last)
+		d->last = last;
+	pthread_mutex_unlock(&d->lock);
+}
+
+void dirty_close(struct dirty_clusters *d) {
+	struct inode inode;
+	// a file unlinked while open is gone already, and the inode's lock keeps
+	// the other handles' writes and reads off the blocks a pack frees
+	lock_inode(d->ino);
+	if (d->first <= d->last && readi(d->ino, &inode) == 0 && inode.valid && S_ISREG(inode.mode)) {
+		int packed = 0;
+		for (uint32_t c = d->first; c <= d->last; c++)
+			packed += cluster_pack(&inode, c) > 0;
+		if (packed > 0)
+			writei(inode.ino, &inode);
+	}
+	unlock_inode(d->ino);
+	pthread_mutex_destroy(&d->lock);
+	free(d);
+}
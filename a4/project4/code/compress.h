@@ -0,0 +1,53 @@
+/*
+ *  Copyright (C) 2020 CS416 Rutgers CS
+ *	Tiny File System
+ *	File:	compress.h
+ *
+ */
+
+#ifndef _COMPRESS_H
+#define _COMPRESS_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+struct inode;
+
+/*
+ * set TFS_COMPRESS in the environment of tfs to compress the clusters a
+ * writer dirtied when it closes the file. Compressed clusters are read
+ * back whether or not it is set. With TFS_DEDUP set too, the clusters it
+ * compresses leave the dedup index, see dedup.h.
+ */
+#define COMPRESS_ENV "TFS_COMPRESS"
+
+/* clusters a file handle wrote to, hung off fi->fh of a regular file */
+struct dirty_clusters {
+	uint16_t		ino;
+	pthread_mutex_t	lock;
+	uint32_t		first;
+	uint32_t		last;				/* first > last while nothing is dirty */
+};
+
+/* LZ4 block format codec, both return the output length or -1 */
+int lz_compress(const void *src, int n, void *dst, int cap);
+int lz_decompress(const void *src, int n, void *dst, int cap);
+
+void compress_init();
+int compress_enabled();
+
+/* the CLUSTER_BLKS pointers of cluster c of a file, -1 for unused ones */
+int cluster_ptrs(const struct inode *inode, uint32_t c, int *ptrs);
+/* decompress the cluster whose pointers are ptrs into CLUSTER_BLKS blocks of buf */
+int cluster_read(const int *ptrs, void *buf);
+/* turn compressed cluster c back into raw blocks, ahead of a write to it */
+int cluster_expand(struct inode *inode, uint32_t c, const int *ptrs);
+/* compress cluster c if it is raw, whole, unshared and saves a block */
+int cluster_pack(struct inode *inode, uint32_t c);
+
+struct dirty_clusters *dirty_open(uint16_t ino);
+void dirty_mark(struct dirty_clusters *d, uint32_t first, uint32_t last);
+/* compress what the handle dirtied and free it, called at release */
+void dirty_close(struct dirty_clusters *d);
+
+#endif
@@ -0,0 +1,253 @@
+/*
+ *  Copyright (C) 2020 CS416 Rutgers CS
+ *	Tiny File System
+ *	File:	dedup.c
+ *
+ *	Block deduplication. Every data block tfs_write() writes is
+ *	fingerprinted, and the index maps a fingerprint to the one block on
+ *	disk holding those bytes. A block whose fingerprint is there, and whose
+ *	bytes compare equal to that block's, is not written: the file points at
+ *	the indexed block, which counts one owner more in the reference tables
+ *	the cloner uses, so a write, unlink or defrag treats it as any shared
+ *	block. An indexed block leaves the index before it is rewritten, zeroed
+ *	or freed, so the index only ever names blocks holding what it says.
+ *	Compressed clusters are not indexed, see dedup.h.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "block.h"
+#include "tfs.h"
+#include "stats.h"
+#include "dedup.h"
+
+#define ENTRIES_PER_BLK (BLOCK_SIZE / sizeof(struct dedup_entry))
+
+int dedup_active;
+
+/*
+ * Taken last, with nothing else locked under it. A block's group lock
+ * comes first, so a block leaves the index and gains an owner in one step
+ * with respect to the other.
+ */
+static pthread_mutex_t dedup_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t *fps;					/* per data block, 0 while not indexed */
+static uint32_t *table;					/* fingerprint -> data block index + 1, linear probing */
+static uint32_t mask;
+
+uint64_t dedup_hash(const void *buf) {
+	const uint64_t *w = buf;
+	uint64_t h = 0x9E3779B97F4A7C15ull;
+	for (size_t i = 0; i < BLOCK_SIZE / sizeof(uint64_t); i++) {
+		h = (h ^ w[i]) * 0xBF58476D1CE4E5B9ull;
+		h ^= h >> 31;
+	}
+	return h != 0 ? h : 1;
+}
+
+/* slot of the entry for fingerprint hash, or of the empty slot it would go in */
+static uint32_t find(uint64_t hash) {
+	uint32_t i = hash & mask;
+	while (table[i] != 0 && fps[table[i] - 1] != hash)
+		i = (i + 1) & mask;
+	return i;
+}
+
+static void insert(uint64_t hash, uint32_t idx) {
+	uint32_t i = find(hash);
+	// the first block with these bytes stays the one shared
+	if (table[i] != 0)
+		return;
+	table[i] = idx + 1;
+	fps[idx] = hash;
+}
+
+/* empty slot i, moving back the entries after it that probed past it */
+static void remove_slot(uint32_t i) {
+	for (uint32_t j = i;;) {
+		j = (j + 1) & mask;
+		if (table[j] == 0)
+			break;
+		uint32_t k = fps[table[j] - 1] & mask;
+		if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+			continue;
+		table[i] = table[j];
+		i = j;
+	}
+	table[i] = 0;
+}
+
+static void forget(int blk) {
+	if (blk_group(superblock, blk) < 0)
+		return;
+	uint32_t idx = dblk_index(superblock, blk);
+	if (fps[idx] == 0)
+		return;
+	uint32_t i = find(fps[idx]);
+	if (table[i] == idx + 1)
+		remove_slot(i);
+	fps[idx] = 0;
+}
+
+void dedup_forget(int blk) {
+	if (!dedup_active)
+		return;
+	pthread_mutex_lock(&dedup_lock);
+	forget(blk);
+	pthread_mutex_unlock(&dedup_lock);
+}
+
+int dedup_own(int blk) {
+	if (!dedup_active || blk_group(superblock, blk) < 0)
+		return blk_refs(blk) == 0;
+	lock_blk_group(blk);
+	int own = blk_refs(blk) == 0;
+	if (own)
+		dedup_forget(blk);
+	unlock_blk_group(blk);
+	return own;
+}
+
+void dedup_add(uint64_t hash, int blk) {
+	if (blk_group(superblock, blk) < 0)
+		return;
+	pthread_mutex_lock(&dedup_lock);
+	insert(hash, dblk_index(superblock, blk));
+	pthread_mutex_unlock(&dedup_lock);
+	stats_dedup(0);
+}
+
+/* the candidate still holds what it was compared against, its group is locked */
+static int still_indexed(int blk, void *hash) {
+	pthread_mutex_lock(&dedup_lock);
+	int ret = fps[dblk_index(superblock, blk)] == *(uint64_t *)hash;
+	pthread_mutex_unlock(&dedup_lock);
+	return ret;
+}
+
+/*
+ * The candidate is compared without a lock. Its owner takes it out of the
+ * index before it rewrites, zeroes or frees it, so if it is still indexed
+ * under the same fingerprint once its group is locked, it still holds
+ * the bytes compared.
+ */
+int dedup_share(uint64_t hash, const void *buf, int blk) {
+	pthread_mutex_lock(&dedup_lock);
+	uint32_t i = find(hash);
+	int dup = table[i] != 0 ? (int)dblk_at(superblock, table[i] - 1) : -1;
+	pthread_mutex_unlock(&dedup_lock);
+	// rewriting a block with what it holds is no dedup
+	if (dup < 0 || dup == blk)
+		return -1;
+	char *cand = blk_alloc();
+	int same = bio_read(dup, cand) >= 0 && memcmp(cand, buf, BLOCK_SIZE) == 0;
+	blk_free(cand);
+	if (!same || share_blk_if(dup, still_indexed, &hash) < 0)
+		return -1;
+	stats_dedup(1);
+	return dup;
+}
+
+/*
+ * Take the index the run of inode DEDUP_INO holds, when tfs dedups and the
+ * image was unmounted cleanly since it was written. An entry whose block
+ * is out of range or free in the bitmap is left out. The run is freed and
+ * the inode cleared either way, no later write keeps the run up to date.
+ */
+static void load_index(struct inode *inode, int use) {
+	uint32_t n = inode->size / sizeof(struct dedup_entry);
+	uint32_t n_blks = (n + ENTRIES_PER_BLK - 1) / ENTRIES_PER_BLK;
+	int start = inode->direct_ptr[0];
+	int g = blk_group(superblock, start);
+	if (n_blks == 0 || g < 0 || blk_group(superblock, (int64_t)start + n_blks - 1) != g) {
+		fprintf(stderr, "dedup index inode points out of the data area (%d), run tfs_fsck\n", start);
+		return;
+	}
+	struct dedup_entry *entries = blk_alloc();
+	char *bitmap = blk_alloc();
+	int bitmap_g = -1;
+	for (uint32_t b = 0; use && b < n_blks; b++) {
+		bio_read(start + b, entries);
+		for (uint32_t e = 0; e < ENTRIES_PER_BLK && b * ENTRIES_PER_BLK + e < n; e++) {
+			int eg = blk_group(superblock, entries[e].blk);
+			if (eg < 0 || entries[e].hash == 0)
+				continue;
+			if (eg != bitmap_g) {
+				bio_read(grp_d_bitmap(superblock, eg), bitmap);
+				bitmap_g = eg;
+			}
+			if (get_bitmap((bitmap_t)bitmap, entries[e].blk - grp_d_start(superblock, eg)))
+				insert(entries[e].hash, dblk_index(superblock, entries[e].blk));
+		}
+	}
+	blk_free(bitmap);
+	blk_free(entries);
+	int *run = malloc(n_blks * sizeof(int));
+	for (uint32_t b = 0; b < n_blks; b++)
+		run[b] = start + b;
+	free_blk_list(run, n_blks);
+	free(run);
+}
+
+void dedup_mount(int clean) {
+	uint32_t size = 1;
+	while (size < 2 * superblock->max_dnum)
+		size <<= 1;
+	mask = size - 1;
+	fps = calloc(superblock->max_dnum, sizeof(uint64_t));
+	table = calloc(size, sizeof(uint32_t));
+
+	struct inode inode;
+	if (readi(DEDUP_INO, &inode) == 0) {
+		load_index(&inode, clean && getenv(DEDUP_ENV) != NULL);
+		memset(&inode, 0, sizeof(inode));
+		writei(DEDUP_INO, &inode);
+	}
+	dedup_active = getenv(DEDUP_ENV) != NULL;
+}
+
+/*
+ * Write the index to a run of free blocks and point inode DEDUP_INO at it.
+ * With no run that large the index is dropped, and dedup starts over empty.
+ */
+void dedup_unmount() {
+	if (dedup_active) {
+		uint32_t n = 0;
+		for (uint32_t i = 0; i <= mask; i++)
+			n += table[i] != 0;
+		uint32_t n_blks = (n + ENTRIES_PER_BLK - 1) / ENTRIES_PER_BLK;
+		int start = n_blks > 0 ? claim_free_run(n_blks) : -1;
+		if (start >= 0) {
+			struct dedup_entry *entries = blk_alloc();
+			uint32_t i = 0;
+			for (uint32_t b = 0; b < n_blks; b++) {
+				memset(entries, 0, BLOCK_SIZE);
+				for (uint32_t e = 0; e < ENTRIES_PER_BLK && i <= mask; i++) {
+					if (table[i] == 0)
+						continue;
+					entries[e].hash = fps[table[i] - 1];
+					entries[e].blk = dblk_at(superblock, table[i] - 1);
+					e++;
+				}
+				bio_write(start + b, entries);
+			}
+			blk_free(entries);
+			struct inode inode;
+			init_inode(&inode, DEDUP_INO, __S_IFREG | 0600);
+			inode.size = n * sizeof(struct dedup_entry);
+			inode.direct_ptr[0] = start;
+			writei(DEDUP_INO, &inode);
+		}
+		else if (n_blks > 0)
+			fprintf(stderr, "no run of %u free blocks for the dedup index, dropping it\n", n_blks);
+	}
+	dedup_active = 0;
+	free(fps);
+	free(table);
+	fps = NULL;
+	table = NULL;
+}
@@ -0,0 +1,51 @@
+/*
+ *  Copyright (C) 2020 CS416 Rutgers CS
+ *	Tiny File System
+ *	File:	dedup.h
+ *
+ */
+
+#ifndef _DEDUP_H
+#define _DEDUP_H
+
+#include <stdint.h>
+
+/*
+ * set TFS_DEDUP in the environment of tfs to share a written block with
+ * one already on disk that holds the same bytes, instead of writing it
+ * again. Blocks shared that way stay shared whether or not it is set.
+ *
+ * It does not combine with TFS_COMPRESS. Only raw blocks are indexed, and
+ * compressing a cluster at close frees its raw blocks and their index
+ * entries with them, so later writes find almost nothing to share. A
+ * cluster that holds a shared block stays raw, so what dedup has already
+ * shared is kept.
+ */
+#define DEDUP_ENV "TFS_DEDUP"
+
+/* set while written blocks are fingerprinted, tfs_write() tests it */
+extern int dedup_active;
+
+/* read the index the last clean unmount left and free its run, after load_refs() */
+void dedup_mount(int clean);
+/* write the index out for the next mount, before the allocators go away */
+void dedup_unmount();
+
+/* fingerprint of a block's contents, never 0 */
+uint64_t dedup_hash(const void *buf);
+/*
+ * A block other than blk, the one the file has there now or -1, holding
+ * the same bytes as buf, with an owner added. -1 if there is none.
+ */
+int dedup_share(uint64_t hash, const void *buf, int blk);
+/* index blk, just written with contents of fingerprint hash */
+void dedup_add(uint64_t hash, int blk);
+/*
+ * Whether the caller is blk's only owner and may rewrite or zero it in
+ * place, in which case it leaves the index first
+ */
+int dedup_own(int blk);
+/* drop blk from the index as it is freed, the caller holds its group's lock */
+void dedup_forget(int blk);
+
+#endif
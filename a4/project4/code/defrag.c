@@ -0,0 +1,533 @@
+/*
+ *  Copyright (C) 2020 CS416 Rutgers CS
+ *	Tiny File System
+ *	File:	defrag.c
+ *
+ *	Online defragmenter. A pass runs on its own thread in three phases:
+ *	 1. fragmented files, worst score first, are copied into the first free
+ *	    run that holds them whole, in their inode's group if it has one
+ *	 2. free space is compacted: files, highest first, move down into the
+ *	    first free run below them in their inode's group, so each group's
+ *	    free space collects at its end. A file moves only if that leaves
+ *	    fewer free extents, those that would not are counted as kept
+ *	 3. files phase 1 found no room for are tried again
+ *	Each file is moved with fs_lock held for writing, so FUSE calls only
+ *	wait for one file at a time. A move claims the new run in the bitmap,
+ *	copies the blocks, and then switches the file over with a single inode
+ *	write; the old blocks are zeroed and released after that.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "block.h"
+#include "tfs.h"
+#include "defrag.h"
+
+/* blocks a file can occupy: direct blocks, indirect pages and their data */
+#define MAX_FILE_BLKS (NUM_DIRECT + NUM_INDIRECT * (1 + PTRS_PER_BLK))
+
+enum defrag_state { DF_IDLE, DF_RUNNING, DF_STOPPING, DF_DONE, DF_STOPPED };
+static const char *state_names[] = { "idle", "running", "stopping", "done", "stopped" };
+
+struct free_space {
+	uint32_t	free_blks;
+	uint32_t	extents;			/* runs of free blocks */
+	uint32_t	largest;			/* longest run of free blocks */
+};
+
+struct defrag_status {
+	enum defrag_state state;
+	int			min_score;
+	int			phase;
+	uint32_t	files;				/* files and directories looked at */
+	uint32_t	fragmented;			/* of those, at or above min_score */
+	uint32_t	defragmented;		/* moved by phase 1 or 3 */
+	uint32_t	compacted;			/* moved by phase 2 */
+	uint32_t	kept;				/* left by phase 2, moving them would not join free runs */
+	uint32_t	no_room;			/* fragmented but no free run was long enough */
+	uint64_t	blocks_moved;
+	double		score_before;		/* mean score of files with 2 or more blocks */
+	double		score_after;
+	struct free_space free_before;
+	struct free_space free_after;
+	double		seconds;
+};
+
+struct candidate {
+	uint16_t	ino;
+	int			key;				/* score in phase 1, first block in phase 2 */
+};
+
+static struct defrag_status status;
+static pthread_mutex_t status_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t defrag_thread;
+static int thread_started;
+
+/* only the defrag thread uses these */
+static int old_blks[MAX_FILE_BLKS];
+static char copy_buf[BLOCK_SIZE];
+static char zero_buf[BLOCK_SIZE];
+
+static int stopping() {
+	pthread_mutex_lock(&status_lock);
+	int stop = status.state == DF_STOPPING;
+	pthread_mutex_unlock(&status_lock);
+	return stop;
+}
+
+/*
+ * A file's blocks in layout order: direct blocks, then each indirect page
+ * followed by the blocks it maps. Holes are skipped. A file that shares
+ * blocks with a clone counts as having none, as it cannot be moved without
+ * the other owners, and so does one with compressed clusters or a packed
+ * file, whose fragment block other files share.
+ */
+static int file_blks(struct inode *inode, int *list) {
+	int n = 0;
+	int page[PTRS_PER_BLK];
+	if (is_packed(inode))
+		return 0;
+	for (int i = 0; i < NUM_DIRECT; i++) {
+		if (inode->direct_ptr[i] != -1)
+			list[n++] = inode->direct_ptr[i];
+	}
+	for (int j = 0; j < NUM_INDIRECT; j++) {
+		if (inode->indirect_ptr[j] == -1)
+			continue;
+		list[n++] = inode->indirect_ptr[j];
+		bio_read(inode->indirect_ptr[j], page);
+		for (int k = 0; k < PTRS_PER_BLK; k++) {
+			if (page[k] != 0)
+				list[n++] = page[k];
+		}
+	}
+	for (int i = 0; i < n; i++) {
+		if (list[i] == COMPRESSED_ADDR || blk_refs(list[i]) > 0)
+			return 0;
+	}
+	return n;
+}
+
+static int frag_score(const int *list, int n) {
+	if (n < 2)
+		return 0;
+	int breaks = 0;
+	for (int i = 1; i < n; i++) {
+		if (list[i] != list[i - 1] + 1)
+			breaks++;
+	}
+	return breaks * 100 / (n - 1);
+}
+
+/*
+ * First free run of n blocks in a group's bitmap starting below limit, or -1
+ */
+static int find_run(bitmap_t d_bitmap, int n, int limit) {
+	int start = 0, len = 0;
+	for (int bit = 0; bit < superblock->blocks_per_group; bit++) {
+		if (get_bitmap(d_bitmap, bit)) {
+			len = 0;
+			start = bit + 1;
+			if (start >= limit)
+				return -1;
+			continue;
+		}
+		if (++len == n)
+			return start;
+	}
+	return -1;
+}
+
+/* Free runs never span groups, the bitmaps and inode slice sit between them */
+static void measure_free(struct free_space *fs) {
+	char d_bitmap[BLOCK_SIZE];
+	memset(fs, 0, sizeof(struct free_space));
+	for (int g = 0; g < superblock->n_groups; g++) {
+		uint32_t run = 0;
+		bio_read(grp_d_bitmap(superblock, g), d_bitmap);
+		for (int bit = 0; bit <= superblock->blocks_per_group; bit++) {
+			if (bit < superblock->blocks_per_group && !get_bitmap((bitmap_t)d_bitmap, bit)) {
+				fs->free_blks++;
+				run++;
+				continue;
+			}
+			if (run > 0) {
+				fs->extents++;
+				if (run > fs->largest)
+					fs->largest = run;
+			}
+			run = 0;
+		}
+	}
+}
+
+/* runs of free blocks in a group's bitmap */
+static int bitmap_extents(bitmap_t d_bitmap) {
+	int extents = 0;
+	for (int bit = 0; bit < superblock->blocks_per_group; bit++) {
+		if (!get_bitmap(d_bitmap, bit) && (bit == 0 || get_bitmap(d_bitmap, bit - 1)))
+			extents++;
+	}
+	return extents;
+}
+
+/*
+ * Free extents that moving the n blocks in old to the run at bit of group g
+ * would add, negative when the move joins free runs up
+ */
+static int extents_change(const int *old, int n, int g, int bit) {
+	char before[BLOCK_SIZE], after[BLOCK_SIZE];
+	int change = 0;
+	for (int h = 0; h < superblock->n_groups; h++) {
+		int touched = h == g;
+		for (int i = 0; i < n && !touched; i++)
+			touched = blk_group(superblock, old[i]) == h;
+		if (!touched)
+			continue;
+		bio_read(grp_d_bitmap(superblock, h), before);
+		memcpy(after, before, BLOCK_SIZE);
+		for (int i = 0; i < n; i++) {
+			if (blk_group(superblock, old[i]) == h)
+				unset_bitmap((bitmap_t)after, old[i] - grp_d_start(superblock, h));
+		}
+		for (int i = 0; h == g && i < n; i++)
+			set_bitmap((bitmap_t)after, bit + i);
+		change += bitmap_extents((bitmap_t)after) - bitmap_extents((bitmap_t)before);
+	}
+	return change;
+}
+
+static void copy_blk(int from, int to) {
+	bio_read(from, copy_buf);
+	bio_write(to, copy_buf);
+}
+
+/*
+ * Move a file's n blocks, listed in old, to the run at bit of group g
+ */
+static void relocate(struct inode *inode, const int *old, int n, int g, int bit) {
+	int page[PTRS_PER_BLK];
+	struct inode moved = *inode;
+	int next = grp_d_start(superblock, g) + bit;
+
+	// Step 1: claim the new run
+	claim_blk_run(g, bit, n);
+
+	// Step 2: copy the blocks in layout order, remapping the indirect pages
+	for (int i = 0; i < NUM_DIRECT; i++) {
+		if (inode->direct_ptr[i] == -1)
+			continue;
+		copy_blk(inode->direct_ptr[i], next);
+		moved.direct_ptr[i] = next++;
+	}
+	for (int j = 0; j < NUM_INDIRECT; j++) {
+		if (inode->indirect_ptr[j] == -1)
+			continue;
+		bio_read(inode->indirect_ptr[j], page);
+		int page_blk = next++;
+		for (int k = 0; k < PTRS_PER_BLK; k++) {
+			if (page[k] == 0)
+				continue;
+			copy_blk(page[k], next);
+			page[k] = next++;
+		}
+		bio_write(page_blk, page);
+		moved.indirect_ptr[j] = page_blk;
+	}
+
+	// Step 3: switch the file over, until here it still uses the old blocks
+	writei(moved.ino, &moved);
+	*inode = moved;
+
+	// Step 4: release the old blocks, zeroed like unlink leaves them
+	for (int i = 0; i < n; i++)
+		bio_write(old[i], zero_buf);
+	free_blk_list(old, n);
+
+	pthread_mutex_lock(&status_lock);
+	status.blocks_moved += n;
+	pthread_mutex_unlock(&status_lock);
+}
+
+static int by_key_desc(const void *a, const void *b) {
+	const struct candidate *x = a, *y = b;
+	if (x->key != y->key)
+		return x->key > y->key ? -1 : 1;
+	return x->ino - y->ino;
+}
+
+/*
+ * Every valid inode with at least one block, keyed by score or first block
+ */
+static struct candidate *collect(int by_score, int *count, double *mean_score) {
+	struct candidate *c = malloc(superblock->max_inum * sizeof(struct candidate));
+	struct inode inode;
+	uint64_t score_sum = 0;
+	int scored = 0;
+	*count = 0;
+	for (int ino = ROOT_INO; ino < superblock->max_inum && !stopping(); ino++) {
+		pthread_rwlock_rdlock(&fs_lock);
+		int n = readi(ino, &inode) == 0 ? file_blks(&inode, old_blks) : 0;
+		pthread_rwlock_unlock(&fs_lock);
+		if (n == 0)
+			continue;
+		int score = frag_score(old_blks, n);
+		if (n > 1) {
+			score_sum += score;
+			scored++;
+		}
+		c[*count].ino = ino;
+		if (by_score)
+			c[*count].key = score;
+		else {
+			c[*count].key = old_blks[0];
+			for (int i = 1; i < n; i++) {
+				if (old_blks[i] < c[*count].key)
+					c[*count].key = old_blks[i];
+			}
+		}
+		(*count)++;
+	}
+	if (mean_score != NULL)
+		*mean_score = scored ? (double)score_sum / scored : 0;
+	qsort(c, *count, sizeof(struct candidate), by_key_desc);
+	return c;
+}
+
+/*
+ * Phases 1 and 3: move fragmented files, returns how many found no room
+ */
+static int defrag_files(struct candidate *c, int count, int retry) {
+	char d_bitmap[BLOCK_SIZE];
+	struct inode inode;
+	int no_room = 0;
+	for (int i = 0; i < count && !stopping(); i++) {
+		if (c[i].key < status.min_score)
+			break;
+		pthread_rwlock_wrlock(&fs_lock);
+		// the file may have changed since it was scored
+		int n = readi(c[i].ino, &inode) == 0 ? file_blks(&inode, old_blks) : 0;
+		if (n > 0 && frag_score(old_blks, n) >= status.min_score) {
+			// the inode's own group first, then the ones after it
+			int home = ino_group(superblock, inode.ino), g = 0, run = -1;
+			for (int k = 0; k < superblock->n_groups && run < 0; k++) {
+				g = (home + k) % superblock->n_groups;
+				bio_read(grp_d_bitmap(superblock, g), d_bitmap);
+				run = find_run((bitmap_t)d_bitmap, n, superblock->blocks_per_group);
+			}
+			if (run < 0)
+				no_room++;
+			else {
+				relocate(&inode, old_blks, n, g, run);
+				pthread_mutex_lock(&status_lock);
+				status.defragmented++;
+				pthread_mutex_unlock(&status_lock);
+			}
+		}
+		pthread_rwlock_unlock(&fs_lock);
+	}
+	if (!retry) {
+		pthread_mutex_lock(&status_lock);
+		status.no_room = no_room;
+		pthread_mutex_unlock(&status_lock);
+	}
+	return no_room;
+}
+
+/*
+ * Phase 2: slide files down into free runs below them, highest first. A file
+ * stays in, or moves into, its inode's group, and only when the move leaves
+ * fewer free extents: filling the middle of a long run with a file whose old
+ * blocks do not border free space only cuts the free space up further.
+ */
+static void compact(struct candidate *c, int count) {
+	char d_bitmap[BLOCK_SIZE];
+	struct inode inode;
+	for (int i = 0; i < count && !stopping(); i++) {
+		pthread_rwlock_wrlock(&fs_lock);
+		int n = readi(c[i].ino, &inode) == 0 ? file_blks(&inode, old_blks) : 0;
+		if (n > 0) {
+			int lowest = old_blks[0];
+			for (int k = 1; k < n; k++) {
+				if (old_blks[k] < lowest)
+					lowest = old_blks[k];
+			}
+			int home = ino_group(superblock, inode.ino);
+			int limit = superblock->blocks_per_group;
+			if (blk_group(superblock, lowest) == home)
+				limit = lowest - grp_d_start(superblock, home);
+			bio_read(grp_d_bitmap(superblock, home), d_bitmap);
+			int run = find_run((bitmap_t)d_bitmap, n, limit);
+			if (run >= 0 && extents_change(old_blks, n, home, run) < 0) {
+				relocate(&inode, old_blks, n, home, run);
+				pthread_mutex_lock(&status_lock);
+				status.compacted++;
+				pthread_mutex_unlock(&status_lock);
+			}
+			else if (run >= 0) {
+				pthread_mutex_lock(&status_lock);
+				status.kept++;
+				pthread_mutex_unlock(&status_lock);
+			}
+		}
+		pthread_rwlock_unlock(&fs_lock);
+	}
+}
+
+static void set_phase(int phase) {
+	pthread_mutex_lock(&status_lock);
+	status.phase = phase;
+	pthread_mutex_unlock(&status_lock);
+}
+
+static void *defrag_main(void *arg) {
+	struct timespec start, end;
+	struct candidate *c;
+	int count;
+	double score;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	pthread_rwlock_rdlock(&fs_lock);
+	measure_free(&status.free_before);
+	pthread_rwlock_unlock(&fs_lock);
+
+	set_phase(1);
+	c = collect(1, &count, &score);
+	pthread_mutex_lock(&status_lock);
+	status.files = count;
+	status.score_before = score;
+	for (int i = 0; i < count; i++) {
+		if (c[i].key >= status.min_score)
+			status.fragmented++;
+	}
+	pthread_mutex_unlock(&status_lock);
+	int no_room = defrag_files(c, count, 0);
+	free(c);
+
+	set_phase(2);
+	c = collect(0, &count, NULL);
+	compact(c, count);
+	free(c);
+
+	if (no_room > 0) {
+		set_phase(3);
+		c = collect(1, &count, NULL);
+		no_room = defrag_files(c, count, 1);
+		pthread_mutex_lock(&status_lock);
+		status.no_room = no_room;
+		pthread_mutex_unlock(&status_lock);
+		free(c);
+	}
+
+	c = collect(1, &count, &score);
+	free(c);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	pthread_rwlock_rdlock(&fs_lock);
+	pthread_mutex_lock(&status_lock);
+	measure_free(&status.free_after);
+	status.score_after = score;
+	status.seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	status.state = status.state == DF_STOPPING ? DF_STOPPED : DF_DONE;
+	status.phase = 0;
+	pthread_mutex_unlock(&status_lock);
+	pthread_rwlock_unlock(&fs_lock);
+	return NULL;
+}
+
+/*
+ * Start a pass, or ask the running one to stop. Never waits for the thread,
+ * the caller holds fs_lock for reading.
+ */
+int defrag_command(const char *buf, size_t len) {
+	char cmd[64];
+	int min_score = DEFRAG_MIN_SCORE;
+	if (len >= sizeof(cmd))
+		return -EINVAL;
+	memcpy(cmd, buf, len);
+	cmd[len] = '\0';
+
+	if (strncmp(cmd, "stop", 4) == 0) {
+		pthread_mutex_lock(&status_lock);
+		if (status.state == DF_RUNNING)
+			status.state = DF_STOPPING;
+		pthread_mutex_unlock(&status_lock);
+		return 0;
+	}
+	if (strncmp(cmd, "start", 5) != 0)
+		return -EINVAL;
+	if (sscanf(cmd + 5, "%d", &min_score) == 1 && (min_score < 0 || min_score > 100))
+		return -EINVAL;
+
+	pthread_mutex_lock(&status_lock);
+	if (status.state == DF_RUNNING || status.state == DF_STOPPING) {
+		pthread_mutex_unlock(&status_lock);
+		return -EBUSY;
+	}
+	// a finished pass has already left fs_lock, joining it cannot block on us
+	if (thread_started)
+		pthread_join(defrag_thread, NULL);
+	memset(&status, 0, sizeof(status));
+	status.state = DF_RUNNING;
+	status.min_score = min_score;
+	thread_started = pthread_create(&defrag_thread, NULL, defrag_main, NULL) == 0;
+	if (!thread_started)
+		status.state = DF_IDLE;
+	pthread_mutex_unlock(&status_lock);
+	return thread_started ? 0 : -EAGAIN;
+}
+
+void defrag_shutdown() {
+	pthread_mutex_lock(&status_lock);
+	if (status.state == DF_RUNNING)
+		status.state = DF_STOPPING;
+	int started = thread_started;
+	thread_started = 0;
+	pthread_mutex_unlock(&status_lock);
+	if (started)
+		pthread_join(defrag_thread, NULL);
+}
+
+char *defrag_render(size_t *len) {
+	char *text = NULL;
+	FILE *out = open_memstream(&text, len);
+	if (out == NULL)
+		return NULL;
+	pthread_mutex_lock(&status_lock);
+	struct defrag_status s = status;
+	pthread_mutex_unlock(&status_lock);
+
+	fprintf(out, "state %s\n", state_names[s.state]);
+	if (s.state == DF_IDLE) {
+		fclose(out);
+		return text;
+	}
+	if (s.phase)
+		fprintf(out, "phase %d\n", s.phase);
+	fprintf(out, "min_score %d\n", s.min_score);
+	fprintf(out, "files %u\n", s.files);
+	fprintf(out, "fragmented %u\n", s.fragmented);
+	fprintf(out, "defragmented %u\n", s.defragmented);
+	fprintf(out, "compacted %u\n", s.compacted);
+	fprintf(out, "kept %u\n", s.kept);
+	fprintf(out, "no_room %u\n", s.no_room);
+	fprintf(out, "blocks_moved %lu\n", s.blocks_moved);
+	fprintf(out, "score_before %.1f\n", s.score_before);
+	fprintf(out, "free_before %u blocks, %u extents, largest %u\n",
+		s.free_before.free_blks, s.free_before.extents, s.free_before.largest);
+	if (s.state == DF_DONE || s.state == DF_STOPPED) {
+		fprintf(out, "score_after %.1f\n", s.score_after);
+		fprintf(out, "free_after %u blocks, %u extents, largest %u\n",
+			s.free_after.free_blks, s.free_after.extents, s.free_after.largest);
+		fprintf(out, "seconds %.3f\n", s.seconds);
+	}
+	fclose(out);
+	return text;
+}
@@ -0,0 +1,35 @@
+/*
+ *  Copyright (C) 2020 CS416 Rutgers CS
+ *	Tiny File System
+ *	File:	defrag.h
+ *
+ */
+
+#ifndef _DEFRAG_H
+#define _DEFRAG_H
+
+#include <stddef.h>
+
+/*
+ * control file of the online defragmenter in the mount root:
+ *	echo start [min_score] > /.tfs_defrag	start a background pass
+ *	echo stop > /.tfs_defrag				stop after the current file
+ *	cat /.tfs_defrag						progress of the last pass
+ */
+#define DEFRAG_NAME "/.tfs_defrag"
+
+/*
+ * A file's score is the share of its block-to-block steps that are not to the
+ * next block, in percent, with blocks taken in the order mktfs lays them out.
+ * 0 is one contiguous run and 100 is no two blocks adjacent.
+ */
+#define DEFRAG_MIN_SCORE 1
+
+/* parse a command written to the control file, returns 0 or -errno */
+int defrag_command(const char *buf, size_t len);
+/* stop a running pass and wait for it, called at unmount */
+void defrag_shutdown();
+/* render the progress of the last pass as text, returns a malloc'd buffer */
+char *defrag_render(size_t *len);
+
+#endif
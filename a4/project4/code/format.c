@@ -0,0 +1,207 @@
+/*
+ *  Copyright (C) 2020 CS416 Rutgers CS
+ *	Tiny File System
+ *	File:	format.c
+ *
+ *	On-disk format helpers shared by tfs and the offline tools
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "block.h"
+#include "tfs.h"
+
+/* 
+ * Fill in the geometry of an image of n_groups block groups. Inodes per
+ * group are rounded up to fill whole inode table blocks. The caller keeps
+ * both totals within MAX_TOTAL and each per-group count within MAX_BITMAP_BITS.
+ */
+void tfs_layout(struct superblock *sb, uint32_t n_groups, uint32_t inodes_per_group, uint32_t blocks_per_group) {
+	inodes_per_group = (inodes_per_group + NUM_INODES - 1) / NUM_INODES * NUM_INODES;
+	memset(sb, 0, sizeof(struct superblock));
+	sb->magic_num = MAGIC_NUM;
+	sb->max_inum = n_groups * inodes_per_group;
+	sb->max_dnum = n_groups * blocks_per_group;
+	sb->n_groups = n_groups;
+	sb->inodes_per_group = inodes_per_group;
+	sb->blocks_per_group = blocks_per_group;
+	sb->i_bitmap_blk = 1;
+	sb->d_bitmap_blk = sb->i_bitmap_blk + 1;
+	sb->i_start_blk = sb->d_bitmap_blk + 1;
+	sb->d_start_blk = sb->i_start_blk + inodes_per_group / NUM_INODES;
+	sb->group_blks = sb->d_start_blk - sb->i_bitmap_blk + blocks_per_group;
+	sb->version = TFS_VERSION;
+}
+
+/* 
+ * A new, empty inode of the given type and permissions, its times set to now
+ */
+void init_inode(struct inode *inode, uint16_t ino, uint16_t mode) {
+	memset(inode, 0, INODE_SIZE);
+	inode->ino = ino;
+	inode->valid = 1;
+	inode->mode = mode;
+	inode->size = 0;
+	inode->link = S_ISDIR(mode) ? 2 : 1;
+	inode->atime = inode->mtime = inode->ctime = time(NULL);
+	memset(inode->direct_ptr, -1, sizeof(inode->direct_ptr));
+	memset(inode->indirect_ptr, -1, sizeof(inode->indirect_ptr));
+}
+
+/* 
+ * Blocks a file with data_blocks blocks of data occupies, indirect pages included
+ */
+uint32_t file_blocks(uint32_t data_blocks) {
+	if (data_blocks <= NUM_DIRECT)
+		return data_blocks;
+	return data_blocks + (data_blocks - NUM_DIRECT + PTRS_PER_BLK - 1) / PTRS_PER_BLK;
+}
+
+/* 
+ * Directory blocks: an empty block is one free record spanning the block
+ */
+void dirblk_init(void *blk) {
+	struct dirent *d = blk;
+	memset(blk, 0, BLOCK_SIZE);
+	d->rec_len = BLOCK_SIZE;
+}
+
+/* 
+ * Whether the record at d runs past the block, or its length is not one
+ * tfs writes, the checks tfs_fsck makes. A walk stops at a bad record.
+ */
+int dirblk_bad(const void *blk, const struct dirent *d) {
+	size_t off = (const char *)d - (const char *)blk;
+	return off + sizeof(struct dirent) > BLOCK_SIZE || d->rec_len == 0 || d->rec_len % 4
+		|| off + d->rec_len > BLOCK_SIZE || d->rec_len < DIRENT_LEN(d->name_len);
+}
+
+struct dirent *dirblk_find(void *blk, const char *name, size_t name_len) {
+	struct dirent *d = blk, *end = (struct dirent *)((char *)blk + BLOCK_SIZE);
+	for (; d < end; d = NEXT_DIRENT(d)) {
+		if (dirblk_bad(blk, d))
+			break;
+		if (d->ino != 0 && d->name_len == name_len && memcmp(d->name, name, name_len) == 0)
+			return d;
+	}
+	return NULL;
+}
+
+/* 
+ * Add an entry in the first record with room for it, splitting off the
+ * slack of a live record when needed. Returns NULL if the block is full.
+ */
+struct dirent *dirblk_add(void *blk, uint16_t ino, const char *name, size_t name_len, uint8_t file_type) {
+	struct dirent *d = blk, *end = (struct dirent *)((char *)blk + BLOCK_SIZE);
+	size_t need = DIRENT_LEN(name_len);
+	for (; d < end; d = NEXT_DIRENT(d)) {
+		if (dirblk_bad(blk, d))
+			break;
+		size_t used = d->ino ? DIRENT_LEN(d->name_len) : 0;
+		if (d->rec_len - used < need)
+			continue;
+		if (used) {
+			struct dirent *split = (struct dirent *)((char *)d + used);
+			split->rec_len = d->rec_len - used;
+			d->rec_len = used;
+			d = split;
+		}
+		d->ino = ino;
+		d->name_len = name_len;
+		d->file_type = file_type;
+		memcpy(d->name, name, name_len);
+		return d;
+	}
+	return NULL;
+}
+
+/* 
+ * Remove an entry, its record merges into the one before it. Returns -1 if
+ * the name is not in the block.
+ */
+int dirblk_remove(void *blk, const char *name, size_t name_len) {
+	struct dirent *d = blk, *prev = NULL, *end = (struct dirent *)((char *)blk + BLOCK_SIZE);
+	for (; d < end; prev = d, d = NEXT_DIRENT(d)) {
+		if (dirblk_bad(blk, d))
+			break;
+		if (d->ino == 0 || d->name_len != name_len || memcmp(d->name, name, name_len) != 0)
+			continue;
+		if (prev != NULL)
+			prev->rec_len += d->rec_len;
+		else
+			d->ino = 0;
+		return 0;
+	}
+	return -1;
+}
+
+int dirblk_empty(void *blk) {
+	struct dirent *d = blk;
+	return d->ino == 0 && d->rec_len == BLOCK_SIZE;
+}
+
+/* 
+ * FNV-1a over the summary's home addresses and the blocks, a word at a time
+ */
+uint32_t log_csum(const struct log_seg *seg, const void *const *blks) {
+	uint32_t h = 2166136261u;
+	for (uint32_t i = 0; i < seg->n; i++)
+		h = (h ^ seg->home[i]) * 16777619u;
+	for (uint32_t i = 0; i < seg->n; i++) {
+		const uint32_t *w = blks[i];
+		for (int k = 0; k < BLOCK_SIZE / 4; k++)
+			h = (h ^ w[k]) * 16777619u;
+	}
+	return h;
+}
+
+/* read the segment at pos of the area into seg and data, 1 if it is the one expected */
+static int read_seg(uint32_t log_blk, uint32_t end, uint32_t seq, uint32_t pos,
+	struct log_seg *seg, char *data, void (*rd)(uint32_t, void *)) {
+	const void *blks[SEG_BLKS];
+	if (pos + 1 > LOG_BLKS - 1)
+		return 0;
+	rd(log_blk + 1 + pos, seg);
+	if (seg->magic != LOG_MAGIC || seg->seq != seq || seg->n == 0 || seg->n > SEG_BLKS
+		|| pos + 1 + seg->n > LOG_BLKS - 1)
+		return 0;
+	for (uint32_t i = 0; i < seg->n; i++) {
+		if (seg->home[i] >= end)
+			return 0;
+		rd(log_blk + 2 + pos + i, data + i * BLOCK_SIZE);
+		blks[i] = data + i * BLOCK_SIZE;
+	}
+	return log_csum(seg, blks) == seg->csum;
+}
+
+/* 
+ * Write the blocks of the segments a log holds past its checkpoint to their
+ * home addresses, all below end. hdr, read from log_blk, is moved past the
+ * segments replayed; returns how many there were.
+ */
+int log_replay(uint32_t log_blk, uint32_t end, struct log_hdr *hdr,
+	void (*rd)(uint32_t blk, void *buf), void (*wr)(uint32_t blk, const void *buf)) {
+	struct log_seg *seg = malloc(BLOCK_SIZE);
+	char *data = malloc(SEG_BLKS * BLOCK_SIZE);
+	int n = 0;
+	for (;;) {
+		// a segment that did not fit at start went at the start of the area
+		uint32_t pos = hdr->start;
+		if (!read_seg(log_blk, end, hdr->seq, pos, seg, data, rd)) {
+			pos = 0;
+			if (hdr->start == 0 || !read_seg(log_blk, end, hdr->seq, pos, seg, data, rd))
+				break;
+		}
+		for (uint32_t i = 0; i < seg->n; i++)
+			wr(seg->home[i], data + i * BLOCK_SIZE);
+		hdr->start = pos + 1 + seg->n < LOG_BLKS - 1 ? pos + 1 + seg->n : 0;
+		hdr->seq++;
+		n++;
+	}
+	free(seg);
+	free(data);
+	return n;
+}
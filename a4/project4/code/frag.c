@@ -0,0 +1,291 @@
+/*
+ *  Copyright (C) 2020 CS416 Rutgers CS
+ *	Tiny File System
+ *	File:	frag.c
+ *
+ *	Tail packing. A file of a few KB would take a data block of its own,
+ *	a bitmap update to get it and a block read for every access, with the
+ *	rest of the block wasted on disk and in the cache. A packed file takes
+ *	a run of FRAG_SIZE byte units of a fragment block it shares with other
+ *	small files, so a block read brings in several of them. Each group
+ *	keeps the units in use in a fragment map, read at mount and written
+ *	through on every change as the bitmaps are. A run that outgrows its
+ *	place grows in place when the units after it are free and moves to a
+ *	new run otherwise, and a file that outgrows PACK_MAX moves to a block
+ *	of its own. The unused bytes of a run are kept zero.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "block.h"
+#include "tfs.h"
+#include "stats.h"
+#include "frag.h"
+
+int pack_active;
+
+// Unit masks per data block of each group, NULL for a group without a map
+static uint16_t **maps;
+// Guards a group's map and the read, change and write of its fragment blocks
+static pthread_mutex_t *map_locks;
+
+static uint32_t map_blk(uint32_t g) {
+	return grp_d_start(superblock, g) + sb_groups(superblock)[g].frag_map - 1;
+}
+
+/* data blocks of a group that can be fragment blocks */
+static uint32_t frag_limit() {
+	return superblock->blocks_per_group < FRAG_MAP_BLKS ? superblock->blocks_per_group : FRAG_MAP_BLKS;
+}
+
+/* give group g its map, with map_locks[g] held, -1 if the group is full */
+static int make_map(uint32_t g) {
+	int blk = claim_blk_below(g, superblock->blocks_per_group);
+	if (blk < 0)
+		return -1;
+	maps[g] = blk_alloc();
+	memset(maps[g], 0, BLOCK_SIZE);
+	bio_write(blk, maps[g]);
+	sb_groups(superblock)[g].frag_map = blk - grp_d_start(superblock, g) + 1;
+	write_sb();
+	return 0;
+}
+
+/* first unit of a run of n free ones in a block with mask, or -1 */
+static int find_run(uint16_t mask, uint32_t n) {
+	for (uint32_t u = 0; u + n <= FRAGS_PER_BLK; u++) {
+		if (!(mask & frag_run_mask(u, n)))
+			return u;
+	}
+	return -1;
+}
+
+/*
+ * Take a run of n units for a file of owner, in a fragment block with room
+ * in the owner's group or another one, or else in a new fragment block.
+ * Returns the block and the run's first unit in *unit, or -1.
+ */
+static int alloc_run(uint16_t owner, uint32_t n, uint32_t *unit) {
+	uint32_t goal = ino_group(superblock, owner), limit = frag_limit();
+	for (uint32_t i = 0; i < superblock->n_groups; i++) {
+		uint32_t g = (goal + i) % superblock->n_groups;
+		pthread_mutex_lock(&map_locks[g]);
+		for (uint32_t e = 0; maps[g] != NULL && e < limit; e++) {
+			int u;
+			if (maps[g][e] == 0 || (u = find_run(maps[g][e], n)) < 0)
+				continue;
+			maps[g][e] |= frag_run_mask(u, n);
+			bio_write(map_blk(g), maps[g]);
+			pthread_mutex_unlock(&map_locks[g]);
+			*unit = u;
+			return grp_d_start(superblock, g) + e;
+		}
+		pthread_mutex_unlock(&map_locks[g]);
+	}
+	for (uint32_t i = 0; i < superblock->n_groups; i++) {
+		uint32_t g = (goal + i) % superblock->n_groups;
+		int blk = -1;
+		pthread_mutex_lock(&map_locks[g]);
+		if (maps[g] != NULL || make_map(g) == 0)
+			blk = claim_blk_below(g, limit);
+		if (blk >= 0) {
+			maps[g][blk - grp_d_start(superblock, g)] = frag_run_mask(0, n);
+			bio_write(map_blk(g), maps[g]);
+		}
+		pthread_mutex_unlock(&map_locks[g]);
+		if (blk >= 0) {
+			*unit = 0;
+			return blk;
+		}
+	}
+	return -1;
+}
+
+/* take the units from unit + old_n to unit + n of blk too, -1 if they are not free */
+static int grow_run(int blk, uint32_t unit, uint32_t old_n, uint32_t n) {
+	uint32_t g = blk_group(superblock, blk);
+	uint16_t *mask = &maps[g][blk - grp_d_start(superblock, g)];
+	if (unit + n > FRAGS_PER_BLK)
+		return -1;
+	int ret = -1;
+	pthread_mutex_lock(&map_locks[g]);
+	if (!(*mask & frag_run_mask(unit + old_n, n - old_n))) {
+		*mask |= frag_run_mask(unit + old_n, n - old_n);
+		bio_write(map_blk(g), maps[g]);
+		ret = 0;
+	}
+	pthread_mutex_unlock(&map_locks[g]);
+	return ret;
+}
+
+/* give back a run, and the fragment block with it once no run is left in it */
+static void free_run(int blk, uint32_t unit, uint32_t n) {
+	uint32_t g = blk_group(superblock, blk);
+	uint16_t *mask = &maps[g][blk - grp_d_start(superblock, g)];
+	pthread_mutex_lock(&map_locks[g]);
+	*mask &= ~frag_run_mask(unit, n);
+	int empty = *mask == 0;
+	bio_write(map_blk(g), maps[g]);
+	pthread_mutex_unlock(&map_locks[g]);
+	// with its mask 0 no run is taken from it again, so it is ours to zero
+	if (empty) {
+		char *buf = blk_alloc();
+		memset(buf, 0, BLOCK_SIZE);
+		bio_write(blk, buf);
+		blk_free(buf);
+		free_blkno(blk);
+	}
+}
+
+/* write the n units of data to a run, leaving the other runs of the block as they are */
+static int write_run(int blk, uint32_t unit, const char *data, uint32_t n) {
+	uint32_t g = blk_group(superblock, blk);
+	char *buf = blk_alloc();
+	int ret = -1;
+	pthread_mutex_lock(&map_locks[g]);
+	if (bio_read(blk, buf) >= 0) {
+		memcpy(buf + unit * FRAG_SIZE, data, n * FRAG_SIZE);
+		ret = bio_write(blk, buf) < 0 ? -1 : 0;
+	}
+	pthread_mutex_unlock(&map_locks[g]);
+	blk_free(buf);
+	return ret;
+}
+
+/* a packed file's bytes, with zeros after them to the end of data */
+static int read_run(const struct inode *inode, char *data) {
+	char *buf = blk_alloc();
+	int ret = bio_read(inode->direct_ptr[1], buf);
+	if (ret >= 0)
+		memcpy(data, buf + inode->direct_ptr[2] * FRAG_SIZE, inode->size);
+	blk_free(buf);
+	return ret < 0 ? -1 : 0;
+}
+
+void frag_mount() {
+	maps = calloc(superblock->n_groups, sizeof(uint16_t *));
+	map_locks = malloc(superblock->n_groups * sizeof(pthread_mutex_t));
+	for (uint32_t g = 0; g < superblock->n_groups; g++) {
+		pthread_mutex_init(&map_locks[g], NULL);
+		if (sb_groups(superblock)[g].frag_map == 0)
+			continue;
+		maps[g] = blk_alloc();
+		bio_read(map_blk(g), maps[g]);
+	}
+	pack_active = getenv(PACK_ENV) != NULL;
+}
+
+void frag_unmount() {
+	for (uint32_t g = 0; g < superblock->n_groups; g++) {
+		blk_free(maps[g]);
+		pthread_mutex_destroy(&map_locks[g]);
+	}
+	free(maps);
+	free(map_locks);
+	maps = NULL;
+	map_locks = NULL;
+	pack_active = 0;
+}
+
+int frag_read(const struct inode *inode, char *buf, size_t size, off_t offset) {
+	char *blk = blk_alloc();
+	int ret = bio_read(inode->direct_ptr[1], blk);
+	if (ret >= 0)
+		memcpy(buf, blk + inode->direct_ptr[2] * FRAG_SIZE + offset, size);
+	blk_free(blk);
+	return ret < 0 ? -1 : 0;
+}
+
+int frag_write(struct inode *inode, const char *buf, size_t size, off_t offset) {
+	uint32_t end = offset + size > inode->size ? offset + size : inode->size;
+	uint32_t n = frag_units(end), old_n = 0, old_unit = 0, unit = 0;
+	int old_blk = -1, blk = -1, moved = 1;
+	char *run = blk_alloc();
+	memset(run, 0, BLOCK_SIZE);
+	if (is_packed(inode)) {
+		old_blk = inode->direct_ptr[1];
+		unit = old_unit = inode->direct_ptr[2];
+		old_n = frag_units(inode->size);
+		if (read_run(inode, run) < 0)
+			goto out;
+		if (n <= old_n || grow_run(old_blk, unit, old_n, n) == 0) {
+			blk = old_blk;
+			moved = 0;
+		}
+	}
+	// a new run may well be in the same block as the old one
+	if (moved && (blk = alloc_run(inode->ino, n, &unit)) < 0)
+		goto out;
+	memcpy(run + offset, buf, size);
+	if (write_run(blk, unit, run, n) < 0) {
+		if (moved)
+			free_run(blk, unit, n);
+		blk = -1;
+		goto out;
+	}
+	if (!moved)
+		goto out;
+	stats_pack_run(old_blk >= 0);
+	inode->direct_ptr[0] = PACKED_ADDR;
+	inode->direct_ptr[1] = blk;
+	inode->direct_ptr[2] = unit;
+	// nobody may find the old run through the inode once it is given up
+	if (old_blk >= 0) {
+		writei(inode->ino, inode);
+		free_run(old_blk, old_unit, old_n);
+	}
+out:
+	blk_free(run);
+	return blk < 0 ? -1 : 0;
+}
+
+int frag_unpack(struct inode *inode) {
+	int blk = get_avail_blkno(inode->ino);
+	if (blk < 0)
+		return -1;
+	char *data = blk_alloc();
+	memset(data, 0, BLOCK_SIZE);
+	if (read_run(inode, data) < 0 || bio_write(blk, data) < 0) {
+		blk_free(data);
+		free_blkno(blk);
+		return -1;
+	}
+	blk_free(data);
+	struct inode old = *inode;
+	inode->direct_ptr[0] = blk;
+	inode->direct_ptr[1] = -1;
+	inode->direct_ptr[2] = -1;
+	writei(inode->ino, inode);
+	free_run(old.direct_ptr[1], old.direct_ptr[2], frag_units(old.size));
+	stats_pack_unpack();
+	return 0;
+}
+
+void frag_free(struct inode *inode) {
+	free_run(inode->direct_ptr[1], inode->direct_ptr[2], frag_units(inode->size));
+	inode->direct_ptr[0] = inode->direct_ptr[1] = inode->direct_ptr[2] = -1;
+}
+
+int frag_clone(const struct inode *src, struct inode *dst) {
+	uint32_t n = frag_units(src->size), unit;
+	char *run = blk_alloc();
+	memset(run, 0, BLOCK_SIZE);
+	int blk = -1;
+	if (read_run(src, run) == 0 && (blk = alloc_run(dst->ino, n, &unit)) >= 0 &&
+		write_run(blk, unit, run, n) < 0) {
+		free_run(blk, unit, n);
+		blk = -1;
+	}
+	blk_free(run);
+	if (blk < 0)
+		return -1;
+	stats_pack_run(0);
+	dst->direct_ptr[0] = PACKED_ADDR;
+	dst->direct_ptr[1] = blk;
+	dst->direct_ptr[2] = unit;
+	return 0;
+}
@@ -0,0 +1,46 @@
+/*
+ *  Copyright (C) 2020 CS416 Rutgers CS
+ *	Tiny File System
+ *	File:	frag.h
+ *
+ */
+
+#ifndef _FRAG_H
+#define _FRAG_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "tfs.h"
+
+/*
+ * set TFS_PACK in the environment of tfs to pack new files of at most
+ * PACK_MAX bytes into fragment blocks. Packed files read and grow the same
+ * whether or not it is set.
+ */
+#define PACK_ENV "TFS_PACK"
+
+/* set while new small files are packed, tfs_write() tests it */
+extern int pack_active;
+
+/* read the fragment maps, after load_groups() */
+void frag_mount();
+void frag_unmount();
+
+/* read size bytes at offset of a packed file, all within its size */
+int frag_read(const struct inode *inode, char *buf, size_t size, off_t offset);
+/*
+ * Write to a packed or empty file, which stays or becomes packed, ending at
+ * most at PACK_MAX. The run grows in place or moves to a new one, whose
+ * inode is written before the old run is given up. Returns -1 when no
+ * fragment block has room.
+ */
+int frag_write(struct inode *inode, const char *buf, size_t size, off_t offset);
+/* move a packed file to a data block of its own, before it grows past PACK_MAX */
+int frag_unpack(struct inode *inode);
+/* give back a packed file's run, at release */
+void frag_free(struct inode *inode);
+/* give the new, empty inode dst a copy of packed src's run */
+int frag_clone(const struct inode *src, struct inode *dst);
+
+#endif
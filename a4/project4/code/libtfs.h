@@ -0,0 +1,64 @@
+/*
+ *  Copyright (C) 2020 CS416 Rutgers CS
+ *	Tiny File System
+ *	File:	libtfs.h
+ *
+ *	The file system as a library. The FUSE daemon (tfs_fuse.c) is one user
+ *	of it; a program that links libtfs.a works on an image in-process,
+ *	without the two kernel crossings every FUSE call pays. One image is
+ *	mounted per process. Each call returns 0, or a byte count for
+ *	tfs_pread() and tfs_pwrite(), or -errno.
+ *
+ *	Calls may come from any number of threads. Namespace calls lock the
+ *	directories and inodes they change, a write or close locks its file
+ *	and a read shares its file's lock, so any mix of calls may run at
+ *	once, on one directory or one file.
+ */
+
+#ifndef _LIBTFS_H
+#define _LIBTFS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <time.h>
+
+/* an open file, or one of the control files in the mount root */
+struct tfs_file;
+
+/* called for every entry of a directory, a nonzero return stops the listing */
+typedef int (*tfs_filler_t)(void *ctx, const char *name, const struct stat *st, off_t off);
+
+/* mount the image in diskfile, making a new one if there is none */
+int tfs_mount(const char *diskfile);
+void tfs_unmount();
+
+/* owner of the files and directories the calling thread creates, its own by default */
+void tfs_set_cred(uid_t uid, gid_t gid);
+
+int tfs_getattr(const char *path, struct stat *st);
+int tfs_opendir(const char *path);
+int tfs_readdir(const char *path, tfs_filler_t filler, void *ctx);
+int tfs_mkdir(const char *path, mode_t mode);
+int tfs_rmdir(const char *path);
+int tfs_unlink(const char *path);
+int tfs_rename(const char *from, const char *to);
+int tfs_link(const char *from, const char *to);
+int tfs_chmod(const char *path, mode_t mode);
+int tfs_utimens(const char *path, const struct timespec tv[2]);
+int tfs_truncate(const char *path, off_t size);
+int tfs_statfs(struct statvfs *st);
+
+/* open path with open(2) flags, O_CREAT and O_EXCL included */
+int tfs_open(const char *path, int flags, mode_t mode, struct tfs_file **file);
+int tfs_pread(struct tfs_file *file, void *buf, size_t size, off_t offset);
+int tfs_pwrite(struct tfs_file *file, const void *buf, size_t size, off_t offset);
+int tfs_close(struct tfs_file *file);
+/* get what was written so far to the disk, datasync as in fsync(2) */
+int tfs_fsync(struct tfs_file *file, int datasync);
+/* set for a control file, whose size getattr does not know */
+int tfs_direct_io(const struct tfs_file *file);
+
+#endif
@@ -0,0 +1,312 @@
+/*
+ *  Copyright (C) 2020 CS416 Rutgers CS
+ *	Tiny File System
+ *	File:	log.c
+ *
+ *	Log-structured writes. Every block tfs writes, data, inodes, bitmaps
+ *	and block 0 alike, is gathered into the open segment and the log takes
+ *	the whole segment in one sequential write. The newest copy of each
+ *	logged block stays in memory, so reads never look in the log on disk.
+ *	When the log is full a checkpoint writes those copies home in address
+ *	order, where a block rewritten many times costs one write, and the log
+ *	starts over behind the last segment. A segment is also written when the
+ *	last call in flight returns and on fsync, so an idle mount keeps no
+ *	write in memory only, while concurrent calls still share segments.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "block.h"
+#include "tfs.h"
+#include "stats.h"
+#include "log.h"
+
+#define AREA_BLKS (LOG_BLKS - 1)
+/* blocks logged since the checkpoint, plus a segment not yet written */
+#define MAX_ENTRIES (AREA_BLKS + SEG_BLKS)
+#define TABLE_SIZE 4096					/* a power of two over twice MAX_ENTRIES */
+#define CHECKPOINT_RUN 256				/* blocks written home with one pwritev */
+
+struct log_entry {
+	uint32_t	home;
+	int			open;					/* in the open segment */
+};
+
+int log_active;
+
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static int broken;						/* a log is there but cannot be used */
+static uint32_t log_blk;				/* the header, 0 while there is no log */
+static uint32_t next_seq;
+static uint32_t head;					/* where the next segment goes in the area */
+static uint32_t used;					/* area blocks written since the checkpoint */
+
+static struct log_entry *entries;
+static char *copies;					/* the newest copy of each entry's block */
+static int n_entries;
+static int32_t *table;					/* home address -> entry, open addressing */
+static struct log_entry **order;		/* entries sorted for a checkpoint */
+static struct log_seg *seg;				/* summary of the open segment */
+static int calls;						/* calls in flight, the last to return flushes */
+
+static void dev_read_blk(uint32_t blk, void *buf) {
+	dev_read(blk, buf);
+}
+
+static void dev_write_blk(uint32_t blk, const void *buf) {
+	struct iovec iov = { (void *)buf, BLOCK_SIZE };
+	dev_writev(blk, &iov, 1);
+}
+
+static char *copy_of(const struct log_entry *e) {
+	return copies + (size_t)(e - entries) * BLOCK_SIZE;
+}
+
+static struct log_entry *lookup(uint32_t blk, int add) {
+	uint32_t h = (blk * 2654435761u) & (TABLE_SIZE - 1);
+	for (;; h = (h + 1) & (TABLE_SIZE - 1)) {
+		int32_t i = table[h];
+		if (i < 0) {
+			if (!add)
+				return NULL;
+			i = table[h] = n_entries++;
+			entries[i].home = blk;
+			entries[i].open = 0;
+			return &entries[i];
+		}
+		if (entries[i].home == blk)
+			return &entries[i];
+	}
+}
+
+/* the header must be on disk before the log reuses the space behind it */
+static void write_hdr() {
+	char *buf = blk_alloc();
+	struct log_hdr hdr = { LOG_MAGIC, next_seq, head };
+	memset(buf, 0, BLOCK_SIZE);
+	memcpy(buf, &hdr, sizeof(hdr));
+	dev_write_blk(log_blk, buf);
+	blk_free(buf);
+	dev_sync();
+}
+
+static int cmp_home(const void *a, const void *b) {
+	uint32_t x = (*(struct log_entry *const *)a)->home;
+	uint32_t y = (*(struct log_entry *const *)b)->home;
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Write every logged block home, runs of adjacent blocks in one write, and
+ * empty the log. Called with log_lock held.
+ */
+static void checkpoint() {
+	struct iovec iov[CHECKPOINT_RUN];
+	for (int i = 0; i < n_entries; i++)
+		order[i] = &entries[i];
+	qsort(order, n_entries, sizeof(*order), cmp_home);
+	for (int i = 0; i < n_entries;) {
+		int n = 0;
+		do {
+			iov[n].iov_base = copy_of(order[i + n]);
+			iov[n].iov_len = BLOCK_SIZE;
+			n++;
+		} while (i + n < n_entries && n < CHECKPOINT_RUN && order[i + n]->home == order[i]->home + n);
+		dev_writev(order[i]->home, iov, n);
+		i += n;
+	}
+	dev_sync();
+	write_hdr();
+	stats_checkpoint(n_entries);
+	memset(table, 0xff, TABLE_SIZE * sizeof(int32_t));
+	n_entries = 0;
+	seg->n = 0;
+	used = 0;
+}
+
+/*
+ * Append the open segment to the log, or checkpoint when it does not fit.
+ * Called with log_lock held.
+ */
+static void seg_flush() {
+	struct iovec iov[1 + SEG_BLKS];
+	const void *blks[SEG_BLKS];
+	uint32_t n = seg->n, pos = head, skip = 0;
+	if (n == 0)
+		return;
+	// a segment never wraps, the rest of the area is skipped
+	if (pos + 1 + n > AREA_BLKS) {
+		skip = AREA_BLKS - pos;
+		pos = 0;
+	}
+	if (used + skip + 1 + n > AREA_BLKS) {
+		checkpoint();
+		return;
+	}
+	for (uint32_t i = 0; i < n; i++) {
+		struct log_entry *e = lookup(seg->home[i], 0);
+		e->open = 0;
+		blks[i] = iov[1 + i].iov_base = copy_of(e);
+		iov[1 + i].iov_len = BLOCK_SIZE;
+	}
+	seg->magic = LOG_MAGIC;
+	seg->seq = next_seq;
+	seg->csum = log_csum(seg, blks);
+	iov[0].iov_base = seg;
+	iov[0].iov_len = BLOCK_SIZE;
+	dev_writev(log_blk + 1 + pos, iov, 1 + n);
+	stats_log_segment(n);
+	head = pos + 1 + n < AREA_BLKS ? pos + 1 + n : 0;
+	used += skip + 1 + n;
+	next_seq++;
+	seg->n = 0;
+}
+
+int log_mount(const struct superblock *sb) {
+	char buf[BLOCK_SIZE];
+	struct log_hdr hdr;
+	log_blk = 0;
+	broken = 0;
+	dev_read(ino_blk(sb, LOG_INO), buf);
+	struct inode *inode = (struct inode *)buf + ino_slot(sb, LOG_INO);
+	if (!inode->valid)
+		return 0;
+	int32_t blk = inode->direct_ptr[0];
+	int g = blk_group(sb, blk);
+	if (g < 0 || blk_group(sb, (int64_t)blk + LOG_BLKS - 1) != g) {
+		fprintf(stderr, "log inode points out of the data area (%d), run tfs_fsck\n", blk);
+		broken = 1;
+		return 0;
+	}
+	dev_read(blk, buf);
+	memcpy(&hdr, buf, sizeof(hdr));
+	if (hdr.magic != LOG_MAGIC || hdr.start >= AREA_BLKS) {
+		fprintf(stderr, "log header at block %d is bad, run tfs_fsck\n", blk);
+		broken = 1;
+		return 0;
+	}
+	log_blk = blk;
+	uint32_t end = sb->i_bitmap_blk + sb->n_groups * sb->group_blks;
+	int n = log_replay(log_blk, end, &hdr, dev_read_blk, dev_write_blk);
+	next_seq = hdr.seq;
+	head = hdr.start;
+	used = 0;
+	if (n > 0) {
+		dev_sync();
+		write_hdr();
+		fprintf(stderr, "replayed %d log segments\n", n);
+	}
+	return n;
+}
+
+/*
+ * Claim the first run of LOG_BLKS free blocks and make it the log
+ */
+static int make_log() {
+	int blk = claim_free_run(LOG_BLKS);
+	if (blk < 0)
+		return -1;
+	log_blk = blk;
+	// stale segments in the run must not pass for ones of this log
+	next_seq = time(NULL);
+	head = 0;
+	used = 0;
+	write_hdr();
+	struct inode inode;
+	init_inode(&inode, LOG_INO, __S_IFREG | 0600);
+	inode.size = LOG_BLKS * BLOCK_SIZE;
+	inode.direct_ptr[0] = log_blk;
+	writei(LOG_INO, &inode);
+	return 0;
+}
+
+int log_start() {
+	if (broken)
+		return -1;
+	if (log_blk == 0 && make_log() < 0) {
+		fprintf(stderr, "no run of %d free blocks for the log, writing in place\n", LOG_BLKS);
+		return -1;
+	}
+	entries = malloc(MAX_ENTRIES * sizeof(struct log_entry));
+	copies = aligned_alloc(BLOCK_SIZE, (size_t)MAX_ENTRIES * BLOCK_SIZE);
+	order = malloc(MAX_ENTRIES * sizeof(struct log_entry *));
+	table = malloc(TABLE_SIZE * sizeof(int32_t));
+	memset(table, 0xff, TABLE_SIZE * sizeof(int32_t));
+	seg = blk_alloc();
+	memset(seg, 0, BLOCK_SIZE);
+	n_entries = 0;
+	log_active = 1;
+	return 0;
+}
+
+void log_shutdown() {
+	if (!log_active)
+		return;
+	pthread_mutex_lock(&log_lock);
+	checkpoint();
+	log_active = 0;
+	pthread_mutex_unlock(&log_lock);
+	free(entries);
+	free(copies);
+	free(order);
+	free(table);
+	blk_free(seg);
+	log_blk = 0;
+}
+
+int log_read(uint32_t blk, void *buf) {
+	pthread_mutex_lock(&log_lock);
+	struct log_entry *e = lookup(blk, 0);
+	if (e != NULL)
+		memcpy(buf, copy_of(e), BLOCK_SIZE);
+	pthread_mutex_unlock(&log_lock);
+	return e != NULL;
+}
+
+void log_read_run(uint32_t blk, int n, void *buf) {
+	pthread_mutex_lock(&log_lock);
+	for (int i = 0; i < n && n_entries > 0; i++) {
+		struct log_entry *e = lookup(blk + i, 0);
+		if (e != NULL)
+			memcpy((char *)buf + (size_t)i * BLOCK_SIZE, copy_of(e), BLOCK_SIZE);
+	}
+	pthread_mutex_unlock(&log_lock);
+}
+
+int log_write(uint32_t blk, const void *buf) {
+	pthread_mutex_lock(&log_lock);
+	struct log_entry *e = lookup(blk, 1);
+	memcpy(copy_of(e), buf, BLOCK_SIZE);
+	if (!e->open) {
+		e->open = 1;
+		seg->home[seg->n++] = blk;
+	}
+	if (seg->n == SEG_BLKS)
+		seg_flush();
+	pthread_mutex_unlock(&log_lock);
+	return BLOCK_SIZE;
+}
+
+void log_call_begin() {
+	__atomic_add_fetch(&calls, 1, __ATOMIC_ACQ_REL);
+}
+
+void log_call_end() {
+	if (__atomic_sub_fetch(&calls, 1, __ATOMIC_ACQ_REL) == 0)
+		log_flush();
+}
+
+void log_flush() {
+	if (!log_active)
+		return;
+	pthread_mutex_lock(&log_lock);
+	seg_flush();
+	pthread_mutex_unlock(&log_lock);
+}
@@ -0,0 +1,43 @@
+/*
+ *  Copyright (C) 2020 CS416 Rutgers CS
+ *	Tiny File System
+ *	File:	log.h
+ *
+ */
+
+#ifndef _LOG_H
+#define _LOG_H
+
+#include <stdint.h>
+
+struct superblock;
+
+/*
+ * set TFS_LOG in the environment of tfs to append every block write to the
+ * log, which is made on the first such mount. A log left behind by a crash
+ * is replayed at mount whether or not it is set.
+ */
+#define LOG_ENV "TFS_LOG"
+
+/* set while block writes go to the log, bio_read() and bio_write() test it */
+extern int log_active;
+
+/* replay the log of the image sb was read from, returns the segments replayed */
+int log_mount(const struct superblock *sb);
+/* make the log if there is none and send block writes to it, after load_groups() */
+int log_start();
+/* write every logged block home and stop logging, before dev_close() */
+void log_shutdown();
+
+/* the newest copy of a logged block, 0 if the log holds none */
+int log_read(uint32_t blk, void *buf);
+/* overlay the newest copies of any logged blocks of n starting at blk */
+void log_read_run(uint32_t blk, int n, void *buf);
+int log_write(uint32_t blk, const void *buf);
+/* append the open segment to the log, it may hold fewer than SEG_BLKS blocks */
+void log_flush();
+/* around each call, the last call in flight to return flushes */
+void log_call_begin();
+void log_call_end();
+
+#endif
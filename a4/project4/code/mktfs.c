@@ -0,0 +1,579 @@
+/*
+ *  Copyright (C) 2020 CS416 Rutgers CS
+ *	Tiny File System
+ *	File:	mktfs.c
+ *
+ *	Offline bulk loader: builds a TFS image from a host directory tree
+ *	without going through FUSE. The tree is scanned first, so the block
+ *	groups can be sized to fit and every file's blocks can be placed
+ *	contiguously, in sorted order, next to its directory and in the same
+ *	group as its inode. The data is then written front to back with large
+ *	sequential writes.
+ *
+ *	usage: mktfs [-f] [-p] [-o DISKFILE] [-i inodes] [-b data_blocks] <srcdir>
+ *		-f	overwrite an existing image
+ *		-p	pack files of at most PACK_MAX bytes into fragment blocks,
+ *			which follow their directory's blocks
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "block.h"
+/* tfs's struct dirent clashes with the host's, host entries are read as struct dirent64 */
+#define dirent tfs_dirent
+#include "tfs.h"
+
+/* data region write buffer */
+#define WBUF_BLOCKS 1024
+/* matches DISK_SIZE in block.c */
+#define MIN_IMAGE_SIZE (32*1024*1024)
+
+struct node {
+	char		*host_path;
+	char		name[MAX_NAME_LEN + 1];
+	int			is_dir;
+	uint64_t	size;
+	uint32_t	mtime;
+	uint16_t	perm;				/* permission bits, owner and mtime of the host file */
+	uint32_t	uid;
+	uint32_t	gid;
+	uint16_t	ino;
+	uint32_t	first;				/* data block index (dblk_at()) the node starts at */
+	uint32_t	unit;				/* first unit of a packed file's run in block first */
+	struct node	**child;
+	int			nchild;
+};
+
+static struct superblock sb;
+static uint32_t islice;				/* inode table blocks per group */
+static char *meta;					/* every group's bitmaps and inode slice */
+static int image = -1;
+static uint32_t n_inodes, n_blocks;
+
+static uint32_t max_groups;
+static uint32_t *grp_inodes;		/* inodes handed out per group */
+static uint32_t used_groups;		/* groups holding data or inodes */
+
+static int pack;
+static uint16_t *frag_masks;		/* data block index -> units packed files use */
+static uint32_t *frag_map_idx;		/* group -> data block index of its fragment map + 1, 0 for none */
+
+static char *wbuf;
+static uint32_t wbuf_n;				/* blocks buffered */
+static uint32_t wbuf_blk;			/* disk block of the first buffered block */
+static uint64_t bytes_written;
+
+static void die(const char *what) {
+	perror(what);
+	exit(1);
+}
+
+static int by_name(const void *a, const void *b) {
+	return strcmp((*(struct node **)a)->name, (*(struct node **)b)->name);
+}
+
+static uint32_t data_blocks(uint64_t size) {
+	return (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+/* Blocks a directory's entries fill, packed in order as write_dir() packs them */
+static uint32_t dir_blocks(struct node *n) {
+	uint32_t blocks = 0, used = BLOCK_SIZE;
+	for (int i = 0; i < n->nchild; i++) {
+		uint32_t len = DIRENT_LEN(strlen(n->child[i]->name));
+		if (used + len > BLOCK_SIZE) {
+			blocks++;
+			used = 0;
+		}
+		used += len;
+	}
+	return blocks;
+}
+
+static int packed(struct node *n) {
+	return pack && !n->is_dir && n->size > 0 && n->size <= PACK_MAX;
+}
+
+/* Fragment blocks a directory's packed files fill, in order as place_frags() packs them */
+static uint32_t frag_blocks(struct node *n) {
+	uint32_t blocks = 0, used = FRAGS_PER_BLK;
+	for (int i = 0; i < n->nchild; i++) {
+		if (!packed(n->child[i]))
+			continue;
+		uint32_t units = frag_units(n->child[i]->size);
+		if (used + units > FRAGS_PER_BLK) {
+			blocks++;
+			used = 0;
+		}
+		used += units;
+	}
+	return blocks;
+}
+
+/* Blocks a node occupies in the data region, not counting its fragment blocks */
+static uint32_t node_blocks(struct node *n) {
+	if (n->is_dir)
+		return dir_blocks(n);
+	if (packed(n))
+		return 0;
+	return file_blocks(data_blocks(n->size));
+}
+
+/* Build the tree under path, sorted by name, counting inodes and blocks as we go */
+static struct node *scan(const char *path, const char *name) {
+	struct stat st;
+	if (lstat(path, &st) < 0)
+		die(path);
+	if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode)) {
+		fprintf(stderr, "mktfs: skipping %s: not a regular file or directory\n", path);
+		return NULL;
+	}
+	if (strlen(name) > MAX_NAME_LEN) {
+		fprintf(stderr, "mktfs: %s: name too long\n", path);
+		exit(1);
+	}
+	struct node *n = calloc(1, sizeof(struct node));
+	n->host_path = strdup(path);
+	strcpy(n->name, name);
+	n->is_dir = S_ISDIR(st.st_mode);
+	n->size = n->is_dir ? 0 : st.st_size;
+	n->mtime = st.st_mtime;
+	n->perm = st.st_mode & 07777;
+	n->uid = st.st_uid;
+	n->gid = st.st_gid;
+	n_inodes++;
+
+	if (n->is_dir) {
+		DIR *d = opendir(path);
+		if (d == NULL)
+			die(path);
+		struct dirent64 *e;
+		int cap = 0;
+		while ((e = readdir64(d)) != NULL) {
+			if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0)
+				continue;
+			char child_path[PATH_MAX];
+			snprintf(child_path, sizeof(child_path), "%s/%s", path, e->d_name);
+			struct node *c = scan(child_path, e->d_name);
+			if (c == NULL)
+				continue;
+			if (n->nchild == cap) {
+				cap = cap ? cap * 2 : 16;
+				n->child = realloc(n->child, cap * sizeof(struct node *));
+			}
+			n->child[n->nchild++] = c;
+		}
+		closedir(d);
+		qsort(n->child, n->nchild, sizeof(struct node *), by_name);
+		if (dir_blocks(n) > NUM_DIRECT) {
+			fprintf(stderr, "mktfs: %s: %d entries do not fit in a directory's %d blocks\n",
+				path, n->nchild, NUM_DIRECT);
+			exit(1);
+		}
+	} else if (data_blocks(n->size) > NUM_DIRECT + NUM_INDIRECT * PTRS_PER_BLK) {
+		fprintf(stderr, "mktfs: %s: too large for a tfs file\n", path);
+		exit(1);
+	}
+	n_blocks += node_blocks(n) + (n->is_dir ? frag_blocks(n) : 0);
+	return n;
+}
+
+/*
+ * Next inode in group g or, when g is full, the first group after it with room
+ */
+static uint16_t alloc_ino(uint32_t g) {
+	while (g < max_groups && grp_inodes[g] == sb.inodes_per_group)
+		g++;
+	if (g == max_groups) {
+		fprintf(stderr, "mktfs: out of inodes\n");
+		exit(1);
+	}
+	if (g + 1 > used_groups)
+		used_groups = g + 1;
+	return g * sb.inodes_per_group + grp_inodes[g]++;
+}
+
+/*
+ * Next fragment block, among the first FRAG_MAP_BLKS of a group, which
+ * brings the group's fragment map right in front of it if it is the group's first
+ */
+static uint32_t new_frag_blk(uint32_t *cursor) {
+	uint32_t g = *cursor / sb.blocks_per_group, off = *cursor % sb.blocks_per_group;
+	uint32_t need = frag_map_idx[g] ? 1 : 2;
+	if (off + need > sb.blocks_per_group || off + need > FRAG_MAP_BLKS) {
+		*cursor += sb.blocks_per_group - off;
+		g++;
+	}
+	if (g >= max_groups) {
+		fprintf(stderr, "mktfs: out of data blocks\n");
+		exit(1);
+	}
+	if (!frag_map_idx[g])
+		frag_map_idx[g] = ++*cursor;
+	if (g + 1 > used_groups)
+		used_groups = g + 1;
+	return (*cursor)++;
+}
+
+/* Pack a directory's small files, in order, into fragment blocks at the cursor */
+static void place_frags(struct node *n, uint32_t *cursor) {
+	uint32_t blk = 0, used = FRAGS_PER_BLK;
+	for (int i = 0; i < n->nchild; i++) {
+		struct node *c = n->child[i];
+		if (!packed(c))
+			continue;
+		uint32_t units = frag_units(c->size);
+		if (used + units > FRAGS_PER_BLK) {
+			blk = new_frag_blk(cursor);
+			used = 0;
+		}
+		c->first = blk;
+		c->unit = used;
+		frag_masks[blk] |= frag_run_mask(used, units);
+		used += units;
+		c->ino = alloc_ino(blk / sb.blocks_per_group);
+	}
+}
+
+/*
+ * Number inodes and place extents depth first: a directory's blocks, then
+ * its fragment blocks, then the other files in it, then its subdirectories.
+ * An extent that would straddle the end of a group starts the next group
+ * instead, unless it is bigger than a group. Every inode goes in the group
+ * its data starts in.
+ */
+static void place(struct node *n, uint32_t *cursor) {
+	uint32_t nb = node_blocks(n);
+	uint32_t off = *cursor % sb.blocks_per_group;
+	if (nb <= sb.blocks_per_group && off + nb > sb.blocks_per_group)
+		*cursor += sb.blocks_per_group - off;
+	n->first = *cursor;
+	*cursor += nb;
+	if ((*cursor + sb.blocks_per_group - 1) / sb.blocks_per_group > used_groups)
+		used_groups = (*cursor + sb.blocks_per_group - 1) / sb.blocks_per_group;
+	n->ino = alloc_ino(n->first / sb.blocks_per_group);
+
+	place_frags(n, cursor);
+	for (int i = 0; i < n->nchild; i++) {
+		if (!n->child[i]->is_dir && !packed(n->child[i]))
+			place(n->child[i], cursor);
+	}
+	for (int i = 0; i < n->nchild; i++) {
+		if (n->child[i]->is_dir)
+			place(n->child[i], cursor);
+	}
+}
+
+/* group g's inode bitmap, data bitmap and inode slice, in that order */
+static char *grp_meta(uint32_t g) {
+	return meta + (size_t)g * (2 + islice) * BLOCK_SIZE;
+}
+
+static void flush() {
+	if (wbuf_n == 0)
+		return;
+	if (pwrite(image, wbuf, (size_t)wbuf_n * BLOCK_SIZE, (off_t)wbuf_blk * BLOCK_SIZE) != (ssize_t)wbuf_n * BLOCK_SIZE)
+		die("write image");
+	bytes_written += (uint64_t)wbuf_n * BLOCK_SIZE;
+	wbuf_n = 0;
+}
+
+/*
+ * Buffer space for up to *count data blocks from index idx on, marked in
+ * use. The buffer only ever holds consecutive disk blocks, so fewer come
+ * back at a group's end or when the buffer fills.
+ */
+static char *reserve(uint32_t idx, uint32_t *count) {
+	uint32_t blk = dblk_at(&sb, idx);
+	if (wbuf_n > 0 && (blk != wbuf_blk + wbuf_n || wbuf_n == WBUF_BLOCKS))
+		flush();
+	if (wbuf_n == 0)
+		wbuf_blk = blk;
+	uint32_t room = WBUF_BLOCKS - wbuf_n;
+	uint32_t in_group = sb.blocks_per_group - idx % sb.blocks_per_group;
+	if (*count > room)
+		*count = room;
+	if (*count > in_group)
+		*count = in_group;
+	bitmap_t d_bitmap = (bitmap_t)(grp_meta(idx / sb.blocks_per_group) + BLOCK_SIZE);
+	for (uint32_t i = 0; i < *count; i++)
+		set_bitmap(d_bitmap, idx % sb.blocks_per_group + i);
+	char *p = wbuf + (size_t)wbuf_n * BLOCK_SIZE;
+	wbuf_n += *count;
+	return p;
+}
+
+static char *emit(uint32_t idx) {
+	uint32_t one = 1;
+	return reserve(idx, &one);
+}
+
+/* Copy count blocks of a host file straight into the write buffer */
+static void emit_data(int fd, const char *path, uint32_t idx, uint32_t count) {
+	while (count > 0) {
+		uint32_t n = count;
+		char *dst = reserve(idx, &n);
+		size_t want = (size_t)n * BLOCK_SIZE, got = 0;
+		while (got < want) {
+			ssize_t r = read(fd, dst + got, want - got);
+			if (r < 0)
+				die(path);
+			if (r == 0)
+				break;
+			got += r;
+		}
+		// the tail of the last block, or a file that shrank under us
+		memset(dst + got, 0, want - got);
+		idx += n;
+		count -= n;
+	}
+}
+
+static struct inode *inode_of(uint16_t ino) {
+	uint32_t g = ino_group(&sb, ino);
+	struct inode *slice = (struct inode *)(grp_meta(g) + 2 * BLOCK_SIZE);
+	return slice + ino % sb.inodes_per_group;
+}
+
+/* Read a small file into its run of a fragment block being buffered */
+static void write_packed(struct node *n, char *frag) {
+	struct inode *in = inode_of(n->ino);
+	init_inode(in, n->ino, __S_IFREG | n->perm);
+	in->uid = n->uid;
+	in->gid = n->gid;
+	in->size = n->size;
+	in->mtime = n->mtime;
+	in->direct_ptr[0] = PACKED_ADDR;
+	in->direct_ptr[1] = dblk_at(&sb, n->first);
+	in->direct_ptr[2] = n->unit;
+	int fd = open(n->host_path, O_RDONLY);
+	if (fd < 0)
+		die(n->host_path);
+	// the block is zeroed when buffered, so a file that shrank under us ends in zeros
+	size_t got = 0;
+	while (got < n->size) {
+		ssize_t r = read(fd, frag + n->unit * FRAG_SIZE + got, n->size - got);
+		if (r < 0)
+			die(n->host_path);
+		if (r == 0)
+			break;
+		got += r;
+	}
+	close(fd);
+}
+
+static void write_file(struct node *n) {
+	struct inode *in = inode_of(n->ino);
+	init_inode(in, n->ino, __S_IFREG | n->perm);
+	in->uid = n->uid;
+	in->gid = n->gid;
+	in->size = n->size;
+	in->mtime = n->mtime;
+	uint32_t left = data_blocks(n->size);
+	uint32_t idx = n->first;
+	int fd = open(n->host_path, O_RDONLY);
+	if (fd < 0)
+		die(n->host_path);
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	uint32_t direct = left < NUM_DIRECT ? left : NUM_DIRECT;
+	for (uint32_t i = 0; i < direct; i++)
+		in->direct_ptr[i] = dblk_at(&sb, idx + i);
+	emit_data(fd, n->host_path, idx, direct);
+	idx += direct;
+	left -= direct;
+	// each indirect page sits right in front of the blocks it points to
+	for (int j = 0; left > 0; j++) {
+		int *page = (int *)emit(idx);
+		uint32_t count = left < PTRS_PER_BLK ? left : PTRS_PER_BLK;
+		memset(page, 0, BLOCK_SIZE);
+		in->indirect_ptr[j] = dblk_at(&sb, idx++);
+		for (uint32_t k = 0; k < count; k++)
+			page[k] = dblk_at(&sb, idx + k);
+		emit_data(fd, n->host_path, idx, count);
+		idx += count;
+		left -= count;
+	}
+	close(fd);
+}
+
+static void write_dir(struct node *n) {
+	struct inode *in = inode_of(n->ino);
+	init_inode(in, n->ino, __S_IFDIR | n->perm);
+	in->uid = n->uid;
+	in->gid = n->gid;
+	in->mtime = n->mtime;
+	in->size = node_blocks(n) * BLOCK_SIZE;
+	int next = 0;
+	for (uint32_t b = 0; b < node_blocks(n); b++) {
+		char *block = emit(n->first + b);
+		dirblk_init(block);
+		in->direct_ptr[b] = dblk_at(&sb, n->first + b);
+		for (; next < n->nchild; next++) {
+			struct node *c = n->child[next];
+			if (dirblk_add(block, c->ino, c->name, strlen(c->name), c->is_dir ? FT_DIR : FT_REG) == NULL)
+				break;
+		}
+	}
+	// the fragment blocks, each buffered once for all the files it holds
+	char *frag = NULL;
+	uint32_t frag_idx = 0;
+	for (int i = 0; i < n->nchild; i++) {
+		struct node *c = n->child[i];
+		if (!packed(c))
+			continue;
+		if (frag == NULL || c->first != frag_idx) {
+			frag = emit(c->first);
+			frag_idx = c->first;
+			memset(frag, 0, BLOCK_SIZE);
+		}
+		write_packed(c, frag);
+	}
+	for (int i = 0; i < n->nchild; i++) {
+		if (!n->child[i]->is_dir && !packed(n->child[i]))
+			write_file(n->child[i]);
+	}
+	for (int i = 0; i < n->nchild; i++) {
+		if (n->child[i]->is_dir)
+			write_dir(n->child[i]);
+	}
+}
+
+static void usage(const char *prog) {
+	fprintf(stderr, "usage: %s [-f] [-p] [-o DISKFILE] [-i inodes] [-b data_blocks] <srcdir>\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv) {
+	const char *out = "DISKFILE";
+	long want_inodes = 0, want_blocks = 0;
+	int force = 0, c;
+	struct timeval start, end;
+
+	while ((c = getopt(argc, argv, "fpo:i:b:")) != -1) {
+		switch (c) {
+		case 'f': force = 1; break;
+		case 'p': pack = 1; break;
+		case 'o': out = optarg; break;
+		case 'i': want_inodes = atol(optarg); break;
+		case 'b': want_blocks = atol(optarg); break;
+		default: usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1)
+		usage(argv[0]);
+	gettimeofday(&start, NULL);
+
+	struct node *root = scan(argv[optind], "/");
+	if (root == NULL || !root->is_dir) {
+		fprintf(stderr, "mktfs: %s is not a directory\n", argv[optind]);
+		exit(1);
+	}
+
+	// Groups are as big as the ones tfs_mkfs() makes. There are at least as
+	// many, more if the tree needs them, and enough inodes per group that the
+	// tree's inodes fit next to its data.
+	uint32_t bpg = MAX_DNUM / NUM_GROUPS;
+	long need = n_blocks > want_blocks ? n_blocks : want_blocks;
+	uint32_t est_groups = (need + bpg - 1) / bpg;
+	if (est_groups < NUM_GROUPS)
+		est_groups = NUM_GROUPS;
+	long inodes = n_inodes + ROOT_INO > want_inodes ? n_inodes + ROOT_INO : want_inodes;
+	uint32_t ipg = (inodes + est_groups - 1) / est_groups;
+	if (ipg < MAX_INUM / NUM_GROUPS)
+		ipg = MAX_INUM / NUM_GROUPS;
+	if (ipg > MAX_BITMAP_BITS)
+		ipg = MAX_BITMAP_BITS;
+	tfs_layout(&sb, 1, ipg, bpg);
+	ipg = sb.inodes_per_group;
+	islice = ipg / NUM_INODES;
+
+	max_groups = MAX_TOTAL / (bpg > ipg ? bpg : ipg);
+	grp_inodes = calloc(max_groups, sizeof(uint32_t));
+	grp_inodes[0] = ROOT_INO;
+	frag_masks = calloc((size_t)max_groups * bpg, sizeof(uint16_t));
+	frag_map_idx = calloc(max_groups, sizeof(uint32_t));
+	uint32_t cursor = 0;
+	place(root, &cursor);
+
+	uint32_t n_groups = used_groups;
+	if (n_groups < est_groups)
+		n_groups = est_groups;
+	if ((uint64_t)n_groups * bpg > MAX_TOTAL || (uint64_t)n_groups * ipg > MAX_TOTAL) {
+		fprintf(stderr, "mktfs: %u inodes and %u blocks needed, an image holds at most %d of each\n",
+			n_inodes, n_blocks, MAX_TOTAL);
+		exit(1);
+	}
+	tfs_layout(&sb, n_groups, ipg, bpg);
+
+	image = open(out, O_WRONLY | O_CREAT | (force ? O_TRUNC : O_EXCL), S_IRUSR | S_IWUSR);
+	if (image < 0)
+		die(out);
+	meta = calloc((size_t)n_groups * (2 + islice), BLOCK_SIZE);
+	wbuf = malloc((size_t)WBUF_BLOCKS * BLOCK_SIZE);
+
+	write_dir(root);
+	flush();
+
+	// block 0 goes out last, with the free counts of a clean image
+	char block[BLOCK_SIZE], map[BLOCK_SIZE];
+	memset(block, 0, BLOCK_SIZE);
+	struct group_desc *desc = sb_groups((struct superblock *)block);
+	for (uint32_t g = 0; g < n_groups; g++) {
+		bitmap_t i_bitmap = (bitmap_t)grp_meta(g), d_bitmap = (bitmap_t)grp_meta(g) + BLOCK_SIZE;
+		for (uint32_t bit = 0; bit < grp_inodes[g]; bit++) {
+			if (g > 0 || bit >= ROOT_INO)
+				set_bitmap(i_bitmap, bit);
+		}
+		desc[g].free_inodes = ipg - grp_inodes[g];
+		// the fragment map, filled in from the masks place_frags() left
+		if (frag_map_idx[g]) {
+			uint32_t bit = (frag_map_idx[g] - 1) % bpg;
+			memset(map, 0, BLOCK_SIZE);
+			memcpy(map, frag_masks + (size_t)g * bpg, (bpg < FRAG_MAP_BLKS ? bpg : FRAG_MAP_BLKS) * sizeof(uint16_t));
+			if (pwrite(image, map, BLOCK_SIZE, (off_t)dblk_at(&sb, frag_map_idx[g] - 1) * BLOCK_SIZE) != BLOCK_SIZE)
+				die("write image");
+			bytes_written += BLOCK_SIZE;
+			set_bitmap(d_bitmap, bit);
+			desc[g].frag_map = bit + 1;
+		}
+		for (uint32_t bit = 0; bit < bpg; bit++)
+			desc[g].free_blocks += !get_bitmap(d_bitmap, bit);
+		sb.free_inodes += desc[g].free_inodes;
+		sb.free_blocks += desc[g].free_blocks;
+		// the inode table is written only as far as the group's inodes go
+		desc[g].itable_init = (grp_inodes[g] + NUM_INODES - 1) / NUM_INODES;
+		size_t len = (size_t)(2 + desc[g].itable_init) * BLOCK_SIZE;
+		if (pwrite(image, grp_meta(g), len, (off_t)grp_i_bitmap(&sb, g) * BLOCK_SIZE) != (ssize_t)len)
+			die("write image");
+		bytes_written += len;
+	}
+	sb.state = TFS_CLEAN;
+	memcpy(block, &sb, sizeof(sb));
+	if (pwrite(image, block, BLOCK_SIZE, 0) != BLOCK_SIZE)
+		die("write image");
+
+	off_t size = (off_t)(sb.i_bitmap_blk + n_groups * sb.group_blks) * BLOCK_SIZE;
+	if (ftruncate(image, size < MIN_IMAGE_SIZE ? MIN_IMAGE_SIZE : size) < 0 || fsync(image) < 0)
+		die(out);
+	close(image);
+
+	gettimeofday(&end, NULL);
+	double secs = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+	printf("%s: %u inodes, %u/%u data blocks in %u groups, wrote %.1f MB in %.3f s (%.1f MB/s)\n", out,
+		n_inodes, n_blocks, sb.max_dnum, n_groups, bytes_written / 1048576.0, secs,
+		secs > 0 ? bytes_written / 1048576.0 / secs : 0.0);
+	return 0;
+}
@@ -0,0 +1,181 @@
+/*
+ *  Copyright (C) 2020 CS416 Rutgers CS
+ *	Tiny File System
+ *	File:	optrace.c
+ *
+ *	Call recorder. Every call into the file system, what it was asked and
+ *	what it returned, when it started and how long it took, becomes one
+ *	record of a binary trace benchmark/tfs_replay can play back against
+ *	another image. A thread gathers its records in a buffer of its own, so
+ *	recording takes no lock, and appends the buffer to the file only once
+ *	it is full. A thread that exits appends its buffer and leaves it, with
+ *	its thread number, to the next new thread. Unmount appends what is
+ *	left and writes the header.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "optrace.h"
+
+struct obuf {
+	struct obuf	*next;
+	uint16_t	thread;
+	int			idle;				/* its thread exited, a new one may take it */
+	size_t		used;
+	char		data[OPTRACE_BUF];
+};
+
+int optrace_enabled;
+
+/* guards the file and the list of buffers */
+static pthread_mutex_t optrace_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *out;
+static struct optrace_hdr hdr;
+static uint64_t start_ns;
+static struct obuf *bufs;
+static uint32_t gen;					/* bumped as each recording starts and ends, so a thread starts a new buffer */
+
+static __thread struct obuf *self;
+static __thread uint32_t self_gen;		/* self is freed at unmount, its recording is over once gen moves on */
+static pthread_key_t self_key;
+static pthread_once_t self_once = PTHREAD_ONCE_INIT;
+
+static inline uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+int optrace_init(const char *path) {
+	out = fopen(path, "w");
+	if (out == NULL) {
+		perror("op trace");
+		return -1;
+	}
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = OPTRACE_MAGIC;
+	hdr.version = OPTRACE_VERSION;
+	hdr.start_time = time(NULL);
+	// the header is written again at unmount, with the count filled in
+	fwrite(&hdr, sizeof(hdr), 1, out);
+	start_ns = now_ns();
+	gen++;
+	optrace_enabled = 1;
+	return 0;
+}
+
+/* append a buffer's records to the file, called with optrace_lock held */
+static void flush(struct obuf *b) {
+	if (b->used > 0 && fwrite(b->data, b->used, 1, out) != 1)
+		perror("op trace");
+	b->used = 0;
+}
+
+/* an exiting thread appends its records and leaves its buffer to the next */
+static void self_exit(void *arg) {
+	struct obuf *b = arg;
+	pthread_mutex_lock(&optrace_lock);
+	if (self_gen == gen) {
+		flush(b);
+		b->idle = 1;
+	}
+	pthread_mutex_unlock(&optrace_lock);
+}
+
+static void self_key_init() {
+	pthread_key_create(&self_key, self_exit);
+}
+
+static struct obuf *self_buf() {
+	if (self != NULL && self_gen == gen)
+		return self;
+	pthread_mutex_lock(&optrace_lock);
+	struct obuf *b = bufs;
+	while (b != NULL && !b->idle)
+		b = b->next;
+	if (b == NULL) {
+		b = malloc(sizeof(struct obuf));
+		if (b == NULL) {
+			pthread_mutex_unlock(&optrace_lock);
+			return NULL;
+		}
+		b->thread = ++hdr.threads;
+		b->next = bufs;
+		bufs = b;
+	}
+	b->idle = 0;
+	b->used = 0;
+	self_gen = gen;
+	pthread_mutex_unlock(&optrace_lock);
+	pthread_once(&self_once, self_key_init);
+	pthread_setspecific(self_key, b);
+	return self = b;
+}
+
+static uint16_t path_len(const char *path) {
+	size_t len = path != NULL ? strlen(path) : 0;
+	return len < UINT16_MAX ? len : UINT16_MAX;
+}
+
+void optrace_record(int op, const struct optrace_args *args, uint64_t start, int ret) {
+	uint64_t lat = now_ns() - start;
+	struct obuf *b = self_buf();
+	if (b == NULL)
+		return;
+	struct optrace_rec r = {
+		.start_ns = start - start_ns,
+		.offset = args->offset,
+		.lat_ns = lat < UINT32_MAX ? lat : UINT32_MAX,
+		.ret = ret,
+		.size = args->size,
+		.file = args->file,
+		.flags = args->flags,
+		.mode = args->mode,
+		.thread = b->thread,
+		.op = op,
+		.path_len = path_len(args->path),
+		.path2_len = path_len(args->path2),
+	};
+	uint32_t len = optrace_rec_len(&r);
+	if (b->used + len > OPTRACE_BUF) {
+		pthread_mutex_lock(&optrace_lock);
+		flush(b);
+		pthread_mutex_unlock(&optrace_lock);
+	}
+	char *p = b->data + b->used;
+	memcpy(p, &r, sizeof(r));
+	p += sizeof(r);
+	if (r.path_len > 0)
+		memcpy(p, args->path, r.path_len);
+	if (r.path2_len > 0)
+		memcpy(p + r.path_len, args->path2, r.path2_len);
+	memset(p + r.path_len + r.path2_len, 0, len - sizeof(r) - r.path_len - r.path2_len);
+	b->used += len;
+	// counted here, a record is in the file once its buffer is
+	__atomic_add_fetch(&hdr.nrecs, 1, __ATOMIC_RELAXED);
+}
+
+void optrace_close() {
+	if (!optrace_enabled)
+		return;
+	optrace_enabled = 0;
+	pthread_mutex_lock(&optrace_lock);
+	while (bufs != NULL) {
+		struct obuf *b = bufs;
+		bufs = b->next;
+		flush(b);
+		free(b);
+	}
+	rewind(out);
+	fwrite(&hdr, sizeof(hdr), 1, out);
+	fclose(out);
+	out = NULL;
+	// the buffers are gone, a thread exiting later must not touch its own
+	gen++;
+	pthread_mutex_unlock(&optrace_lock);
+}
@@ -0,0 +1,81 @@
+/*
+ *  Copyright (C) 2020 CS416 Rutgers CS
+ *	Tiny File System
+ *	File:	optrace.h
+ *
+ */
+
+#ifndef _OPTRACE_H
+#define _OPTRACE_H
+
+#include <stdint.h>
+
+/*
+ * set TFS_OPTRACE=<file> in the environment of tfs to record every call
+ * into the file system, which benchmark/tfs_replay plays back
+ */
+#define OPTRACE_ENV "TFS_OPTRACE"
+#define OPTRACE_MAGIC 0x4F534654		/* "TFSO" */
+#define OPTRACE_VERSION 1
+/* bytes a thread gathers before it appends them to the file */
+#define OPTRACE_BUF (256 << 10)
+
+/*
+ * The file is a header followed by nrecs records in the order the threads
+ * handed them in, not sorted by start_ns. Each record is followed by its
+ * path and then its second path, path_len and path2_len bytes, not NUL
+ * terminated, and padded to 8 bytes.
+ */
+struct optrace_hdr {
+	uint32_t	magic;
+	uint32_t	version;
+	uint64_t	nrecs;
+	uint64_t	start_time;			/* wall clock seconds when recording began */
+	uint32_t	threads;			/* thread numbers given out, an exited thread's is reused */
+	uint32_t	reserved;
+};
+
+struct optrace_rec {
+	uint64_t	start_ns;			/* ns since recording began */
+	uint64_t	offset;				/* of a read or write */
+	uint32_t	lat_ns;				/* time in the call, at most UINT32_MAX */
+	int32_t		ret;
+	uint32_t	size;				/* of a read or write */
+	uint32_t	file;				/* open file the call made or used, 0 for none */
+	uint32_t	flags;				/* open(2) flags */
+	uint16_t	mode;				/* open, mkdir and chmod mode */
+	uint16_t	thread;				/* recording thread, numbered from 1 */
+	uint8_t		op;					/* enum tfs_op */
+	uint8_t		pad;
+	uint16_t	path_len;
+	uint16_t	path2_len;			/* target of rename and link */
+	uint16_t	pad2;
+};
+
+/* bytes a record takes in the file, paths included */
+static inline uint32_t optrace_rec_len(const struct optrace_rec *r) {
+	return (sizeof(struct optrace_rec) + r->path_len + r->path2_len + 7) & ~7;
+}
+
+struct tfs_file;
+
+/* what an entry point was called with, filled in by the TIMED wrappers */
+struct optrace_args {
+	const char	*path;
+	const char	*path2;
+	uint64_t	offset;
+	uint32_t	size;
+	uint32_t	file;
+	uint32_t	flags;
+	uint16_t	mode;
+	struct tfs_file **filep;		/* where tfs_open() puts the file it opens */
+};
+
+extern int optrace_enabled;
+
+int optrace_init(const char *path);
+void optrace_record(int op, const struct optrace_args *args, uint64_t start_ns, int ret);
+/* append what the threads still hold and finish the header, at unmount */
+void optrace_close();
+
+#endif
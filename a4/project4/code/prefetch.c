@@ -0,0 +1,117 @@
+/*
+ *  Copyright (C) 2020 CS416 Rutgers CS
+ *	Tiny File System
+ *	File:	prefetch.c
+ *
+ *	Mount-time prefetch. A mount reads block 0 and little else, so the
+ *	first calls after it would each wait on a bitmap, an inode table block
+ *	or a directory block. A thread started at mount asks the host to read
+ *	each group's bitmaps and the initialized part of its inode table, which
+ *	lie next to each other, in one request per group. It then walks the
+ *	tree from the root breadth first and asks for every directory's blocks,
+ *	up to PREFETCH_BLKS of them. The blocks land in the host's page cache,
+ *	so with the volume in memory or the disk file opened O_DIRECT there is
+ *	nothing to do.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "block.h"
+#include "tfs.h"
+#include "stats.h"
+#include "prefetch.h"
+
+static pthread_t prefetch_thread;
+static int thread_started;
+static int stopping;
+
+/* ask for the blocks of a directory, runs of adjacent ones in one request each */
+static int hint_dir(const struct inode *dir) {
+	int n = 0;
+	for (int i = 0; i < NUM_DIRECT;) {
+		int blk = dir->direct_ptr[i], len = 1;
+		if (blk < 0) {
+			i++;
+			continue;
+		}
+		while (i + len < NUM_DIRECT && dir->direct_ptr[i + len] == blk + len)
+			len++;
+		dev_prefetch(blk, len);
+		n += len;
+		i += len;
+	}
+	return n;
+}
+
+/*
+ * Queue the subdirectories a directory block names. The block is read
+ * without the directory locked, a record chain that looks broken ends it.
+ */
+static void queue_subdirs(const char *blk, uint16_t *queue, int *tail, char *seen) {
+	for (uint32_t off = 0; off + sizeof(struct dirent) <= BLOCK_SIZE;) {
+		const struct dirent *d = (const struct dirent *)(blk + off);
+		if (d->rec_len == 0 || off + d->rec_len > BLOCK_SIZE)
+			break;
+		if (d->ino != 0 && d->ino < superblock->max_inum && d->file_type == FT_DIR && !seen[d->ino]) {
+			seen[d->ino] = 1;
+			queue[(*tail)++] = d->ino;
+		}
+		off += d->rec_len;
+	}
+}
+
+static void *prefetch_main(void *arg) {
+	int hinted = 0;
+	for (int g = 0; g < superblock->n_groups; g++) {
+		int n = 2 + sb_groups(superblock)[g].itable_init;
+		dev_prefetch(grp_i_bitmap(superblock, g), n);
+		hinted += n;
+	}
+
+	uint16_t *queue = malloc(superblock->max_inum * sizeof(uint16_t));
+	char *seen = calloc(superblock->max_inum, 1);
+	char *buf = blk_alloc();
+	int head = 0, tail = 0, dir_blks = 0;
+	queue[tail++] = ROOT_INO;
+	seen[ROOT_INO] = 1;
+	while (head < tail && dir_blks < PREFETCH_BLKS && !__atomic_load_n(&stopping, __ATOMIC_RELAXED)) {
+		struct inode dir;
+		// one directory at a time, so a defrag pass never waits long on the walk
+		pthread_rwlock_rdlock(&fs_lock);
+		if (readi(queue[head++], &dir) == 0 && S_ISDIR(dir.mode)) {
+			dir_blks += hint_dir(&dir);
+			for (int i = 0; i < NUM_DIRECT; i++) {
+				if (dir.direct_ptr[i] < 0)
+					continue;
+				bio_read(dir.direct_ptr[i], buf);
+				queue_subdirs(buf, queue, &tail, seen);
+			}
+		}
+		pthread_rwlock_unlock(&fs_lock);
+	}
+	blk_free(buf);
+	free(seen);
+	free(queue);
+	stats_prefetch(hinted + dir_blks);
+	return NULL;
+}
+
+void prefetch_start() {
+	// nothing would keep what is read
+	if (dev_prefetch(0, 1) < 0)
+		return;
+	__atomic_store_n(&stopping, 0, __ATOMIC_RELAXED);
+	thread_started = pthread_create(&prefetch_thread, NULL, prefetch_main, NULL) == 0;
+}
+
+void prefetch_stop() {
+	if (!thread_started)
+		return;
+	__atomic_store_n(&stopping, 1, __ATOMIC_RELAXED);
+	pthread_join(prefetch_thread, NULL);
+	thread_started = 0;
+}
@@ -0,0 +1,19 @@
+/*
+ *  Copyright (C) 2020 CS416 Rutgers CS
+ *	Tiny File System
+ *	File:	prefetch.h
+ *
+ */
+
+#ifndef _PREFETCH_H
+#define _PREFETCH_H
+
+/* directory blocks the walk from the root asks for at most */
+#define PREFETCH_BLKS 4096
+
+/* start the prefetch thread, at mount once fs_lock is set up */
+void prefetch_start();
+/* stop it and wait for it, first thing at unmount */
+void prefetch_stop();
+
+#endif
@@ -0,0 +1,314 @@
+/*
+ *  Copyright (C) 2020 CS416 Rutgers CS
+ *	Tiny File System
+ *	File:	ram.c
+ *
+ *	RAM-backed volume. The image is read into one anonymous mapping when
+ *	the disk file is opened, on huge pages where the host has them, and
+ *	the block calls copy to and from the mapping from then on. A write
+ *	marks the region of RAM_REGION_BLKS blocks it falls in dirty. A
+ *	snapshot writes the dirty regions back to the disk file, a run of
+ *	adjacent ones in large sequential writes, with fs_lock held for writing
+ *	so the file holds the volume as it was between two calls.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "block.h"
+#include "tfs.h"
+#include "ram.h"
+
+#define HUGE_PAGE (2UL << 20)
+#define REGION_BYTES ((size_t)RAM_REGION_BLKS * BLOCK_SIZE)
+#define RAM_IO (8UL << 20)				/* bytes per pread or pwrite */
+
+struct ram_status {
+	uint32_t	snapshots;
+	uint64_t	bytes;				/* written back by all of them */
+	uint64_t	last_bytes;
+	uint32_t	last_writes;		/* pwrite calls the last one made */
+	double		last_seconds;
+	time_t		last_time;
+};
+
+int ram_active;
+
+static int disk_fd = -1;
+static char *mem;
+static size_t mem_size;
+static const char *pages;				/* what mem is backed by */
+static uint8_t *dirty;					/* per region */
+static size_t n_regions;
+static int interval;					/* seconds between snapshots, 0 for none */
+
+static struct ram_status status;
+static pthread_mutex_t status_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+static pthread_t snapshot_thread;
+static int thread_started;
+static int requested;
+static int stopping;
+
+/* move len bytes between mem and the disk file in RAM_IO pieces, returns the calls made or -1 */
+static int disk_io(int write, size_t off, size_t len) {
+	int calls = 0;
+	while (len > 0) {
+		size_t n = len < RAM_IO ? len : RAM_IO;
+		ssize_t ret = write ? pwrite(disk_fd, mem + off, n, off) : pread(disk_fd, mem + off, n, off);
+		calls++;
+		if (ret < 0) {
+			perror(write ? "snapshot write failed" : "ram load failed");
+			return -1;
+		}
+		// a read past the end of the file leaves the rest zero
+		if (ret == 0)
+			break;
+		off += ret;
+		len -= ret;
+	}
+	return calls;
+}
+
+int ram_load(int fd) {
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		perror("ram_load");
+		return -1;
+	}
+	// room for the whole geometry, the disk file may not have grown to it yet
+	struct superblock *sb = blk_alloc();
+	if (pread(fd, sb, BLOCK_SIZE, 0) != BLOCK_SIZE || sb->magic_num != MAGIC_NUM || sb->n_groups > MAX_GROUPS)
+		tfs_layout(sb, NUM_GROUPS, MAX_INUM/NUM_GROUPS, MAX_DNUM/NUM_GROUPS);
+	size_t size = (size_t)(sb->i_bitmap_blk + sb->n_groups * sb->group_blks) * BLOCK_SIZE;
+	blk_free(sb);
+	if (size < (size_t)st.st_size)
+		size = st.st_size;
+	size = (size + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1);
+
+	// huge pages only if the host has them reserved, which MAP_NORESERVE would not check
+	pages = "huge pages";
+	mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (mem == MAP_FAILED) {
+		mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (mem == MAP_FAILED) {
+			perror("ram_load");
+			return -1;
+		}
+		pages = madvise(mem, size, MADV_HUGEPAGE) == 0 ? "transparent huge pages" : "small pages";
+	}
+	mem_size = size;
+	disk_fd = fd;
+
+	// only the parts of a sparse image that hold data are read
+	off_t pos = 0;
+	while (pos < st.st_size) {
+		off_t data = lseek(fd, pos, SEEK_DATA), hole = st.st_size;
+		if (data < 0 && errno == ENXIO)
+			break;
+		if (data < 0)
+			data = pos;
+		else
+			hole = lseek(fd, data, SEEK_HOLE);
+		data &= ~(off_t)(BLOCK_SIZE - 1);
+		hole = (hole + BLOCK_SIZE - 1) & ~(off_t)(BLOCK_SIZE - 1);
+		if (hole > (off_t)mem_size)
+			hole = mem_size;
+		if (disk_io(0, data, hole - data) < 0) {
+			munmap(mem, mem_size);
+			disk_fd = -1;
+			return -1;
+		}
+		pos = hole;
+	}
+
+	n_regions = (mem_size + REGION_BYTES - 1) / REGION_BYTES;
+	dirty = calloc(n_regions, 1);
+	char *env = getenv(RAM_ENV);
+	interval = env != NULL ? atoi(env) : 0;
+	if (interval < 0)
+		interval = 0;
+	memset(&status, 0, sizeof(status));
+	ram_active = 1;
+	return 0;
+}
+
+int ram_read(int block_num, int n, void *buf) {
+	size_t off = (size_t)block_num * BLOCK_SIZE, len = (size_t)n * BLOCK_SIZE;
+	// past the volume reads back as zeros, as past the end of the disk file
+	if (block_num < 0 || off + len > mem_size) {
+		memset(buf, 0, len);
+		return 0;
+	}
+	memcpy(buf, mem + off, len);
+	return len;
+}
+
+int ram_write(int block_num, const void *buf) {
+	size_t off = (size_t)block_num * BLOCK_SIZE;
+	if (block_num < 0 || off + BLOCK_SIZE > mem_size) {
+		fprintf(stderr, "block_write failed: block %d is past the volume\n", block_num);
+		return -1;
+	}
+	memcpy(mem + off, buf, BLOCK_SIZE);
+	dirty[block_num / RAM_REGION_BLKS] = 1;
+	return BLOCK_SIZE;
+}
+
+/*
+ * Write the dirty regions back and sync the disk file. Nothing may write
+ * to the volume meanwhile.
+ */
+static void snapshot() {
+	struct timespec start, end;
+	uint64_t bytes = 0;
+	uint32_t writes = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (size_t r = 0; r < n_regions;) {
+		if (!dirty[r]) {
+			r++;
+			continue;
+		}
+		size_t first = r;
+		while (r < n_regions && dirty[r])
+			dirty[r++] = 0;
+		int calls = disk_io(1, first * REGION_BYTES, (r - first) * REGION_BYTES);
+		if (calls > 0)
+			writes += calls;
+		bytes += (r - first) * REGION_BYTES;
+	}
+	if (bytes > 0 && fdatasync(disk_fd) < 0)
+		perror("fdatasync failed");
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	pthread_mutex_lock(&status_lock);
+	status.snapshots++;
+	status.bytes += bytes;
+	status.last_bytes = bytes;
+	status.last_writes = writes;
+	status.last_seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	status.last_time = time(NULL);
+	pthread_mutex_unlock(&status_lock);
+}
+
+void ram_unload() {
+	if (!ram_active)
+		return;
+	snapshot();
+	munmap(mem, mem_size);
+	free(dirty);
+	mem = NULL;
+	dirty = NULL;
+	disk_fd = -1;
+	ram_active = 0;
+}
+
+/* takes a snapshot every interval seconds and whenever one is asked for */
+static void *snapshot_main(void *arg) {
+	pthread_mutex_lock(&status_lock);
+	while (!stopping) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += interval;
+		int timed_out = 0;
+		while (!stopping && !requested && !timed_out) {
+			if (interval > 0)
+				timed_out = pthread_cond_timedwait(&wake, &status_lock, &deadline) == ETIMEDOUT;
+			else
+				pthread_cond_wait(&wake, &status_lock);
+		}
+		if (stopping)
+			break;
+		requested = 0;
+		pthread_mutex_unlock(&status_lock);
+		pthread_rwlock_wrlock(&fs_lock);
+		snapshot();
+		pthread_rwlock_unlock(&fs_lock);
+		pthread_mutex_lock(&status_lock);
+	}
+	pthread_mutex_unlock(&status_lock);
+	return NULL;
+}
+
+void ram_start() {
+	if (!ram_active)
+		return;
+	stopping = 0;
+	requested = 0;
+	thread_started = pthread_create(&snapshot_thread, NULL, snapshot_main, NULL) == 0;
+	if (!thread_started)
+		fprintf(stderr, "no snapshot thread, the volume is written back at unmount only\n");
+}
+
+void ram_stop() {
+	pthread_mutex_lock(&status_lock);
+	stopping = 1;
+	pthread_cond_signal(&wake);
+	int started = thread_started;
+	thread_started = 0;
+	pthread_mutex_unlock(&status_lock);
+	if (started)
+		pthread_join(snapshot_thread, NULL);
+}
+
+/*
+ * The caller holds fs_lock for reading, so the snapshot thread is only
+ * woken, never waited for.
+ */
+int ram_command(const char *buf, size_t len) {
+	if (len < 8 || strncmp(buf, "snapshot", 8) != 0)
+		return -EINVAL;
+	pthread_mutex_lock(&status_lock);
+	int ret = thread_started ? 0 : -ENOTSUP;
+	if (ret == 0) {
+		requested = 1;
+		pthread_cond_signal(&wake);
+	}
+	pthread_mutex_unlock(&status_lock);
+	return ret;
+}
+
+char *ram_render(size_t *len) {
+	char *text = NULL;
+	FILE *out = open_memstream(&text, len);
+	if (out == NULL)
+		return NULL;
+	if (!ram_active) {
+		fprintf(out, "volume on disk\n");
+		fclose(out);
+		return text;
+	}
+	size_t n_dirty = 0;
+	for (size_t r = 0; r < n_regions; r++)
+		n_dirty += dirty[r];
+	pthread_mutex_lock(&status_lock);
+	struct ram_status s = status;
+	pthread_mutex_unlock(&status_lock);
+
+	fprintf(out, "volume in memory, %zu MB on %s\n", mem_size >> 20, pages);
+	if (interval > 0)
+		fprintf(out, "interval %d s\n", interval);
+	else
+		fprintf(out, "interval none\n");
+	fprintf(out, "dirty_regions %zu of %zu\n", n_dirty, n_regions);
+	fprintf(out, "snapshots %u\n", s.snapshots);
+	fprintf(out, "bytes_written %lu\n", s.bytes);
+	if (s.snapshots > 0) {
+		fprintf(out, "last_bytes %lu\n", s.last_bytes);
+		fprintf(out, "last_writes %u\n", s.last_writes);
+		fprintf(out, "last_seconds %.3f\n", s.last_seconds);
+		fprintf(out, "last_age %ld s\n", (long)(time(NULL) - s.last_time));
+	}
+	fclose(out);
+	return text;
+}
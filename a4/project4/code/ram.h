@@ -0,0 +1,50 @@
+/*
+ *  Copyright (C) 2020 CS416 Rutgers CS
+ *	Tiny File System
+ *	File:	ram.h
+ *
+ */
+
+#ifndef _RAM_H
+#define _RAM_H
+
+#include <stddef.h>
+
+/*
+ * set TFS_RAM in the environment of tfs to keep the whole volume in memory
+ * and write it back to the disk file only in snapshots: every TFS_RAM
+ * seconds if it is a number above 0, on request, and at unmount. A crash
+ * loses what was written since the last snapshot.
+ */
+#define RAM_ENV "TFS_RAM"
+
+/*
+ * control file of the snapshots in the mount root:
+ *	echo snapshot > /.tfs_snapshot	write the dirty regions back now
+ *	cat /.tfs_snapshot				what the snapshots have written
+ */
+#define SNAPSHOT_NAME "/.tfs_snapshot"
+
+/* blocks per dirty region, the unit a snapshot writes */
+#define RAM_REGION_BLKS 64
+
+/* set while the volume lives in memory, the block calls test it */
+extern int ram_active;
+
+/* read the image in the open disk file fd into memory */
+int ram_load(int fd);
+/* take a last snapshot and let go of the memory, called by dev_close() */
+void ram_unload();
+int ram_read(int block_num, int n, void *buf);
+int ram_write(int block_num, const void *buf);
+
+/* start the thread taking snapshots, once fs_lock is set up */
+void ram_start();
+/* stop it, at unmount before the last snapshot */
+void ram_stop();
+/* ask for a snapshot, returns 0 or -errno without waiting for it */
+int ram_command(const char *buf, size_t len);
+/* render what the snapshots have done as text, returns a malloc'd buffer */
+char *ram_render(size_t *len);
+
+#endif
@@ -0,0 +1,103 @@
+/*
+ *  Copyright (C) 2020 CS416 Rutgers CS
+ *	Tiny File System
+ *	File:	scratch.c
+ *
+ *	Scratch arenas. Each thread has one SCRATCH_SIZE arena, made on its
+ *	first request and freed when the thread exits. Allocations bump the
+ *	used count and a release moves it back, so a request costs no malloc
+ *	or free and a thread's memory stays constant however many it serves.
+ *	What does not fit is malloc'd, linked into the spill list and freed by
+ *	the release that passes it.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "block.h"
+#include "scratch.h"
+
+#define ALIGN 16
+
+struct spill {
+	struct spill	*next;
+	char			pad[BLOCK_SIZE - sizeof(struct spill *)];	/* the data stays block aligned */
+};
+
+static __thread char *arena;
+static __thread size_t used;
+static __thread struct spill *spills;
+static pthread_key_t arena_key;
+static pthread_once_t arena_once = PTHREAD_ONCE_INIT;
+
+struct scratch_mark scratch_mark() {
+	struct scratch_mark mark = { used, spills };
+	return mark;
+}
+
+void scratch_release(struct scratch_mark mark) {
+	used = mark.used;
+	while (spills != mark.spill) {
+		struct spill *s = spills;
+		spills = s->next;
+		free(s);
+	}
+}
+
+/*
+ * A thread's arena goes when it exits, with any spills a release never reached
+ */
+static void arena_exit(void *arg) {
+	while (spills != NULL) {
+		struct spill *s = spills;
+		spills = s->next;
+		free(s);
+	}
+	free(arg);
+	arena = NULL;
+	used = 0;
+}
+
+static void arena_key_init() {
+	pthread_key_create(&arena_key, arena_exit);
+}
+
+static void *alloc_aligned(size_t size, size_t align) {
+	if (arena == NULL) {
+		pthread_once(&arena_once, arena_key_init);
+		if (posix_memalign((void **)&arena, BLOCK_SIZE, SCRATCH_SIZE) != 0) {
+			perror("scratch arena failed");
+			exit(EXIT_FAILURE);
+		}
+		pthread_setspecific(arena_key, arena);
+	}
+	size_t at = (used + align - 1) & ~(align - 1);
+	if (at + size <= SCRATCH_SIZE) {
+		used = at + size;
+		return arena + at;
+	}
+	struct spill *s;
+	if (posix_memalign((void **)&s, BLOCK_SIZE, sizeof(struct spill) + size) != 0) {
+		perror("scratch spill failed");
+		exit(EXIT_FAILURE);
+	}
+	s->next = spills;
+	spills = s;
+	return s + 1;
+}
+
+void *scratch_alloc(size_t size) {
+	return alloc_aligned(size, ALIGN);
+}
+
+void *scratch_blks(int n) {
+	return alloc_aligned((size_t)n * BLOCK_SIZE, BLOCK_SIZE);
+}
+
+char *scratch_strdup(const char *s) {
+	size_t len = strlen(s) + 1;
+	return memcpy(scratch_alloc(len), s, len);
+}
@@ -0,0 +1,38 @@
+/*
+ *  Copyright (C) 2020 CS416 Rutgers CS
+ *	Tiny File System
+ *	File:	scratch.h
+ *
+ */
+
+#ifndef _SCRATCH_H
+#define _SCRATCH_H
+
+#include <stddef.h>
+
+/* bytes of a thread's arena, a request asking for more gets them from malloc */
+#define SCRATCH_SIZE (256 << 10)
+
+/* how far a thread's arena is used, to go back to */
+struct scratch_mark {
+	size_t		used;
+	void		*spill;				/* newest allocation that did not fit */
+};
+
+/*
+ * Per-thread scratch memory for what lives only as long as one request:
+ * path copies, directory and inode table blocks, cluster buffers. An
+ * allocation bumps a pointer, and scratch_release() gives back everything
+ * allocated since the mark in one step, the TIMED entry points around every
+ * request and loops around each pass.
+ */
+struct scratch_mark scratch_mark();
+void scratch_release(struct scratch_mark mark);
+/* size bytes aligned to 16 */
+void *scratch_alloc(size_t size);
+/* n blocks aligned to BLOCK_SIZE, as O_DIRECT wants */
+void *scratch_blks(int n);
+/* a copy of s */
+char *scratch_strdup(const char *s);
+
+#endif
@@ -0,0 +1,262 @@
+/*
+ *  Copyright (C) 2020 CS416 Rutgers CS
+ *	Tiny File System
+ *	File:	stats.c
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "stats.h"
+
+__thread struct tfs_stats *my_stats;
+
+static struct tfs_stats *all_stats;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *op_names[NUM_OPS] = {
+	[OP_NONE]		= "none",
+	[OP_GETATTR]	= "getattr",
+	[OP_READDIR]	= "readdir",
+	[OP_OPENDIR]	= "opendir",
+	[OP_RELEASEDIR]	= "releasedir",
+	[OP_MKDIR]		= "mkdir",
+	[OP_RMDIR]		= "rmdir",
+	[OP_CREATE]		= "create",
+	[OP_OPEN]		= "open",
+	[OP_READ]		= "read",
+	[OP_WRITE]		= "write",
+	[OP_UNLINK]		= "unlink",
+	[OP_TRUNCATE]	= "truncate",
+	[OP_FLUSH]		= "flush",
+	[OP_UTIMENS]	= "utimens",
+	[OP_RELEASE]	= "release",
+	[OP_STATFS]		= "statfs",
+	[OP_CHMOD]		= "chmod",
+	[OP_RENAME]		= "rename",
+	[OP_LINK]		= "link",
+	[OP_FSYNC]		= "fsync",
+};
+
+const char *stats_op_name(enum tfs_op op) {
+	if (op < 0 || op >= NUM_OPS)
+		return "?";
+	return op_names[op];
+}
+
+/*
+ * Called once per thread: the counter block is never freed so that counts
+ * from FUSE worker threads that have exited are still reported.
+ */
+struct tfs_stats *stats_register() {
+	struct tfs_stats *s = calloc(1, sizeof(struct tfs_stats));
+	if (s == NULL)
+		abort();
+	pthread_mutex_lock(&stats_lock);
+	s->next = all_stats;
+	all_stats = s;
+	pthread_mutex_unlock(&stats_lock);
+	return s;
+}
+
+static inline uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+uint64_t stats_begin(enum tfs_op op) {
+	stats_self();
+	return now_ns();
+}
+
+void stats_end(enum tfs_op op, uint64_t start, int ret) {
+	struct op_stats *o = &stats_self()->op[op];
+	uint64_t ns = now_ns() - start;
+	int bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+	if (bucket >= STATS_BUCKETS)
+		bucket = STATS_BUCKETS - 1;
+	o->calls++;
+	if (ret < 0)
+		o->errors++;
+	o->total_ns += ns;
+	o->hist[bucket]++;
+}
+
+void stats_blk_read(size_t bytes) {
+	struct tfs_stats *s = stats_self();
+	s->blk_reads++;
+	s->bytes_read += bytes;
+}
+
+void stats_blk_write(size_t bytes) {
+	struct tfs_stats *s = stats_self();
+	s->blk_writes++;
+	s->bytes_written += bytes;
+}
+
+void stats_alloc_ino(int scanned) {
+	struct tfs_stats *s = stats_self();
+	s->ialloc_calls++;
+	s->ialloc_scan += scanned;
+}
+
+void stats_alloc_blk(int scanned) {
+	struct tfs_stats *s = stats_self();
+	s->dalloc_calls++;
+	s->dalloc_scan += scanned;
+}
+
+void stats_cluster_pack(int packed) {
+	struct tfs_stats *s = stats_self();
+	if (packed)
+		s->cluster_packs++;
+	else
+		s->cluster_raw++;
+}
+
+void stats_cluster_read() {
+	stats_self()->cluster_reads++;
+}
+
+void stats_cluster_expand() {
+	stats_self()->cluster_expands++;
+}
+
+void stats_log_segment(int blocks) {
+	struct tfs_stats *s = stats_self();
+	s->log_segments++;
+	s->log_blocks += blocks;
+}
+
+void stats_checkpoint(int blocks) {
+	struct tfs_stats *s = stats_self();
+	s->checkpoints++;
+	s->checkpoint_blocks += blocks;
+}
+
+void stats_dedup(int shared) {
+	struct tfs_stats *s = stats_self();
+	if (shared)
+		s->dedup_shared++;
+	else
+		s->dedup_indexed++;
+}
+
+void stats_prefetch(int blocks) {
+	stats_self()->prefetch_blocks += blocks;
+}
+
+void stats_pack_run(int moved) {
+	struct tfs_stats *s = stats_self();
+	s->pack_runs++;
+	if (moved)
+		s->pack_moves++;
+}
+
+void stats_pack_unpack() {
+	stats_self()->pack_unpacks++;
+}
+
+/*
+ * Sum every thread's counters. The other threads keep counting while we read
+ * them; 64-bit loads are not torn, so at worst a snapshot is a few calls old.
+ */
+static void stats_sum(struct tfs_stats *sum) {
+	memset(sum, 0, sizeof(struct tfs_stats));
+	pthread_mutex_lock(&stats_lock);
+	for (struct tfs_stats *s = all_stats; s != NULL; s = s->next) {
+		for (int i = 0; i < NUM_OPS; i++) {
+			sum->op[i].calls += s->op[i].calls;
+			sum->op[i].errors += s->op[i].errors;
+			sum->op[i].total_ns += s->op[i].total_ns;
+			for (int b = 0; b < STATS_BUCKETS; b++)
+				sum->op[i].hist[b] += s->op[i].hist[b];
+		}
+		sum->blk_reads += s->blk_reads;
+		sum->blk_writes += s->blk_writes;
+		sum->bytes_read += s->bytes_read;
+		sum->bytes_written += s->bytes_written;
+		sum->ialloc_calls += s->ialloc_calls;
+		sum->ialloc_scan += s->ialloc_scan;
+		sum->dalloc_calls += s->dalloc_calls;
+		sum->dalloc_scan += s->dalloc_scan;
+		sum->cluster_packs += s->cluster_packs;
+		sum->cluster_raw += s->cluster_raw;
+		sum->cluster_reads += s->cluster_reads;
+		sum->cluster_expands += s->cluster_expands;
+		sum->log_segments += s->log_segments;
+		sum->log_blocks += s->log_blocks;
+		sum->checkpoints += s->checkpoints;
+		sum->checkpoint_blocks += s->checkpoint_blocks;
+		sum->dedup_shared += s->dedup_shared;
+		sum->dedup_indexed += s->dedup_indexed;
+		sum->prefetch_blocks += s->prefetch_blocks;
+		sum->pack_runs += s->pack_runs;
+		sum->pack_moves += s->pack_moves;
+		sum->pack_unpacks += s->pack_unpacks;
+	}
+	pthread_mutex_unlock(&stats_lock);
+}
+
+char *stats_render(size_t *len) {
+	struct tfs_stats sum;
+	char *text = NULL;
+	FILE *out = open_memstream(&text, len);
+	if (out == NULL)
+		return NULL;
+	stats_sum(&sum);
+
+	fprintf(out, "%-12s %12s %8s %14s %10s\n", "op", "calls", "errors", "total_us", "avg_us");
+	for (int i = 1; i < NUM_OPS; i++) {
+		struct op_stats *o = &sum.op[i];
+		fprintf(out, "%-12s %12lu %8lu %14lu %10.2f\n", op_names[i], o->calls, o->errors,
+			o->total_ns / 1000, o->calls ? o->total_ns / 1000.0 / o->calls : 0.0);
+	}
+
+	// one line per op, "n:count" means count calls took [2^(n-1), 2^n) ns
+	fprintf(out, "\nlatency histogram (log2 ns)\n");
+	for (int i = 1; i < NUM_OPS; i++) {
+		if (sum.op[i].calls == 0)
+			continue;
+		fprintf(out, "%-12s", op_names[i]);
+		for (int b = 0; b < STATS_BUCKETS; b++) {
+			if (sum.op[i].hist[b])
+				fprintf(out, " %d:%lu", b, sum.op[i].hist[b]);
+		}
+		fprintf(out, "\n");
+	}
+
+	fprintf(out, "\nblock layer, allocators, compression, log, dedup, prefetch and packing\n");
+	fprintf(out, "%-16s %lu\n", "blk_reads", sum.blk_reads);
+	fprintf(out, "%-16s %lu\n", "blk_writes", sum.blk_writes);
+	fprintf(out, "%-16s %lu\n", "bytes_read", sum.bytes_read);
+	fprintf(out, "%-16s %lu\n", "bytes_written", sum.bytes_written);
+	fprintf(out, "%-16s %lu\n", "ialloc_calls", sum.ialloc_calls);
+	fprintf(out, "%-16s %lu\n", "ialloc_scan", sum.ialloc_scan);
+	fprintf(out, "%-16s %lu\n", "dalloc_calls", sum.dalloc_calls);
+	fprintf(out, "%-16s %lu\n", "dalloc_scan", sum.dalloc_scan);
+	fprintf(out, "%-16s %lu\n", "cluster_packs", sum.cluster_packs);
+	fprintf(out, "%-16s %lu\n", "cluster_raw", sum.cluster_raw);
+	fprintf(out, "%-16s %lu\n", "cluster_reads", sum.cluster_reads);
+	fprintf(out, "%-16s %lu\n", "cluster_expands", sum.cluster_expands);
+	fprintf(out, "%-16s %lu\n", "log_segments", sum.log_segments);
+	fprintf(out, "%-16s %lu\n", "log_blocks", sum.log_blocks);
+	fprintf(out, "%-16s %lu\n", "checkpoints", sum.checkpoints);
+	fprintf(out, "%-16s %lu\n", "checkpoint_blocks", sum.checkpoint_blocks);
+	fprintf(out, "%-16s %lu\n", "dedup_shared", sum.dedup_shared);
+	fprintf(out, "%-16s %lu\n", "dedup_indexed", sum.dedup_indexed);
+	fprintf(out, "%-16s %lu\n", "prefetch_blocks", sum.prefetch_blocks);
+	fprintf(out, "%-16s %lu\n", "pack_runs", sum.pack_runs);
+	fprintf(out, "%-16s %lu\n", "pack_moves", sum.pack_moves);
+	fprintf(out, "%-16s %lu\n", "pack_unpacks", sum.pack_unpacks);
+
+	fclose(out);
+	return text;
+}
@@ -0,0 +1,114 @@
+/*
+ *  Copyright (C) 2020 CS416 Rutgers CS
+ *	Tiny File System
+ *	File:	stats.h
+ *
+ */
+
+#ifndef _STATS_H
+#define _STATS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* name of the synthetic read-only statistics file in the mount root */
+#define STATS_NAME "/.tfs_stats"
+
+/* FUSE operations that are counted and timed */
+enum tfs_op {
+	OP_NONE = 0,
+	OP_GETATTR,
+	OP_READDIR,
+	OP_OPENDIR,
+	OP_RELEASEDIR,
+	OP_MKDIR,
+	OP_RMDIR,
+	OP_CREATE,
+	OP_OPEN,
+	OP_READ,
+	OP_WRITE,
+	OP_UNLINK,
+	OP_TRUNCATE,
+	OP_FLUSH,
+	OP_UTIMENS,
+	OP_RELEASE,
+	OP_STATFS,
+	OP_CHMOD,
+	OP_RENAME,
+	OP_LINK,
+	OP_FSYNC,
+	NUM_OPS
+};
+
+/* latency histogram bucket n holds calls that took [2^(n-1), 2^n) ns */
+#define STATS_BUCKETS 40
+
+struct op_stats {
+	uint64_t	calls;
+	uint64_t	errors;
+	uint64_t	total_ns;
+	uint64_t	hist[STATS_BUCKETS];
+};
+
+struct tfs_stats {
+	struct op_stats	op[NUM_OPS];
+	uint64_t	blk_reads;			/* bio_read() calls */
+	uint64_t	blk_writes;			/* bio_write() calls */
+	uint64_t	bytes_read;
+	uint64_t	bytes_written;
+	uint64_t	ialloc_calls;		/* get_avail_ino() calls */
+	uint64_t	ialloc_scan;		/* inode bitmap bits probed */
+	uint64_t	dalloc_calls;		/* get_avail_blkno() calls */
+	uint64_t	dalloc_scan;		/* data bitmap bits probed */
+	uint64_t	cluster_packs;		/* clusters compressed at release */
+	uint64_t	cluster_raw;		/* clusters left raw, they did not compress */
+	uint64_t	cluster_reads;		/* compressed clusters decompressed */
+	uint64_t	cluster_expands;	/* compressed clusters turned raw for a write */
+	uint64_t	log_segments;		/* log segments written */
+	uint64_t	log_blocks;			/* blocks those segments carried */
+	uint64_t	checkpoints;		/* times the log was written home and emptied */
+	uint64_t	checkpoint_blocks;	/* blocks written home by them */
+	uint64_t	dedup_shared;		/* written blocks shared with one already on disk */
+	uint64_t	dedup_indexed;		/* written blocks added to the dedup index */
+	uint64_t	prefetch_blocks;	/* blocks the mount-time prefetch asked the host to read */
+	uint64_t	pack_runs;			/* fragment block runs given to packed files */
+	uint64_t	pack_moves;			/* packed files moved to a larger run */
+	uint64_t	pack_unpacks;		/* packed files moved to a block of their own */
+	struct tfs_stats *next;			/* registry of all threads' counters */
+};
+
+/*
+ * Counters are kept per thread and only summed when the stats file is read,
+ * so the hot path never takes a lock or an atomic.
+ */
+extern __thread struct tfs_stats *my_stats;
+struct tfs_stats *stats_register();
+
+static inline struct tfs_stats *stats_self() {
+	if (my_stats == NULL)
+		my_stats = stats_register();
+	return my_stats;
+}
+
+uint64_t stats_begin(enum tfs_op op);
+void stats_end(enum tfs_op op, uint64_t start, int ret);
+
+void stats_blk_read(size_t bytes);
+void stats_blk_write(size_t bytes);
+void stats_alloc_ino(int scanned);
+void stats_alloc_blk(int scanned);
+void stats_cluster_pack(int packed);
+void stats_cluster_read();
+void stats_cluster_expand();
+void stats_log_segment(int blocks);
+void stats_checkpoint(int blocks);
+void stats_dedup(int shared);
+void stats_prefetch(int blocks);
+void stats_pack_run(int moved);
+void stats_pack_unpack();
+
+/* render the summed counters as text, returns a malloc'd buffer */
+char *stats_render(size_t *len);
+const char *stats_op_name(enum tfs_op op);
+
+#endif
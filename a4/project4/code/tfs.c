@@ -3,18 +3,20 @@
  *	Tiny File System
  *	File:	tfs.c
  *
+ *	The file system behind libtfs.h, with no FUSE in it; tfs_fuse.c
+ *	mounts it through FUSE.
  */
 
 
-#define FUSE_USE_VERSION 26
+#define _GNU_SOURCE
 
-#include <fuse.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <errno.h>
 #include <sys/time.h>
 #include <libgen.h>
@@ -22,825 +24,2119 @@
 
 #include "block.h"
 #include "tfs.h"
+#include "stats.h"
+#include "trace.h"
+#include "defrag.h"
+#include "clone.h"
+#include "compress.h"
+#include "log.h"
+#include "ram.h"
+#include "scratch.h"
+#include "dedup.h"
+#include "prefetch.h"
+#include "optrace.h"
+#include "frag.h"
+#include "libtfs.h"
 
-#define INODE_SIZE sizeof(struct inode)
-#define NUM_INODES BLOCK_SIZE/INODE_SIZE
-#define NUM_IBLKS MAX_INUM/NUM_INODES
-
-#define DIRENT_SIZE sizeof(struct dirent)
-#define NUM_DIRENTS (BLOCK_SIZE/DIRENT_SIZE)
 #define ROOT "/"
 #define CUR_DIR "."
 #define PAR_DIR ".."
 
-char diskfile_path[PATH_MAX];
+// Times the control files report, fixed so their cached attributes stay valid
+static time_t mount_time;
+
+/*
+ * An open file. A control file has no inode, and carries the text it
+ * rendered at open if it was opened for reading.
+ */
+struct tfs_file {
+	uint32_t	id;					/* names the file in the op trace */
+	uint16_t	ino;
+	int			flags;
+	const char*	ctl;				/* STATS_NAME, DEFRAG_NAME, CLONE_NAME, SNAPSHOT_NAME or NULL */
+	char*		text;
+	size_t		len;
+	struct dirty_clusters* dirty;	/* clusters to compress at close */
+};
+
+// Owner of what this thread creates, set by tfs_set_cred()
+static __thread int cred_set;
+static __thread uid_t cred_uid;
+static __thread gid_t cred_gid;
 
 // Declare your in-memory data structures here
 
 struct superblock* superblock;
+pthread_rwlock_t fs_lock;
+
+// Free inodes and data blocks per group, the table in the in-memory block 0
+struct group_desc* groups;
+// Guards a group's bitmaps, counts and reference table, and where its next block run is looked for
+static pthread_mutex_t* group_locks;
+static uint32_t* d_rotor;
+// Held from changing block 0 in memory to writing it, so a write never leaves out a change another group made first
+static pthread_mutex_t sb_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Blocks a thread reserves in a group at a time
+#define WINDOW_BLKS 64
+// A thread's reserved blocks per group: next block in the low 32 bits, end in the high 32
+struct alloc_windows {
+	uint64_t*	span;
+	struct alloc_windows* next;
+};
+static struct alloc_windows* all_windows;
+static pthread_mutex_t windows_lock = PTHREAD_MUTEX_INITIALIZER;
+// a new mount or an unmount starts a new generation, whose windows every thread registers afresh
+static int windows_gen;
+static __thread struct alloc_windows* my_windows;
+static __thread int my_windows_gen = -1;
+// gives a thread's windows back when it exits
+static pthread_key_t windows_key;
+static pthread_once_t windows_once = PTHREAD_ONCE_INIT;
+// Inode table blocks are read, changed and written back one inode at a time, under the lock their number hashes to
+#define ITABLE_LOCKS 64
+static pthread_mutex_t itable_locks[ITABLE_LOCKS] = { [0 ... ITABLE_LOCKS - 1] = PTHREAD_MUTEX_INITIALIZER };
+// A namespace change holds the locks of the directories whose entries it changes and of the inodes whose links it counts,
+// a write or a compression at release its file's, striped by inode number. A read holds its file's shared.
+#define INODE_LOCKS 64
+static pthread_rwlock_t inode_locks[INODE_LOCKS] = { [0 ... INODE_LOCKS - 1] = PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP };
+// Reference counts of shared data blocks per group, NULL for a group without a table
+static uint8_t** refs;
+static char* refs_dirty;
 
-// static long i_calls;
-// static long d_calls;
 static void getNames(const char* path, char* dirName, char* baseName)
 {
-	char* temp = calloc(1,strlen(path)+1);
-	strcpy(temp,path);
-	strcpy(dirName,dirname(temp));
-	strcpy(baseName,__xpg_basename((char*)path));
+	// both may write to the path they are given
+	strcpy(dirName,dirname(scratch_strdup(path)));
+	strcpy(baseName,__xpg_basename(scratch_strdup(path)));
 }
+
 /* 
- * Get available inode number from bitmap
+ * A new inode belongs to the process that created it
  */
-int get_avail_ino() {
-	char i_bitmap_string[BLOCK_SIZE];
-	bitmap_t i_bitmap = (bitmap_t)i_bitmap_string;
+void tfs_set_cred(uid_t uid, gid_t gid)
+{
+	cred_uid = uid;
+	cred_gid = gid;
+	cred_set = 1;
+}
 
-	bio_read(superblock->i_bitmap_blk,i_bitmap);
+static void set_owner(struct inode* inode)
+{
+	inode->uid = cred_set ? cred_uid : geteuid();
+	inode->gid = cred_set ? cred_gid : getegid();
+}
 
-	int i_num = 2;
-	while(get_bitmap(i_bitmap,i_num))
-		i_num++;
+/* 
+ * The control file at path, which has no inode, or NULL
+ */
+static const char* ctl_name(const char* path)
+{
+	if(strcmp(path,STATS_NAME) == 0)
+		return STATS_NAME;
+	if(strcmp(path,DEFRAG_NAME) == 0)
+		return DEFRAG_NAME;
+	if(strcmp(path,CLONE_NAME) == 0)
+		return CLONE_NAME;
+	if(strcmp(path,SNAPSHOT_NAME) == 0)
+		return SNAPSHOT_NAME;
+	return NULL;
+}
 
-	set_bitmap(i_bitmap, i_num);
-	bio_write(superblock->i_bitmap_blk, i_bitmap);
-	
-	// i_calls++;
-	// printf("iBlocks: %ld\n", i_calls);
-	return i_num;
+static int ctl_file(const char* path)
+{
+	return ctl_name(path) != NULL;
+}
+/* 
+ * Pick a group for a new directory: the one with the most free blocks among
+ * those with at least the average number of free inodes, which spreads
+ * directories, and the files that follow them, over the disk
+ */
+static int find_group_dir() {
+	uint32_t total = 0;
+	for (int g = 0; g < superblock->n_groups; g++)
+		total += groups[g].free_inodes;
+	uint32_t avg = total / superblock->n_groups;
+	int best = -1;
+	for (int g = 0; g < superblock->n_groups; g++)
+	{
+		if (groups[g].free_inodes == 0 || groups[g].free_inodes < avg)
+			continue;
+		if (best < 0 || groups[g].free_blocks > groups[best].free_blocks)
+			best = g;
+	}
+	return best < 0 ? 0 : best;
+}
+
+/* 
+ * Zero group g's inode table blocks from its watermark up to blk and raise
+ * the watermark past them, with the group locked
+ */
+static void init_itable(int g, uint32_t blk) {
+	char* zero = blk_alloc();
+	memset(zero, 0, BLOCK_SIZE);
+	for(uint32_t b = groups[g].itable_init; b <= blk; b++)
+		bio_write(grp_i_start(superblock, g) + b, zero);
+	blk_free(zero);
+	pthread_mutex_lock(&sb_lock);
+	groups[g].itable_init = blk + 1;
+	bio_write(0, superblock);
+	pthread_mutex_unlock(&sb_lock);
+}
+
+/* 
+ * Get available inode number from bitmap. A file goes in its parent's group,
+ * a directory in the group find_group_dir() picks, and either spills over
+ * into the groups after it.
+ */
+int get_avail_ino(uint16_t parent, int is_dir) {
+	char i_bitmap_string[BLOCK_SIZE];
+	bitmap_t i_bitmap = (bitmap_t)i_bitmap_string;
+	int goal = is_dir ? find_group_dir() : ino_group(superblock, parent);
+	int scanned = 0;
+
+	for (int i = 0; i < superblock->n_groups; i++)
+	{
+		int g = (goal + i) % superblock->n_groups;
+		if (groups[g].free_inodes == 0)
+			continue;
+		pthread_mutex_lock(&group_locks[g]);
+		bio_read(grp_i_bitmap(superblock, g),i_bitmap);
+		// inodes below ROOT_INO are reserved
+		int bit = g == 0 ? ROOT_INO : 0;
+		while(bit < superblock->inodes_per_group && get_bitmap(i_bitmap,bit))
+			bit++;
+		scanned += bit;
+		if(bit == superblock->inodes_per_group)
+		{
+			pthread_mutex_unlock(&group_locks[g]);
+			continue;
+		}
+		set_bitmap(i_bitmap, bit);
+		bio_write(grp_i_bitmap(superblock, g), i_bitmap);
+		groups[g].free_inodes--;
+		if(bit / NUM_INODES >= groups[g].itable_init)
+			init_itable(g, bit / NUM_INODES);
+		pthread_mutex_unlock(&group_locks[g]);
+		__atomic_fetch_sub(&superblock->free_inodes, 1, __ATOMIC_RELAXED);
+		stats_alloc_ino(scanned);
+		return g * superblock->inodes_per_group + bit;
+	}
+	stats_alloc_ino(scanned);
+	return -1;
 }
 
 /* 
- * Get available data block number from bitmap
+ * Reserve a run of up to WINDOW_BLKS free blocks in group g, scanning its
+ * bitmap from where the last reservation ended. Returns the run's first
+ * bit and its length in *len, or -1 if the group is full.
  */
-int get_avail_blkno() {
-	// Step 1: Read data block bitmap from disk
+static int reserve_run(uint32_t g, uint32_t *len, int *scanned) {
 	char d_bitmap_string[BLOCK_SIZE];
 	bitmap_t d_bitmap = (bitmap_t)d_bitmap_string;
-	bio_read(superblock->d_bitmap_blk,d_bitmap);
-	// Step 2: Traverse data block bitmap to find an available slot
-	int d_num = 1;
-	while(get_bitmap(d_bitmap,d_num))
-		d_num++;
-	// Step 3: Update data block bitmap and write to disk 
-	set_bitmap(d_bitmap, d_num);
-	bio_write(superblock->d_bitmap_blk, d_bitmap);
-	
-	// d_calls++;
-	// printf("dBlocks: %ld\n", d_calls); 
-	return d_num;
+	uint32_t bpg = superblock->blocks_per_group;
+	pthread_mutex_lock(&group_locks[g]);
+	if (groups[g].free_blocks == 0)
+	{
+		pthread_mutex_unlock(&group_locks[g]);
+		return -1;
+	}
+	bio_read(grp_d_bitmap(superblock, g), d_bitmap);
+	uint32_t bit = d_rotor[g], n = 0;
+	for (; n < bpg && get_bitmap(d_bitmap, bit); n++)
+		bit = bit + 1 == bpg ? 0 : bit + 1;
+	*scanned += n;
+	if (n == bpg)
+	{
+		pthread_mutex_unlock(&group_locks[g]);
+		return -1;
+	}
+	for (*len = 0; *len < WINDOW_BLKS && bit + *len < bpg && !get_bitmap(d_bitmap, bit + *len); (*len)++)
+		set_bitmap(d_bitmap, bit + *len);
+	bio_write(grp_d_bitmap(superblock, g), d_bitmap);
+	groups[g].free_blocks -= *len;
+	d_rotor[g] = bit + *len == bpg ? 0 : bit + *len;
+	pthread_mutex_unlock(&group_locks[g]);
+	__atomic_fetch_sub(&superblock->free_blocks, *len, __ATOMIC_RELAXED);
+	return bit;
+}
+
+/* 
+ * Take the next block of a window, the owning thread and a drain may race
+ */
+static int window_take(uint64_t* span) {
+	uint64_t old = __atomic_load_n(span, __ATOMIC_RELAXED);
+	for (;;)
+	{
+		uint32_t next = (uint32_t)old, end = old >> 32;
+		if (next >= end)
+			return -1;
+		uint64_t new = (uint64_t)end << 32 | (next + 1);
+		if (__atomic_compare_exchange_n(span, &old, new, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+			return next;
+	}
+}
+
+/* 
+ * Empty a window and give the blocks it still holds back to the bitmap
+ */
+static void window_release(uint64_t* span) {
+	uint64_t old = __atomic_exchange_n(span, 0, __ATOMIC_ACQ_REL);
+	uint32_t next = (uint32_t)old, end = old >> 32;
+	if (next >= end)
+		return;
+	int blks[WINDOW_BLKS];
+	for (uint32_t b = next; b < end; b++)
+		blks[b - next] = b;
+	free_blk_list(blks, end - next);
+}
+
+/* 
+ * Give back the reserved blocks of a thread that exits, so a FUSE worker
+ * that comes and goes leaves none behind. Windows of an earlier generation
+ * were given back and freed at unmount.
+ */
+static void windows_exit(void* arg) {
+	struct alloc_windows* w = arg;
+	pthread_mutex_lock(&windows_lock);
+	if (my_windows_gen == windows_gen)
+	{
+		for (int g = 0; g < superblock->n_groups; g++)
+			window_release(&w->span[g]);
+		struct alloc_windows** p = &all_windows;
+		while (*p != w)
+			p = &(*p)->next;
+		*p = w->next;
+		free(w->span);
+		free(w);
+	}
+	pthread_mutex_unlock(&windows_lock);
+}
+
+static void windows_key_init() {
+	pthread_key_create(&windows_key, windows_exit);
+}
+
+/* 
+ * This thread's windows, one per group, registered so a drain, the
+ * unmount or the thread's exit can find them
+ */
+static uint64_t* windows_self() {
+	if (my_windows_gen != windows_gen)
+	{
+		pthread_once(&windows_once, windows_key_init);
+		struct alloc_windows* w = calloc(1, sizeof(struct alloc_windows));
+		w->span = calloc(superblock->n_groups, sizeof(uint64_t));
+		pthread_mutex_lock(&windows_lock);
+		w->next = all_windows;
+		all_windows = w;
+		my_windows_gen = windows_gen;
+		pthread_mutex_unlock(&windows_lock);
+		my_windows = w;
+		pthread_setspecific(windows_key, w);
+	}
+	return my_windows->span;
+}
+
+/* 
+ * Give back every thread's reserved blocks, when space runs out and at unmount
+ */
+static void windows_drain() {
+	pthread_mutex_lock(&windows_lock);
+	for (struct alloc_windows* w = all_windows; w != NULL; w = w->next)
+	{
+		for (int g = 0; g < superblock->n_groups; g++)
+			window_release(&w->span[g]);
+	}
+	pthread_mutex_unlock(&windows_lock);
+}
+
+/* 
+ * Get available data block number, returns the block number on disk. Blocks
+ * come from the owner inode's group first. Each thread reserves runs of
+ * WINDOW_BLKS blocks per group and hands them out without a lock or a
+ * bitmap write, so parallel writers neither contend nor interleave their
+ * blocks one at a time. When every group is full the other threads'
+ * windows are drained and the scan is tried once more.
+ */
+int get_avail_blkno(uint16_t owner) {
+	int goal = ino_group(superblock, owner);
+	uint64_t* span = windows_self();
+	int blk = window_take(&span[goal]);
+	if (blk >= 0)
+	{
+		stats_alloc_blk(0);
+		return blk;
+	}
+	int scanned = 0;
+	for (int pass = 0; pass < 2; pass++)
+	{
+		for (int i = 0; i < superblock->n_groups; i++)
+		{
+			int g = (goal + i) % superblock->n_groups;
+			// what is left of a window in another group goes first
+			if ((blk = window_take(&span[g])) >= 0)
+				break;
+			uint32_t len;
+			int bit = reserve_run(g, &len, &scanned);
+			if (bit < 0)
+				continue;
+			blk = grp_d_start(superblock, g) + bit;
+			if (len > 1)
+				__atomic_store_n(&span[g], (uint64_t)(blk + len) << 32 | (blk + 1), __ATOMIC_RELEASE);
+			break;
+		}
+		if (blk >= 0 || pass == 1)
+			break;
+		windows_drain();
+	}
+	stats_alloc_blk(scanned + 1);
+	return blk;
+}
+
+/* 
+ * Give an inode number back to the inode bitmap
+ */
+void free_ino(int ino) {
+	char i_bitmap[BLOCK_SIZE];
+	int g = ino_group(superblock, ino);
+	pthread_mutex_lock(&group_locks[g]);
+	bio_read(grp_i_bitmap(superblock, g), i_bitmap);
+	unset_bitmap((bitmap_t)i_bitmap, ino % superblock->inodes_per_group);
+	bio_write(grp_i_bitmap(superblock, g), i_bitmap);
+	groups[g].free_inodes++;
+	pthread_mutex_unlock(&group_locks[g]);
+	__atomic_fetch_add(&superblock->free_inodes, 1, __ATOMIC_RELAXED);
+}
+
+/* 
+ * Give a data block back to the data block bitmap
+ */
+void free_blkno(int blkno) {
+	free_blk_list(&blkno, 1);
+}
+
+/* 
+ * Give a list of data blocks back, each group's bitmap is written once per
+ * run of blocks in that group
+ */
+void free_blk_list(const int *blks, int n) {
+	char d_bitmap[BLOCK_SIZE];
+	int cur = -1;
+	uint32_t freed = 0;
+	for (int i = 0; i < n; i++)
+	{
+		int g = blk_group(superblock, blks[i]);
+		if (g != cur)
+		{
+			if (cur >= 0)
+			{
+				bio_write(grp_d_bitmap(superblock, cur), d_bitmap);
+				pthread_mutex_unlock(&group_locks[cur]);
+			}
+			cur = g;
+			pthread_mutex_lock(&group_locks[cur]);
+			bio_read(grp_d_bitmap(superblock, cur), d_bitmap);
+		}
+		// a block shared with a clone only loses an owner
+		if (blk_refs(blks[i]) > 0)
+		{
+			refs[g][blks[i] - grp_d_start(superblock, g)]--;
+			refs_dirty[g] = 1;
+			continue;
+		}
+		// out of the dedup index before the bitmap can hand it out again
+		dedup_forget(blks[i]);
+		unset_bitmap((bitmap_t)d_bitmap, blks[i] - grp_d_start(superblock, g));
+		groups[g].free_blocks++;
+		freed++;
+	}
+	if (cur >= 0)
+	{
+		bio_write(grp_d_bitmap(superblock, cur), d_bitmap);
+		pthread_mutex_unlock(&group_locks[cur]);
+	}
+	__atomic_fetch_add(&superblock->free_blocks, freed, __ATOMIC_RELAXED);
+	flush_refs();
+}
+
+/* 
+ * Mark n data blocks of group g, from bit on, in use in its bitmap
+ * d_bitmap and on disk, with group_locks[g] held
+ */
+static void claim_bits_locked(uint32_t g, char* d_bitmap, uint32_t bit, uint32_t n) {
+	for (uint32_t i = 0; i < n; i++)
+		set_bitmap((bitmap_t)d_bitmap, bit + i);
+	bio_write(grp_d_bitmap(superblock, g), d_bitmap);
+	groups[g].free_blocks -= n;
+}
+
+/* 
+ * Mark n data blocks of group g, from bit on, in use
+ */
+void claim_blk_run(uint32_t g, uint32_t bit, uint32_t n) {
+	char d_bitmap[BLOCK_SIZE];
+	pthread_mutex_lock(&group_locks[g]);
+	bio_read(grp_d_bitmap(superblock, g), d_bitmap);
+	claim_bits_locked(g, d_bitmap, bit, n);
+	pthread_mutex_unlock(&group_locks[g]);
+	__atomic_fetch_sub(&superblock->free_blocks, n, __ATOMIC_RELAXED);
+}
+
+/* 
+ * Claim the first run of n free data blocks in a group, returns its first
+ * block or -1 if no group has one. The run is claimed before the group's
+ * lock is let go, so no other thread can take it in between.
+ */
+int claim_free_run(uint32_t n) {
+	char d_bitmap[BLOCK_SIZE];
+	for (uint32_t g = 0; g < superblock->n_groups; g++)
+	{
+		if (groups[g].free_blocks < n)
+			continue;
+		pthread_mutex_lock(&group_locks[g]);
+		bio_read(grp_d_bitmap(superblock, g), d_bitmap);
+		uint32_t run = 0, bit = 0;
+		for (; bit < superblock->blocks_per_group && run < n; bit++)
+			run = get_bitmap((bitmap_t)d_bitmap, bit) ? 0 : run + 1;
+		if (run == n)
+			claim_bits_locked(g, d_bitmap, bit - n, n);
+		pthread_mutex_unlock(&group_locks[g]);
+		if (run == n)
+		{
+			__atomic_fetch_sub(&superblock->free_blocks, n, __ATOMIC_RELAXED);
+			return grp_d_start(superblock, g) + bit - n;
+		}
+	}
+	return -1;
+}
+
+/* 
+ * Claim the first free data block among the first limit of group g,
+ * returns the block or -1 if they are all in use
+ */
+int claim_blk_below(uint32_t g, uint32_t limit) {
+	char d_bitmap[BLOCK_SIZE];
+	if (limit > superblock->blocks_per_group)
+		limit = superblock->blocks_per_group;
+	pthread_mutex_lock(&group_locks[g]);
+	bio_read(grp_d_bitmap(superblock, g), d_bitmap);
+	uint32_t bit = 0;
+	while (bit < limit && get_bitmap((bitmap_t)d_bitmap, bit))
+		bit++;
+	if (bit == limit)
+	{
+		pthread_mutex_unlock(&group_locks[g]);
+		return -1;
+	}
+	set_bitmap((bitmap_t)d_bitmap, bit);
+	bio_write(grp_d_bitmap(superblock, g), d_bitmap);
+	groups[g].free_blocks--;
+	pthread_mutex_unlock(&group_locks[g]);
+	__atomic_fetch_sub(&superblock->free_blocks, 1, __ATOMIC_RELAXED);
+	return grp_d_start(superblock, g) + bit;
+}
+
+/* 
+ * Owners of a data block beyond the first
+ */
+int blk_refs(int blk) {
+	int g = blk_group(superblock, blk);
+	if (g < 0 || refs[g] == NULL || blk - grp_d_start(superblock, g) >= BLOCK_SIZE)
+		return 0;
+	return refs[g][blk - grp_d_start(superblock, g)];
+}
+
+/* 
+ * Count one more owner of a data block, returns -1 if the block cannot be
+ * shared and the caller has to copy it. The change is written by flush_refs().
+ */
+int share_blk(int blk) {
+	return share_blk_if(blk, NULL, NULL);
+}
+
+/* 
+ * share_blk(), but only if check, called with the block's group locked,
+ * says the block may still be shared
+ */
+int share_blk_if(int blk, int (*check)(int blk, void *arg), void *arg) {
+	int g = blk_group(superblock, blk);
+	if (g < 0 || blk - grp_d_start(superblock, g) >= BLOCK_SIZE)
+		return -1;
+	int table = -1;
+	if (refs[g] == NULL)
+	{
+		// the group's first shared block brings its table, in the group itself
+		table = get_avail_blkno(g * superblock->inodes_per_group);
+		if (table < 0)
+			return -1;
+	}
+	pthread_mutex_lock(&group_locks[g]);
+	if (refs[g] == NULL)
+	{
+		refs[g] = blk_alloc();
+		memset(refs[g], 0, BLOCK_SIZE);
+		bio_write(table, refs[g]);
+		pthread_mutex_lock(&sb_lock);
+		sb_ref_blks(superblock)[g] = table;
+		bio_write(0, superblock);
+		pthread_mutex_unlock(&sb_lock);
+		table = -1;
+	}
+	uint8_t* count = &refs[g][blk - grp_d_start(superblock, g)];
+	int ret = -1;
+	if (*count < MAX_REFS && (check == NULL || check(blk, arg)))
+	{
+		(*count)++;
+		refs_dirty[g] = 1;
+		ret = 0;
+	}
+	pthread_mutex_unlock(&group_locks[g]);
+	// another clone made the table first
+	if (table >= 0)
+		free_blkno(table);
+	return ret;
+}
+
+/* 
+ * Hold off every allocation, free and reference count change in the group
+ * of data block blk
+ */
+void lock_blk_group(int blk) {
+	pthread_mutex_lock(&group_locks[blk_group(superblock, blk)]);
+}
+
+void unlock_blk_group(int blk) {
+	pthread_mutex_unlock(&group_locks[blk_group(superblock, blk)]);
+}
+
+/* 
+ * Write back the reference tables changed since the last flush
+ */
+void flush_refs() {
+	for (int g = 0; g < superblock->n_groups; g++)
+	{
+		if (!refs_dirty[g])
+			continue;
+		pthread_mutex_lock(&group_locks[g]);
+		if (refs_dirty[g])
+			bio_write(sb_ref_blks(superblock)[g], refs[g]);
+		refs_dirty[g] = 0;
+		pthread_mutex_unlock(&group_locks[g]);
+	}
+}
+
+/* 
+ * Write block 0 with the changes made to it in memory
+ */
+void write_sb() {
+	pthread_mutex_lock(&sb_lock);
+	bio_write(0, superblock);
+	pthread_mutex_unlock(&sb_lock);
+}
+
+/* 
+ * Read the reference tables of the groups that have one
+ */
+static void load_refs() {
+	refs = calloc(superblock->n_groups, sizeof(uint8_t*));
+	refs_dirty = calloc(superblock->n_groups, 1);
+	for (int g = 0; g < superblock->n_groups; g++)
+	{
+		if (sb_ref_blks(superblock)[g] == 0)
+			continue;
+		refs[g] = blk_alloc();
+		bio_read(sb_ref_blks(superblock)[g], refs[g]);
+	}
+}
+
+/* 
+ * Take the free counts from block 0 if the image was unmounted cleanly,
+ * otherwise count each group's free inodes and blocks from its bitmaps.
+ * Either way the image is marked not clean until tfs_destroy().
+ */
+static void load_groups() {
+	char bitmap[BLOCK_SIZE];
+	groups = sb_groups(superblock);
+	if (superblock->state != TFS_CLEAN)
+	{
+		superblock->free_inodes = 0;
+		superblock->free_blocks = 0;
+		for (int g = 0; g < superblock->n_groups; g++)
+		{
+			groups[g].free_inodes = 0;
+			bio_read(grp_i_bitmap(superblock, g), bitmap);
+			for (int bit = g == 0 ? ROOT_INO : 0; bit < superblock->inodes_per_group; bit++)
+				groups[g].free_inodes += !get_bitmap((bitmap_t)bitmap, bit);
+			groups[g].free_blocks = 0;
+			bio_read(grp_d_bitmap(superblock, g), bitmap);
+			for (int bit = 0; bit < superblock->blocks_per_group; bit++)
+				groups[g].free_blocks += !get_bitmap((bitmap_t)bitmap, bit);
+			superblock->free_inodes += groups[g].free_inodes;
+			superblock->free_blocks += groups[g].free_blocks;
+		}
+	}
+	superblock->state = 0;
+	bio_write(0, superblock);
+	group_locks = malloc(superblock->n_groups * sizeof(pthread_mutex_t));
+	for (int g = 0; g < superblock->n_groups; g++)
+		pthread_mutex_init(&group_locks[g], NULL);
+	d_rotor = calloc(superblock->n_groups, sizeof(uint32_t));
+	windows_gen++;
+}
+
+/* 
+ * Give back the blocks the threads hold reserved and let go of the
+ * allocator state, before block 0 is written at unmount
+ */
+static void unload_groups() {
+	windows_drain();
+	pthread_mutex_lock(&windows_lock);
+	while (all_windows != NULL)
+	{
+		struct alloc_windows* w = all_windows;
+		all_windows = w->next;
+		free(w->span);
+		free(w);
+	}
+	windows_gen++;
+	pthread_mutex_unlock(&windows_lock);
+	for (int g = 0; g < superblock->n_groups; g++)
+		pthread_mutex_destroy(&group_locks[g]);
+	free(group_locks);
+	free(d_rotor);
+	group_locks = NULL;
+	d_rotor = NULL;
 }
 
 
 int readi(uint16_t ino, struct inode *inode) {
+	trace_ino(ino);
+	// Step 0: Past the watermark of its group no inode is valid, and the block is not read
+	if(!ino_initialized(superblock, ino))
+		return -1;
 	// Step 1: Get the inode's on-disk block number
-	struct inode* temp_blk = calloc(1,BLOCK_SIZE);
-	uint32_t blk_num = (ino*INODE_SIZE)/BLOCK_SIZE;
+	struct inode* temp_blk = blk_alloc();
+	uint32_t offset = ino_blk(superblock, ino);
 	// Step 2: Get offset of the inode in the inode on-disk block
-	uint32_t offset = (blk_num*BLOCK_SIZE) + superblock->i_start_blk;
-	int internal_off = ino - (NUM_INODES*blk_num);
+	int internal_off = ino_slot(superblock, ino);
 	// Step 3: Read the block from disk and then copy into inode structure
 	bio_read(offset,temp_blk);
-	if(!temp_blk[internal_off].valid)
-		return -1;
-	memcpy(inode,&temp_blk[internal_off],INODE_SIZE);
-	return 0;
+	int valid = temp_blk[internal_off].valid;
+	if(valid)
+		memcpy(inode,&temp_blk[internal_off],INODE_SIZE);
+	blk_free(temp_blk);
+	return valid ? 0 : -1;
 }
 
-
 int writei(uint16_t ino, struct inode *inode) {
+	trace_ino(ino);
 	// Step 1: Get the block number where this inode resides on disk
-	struct inode* temp_blk = calloc(1,BLOCK_SIZE);
-	uint32_t blk_num = (ino*INODE_SIZE)/BLOCK_SIZE;
+	struct inode* temp_blk = blk_alloc();
+	uint32_t offset = ino_blk(superblock, ino);
 	// Step 2: Get the offset in the block where this inode resides on disk
-	uint32_t offset = (blk_num*BLOCK_SIZE) + superblock->i_start_blk;
-	int int_offset = ino-(NUM_INODES*blk_num);
-	// Step 3: Write inode to disk 
+	int int_offset = ino_slot(superblock, ino);
+	// Step 3: Write inode to disk, the other inodes of the block may be written meanwhile
+	pthread_mutex_t* lock = &itable_locks[offset % ITABLE_LOCKS];
+	pthread_mutex_lock(lock);
 	bio_read(offset,temp_blk);
 	memcpy(&temp_blk[int_offset],inode,INODE_SIZE);
 	bio_write(offset,temp_blk);
+	pthread_mutex_unlock(lock);
+	blk_free(temp_blk);
 	return 0;
 }
 
+/* the lock stripes of the n inodes of inos, one bit each */
+static uint64_t inode_stripes(const uint16_t* inos, int n) {
+	uint64_t stripes = 0;
+	for(int i = 0; i < n; i++)
+		stripes |= 1ULL << (inos[i] % INODE_LOCKS);
+	return stripes;
+}
+
+/* 
+ * Lock the n inodes of inos, in stripe order so that two callers never wait
+ * on each other. An inode given twice, or two on one stripe, lock it once.
+ */
+void lock_inodes(const uint16_t* inos, int n) {
+	uint64_t stripes = inode_stripes(inos, n);
+	for(int s = 0; s < INODE_LOCKS; s++)
+		if(stripes & (1ULL << s))
+			pthread_rwlock_wrlock(&inode_locks[s]);
+}
+
+void unlock_inodes(const uint16_t* inos, int n) {
+	uint64_t stripes = inode_stripes(inos, n);
+	for(int s = 0; s < INODE_LOCKS; s++)
+		if(stripes & (1ULL << s))
+			pthread_rwlock_unlock(&inode_locks[s]);
+}
+
+void lock_inode(uint16_t ino) {
+	lock_inodes(&ino, 1);
+}
+
+void unlock_inode(uint16_t ino) {
+	unlock_inodes(&ino, 1);
+}
+
+/* 
+ * Hold off the writers of an inode, for a read that follows its pointers
+ */
+static void lock_inode_shared(uint16_t ino) {
+	pthread_rwlock_rdlock(&inode_locks[ino % INODE_LOCKS]);
+}
 
 /* 
  * directory operations
  */
 int dir_find(uint16_t ino, const char *fname, size_t name_len, struct dirent *dirent) {
-	struct dirent curr_dirent[NUM_DIRENTS];
-	memset(curr_dirent,0, BLOCK_SIZE);
+	char curr_block[BLOCK_SIZE];
 	struct inode curr_inode;
 	// Step 1: Call readi() to get the inode using ino (inode number of current directory)
 	if(readi(ino,&curr_inode) < 0)
 		return -1;
-	if(!curr_inode.valid)
+	if(!curr_inode.valid || !S_ISDIR(curr_inode.mode))
 		return -1;
 	// Step 2: Get data block of current directory from inode
-	for(int i = 0; i < 16; i++)
+	for(int i = 0; i < NUM_DIRECT; i++)
 	{
 		if(curr_inode.direct_ptr[i] != -1)
 		{
 			// Step 3: Read directory's data block and check each directory entry.
-			//If the name matches, then copy directory entry to dirent structure
-			bio_read(curr_inode.direct_ptr[i],curr_dirent);
-			for(int j = 0; j < NUM_DIRENTS; j++)
+			//If the name matches, then copy the entry's header to dirent structure
+			bio_read(curr_inode.direct_ptr[i],curr_block);
+			struct dirent* found = dirblk_find(curr_block, fname, name_len);
+			if(found != NULL)
 			{
-				if(curr_dirent[j].valid == 1)
-				{
-					if(strcmp(curr_dirent[j].name, fname) == 0)
-					{
-						memcpy(dirent, &curr_dirent[j], DIRENT_SIZE);
-						return 0;
-					}
-				}
+				memcpy(dirent, found, sizeof(struct dirent));
+				return 0;
 			}
 		}
 	}	
 	return -1;
 }
 
-int dir_add(struct inode dir_inode, uint16_t f_ino, const char *fname, size_t name_len) {
+/* 
+ * Add an entry to directory dir_ino, whose lock the caller holds. The
+ * directory's inode is read here, under the lock, so no older copy of it
+ * is written back.
+ */
+int dir_add(uint16_t dir_ino, uint16_t f_ino, const char *fname, size_t name_len, uint8_t file_type) {
+	struct inode dir_inode;
 	struct dirent entry;
-	if(dir_find(dir_inode.ino,fname,name_len,&entry) == 0)
+	if(name_len > MAX_NAME_LEN)
+		return -1;
+	if(readi(dir_ino,&dir_inode) < 0 || dir_find(dir_ino,fname,name_len,&entry) == 0)
 		return -1;
 
-	for(int i = 0; i < 16; i++)
+	char block[BLOCK_SIZE];
+	// Step 1: Look for room in the blocks the directory already has
+	for(int i = 0; i < NUM_DIRECT; i++)
 	{
 		if(dir_inode.direct_ptr[i] == -1)
+			continue;
+		bio_read(dir_inode.direct_ptr[i], block);
+		if(dirblk_add(block, f_ino, fname, name_len, file_type) != NULL)
 		{
-			dir_inode.direct_ptr[i] = get_avail_blkno()*BLOCK_SIZE + superblock->d_start_blk;
-			dir_inode.size += DIRENT_SIZE;
-			struct dirent* temp = calloc(1,BLOCK_SIZE);
-			bio_read(dir_inode.direct_ptr[i], temp);
-			memset(temp,0, BLOCK_SIZE);
-			temp[0].ino = f_ino;
-			temp[0].valid = 1;
-			memcpy(temp[0].name, fname, name_len);
-			bio_write(dir_inode.direct_ptr[i], temp);
+			bio_write(dir_inode.direct_ptr[i], block);
+			dir_inode.mtime = dir_inode.ctime = time(NULL);
 			writei(dir_inode.ino, &dir_inode);
 			return 0;
-		} 
-
-		struct dirent* entries = calloc(1,BLOCK_SIZE);
-		bio_read(dir_inode.direct_ptr[i], entries);
-		for(int j = 0; j < NUM_DIRENTS; j++)
-		{
-			if(entries[j].valid == 0)
-			{
-				dir_inode.size += DIRENT_SIZE;
-				entries[j].ino = f_ino;
-				entries[j].valid = 1;
-				memcpy(entries[j].name, fname, name_len);
-				bio_write(dir_inode.direct_ptr[i], entries);
-				return 0;
-			}
 		}
 	}
+	// Step 2: Otherwise start a new block
+	for(int i = 0; i < NUM_DIRECT; i++)
+	{
+		if(dir_inode.direct_ptr[i] != -1)
+			continue;
+		dir_inode.direct_ptr[i] = get_avail_blkno(dir_inode.ino);
+		if(dir_inode.direct_ptr[i] < 0)
+			return -1;
+		dir_inode.size += BLOCK_SIZE;
+		dirblk_init(block);
+		dirblk_add(block, f_ino, fname, name_len, file_type);
+		bio_write(dir_inode.direct_ptr[i], block);
+		dir_inode.mtime = dir_inode.ctime = time(NULL);
+		writei(dir_inode.ino, &dir_inode);
+		return 0;
+	}
 	return -1;
 }
 
 int dir_remove(struct inode* dir_inode, const char *fname, size_t name_len) {
 	// Step 1: Read dir_inode's data block and checks each directory entry of dir_inode
-	struct dirent entry;
-	// Step 2: Check if fname exist
-	if(dir_find(dir_inode->ino,fname,name_len,&entry) < 0)
-		return -1;
-	
-	// Step 3: If exist, then remove it from dir_inode's data block and write to disk
-	struct dirent* entries = calloc(1,BLOCK_SIZE);
-	bio_read(dir_inode->direct_ptr[0], entries);
-	for(int i = 0; i < NUM_DIRENTS; i++)
+	char block[BLOCK_SIZE];
+	for(int k = 0; k < NUM_DIRECT; k++)
 	{
-		if(entries[i].valid == 1)
+		if(dir_inode->direct_ptr[k] == -1)
+			continue;
+		bio_read(dir_inode->direct_ptr[k], block);
+		// Step 2: Check if fname exist
+		if(dirblk_remove(block, fname, name_len) < 0)
+			continue;
+		// Step 3: If exist, then remove it from dir_inode's data block and write to disk.
+		// The block is given back once its last entry is gone
+		if(!dirblk_empty(block))
+			bio_write(dir_inode->direct_ptr[k], block);
+		else
 		{
-			if(strcmp(entries[i].name, fname) == 0)
-			{
-				memset(&entries[i],0,DIRENT_SIZE);
-				dir_inode->size -= DIRENT_SIZE;
-				for(int j = 0; j < NUM_DIRENTS; j++)
-				{
-					if(entries[j].valid == 1)
-					{
-						bio_write(dir_inode->direct_ptr[0], entries);
-						return 0;
-					}
-				}
-				char d_bitmap[BLOCK_SIZE];
-				int blk_num = (dir_inode->direct_ptr[0]- superblock->d_start_blk)/BLOCK_SIZE;
-				bio_read(superblock->d_bitmap_blk, (bitmap_t)d_bitmap);
-				unset_bitmap((bitmap_t)d_bitmap, blk_num);
-				bio_write(superblock->d_bitmap_blk, (bitmap_t)d_bitmap);
-
-				dir_inode->direct_ptr[0] = -1;
-				writei(dir_inode->ino,dir_inode);
-				return 0;
-			}
+			free_blkno(dir_inode->direct_ptr[k]);
+			dir_inode->direct_ptr[k] = -1;
+			dir_inode->size -= BLOCK_SIZE;
 		}
+		dir_inode->mtime = dir_inode->ctime = time(NULL);
+		writei(dir_inode->ino,dir_inode);
+		return 0;
 	}
 	return -1;
 }
 
 /* 
- * namei operation
+ * Point the existing entry fname of a directory at another inode. The entry
+ * is rewritten where it is, so the name is never missing from the directory.
  */
-int get_node_by_path(const char *path, uint16_t ino, struct inode *inode) {
-	
-	// Step 1: Resolve the path name, walk through path, and finally, find its inode.
-	// Note: You could either implement it in a iterative way or recursive way
-	struct dirent curr_dir;
-	int path_size = strlen(path)+1;
-	char* temp_path = calloc(1,path_size);
+int dir_replace(struct inode* dir_inode, const char *fname, size_t name_len, uint16_t f_ino, uint8_t file_type) {
+	char block[BLOCK_SIZE];
+	for(int k = 0; k < NUM_DIRECT; k++)
+	{
+		if(dir_inode->direct_ptr[k] == -1)
+			continue;
+		bio_read(dir_inode->direct_ptr[k], block);
+		struct dirent* found = dirblk_find(block, fname, name_len);
+		if(found == NULL)
+			continue;
+		found->ino = f_ino;
+		found->file_type = file_type;
+		bio_write(dir_inode->direct_ptr[k], block);
+		dir_inode->mtime = dir_inode->ctime = time(NULL);
+		writei(dir_inode->ino,dir_inode);
+		return 0;
+	}
+	return -1;
+}
 
-    memcpy(temp_path, path, path_size);
+/* 
+ * Give block idx of a file, shared with a clone as blk, a block of its own,
+ * with blk's contents if copy is set. Returns the new block, or -1 when the
+ * disk is full.
+ */
+static int unshare_file_blk(struct inode *inode, int idx, int blk, int copy) {
+	char buf[BLOCK_SIZE];
+	int new_blk = get_avail_blkno(inode->ino);
+	if(new_blk < 0)
+		return -1;
+	if(copy)
+	{
+		bio_read(blk, buf);
+		bio_write(new_blk, buf);
+	}
+	set_file_blk(inode, idx, new_blk);
+	free_blk_list(&blk, 1);
+	return new_blk;
+}
 
-	if(strcmp(path,"/") == 0) 
+/* 
+ * Point block idx of a file at blk, allocating the indirect page that holds
+ * it if there is none. Returns -1 past the largest file or when the disk is full.
+ */
+int set_file_blk(struct inode *inode, int idx, int blk) {
+	if(idx < NUM_DIRECT)
 	{
-		if(readi(ino, inode) < 0)
-			return -1;
+		inode->direct_ptr[idx] = blk;
 		return 0;
 	}
-	
-	char* fname = strtok(temp_path,"/");
-	if(dir_find(ino,fname,strlen(fname),&curr_dir) < 0)
+	int indirect_page[PTRS_PER_BLK];
+	int j = (idx - NUM_DIRECT) / PTRS_PER_BLK;
+	if(j >= NUM_INDIRECT)
 		return -1;
-	else 
+	if(inode->indirect_ptr[j] == -1)
 	{
-		if(readi(curr_dir.ino, inode) < 0)
+		int page_blk = get_avail_blkno(inode->ino);
+		if(page_blk < 0)
 			return -1;
+		memset(indirect_page, 0, BLOCK_SIZE);
+		inode->indirect_ptr[j] = page_blk;
 	}
+	else
+		bio_read(inode->indirect_ptr[j], indirect_page);
+	indirect_page[(idx - NUM_DIRECT) % PTRS_PER_BLK] = blk;
+	bio_write(inode->indirect_ptr[j], indirect_page);
+	return 0;
+}
 
-	while(fname != NULL)
+/* 
+ * Map block idx of a file to its block on disk. With alloc set, a missing
+ * data block (and the indirect page that holds it) is allocated. Returns -1
+ * for a hole, or when the disk is full.
+ */
+int get_file_blk(struct inode *inode, int idx, int alloc) {
+	if(idx < NUM_DIRECT)
 	{
-		fname = strtok(NULL,"/");
-		if(fname == NULL)
-			return 0;
-		if(dir_find(inode->ino,fname,strlen(fname),&curr_dir) < 0)
+		if(inode->direct_ptr[idx] == -1 && alloc)
+			inode->direct_ptr[idx] = get_avail_blkno(inode->ino);
+		return inode->direct_ptr[idx];
+	}
+	idx -= NUM_DIRECT;
+	int j = idx / PTRS_PER_BLK;
+	int k = idx % PTRS_PER_BLK;
+	if(j >= NUM_INDIRECT)
+		return -1;
+	int indirect_page[PTRS_PER_BLK];
+	if(inode->indirect_ptr[j] == -1)
+	{
+		if(!alloc)
 			return -1;
-		else 
-		{
-			if(readi(curr_dir.ino, inode) < 0)
-				return -1;
-		}
+		int blk = get_avail_blkno(inode->ino);
+		if(blk < 0)
+			return -1;
+		memset(indirect_page, 0, BLOCK_SIZE);
+		bio_write(blk, indirect_page);
+		inode->indirect_ptr[j] = blk;
 	}
-	return -1;
+	else
+		bio_read(inode->indirect_ptr[j], indirect_page);
+	if(indirect_page[k] == 0)
+	{
+		if(!alloc)
+			return -1;
+		int blk = get_avail_blkno(inode->ino);
+		if(blk < 0)
+			return -1;
+		indirect_page[k] = blk;
+		bio_write(inode->indirect_ptr[j], indirect_page);
+	}
+	return indirect_page[k];
+}
+
+/* 
+ * namei operation
+ */
+int get_node_by_path(const char *path, uint16_t ino, struct inode *inode) {
+	
+	// Step 1: Resolve the path name, walk through path, and finally, find its inode.
+	// A path of slashes only names the starting directory. Returns -ENOENT for
+	// a missing name and -ENOTDIR when a name before the last is no directory.
+	struct dirent curr_dir;
+	char* temp_path = scratch_strdup(path);
+	char* save = NULL;
+	if(readi(ino, inode) < 0)
+		return -ENOENT;
+	for(char* fname = strtok_r(temp_path,"/",&save); fname != NULL; fname = strtok_r(NULL,"/",&save))
+	{
+		// Step 2: Only a directory's blocks hold entries to look the next name up in
+		if(!S_ISDIR(inode->mode))
+			return -ENOTDIR;
+		if(dir_find(inode->ino,fname,strlen(fname),&curr_dir) < 0 || readi(curr_dir.ino, inode) < 0)
+			return -ENOENT;
+	}
+	return 0;
 }
 
 /* 
  * Make file system
  */
-int tfs_mkfs() {
+int tfs_mkfs(const char *diskfile_path) {
 	// Call dev_init() to initialize (Create) Diskfile
-	dev_init(diskfile_path);
-	// write superblock information
-	superblock = calloc(1,sizeof(superblock));
-	superblock->magic_num = MAGIC_NUM;
-	superblock->max_inum = MAX_INUM;
-	superblock->max_dnum = MAX_DNUM;
-	superblock->i_bitmap_blk = BLOCK_SIZE;
-	superblock->d_bitmap_blk = superblock->i_bitmap_blk + BLOCK_SIZE;
-	superblock->i_start_blk = superblock->d_bitmap_blk + BLOCK_SIZE;
-	superblock->d_start_blk= superblock->i_start_blk + (MAX_INUM*INODE_SIZE);
-	bio_write(0,superblock);
-	// initialize inode bitmap
-	char i_bitmap_string[BLOCK_SIZE];
-	bitmap_t i_bitmap = (bitmap_t)i_bitmap_string;
-	memset(i_bitmap_string,0,BLOCK_SIZE);
-	set_bitmap(i_bitmap,2);
-	// initialize data block bitmap
+	dev_init(diskfile_path);
+	// write superblock information, the superblock owns a whole block so bio_write() stays in bounds
+	superblock = blk_alloc();
+	memset(superblock,0,BLOCK_SIZE);
+	tfs_layout(superblock, NUM_GROUPS, MAX_INUM/NUM_GROUPS, MAX_DNUM/NUM_GROUPS);
+	// initialize every group's inode and data block bitmaps
+	char bitmap_string[BLOCK_SIZE];
+	memset(bitmap_string,0,BLOCK_SIZE);
+	for(int g = 0; g < superblock->n_groups; g++)
+	{
+		bio_write(grp_i_bitmap(superblock, g),bitmap_string);
+		bio_write(grp_d_bitmap(superblock, g),bitmap_string);
+	}
+	// the inode tables stay as they are but for the block of the root and the
+	// reserved inodes, every other one is zeroed when its first inode is taken
+	bio_write(superblock->i_start_blk,bitmap_string);
+	sb_groups(superblock)[0].itable_init = 1;
 	struct inode root;
-	root.ino = 2;
-	root.valid = 1;
-	root.type = __S_IFDIR;
-	root.size = 0;
-	memset(root.direct_ptr,-1,sizeof(root.direct_ptr));
-	// update bitmap information for root directory
-	writei(2,&root);
+	init_inode(&root, ROOT_INO, __S_IFDIR | 0755);
 	// update inode for root directory
+	writei(ROOT_INO,&root);
+	// update bitmap information for root directory
+	bitmap_t i_bitmap = (bitmap_t)bitmap_string;
+	set_bitmap(i_bitmap,ROOT_INO);
 	bio_write(superblock->i_bitmap_blk,i_bitmap);
+	bio_write(0,superblock);
 	return 0;
 }
 
 /* 
- * FUSE file operations
+ * Mount and unmount
  */
-static void *tfs_init(struct fuse_conn_info *conn) {
+int tfs_mount(const char *diskfile_path) {
+
+	// Step 0: A waiting defrag pass must not starve behind a steady stream of readers
+	pthread_rwlockattr_t attr;
+	pthread_rwlockattr_init(&attr);
+	pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	pthread_rwlock_init(&fs_lock, &attr);
+	pthread_rwlockattr_destroy(&attr);
+	mount_time = time(NULL);
 
 	// Step 1a: If disk file is not found, call mkfs
 	if(dev_open(diskfile_path)<0)
-		tfs_mkfs();
+		tfs_mkfs(diskfile_path);
 	else
 	{
 		// Step 1b: If disk file is found, just initialize in-memory data structures
 		// and read superblock from disk
-		superblock = calloc(1,sizeof(struct superblock));
+		superblock = blk_alloc();
+		bio_read(0,superblock);
+		int bad = 1;
+		if(superblock->magic_num != MAGIC_NUM)
+			fprintf(stderr, "%s: bad magic number, not a tfs image\n", diskfile_path);
+		else if(superblock->version != TFS_VERSION)
+			fprintf(stderr, "%s: on-disk format version %u, this tfs reads version %d\n",
+				diskfile_path, superblock->version, TFS_VERSION);
+		else if(superblock->n_groups > MAX_GROUPS)
+			fprintf(stderr, "%s: %u groups, at most %lu fit in block 0\n",
+				diskfile_path, superblock->n_groups, MAX_GROUPS);
+		else
+			bad = 0;
+		if(bad)
+		{
+			blk_free(superblock);
+			superblock = NULL;
+			dev_close();
+			return -EINVAL;
+		}
+	}
+	// Step 1c: Replay what a crash left in the log, block 0 may be among it
+	if(log_mount(superblock) > 0)
 		bio_read(0,superblock);
+	int clean = superblock->state == TFS_CLEAN;
+	load_groups();
+	load_refs();
+	frag_mount();
+	compress_init();
+	dedup_mount(clean);
+	// a volume in memory has no use for the log
+	if(getenv(LOG_ENV) != NULL && !ram_active)
+		log_start();
+	ram_start();
+	// Step 1d: Have the metadata the first calls need read in behind the mount
+	prefetch_start();
+	// Step 2: Start the block I/O trace if it was asked for
+	char* trace_file = getenv(TRACE_ENV);
+	if(trace_file != NULL)
+	{
+		struct trace_hdr layout;
+		memset(&layout, 0, sizeof(layout));
+		layout.i_bitmap_blk = superblock->i_bitmap_blk;
+		layout.d_bitmap_blk = superblock->d_bitmap_blk;
+		layout.i_start_blk = superblock->i_start_blk;
+		layout.d_start_blk = superblock->d_start_blk;
+		layout.group_blks = superblock->group_blks;
+		trace_init(trace_file, &layout);
 	}
-	return NULL;
+	// Step 3: Record the calls made from here on if asked to
+	char* optrace_file = getenv(OPTRACE_ENV);
+	if(optrace_file != NULL)
+		optrace_init(optrace_file);
+	return 0;
 }
 
-static void tfs_destroy(void *userdata) {
-
-	// Step 1: De-allocate in-memory data structures
-	free(superblock);
+void tfs_unmount() {
+
+	// Step 1: Stop the prefetch, the defragmenter and the snapshots, then write the free counts back,
+	// mark the image clean and write what the log holds home
+	prefetch_stop();
+	defrag_shutdown();
+	ram_stop();
+	trace_dump();
+	optrace_close();
+	dedup_unmount();
+	frag_unmount();
+	unload_groups();
+	superblock->state = TFS_CLEAN;
+	bio_write(0,superblock);
+	log_shutdown();
+	// Step 2: De-allocate in-memory data structures
+	for(int g = 0; g < superblock->n_groups; g++)
+		blk_free(refs[g]);
+	free(refs);
+	free(refs_dirty);
+	refs=NULL;
+	refs_dirty=NULL;
+	blk_free(superblock);
 	superblock=NULL;
-	// Step 2: Close diskfile
+	groups=NULL;
+	// Step 3: Close diskfile
 	dev_close();
 
 }
 
-static int tfs_getattr(const char *path, struct stat *stbuf) {
+/* 
+ * Attributes of an inode as getattr and readdir report them
+ */
+static void inode_stat(const struct inode *inode, struct stat *stbuf) {
+	stbuf->st_ino = inode->ino;
+	stbuf->st_gid = inode->gid;
+	stbuf->st_uid = inode->uid;
+	stbuf->st_mode = inode->mode;
+	stbuf->st_nlink = inode->link;
+	stbuf->st_size = inode->size;
+	stbuf->st_atime = inode->atime;
+	stbuf->st_mtime = inode->mtime;
+	stbuf->st_ctime = inode->ctime;
+}
+
+static int do_getattr(const char *path, struct stat *stbuf) {
 
 	// Step 1: call get_node_by_path() to get inode from path
 	struct inode temp;
 	memset(stbuf,0,sizeof(struct stat));
 
-	if(get_node_by_path(path,2,&temp)<0)
-		return -ENOENT;
-	// Step 2: fill attribute of file into stbuf from inode
-	stbuf->st_gid=getgid();
-	stbuf->st_uid=getuid();
-	if(temp.type == __S_IFDIR)
+	// The stats file has no inode, its size is only known once rendered
+	if(strcmp(path,STATS_NAME) == 0)
 	{
-		stbuf->st_mode = __S_IFDIR | 0755;
-		stbuf->st_nlink=2;
+		stbuf->st_mode = __S_IFREG | 0444;
+		stbuf->st_nlink = 1;
+		stbuf->st_gid=getgid();
+		stbuf->st_uid=getuid();
+		stbuf->st_atime = stbuf->st_mtime = stbuf->st_ctime = mount_time;
+		return 0;
 	}
-	else
+	if(strcmp(path,DEFRAG_NAME) == 0 || strcmp(path,CLONE_NAME) == 0 || strcmp(path,SNAPSHOT_NAME) == 0)
 	{
 		stbuf->st_mode = __S_IFREG | 0644;
 		stbuf->st_nlink = 1;
+		stbuf->st_gid=getgid();
+		stbuf->st_uid=getuid();
+		stbuf->st_atime = stbuf->st_mtime = stbuf->st_ctime = mount_time;
+		return 0;
 	}
-	stbuf->st_size = temp.size;
-	time(&stbuf->st_mtime);
+	int ret = get_node_by_path(path,2,&temp);
+	if(ret < 0)
+		return ret;
+	// Step 2: fill attribute of file into stbuf from inode
+	inode_stat(&temp, stbuf);
 	return 0;
 }
 
-static int tfs_opendir(const char *path, struct fuse_file_info *fi) {
+static int do_opendir(const char *path) {
 
 	// Step 1: Call get_node_by_path() to get inode from path
 	struct inode temp;
-	if(get_node_by_path(path,2,&temp)<0)
-		return -ENOENT;
+	int ret = get_node_by_path(path,2,&temp);
+	if(ret < 0)
+		return ret;
 	// Step 2: If not find, return -1
+	if(!S_ISDIR(temp.mode))
+		return -ENOTDIR;
     return 0;
 }
 
-static int tfs_readdir(const char *path, void *buffer, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
+static int cmp_blk(const void *a, const void *b) {
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+	return x < y ? -1 : (x > y);
+}
+
+static int do_readdir(const char *path, tfs_filler_t filler, void *buffer) {
 
 	// Step 1: Call get_node_by_path() to get inode from path
 	struct inode temp;
-	struct dirent entries[NUM_DIRENTS];
-	if(get_node_by_path(path,2,&temp)<0)
-		return -ENOENT;
-	// Step 2: Read directory entries from its data blocks, and copy them to filler
+	struct stat st;
+	char name[MAX_NAME_LEN + 1];
+	int err = get_node_by_path(path,2,&temp);
+	if(err < 0)
+		return err;
+	if(!S_ISDIR(temp.mode))
+		return -ENOTDIR;
+	// Step 2: Read all of the directory's blocks
+	char* blocks = scratch_blks(NUM_DIRECT);
+	int n_blocks = 0, n_entries = 0;
+	for(int i = 0;i<NUM_DIRECT;i++)
+	{
+		if(temp.direct_ptr[i] == -1)
+			continue;
+		bio_read(temp.direct_ptr[i],blocks + n_blocks * BLOCK_SIZE);
+		n_blocks++;
+		n_entries += BLOCK_SIZE / DIRENT_LEN(0);
+	}
+	// Step 3: Read the inode table blocks the entries point into, each once,
+	// and in runs of adjacent blocks
+	uint32_t* iblks = scratch_alloc((n_entries ? n_entries : 1) * sizeof(uint32_t));
+	int n_iblks = 0;
+	for(int b = 0;b<n_blocks;b++)
+	{
+		struct dirent* d = (struct dirent*)(blocks + b * BLOCK_SIZE);
+		struct dirent* end = (struct dirent*)(blocks + (b + 1) * BLOCK_SIZE);
+		for(; d < end && !dirblk_bad(blocks + b * BLOCK_SIZE, d); d = NEXT_DIRENT(d))
+		{
+			if(d->ino != 0)
+				iblks[n_iblks++] = ino_blk(superblock, d->ino);
+		}
+	}
+	qsort(iblks, n_iblks, sizeof(uint32_t), cmp_blk);
+	int n_unique = 0;
+	for(int i = 0;i<n_iblks;i++)
+	{
+		if(n_unique == 0 || iblks[n_unique - 1] != iblks[i])
+			iblks[n_unique++] = iblks[i];
+	}
+	char* itable = scratch_blks(n_unique ? n_unique : 1);
+	for(int i = 0, run;i<n_unique;i += run)
+	{
+		for(run = 1; i + run < n_unique && iblks[i + run] == iblks[i] + run; run++)
+			;
+		bio_read_run(iblks[i], run, itable + i * BLOCK_SIZE);
+	}
+	// Step 4: Hand every entry to filler with its attributes
+	int ret = 0;
 	filler(buffer,CUR_DIR,NULL,0);
 	filler(buffer,PAR_DIR,NULL,0);
-	for(int i = 0;i<16;i++)
+	if(strcmp(path,ROOT) == 0)
+	{
+		filler(buffer,STATS_NAME+1,NULL,0);
+		filler(buffer,DEFRAG_NAME+1,NULL,0);
+		filler(buffer,CLONE_NAME+1,NULL,0);
+		filler(buffer,SNAPSHOT_NAME+1,NULL,0);
+	}
+	for(int b = 0;b<n_blocks && ret == 0;b++)
 	{
-		if(temp.direct_ptr[i] != -1)
+		struct dirent* d = (struct dirent*)(blocks + b * BLOCK_SIZE);
+		struct dirent* end = (struct dirent*)(blocks + (b + 1) * BLOCK_SIZE);
+		for(; d < end && !dirblk_bad(blocks + b * BLOCK_SIZE, d); d = NEXT_DIRENT(d))
 		{
-			bio_read(temp.direct_ptr[i],entries);
-			for(int j = 0;j< NUM_DIRENTS;j++)
+			if(d->ino == 0)
+				continue;
+			uint32_t iblk = ino_blk(superblock, d->ino);
+			uint32_t* at = bsearch(&iblk, iblks, n_unique, sizeof(uint32_t), cmp_blk);
+			struct inode* inode = (struct inode*)(itable + (at - iblks) * BLOCK_SIZE) + ino_slot(superblock, d->ino);
+			memset(&st, 0, sizeof(st));
+			inode_stat(inode, &st);
+			memcpy(name, d->name, d->name_len);
+			name[d->name_len] = '\0';
+			if(filler(buffer,name,&st,0)!=0)
 			{
-				if(entries[j].valid)
-				{
-					if(filler(buffer,entries[j].name,NULL,0)!=0)
-						return -ENOMEM;
-				}
+				ret = -ENOMEM;
+				break;
 			}
 		}
 	}
-	return 0;
+	return ret;
 }
 
 
-static int tfs_mkdir(const char *path, mode_t mode) {
-
-	// Step 1: Use dirname() and basename() to separate parent directory path and target directory name
-	// char throw_away[strlen(path) + 1]; //because dirname and basename are stupid and change path
-	// strcpy(throw_away, path);
-	// char* dirnm = dirname(throw_away);
-	char* dirName = calloc(1,strlen(path)+1);
-	char* baseName = calloc(1,strlen(path)+1);
-	getNames(path,dirName,baseName);
-	// Step 2: Call get_node_by_path() to get inode of parent directory
-	struct inode parent_inode;
-	if(get_node_by_path(dirName, 2, &parent_inode) != 0) 
-		return -1;
-	// Step 3: Call get_avail_ino() to get an available inode number
-	uint16_t ino = get_avail_ino();
-	// Step 4: Call dir_add() to add directory entry of target directory to parent directory	
-	// char* basenm = __xpg_basename((char*)path);
-	if(dir_add(parent_inode, ino, baseName, strlen(baseName)) != 0) 
-		return -1;
-	// Step 5: Update inode for target directory
-	struct inode* temp = calloc(1,INODE_SIZE);
-	temp->ino = ino;
-	temp->valid=1;
-	temp->type = __S_IFDIR;
-	temp->size=0;
-	memset(temp->direct_ptr,-1,sizeof(temp->direct_ptr));
-	memset(temp->indirect_ptr,-1,sizeof(temp->indirect_ptr));
-	// Step 6: Call writei() to write inode to disk
-	if(writei(ino, temp) != 0) 
-		return -1;
-	return 0;
-}
-
-static int tfs_rmdir(const char *path) {
+/* 
+ * Add the new node name to directory parent, whose lock the caller holds
+ */
+static int add_node(uint16_t parent, const char *name, mode_t mode, struct inode *inode) {
 
-	// Step 1: Use dirname() and basename() to separate parent directory path and target directory name
-	char* dirName = calloc(1,strlen(path));
-	char* baseName = calloc(1,strlen(path));
-	getNames(path,dirName,baseName);
-	// Step 2: Call get_node_by_path() to get inode of target directory
+	// Step 1: Read the parent directory again under its lock, it may have gone meanwhile
 	struct inode parent_inode;
-	if(get_node_by_path(dirName, 2, &parent_inode) != 0) 
-		return -1;
-	struct dirent temp_dirent;
-	if(dir_find(parent_inode.ino, baseName, strlen(baseName), &temp_dirent) != 0) 
-		return -1;
-	
-	//check for empty dir
-	struct inode temp_dir_inode;
-	if(readi(temp_dirent.ino, &temp_dir_inode) != 0) 
-		return -1;
-	int i;
-	for(i=0; i < sizeof(temp_dir_inode.direct_ptr)/sizeof(int); i++)
+	struct dirent entry;
+	if(readi(parent, &parent_inode) < 0)
+		return -ENOENT;
+	if(!S_ISDIR(parent_inode.mode))
+		return -ENOTDIR;
+	if(dir_find(parent, name, strlen(name), &entry) == 0)
+		return -EEXIST;
+	// Step 2: Call get_avail_ino() to get an available inode number
+	int ino = get_avail_ino(parent, S_ISDIR(mode));
+	if(ino < 0)
+		return -ENOSPC;
+	// Step 3: Call dir_add() to add directory entry of target to parent directory
+	if(dir_add(parent, ino, name, strlen(name), S_ISDIR(mode) ? FT_DIR : FT_REG) != 0)
 	{
-		if(temp_dir_inode.direct_ptr[i] != -1)
-			return -1;
+		free_ino(ino);
+		return -ENOSPC;
 	}
-	// Step 3: Clear data block bitmap of target directory
-	// Step 4: Clear inode bitmap and its data block
-	unsigned char bitmap[BLOCK_SIZE]; 
-	bio_read(superblock->i_bitmap_blk, bitmap); 
-	unset_bitmap(bitmap, temp_dirent.ino); 
-	bio_write(superblock->i_bitmap_blk, bitmap);
-	// Step 5: Call get_node_by_path() to get inode of parent directory 	
-	// Step 6: Call dir_remove() to remove directory entry of target directory in its parent directory
-	dir_remove(&parent_inode, baseName, strlen(baseName));
+	// Step 4: Update inode for target
+	struct inode temp;
+	init_inode(&temp, ino, mode);
+	set_owner(&temp);
+	// Step 5: Call writei() to write inode to disk
+	if(writei(ino, &temp) != 0)
+		return -EIO;
+	if(inode != NULL)
+		*inode = temp;
 	return 0;
 }
 
-static int tfs_releasedir(const char *path, struct fuse_file_info *fi) {
-	// For this project, you don't need to fill this function
-	// But DO NOT DELETE IT!
-    return 0;
-}
-
-static int tfs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+/* 
+ * Make a file or directory at path, mode holds its type and permissions.
+ * The new inode is copied to inode unless that is NULL.
+ */
+int new_node(const char *path, mode_t mode, struct inode *inode) {
 
-	// Step 1: Use dirname() and basename() to separate parent directory path and target file name
-	char* dirName = calloc(1,strlen(path));
-	char* baseName = calloc(1,strlen(path));
+	// Step 1: Use dirname() and basename() to separate parent directory path and target name
+	if(ctl_file(path))
+		return -EEXIST;
+	char dirName[strlen(path)+1], baseName[strlen(path)+1];
 	getNames(path,dirName,baseName);
+	if(strlen(baseName) > MAX_NAME_LEN)
+		return -ENAMETOOLONG;
 	// Step 2: Call get_node_by_path() to get inode of parent directory
 	struct inode parent_inode;
-	if(get_node_by_path(dirName, 2, &parent_inode) != 0) 
-		return -1;
-	// Step 3: Call get_avail_ino() to get an available inode number
-	uint16_t temp_ino = get_avail_ino();
-	// Step 4: Call dir_add() to add directory entry of target file to parent directory
-	if(dir_add(parent_inode, temp_ino, baseName, strlen(baseName)) != 0) 
-		return -1;
-	// Step 5: Update inode for target file
-	struct inode* temp = calloc(1,INODE_SIZE);
-	temp->ino =temp_ino;
-	temp->valid=1;
-	temp->type = __S_IFREG;
-	temp->size=0;
-	memset(temp->direct_ptr,-1,sizeof(temp->direct_ptr));
-	memset(temp->indirect_ptr,-1,sizeof(temp->indirect_ptr));
-	// Step 6: Call writei() to write inode to disk
-	if(writei(temp_ino, temp) != 0) 
-		return -1;
-	return 0;
+	int ret = get_node_by_path(dirName, ROOT_INO, &parent_inode);
+	if(ret != 0)
+		return ret;
+	// Step 3: Add the node with the parent locked
+	lock_inodes(&parent_inode.ino, 1);
+	ret = add_node(parent_inode.ino, baseName, mode, inode);
+	unlock_inodes(&parent_inode.ino, 1);
+	return ret;
 }
 
-static int tfs_open(const char *path, struct fuse_file_info *fi) {
-
-	// Step 1: Call get_node_by_path() to get inode from path
-	struct inode temp_inode;
-	if(get_node_by_path(path,2,&temp_inode)!=0)
-		return -1;
-	// Step 2: If not find, return -1
-	return 0;
+static int do_mkdir(const char *path, mode_t mode) {
+	return new_node(path, __S_IFDIR | (mode & 07777), NULL);
 }
 
-static int tfs_read(const char *path, char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
+static int do_open(const char *path, int flags, mode_t mode, struct tfs_file **file) {
 
-	// Step 1: You could call get_node_by_path() to get inode from path
-	struct inode temp_inode;
-	if(get_node_by_path(path,2,&temp_inode)!=0)
-		return -1;
-	// Step 2: Based on size and offset, read its data blocks from disk
-	char* read_buf = calloc(1,BLOCK_SIZE);
-	char* copy_buf = calloc(1,size);
-	int start = offset/BLOCK_SIZE;
-	offset -=(start*BLOCK_SIZE);
-	int amount = 0;
-	// Step 3: copy the correct amount of data from offset to buffer
-	for(int i = start;i<sizeof(temp_inode.direct_ptr)/sizeof(int) && size !=0;i++)
+	static uint32_t next_id;
+	struct tfs_file* f = calloc(1, sizeof(struct tfs_file));
+	f->id = __atomic_add_fetch(&next_id, 1, __ATOMIC_RELAXED);
+	f->flags = flags;
+	f->ctl = ctl_name(path);
+	// Step 0: A control file opened for reading renders its text now, so every
+	// read of this handle sees the same text. The stats file takes no commands.
+	if(f->ctl != NULL)
 	{
-		if(temp_inode.direct_ptr[i] == -1)
-			break;
-		if(bio_read(temp_inode.direct_ptr[i],read_buf)<0)
-			return amount;
-		if(BLOCK_SIZE-offset >=size)
-		{
-			memcpy(copy_buf + amount,read_buf+offset,size);
-			offset = 0;
-			amount+=size;
-			size-=size;
-		}
+		int ret = 0;
+		if((flags & O_ACCMODE) != O_RDONLY)
+			ret = strcmp(f->ctl,STATS_NAME) == 0 ? -EACCES : 0;
+		else if(strcmp(f->ctl,STATS_NAME) == 0)
+			f->text = stats_render(&f->len);
+		else if(strcmp(f->ctl,DEFRAG_NAME) == 0)
+			f->text = defrag_render(&f->len);
+		else if(strcmp(f->ctl,SNAPSHOT_NAME) == 0)
+			f->text = ram_render(&f->len);
 		else
+			f->text = clone_render(&f->len);
+		if(ret == 0 && (flags & O_ACCMODE) == O_RDONLY && f->text == NULL)
+			ret = -ENOMEM;
+		if(ret < 0)
 		{
-			memcpy(copy_buf+amount, read_buf+offset,BLOCK_SIZE-offset);
-			amount+=(BLOCK_SIZE - offset);
-			offset = 0;
-			size -= (BLOCK_SIZE - offset);
+			free(f);
+			return ret;
 		}
+		*file = f;
+		return 0;
 	}
-	//read from indirect pointers
-	int* indirect_page;
-	int off;
-	if(start > 16)
-		off = 16;
-	else
-		off = 12;
-	int start_indirect = (start-16) / (BLOCK_SIZE/4);
-	int direct_ptr_start = (start-off) % (BLOCK_SIZE);
-	for(int j = start_indirect;j<8 && size!=0;j++)
+	// Step 1: Call get_node_by_path() to get inode from path, O_CREAT makes a missing file
+	struct inode temp_inode;
+	int ret = get_node_by_path(path,ROOT_INO,&temp_inode);
+	if(ret != 0)
 	{
-		indirect_page = calloc(1,BLOCK_SIZE);
-		if(temp_inode.indirect_ptr[j] == -1)
-			break;
-		if(bio_read(temp_inode.indirect_ptr[j],indirect_page)<0)
-			return amount;
-		//iterate through indirect page
-		for(int k = direct_ptr_start;k<BLOCK_SIZE/sizeof(int) && size!=0;k++)
+		if(ret == -ENOENT && (flags & O_CREAT))
+			ret = new_node(path, __S_IFREG | (mode & 07777), &temp_inode);
+		// a file another thread made meanwhile is opened as if it had been there
+		if(ret == -EEXIST && !(flags & O_EXCL) && get_node_by_path(path,ROOT_INO,&temp_inode) == 0)
+			ret = S_ISDIR(temp_inode.mode) && (flags & O_ACCMODE) != O_RDONLY ? -EISDIR : 0;
+	}
+	else if((flags & O_CREAT) && (flags & O_EXCL))
+		ret = -EEXIST;
+	else if(S_ISDIR(temp_inode.mode) && (flags & O_ACCMODE) != O_RDONLY)
+		ret = -EISDIR;
+	// Step 2: If not find, return the error
+	if(ret < 0)
+	{
+		free(f);
+		return ret;
+	}
+	f->ino = temp_inode.ino;
+	// Step 3: A writer's clusters are compressed when it lets go of the file
+	if(compress_enabled() && (flags & O_ACCMODE) != O_RDONLY && S_ISREG(temp_inode.mode))
+		f->dirty = dirty_open(f->ino);
+	*file = f;
+	return 0;
+}
+
+/* 
+ * Read from an open file with its inode's lock shared, so no writer frees
+ * the blocks the read follows
+ */
+static int read_file(struct tfs_file *f, char *buffer, size_t size, off_t offset) {
+	// Step 1: Read the inode of the open file, which a rename does not change
+	struct inode temp_inode;
+	if(readi(f->ino,&temp_inode) < 0 || !temp_inode.valid)
+		return -ENOENT;
+	if(offset >= temp_inode.size)
+		return 0;
+	if(offset + size > temp_inode.size)
+		size = temp_inode.size - offset;
+	// Step 1b: A packed file is all in one run of its fragment block
+	if(is_packed(&temp_inode))
+		return frag_read(&temp_inode, buffer, size, offset) < 0 ? -EIO : size;
+	// Step 2: Based on size and offset, read its data blocks from disk, a
+	// cluster's pointers at a time. A compressed cluster is decompressed
+	// once for all of its blocks the read wants.
+	char* read_buf = blk_alloc();
+	char* cluster_buf = NULL;
+	int ptrs[CLUSTER_BLKS];
+	int64_t cluster = -1;
+	int amount = 0;
+	// Step 3: copy the correct amount of data from offset to buffer
+	while(size != 0)
+	{
+		int blk_off = offset % BLOCK_SIZE;
+		int len = BLOCK_SIZE - blk_off;
+		if(len > size)
+			len = size;
+		int idx = offset / BLOCK_SIZE;
+		if(idx / CLUSTER_BLKS != cluster)
 		{
-			if(indirect_page[k]==0)
-			{
-				//sequential reads requires the correct bytes return
-				amount += size;
-				size = 0;
+			cluster = idx / CLUSTER_BLKS;
+			if(cluster_ptrs(&temp_inode, cluster, ptrs) < 0)
 				break;
-			}
-			if(indirect_page[k] != 0)
+			if(ptrs[0] == COMPRESSED_ADDR)
 			{
-				if(bio_read(indirect_page[k],read_buf)<0)
-					return amount;
-				if(BLOCK_SIZE-offset >=size)
-				{
-					memcpy(copy_buf + amount,read_buf+offset,size);
-					offset = 0;
-					amount+=size;
-					size-=size;
-				}
-				else
-				{
-					memcpy(copy_buf+amount, read_buf+offset,BLOCK_SIZE-offset);
-					amount+=(BLOCK_SIZE - offset);
-					offset = 0;
-					size -= (BLOCK_SIZE - offset);
-				}
+				if(cluster_buf == NULL)
+					cluster_buf = scratch_blks(CLUSTER_BLKS);
+				if(cluster_read(ptrs, cluster_buf) < 0)
+					break;
 			}
 		}
-		free(indirect_page);
+		int blk = ptrs[idx % CLUSTER_BLKS];
+		if(ptrs[0] == COMPRESSED_ADDR)
+			memcpy(read_buf, cluster_buf + idx % CLUSTER_BLKS * BLOCK_SIZE, BLOCK_SIZE);
+		// a hole reads back as zeros
+		else if(blk < 0)
+			memset(read_buf, 0, BLOCK_SIZE);
+		else if(bio_read(blk, read_buf) < 0)
+			break;
+		memcpy(buffer + amount, read_buf + blk_off, len);
+		amount += len;
+		offset += len;
+		size -= len;
 	}
-	memcpy(buffer,copy_buf,amount);
-	free(copy_buf);
+	blk_free(read_buf);
+	if(amount == 0 && size != 0)
+		return -EIO;
 	// Note: this function should return the amount of bytes you copied to buffer
 	return amount;
 }
 
-static int tfs_write(const char *path, const char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
-	// Step 1: You could call get_node_by_path() to get inode from path
+static int do_pread(struct tfs_file *f, char *buffer, size_t size, off_t offset) {
+
+	if(f->ctl != NULL)
+	{
+		if(f->text == NULL || offset >= f->len)
+			return 0;
+		if(offset + size > f->len)
+			size = f->len - offset;
+		memcpy(buffer, f->text + offset, size);
+		return size;
+	}
+	if((f->flags & O_ACCMODE) == O_WRONLY)
+		return -EBADF;
+	lock_inode_shared(f->ino);
+	int ret = read_file(f, buffer, size, offset);
+	unlock_inode(f->ino);
+	return ret;
+}
+
+/* 
+ * Write to an open file with its inode's lock held, which keeps the
+ * compression at another handle's release() and an unlink from changing
+ * or freeing its blocks meanwhile
+ */
+static int write_file(struct tfs_file *f, const char *buffer, size_t size, off_t offset) {
+	// Step 1: Read the inode of the open file
 	struct inode temp_inode;
-	if(get_node_by_path(path, 2, &temp_inode) != 0) 
-		return -1;
+	if(readi(f->ino, &temp_inode) < 0 || !temp_inode.valid)
+		return -ENOENT;
 	// Step 2: Based on size and offset, read its data blocks from disk
-	char* read_buf = calloc(1,BLOCK_SIZE);
-	int start = offset/BLOCK_SIZE;
-	offset -= (start * BLOCK_SIZE);
+	char* write_buf = blk_alloc();
 	// Step 3: Write the correct amount of data from offset to disk
-	int amount=0;
-	for(int i = start; i < sizeof(temp_inode.direct_ptr)/sizeof(int) && size != 0; i++)
+	int amount = 0;
+	off_t start = offset;
+	int64_t cluster = -1;
+	// a small file stays in or goes to a fragment block, one that outgrows
+	// PACK_MAX or finds no room there gets a block of its own first
+	int packed = is_packed(&temp_inode);
+	if(size != 0 && (packed || (pack_active && temp_inode.size == 0)))
 	{
-		if(temp_inode.direct_ptr[i] == -1)
+		if(offset + size <= PACK_MAX && frag_write(&temp_inode, buffer, size, offset) == 0)
 		{
-			if(size == 0) 
-				break;
-			temp_inode.direct_ptr[i] = get_avail_blkno();
-		}
-		if(bio_read(temp_inode.direct_ptr[i], read_buf) < 0) 
-			return amount;
-		if(BLOCK_SIZE - offset >= size)
-		{
-			memcpy(read_buf + offset, buffer + amount, size);
-			if(bio_write(temp_inode.direct_ptr[i], read_buf) < 0 ) 
-				return amount;
-			amount += size;
-			size -= size;
-			offset = 0;
+			amount = size;
+			offset += size;
+			size = 0;
 		}
-		else
+		else if(packed && frag_unpack(&temp_inode) < 0)
 		{
-			memcpy(read_buf + offset, buffer + amount, BLOCK_SIZE - offset);
-			if(bio_write(temp_inode.direct_ptr[i], read_buf) < 0) 
-				return amount;
-			amount += (BLOCK_SIZE - offset);
-			size -= (BLOCK_SIZE - offset);
-			offset = 0;
+			blk_free(write_buf);
+			return -ENOSPC;
 		}
 	}
-	//start using indirect pointers
-	int* indirect_page;
-	int start_indirect = (start-16) / (BLOCK_SIZE/4);
-	for(int j = start_indirect;j<8 && size !=0;j++)
+	while(size != 0)
 	{
-		indirect_page = calloc(1,BLOCK_SIZE);
-		//initialize the block for pointers
-		if(temp_inode.indirect_ptr[j] == -1)
+		int blk_off = offset % BLOCK_SIZE;
+		int len = BLOCK_SIZE - blk_off;
+		if(len > size)
+			len = size;
+		// a compressed cluster turns back into raw blocks first
+		int idx = offset / BLOCK_SIZE;
+		if(idx / CLUSTER_BLKS != cluster)
 		{
-			if(size == 0) 
+			int ptrs[CLUSTER_BLKS];
+			cluster = idx / CLUSTER_BLKS;
+			if(cluster_ptrs(&temp_inode, cluster, ptrs) < 0)
+				break;
+			if(ptrs[0] == COMPRESSED_ADDR && cluster_expand(&temp_inode, cluster, ptrs) < 0)
 				break;
-			temp_inode.indirect_ptr[j] = get_avail_blkno();
 		}
-		//grab indirect page
-		if(bio_read(temp_inode.indirect_ptr[j], indirect_page) < 0) 
-			return amount;
-		//iterate through the indirect page
-		for(int k = 0;k<BLOCK_SIZE/sizeof(int) && size !=0;k++)
+		// only a partial block needs its old contents, a hole's are zeros
+		int blk = get_file_blk(&temp_inode, idx, 0);
+		if(len < BLOCK_SIZE && blk < 0)
+			memset(write_buf, 0, BLOCK_SIZE);
+		else if(len < BLOCK_SIZE && bio_read(blk, write_buf) < 0)
+			break;
+		memcpy(write_buf + blk_off, buffer + amount, len);
+		// with dedup on, a block already on disk holding the same bytes is shared instead
+		uint64_t hash = 0;
+		if(dedup_active)
 		{
-			//found empty direct pointer spot
-			if(indirect_page[k] == 0)
+			hash = dedup_hash(write_buf);
+			int dup = dedup_share(hash, write_buf, blk);
+			if(dup >= 0)
 			{
-				//get a new block
-				int direct_block = get_avail_blkno();
-				//check if the direct block is valid
-				if(bio_read(indirect_page[k],read_buf)<0)
-					return amount;
-				indirect_page[k] = direct_block;
-				bio_write(temp_inode.indirect_ptr[j],indirect_page);
-				//write to the direct block
-				if(BLOCK_SIZE - offset >= size)
-				{
-					memcpy(read_buf + offset, buffer + amount, size);
-					if(bio_write(indirect_page[k], read_buf) < 0 ) 
-						return amount;
-					amount += size;
-					size -= size;
-					offset = 0;
-				}
-				else
+				if(set_file_blk(&temp_inode, idx, dup) < 0)
 				{
-					memcpy(read_buf + offset, buffer + amount, BLOCK_SIZE - offset);
-					if(bio_write(indirect_page[k], read_buf) < 0) 
-						return amount;
-					amount += (BLOCK_SIZE - offset);
-					size -= (BLOCK_SIZE - offset);
-					offset = 0;
+					free_blkno(dup);
+					break;
 				}
+				if(blk >= 0)
+					free_blkno(blk);
+				amount += len;
+				offset += len;
+				size -= len;
+				continue;
 			}
 		}
-		free(indirect_page);
+		if(blk < 0 && (blk = get_file_blk(&temp_inode, idx, 1)) < 0)
+			break;
+		// a block shared with a clone or by dedup gets one of its own first
+		if(!dedup_own(blk))
+		{
+			blk = unshare_file_blk(&temp_inode, idx, blk, 0);
+			if(blk < 0)
+				break;
+		}
+		if(bio_write(blk, write_buf) < 0)
+			break;
+		if(hash != 0)
+			dedup_add(hash, blk);
+		amount += len;
+		offset += len;
+		size -= len;
 	}
+	blk_free(write_buf);
+	// the owners dedup added
+	if(dedup_active)
+		flush_refs();
 	// Step 4: Update the inode info and write it to disk
-	temp_inode.size += amount;
+	if(offset > temp_inode.size)
+		temp_inode.size = offset;
+	if(amount > 0)
+		temp_inode.mtime = temp_inode.ctime = time(NULL);
 	if(writei(temp_inode.ino, &temp_inode) < 0) 
 		return -1;
+	if(amount > 0 && f->dirty != NULL)
+		dirty_mark(f->dirty, start / BLOCK_SIZE / CLUSTER_BLKS, (offset - 1) / BLOCK_SIZE / CLUSTER_BLKS);
+	if(amount == 0 && size != 0)
+		return -ENOSPC;
 	// Note: this function should return the amount of bytes you write to disk
 	return amount;
 }
 
-static int tfs_unlink(const char *path) {
-
-	// Step 1: Use dirname() and basename() to separate parent directory path and target file name
-	char* dirName = calloc(1,strlen(path));
-	char* baseName = calloc(1,strlen(path));
-	getNames(path,dirName,baseName);
-	// Step 2: Call get_node_by_path() to get inode of target file
-	struct inode parent_node;
-	if(get_node_by_path(dirName,2,&parent_node)!=0)
-		return -1;
-	struct dirent temp_dir;
-	if(dir_find(parent_node.ino,baseName,strlen(baseName),&temp_dir)!=0)
-		return -1;	
-	// Step 3: Clear data block bitmap of target file
-	unsigned char d_bitmap[BLOCK_SIZE];
-	if(bio_read(superblock->d_bitmap_blk,d_bitmap)<0)
-		return -1;
-	// Step 4: Clear inode bitmap and its data block
-	unsigned char bitmap[BLOCK_SIZE]; 
-	bio_read(superblock->i_bitmap_blk, bitmap); 
-	unset_bitmap(bitmap, temp_dir.ino); 
-	bio_write(superblock->i_bitmap_blk, bitmap);
+static int do_pwrite(struct tfs_file *f, const char *buffer, size_t size, off_t offset) {
+	if((f->flags & O_ACCMODE) == O_RDONLY)
+		return -EBADF;
+	if(f->ctl != NULL)
+	{
+		int ret;
+		if(strcmp(f->ctl,DEFRAG_NAME) == 0)
+			ret = defrag_command(buffer, size);
+		else if(strcmp(f->ctl,SNAPSHOT_NAME) == 0)
+			ret = ram_command(buffer, size);
+		else
+			ret = clone_command(buffer, size);
+		return ret < 0 ? ret : size;
+	}
+	// Step 1: The inode is read, changed and written back with its lock held
+	lock_inode(f->ino);
+	int ret = write_file(f, buffer, size, offset);
+	unlock_inode(f->ino);
+	return ret;
+}
 
-	struct inode temp_inode;
-	char* temp_buf = calloc(1,BLOCK_SIZE);
-	if(readi(temp_dir.ino,&temp_inode)<0)
-		return -1;
-	for(int i =0;i<sizeof(temp_inode.direct_ptr)/sizeof(int);i++)
+/* 
+ * Give back an inode and every block it holds
+ */
+static void release_inode(struct inode* inode) {
+	struct inode temp_inode = *inode;
+	char* temp_buf = blk_alloc();
+	memset(temp_buf, 0, BLOCK_SIZE);
+	// Step 1: Clear data block bitmap of the file, freed blocks are zeroed
+	// so a reused block never shows stale data past EOF. A block a clone
+	// still uses is left as it is, and a compressed cluster's marker is no block.
+	// A packed file gives its run back to the fragment block.
+	int* freed = scratch_alloc((NUM_DIRECT + NUM_INDIRECT * (PTRS_PER_BLK + 1)) * sizeof(int));
+	int n_freed = 0;
+	if(is_packed(&temp_inode))
+		frag_free(&temp_inode);
+	for(int i =0;i<NUM_DIRECT;i++)
 	{
-		if(temp_inode.direct_ptr[i] != -1)
+		if(temp_inode.direct_ptr[i] >= 0)
 		{
-			bio_read(temp_inode.direct_ptr[i],temp_buf);
-			memset(temp_buf,0,BLOCK_SIZE);
-			bio_write(temp_inode.direct_ptr[i],temp_buf);
-			unset_bitmap(d_bitmap,temp_inode.direct_ptr[i]);
+			if(dedup_own(temp_inode.direct_ptr[i]))
+				bio_write(temp_inode.direct_ptr[i],temp_buf);
+			freed[n_freed++] = temp_inode.direct_ptr[i];
 		}
 	}
-	int* indirect_page;
-	for(int j = 0;j<8;j++)
+	int* indirect_page = blk_alloc();
+	for(int j = 0;j<NUM_INDIRECT;j++)
 	{
-		indirect_page = calloc(1,BLOCK_SIZE);
 		if(temp_inode.indirect_ptr[j] != -1)
 		{	
-			if(bio_read(temp_inode.indirect_ptr[j],indirect_page)<0)
-				return -1;
-			for(int k = 0;k<BLOCK_SIZE/sizeof(int);k++)
+			bio_read(temp_inode.indirect_ptr[j],indirect_page);
+			for(int k = 0;k<PTRS_PER_BLK;k++)
 			{
-				if(indirect_page[k] != 0)
+				if(indirect_page[k] > 0)
 				{
-					bio_read(indirect_page[k],temp_buf);
-					memset(temp_buf,0,BLOCK_SIZE);
-					bio_write(indirect_page[k],temp_buf);
-					unset_bitmap(d_bitmap,indirect_page[k]);
+					if(dedup_own(indirect_page[k]))
+						bio_write(indirect_page[k],temp_buf);
+					freed[n_freed++] = indirect_page[k];
 				}
 			}
-			memset(indirect_page,0,BLOCK_SIZE);
-			bio_write(temp_inode.indirect_ptr[j],indirect_page);
+			bio_write(temp_inode.indirect_ptr[j],temp_buf);
+			freed[n_freed++] = temp_inode.indirect_ptr[j];
 		}
-		free(indirect_page);
 	}
-	if(bio_write(superblock->d_bitmap_blk,d_bitmap)<0)
-		return -1; 
-	// Step 5: Call get_node_by_path() to get inode of parent directory
-	// Step 6: Call dir_remove() to remove directory entry of target file in its parent directory
-	if(dir_remove(&parent_node,baseName,strlen(baseName))<0)
-		return -1;
+	blk_free(indirect_page);
+	blk_free(temp_buf);
+	free_blk_list(freed, n_freed);
+	// Step 2: Mark the inode free on disk
+	temp_inode.valid = 0;
+	writei(temp_inode.ino, &temp_inode);
+	// Step 3: Clear inode bitmap, only now may another thread take the number
+	free_ino(temp_inode.ino);
+}
+
+/* 
+ * Drop one link to a file after its entry is gone. A directory has only
+ * the one entry.
+ */
+static void drop_link(struct inode* inode) {
+	if(S_ISDIR(inode->mode) || inode->link <= 1)
+	{
+		release_inode(inode);
+		return;
+	}
+	inode->link--;
+	inode->ctime = time(NULL);
+	writei(inode->ino, inode);
+}
+
+/* 
+ * Find the entry name of directory *dir and lock the directory together
+ * with the inode the entry points at. Both are looked up again under the
+ * locks, since the entry may change before they are held, and *dir is
+ * read again. Returns -1, with nothing locked, when there is no entry.
+ */
+static int lock_entry(struct inode* dir, const char* name, struct dirent* entry) {
+	struct dirent again;
+	for(;;)
+	{
+		if(dir_find(dir->ino, name, strlen(name), entry) != 0)
+			return -1;
+		uint16_t inos[2] = { dir->ino, entry->ino };
+		lock_inodes(inos, 2);
+		if(readi(dir->ino, dir) < 0 || dir_find(dir->ino, name, strlen(name), &again) != 0)
+		{
+			unlock_inodes(inos, 2);
+			return -1;
+		}
+		if(again.ino == entry->ino)
+			return 0;
+		unlock_inodes(inos, 2);
+	}
+}
+
+static int do_rmdir(const char *path) {
+
+	if(ctl_file(path))
+		return -ENOTDIR;
+	// Step 1: Use dirname() and basename() to separate parent directory path and target directory name
+	char dirName[strlen(path)+1], baseName[strlen(path)+1];
+	getNames(path,dirName,baseName);
+	// Step 2: Call get_node_by_path() to get inode of parent directory, and lock
+	// it with the target directory
+	struct inode parent_inode;
+	int ret = get_node_by_path(dirName, ROOT_INO, &parent_inode);
+	if(ret != 0) 
+		return ret;
+	if(!S_ISDIR(parent_inode.mode))
+		return -ENOTDIR;
+	struct dirent temp_dirent;
+	if(lock_entry(&parent_inode, baseName, &temp_dirent) != 0)
+		return -ENOENT;
+	uint16_t locked[2] = { parent_inode.ino, temp_dirent.ino };
+	struct inode temp_dir_inode;
+	if(readi(temp_dirent.ino, &temp_dir_inode) != 0) 
+		ret = -ENOENT;
+	else if(!S_ISDIR(temp_dir_inode.mode))
+		ret = -ENOTDIR;
+	// Step 3: Only an empty directory goes, it has no data block left
+	else if(temp_dir_inode.size != 0)
+		ret = -ENOTEMPTY;
+	// Step 4: Call dir_remove() to remove directory entry of target directory in its parent directory
+	else if(dir_remove(&parent_inode, baseName, strlen(baseName)) < 0)
+		ret = -ENOENT;
+	// Step 5: Drop the entry's link, which frees the directory's inode
+	else
+		drop_link(&temp_dir_inode);
+	unlock_inodes(locked, 2);
+	return ret;
+}
+
+static int do_unlink(const char *path) {
+
+	if(ctl_file(path))
+		return -EACCES;
+	// Step 1: Use dirname() and basename() to separate parent directory path and target file name
+	char dirName[strlen(path)+1], baseName[strlen(path)+1];
+	getNames(path,dirName,baseName);
+	// Step 2: Call get_node_by_path() to get inode of target file, with it
+	// and its directory locked
+	struct inode parent_node;
+	int ret = get_node_by_path(dirName,2,&parent_node);
+	if(ret != 0)
+		return ret;
+	if(!S_ISDIR(parent_node.mode))
+		return -ENOTDIR;
+	struct dirent temp_dir;
+	if(lock_entry(&parent_node,baseName,&temp_dir)!=0)
+		return -ENOENT;
+	uint16_t locked[2] = { parent_node.ino, temp_dir.ino };
+	struct inode temp_inode;
+	if(readi(temp_dir.ino,&temp_inode)<0)
+		ret = -1;
+	else if(S_ISDIR(temp_inode.mode))
+		ret = -EISDIR;
+	// Step 3: Call dir_remove() to remove directory entry of target file in its parent directory
+	else if(dir_remove(&parent_node,baseName,strlen(baseName))<0)
+		ret = -1;
+	// Step 4: Drop the link the entry held, the last one frees the file
+	else
+		drop_link(&temp_inode);
+	unlock_inodes(locked, 2);
+	return ret;
+}
+
+/* 
+ * Move entry from fromBase of from_parent to toBase of to_parent, with
+ * both directories, the moved inode and the one toBase names locked
+ */
+static int move_entry(struct inode* from_parent, const char* fromBase, const struct dirent* entry,
+	struct inode* to_parent, const char* toBase, const struct dirent* old) {
+
+	struct inode inode;
+	if(readi(entry->ino,&inode) < 0)
+		return -ENOENT;
+	if(!S_ISDIR(to_parent->mode))
+		return -ENOTDIR;
+	uint8_t file_type = S_ISDIR(inode.mode) ? FT_DIR : FT_REG;
+	// Step 3: An existing target entry is pointed at the inode in place, so
+	// the target name always names one file or the other
+	if(old != NULL)
+	{
+		struct inode victim;
+		if(old->ino == entry->ino)
+			return 0;
+		if(readi(old->ino,&victim) < 0)
+			return -EIO;
+		if(S_ISDIR(victim.mode) && !S_ISDIR(inode.mode))
+			return -EISDIR;
+		if(!S_ISDIR(victim.mode) && S_ISDIR(inode.mode))
+			return -ENOTDIR;
+		if(S_ISDIR(victim.mode) && victim.size != 0)
+			return -ENOTEMPTY;
+		dir_replace(to_parent,toBase,strlen(toBase),inode.ino,file_type);
+		drop_link(&victim);
+	}
+	else if(dir_add(to_parent->ino,inode.ino,toBase,strlen(toBase),file_type) != 0)
+		return -ENOSPC;
+	// Step 4: Remove the old entry, rereading its directory, which the add
+	// may have just changed
+	readi(from_parent->ino,from_parent);
+	dir_remove(from_parent,fromBase,strlen(fromBase));
+	inode.ctime = time(NULL);
+	writei(inode.ino,&inode);
 	return 0;
 }
 
-static int tfs_truncate(const char *path, off_t size) {
-	// For this project, you don't need to fill this function
-	// But DO NOT DELETE IT!
-    return 0;
+static int do_rename(const char *from, const char *to) {
+
+	// Step 1: The control files stay where they are, and a directory cannot move into itself
+	if(ctl_file(from) || ctl_file(to))
+		return -EPERM;
+	if(strcmp(from,to) == 0)
+		return 0;
+	size_t from_len = strlen(from);
+	if(strncmp(to,from,from_len) == 0 && to[from_len] == '/')
+		return -EINVAL;
+	char fromDir[from_len+1], fromBase[from_len+1];
+	char toDir[strlen(to)+1], toBase[strlen(to)+1];
+	getNames(from,fromDir,fromBase);
+	getNames(to,toDir,toBase);
+	if(strlen(toBase) > MAX_NAME_LEN)
+		return -ENAMETOOLONG;
+	// Step 2: Find the entry to move, the new parent and the entry the move
+	// replaces, and lock all their inodes. They are looked up again under
+	// the locks and the lookup starts over when one has changed meanwhile.
+	struct inode from_parent, to_parent;
+	struct dirent entry, old, again;
+	for(;;)
+	{
+		int ret = get_node_by_path(fromDir,ROOT_INO,&from_parent);
+		if(ret == 0 && dir_find(from_parent.ino,fromBase,strlen(fromBase),&entry) != 0)
+			ret = S_ISDIR(from_parent.mode) ? -ENOENT : -ENOTDIR;
+		if(ret == 0)
+			ret = get_node_by_path(toDir,ROOT_INO,&to_parent);
+		if(ret != 0)
+			return ret;
+		int has_old = dir_find(to_parent.ino,toBase,strlen(toBase),&old) == 0;
+		uint16_t locked[4] = { from_parent.ino, to_parent.ino, entry.ino, has_old ? old.ino : entry.ino };
+		lock_inodes(locked, 4);
+		if(readi(from_parent.ino,&from_parent) == 0 && readi(to_parent.ino,&to_parent) == 0
+			&& dir_find(from_parent.ino,fromBase,strlen(fromBase),&again) == 0 && again.ino == entry.ino
+			&& (dir_find(to_parent.ino,toBase,strlen(toBase),&again) == 0) == has_old
+			&& (!has_old || again.ino == old.ino))
+		{
+			ret = move_entry(&from_parent,fromBase,&entry,&to_parent,toBase,has_old ? &old : NULL);
+			unlock_inodes(locked, 4);
+			return ret;
+		}
+		unlock_inodes(locked, 4);
+	}
 }
 
-static int tfs_release(const char *path, struct fuse_file_info *fi) {
-	// For this project, you don't need to fill this function
-	// But DO NOT DELETE IT!
+/* 
+ * Add the entry toBase of parent for inode, with both locked
+ */
+static int add_link(struct inode* parent, const char* toBase, struct inode* inode) {
+	struct dirent old;
+	// Step 3: Read both again under the locks, either may have gone meanwhile
+	if(readi(inode->ino,inode) < 0 || readi(parent->ino,parent) < 0)
+		return -ENOENT;
+	if(!S_ISDIR(parent->mode))
+		return -ENOTDIR;
+	if(S_ISDIR(inode->mode))
+		return -EPERM;
+	if(inode->link == UINT16_MAX)
+		return -EMLINK;
+	if(dir_find(parent->ino,toBase,strlen(toBase),&old) == 0)
+		return -EEXIST;
+	if(dir_add(parent->ino,inode->ino,toBase,strlen(toBase),FT_REG) != 0)
+		return -ENOSPC;
+	// Step 4: Count the link
+	inode->link++;
+	inode->ctime = time(NULL);
+	writei(inode->ino,inode);
 	return 0;
 }
 
-static int tfs_flush(const char * path, struct fuse_file_info * fi) {
-	// For this project, you don't need to fill this function
-	// But DO NOT DELETE IT!
-    return 0;
+static int do_link(const char *from, const char *to) {
+
+	// Step 1: Find the file to link, directories get no extra names
+	if(ctl_file(from) || ctl_file(to))
+		return -EPERM;
+	struct inode inode, parent;
+	int ret = get_node_by_path(from,ROOT_INO,&inode);
+	if(ret != 0)
+		return ret;
+	if(S_ISDIR(inode.mode))
+		return -EPERM;
+	// Step 2: Add the new entry to its directory, with the directory and the file locked
+	char toDir[strlen(to)+1], toBase[strlen(to)+1];
+	getNames(to,toDir,toBase);
+	if(strlen(toBase) > MAX_NAME_LEN)
+		return -ENAMETOOLONG;
+	if((ret = get_node_by_path(toDir,ROOT_INO,&parent)) != 0)
+		return ret;
+	uint16_t locked[2] = { parent.ino, inode.ino };
+	lock_inodes(locked, 2);
+	ret = add_link(&parent,toBase,&inode);
+	unlock_inodes(locked, 2);
+	return ret;
 }
 
-static int tfs_utimens(const char *path, const struct timespec tv[2]) {
+
+static int do_truncate(const char *path, off_t size) {
 	// For this project, you don't need to fill this function
 	// But DO NOT DELETE IT!
     return 0;
 }
 
+static int do_close(struct tfs_file *f) {
+	// Compress the clusters this handle wrote
+	if(f->dirty != NULL)
+		dirty_close(f->dirty);
+	free(f->text);
+	free(f);
+	return 0;
+}
 
-static struct fuse_operations tfs_ope = {
-	.init		= tfs_init,
-	.destroy	= tfs_destroy,
-
-	.getattr	= tfs_getattr,
-	.readdir	= tfs_readdir,
-	.opendir	= tfs_opendir,
-	.releasedir	= tfs_releasedir,
-	.mkdir		= tfs_mkdir,
-	.rmdir		= tfs_rmdir,
-
-	.create		= tfs_create,
-	.open		= tfs_open,
-	.read 		= tfs_read,
-	.write		= tfs_write,
-	.unlink		= tfs_unlink,
+/* 
+ * Get what was written so far to the disk: the reference tables, the open
+ * log segment, and then the device itself. Data and metadata go to one
+ * image, so datasync syncs as much.
+ */
+static int do_fsync(struct tfs_file *f, int datasync) {
+	if(f->ctl != NULL)
+		return 0;
+	flush_refs();
+	log_flush();
+	dev_sync();
+	return 0;
+}
 
-	.truncate   = tfs_truncate,
-	.flush      = tfs_flush,
-	.utimens    = tfs_utimens,
-	.release	= tfs_release
-};
+static int do_utimens(const char *path, const struct timespec tv[2]) {
+
+	// Step 1: The control files have no inode to keep times in
+	if(ctl_file(path))
+		return -EPERM;
+	struct inode inode;
+	int ret = get_node_by_path(path, ROOT_INO, &inode);
+	if(ret < 0)
+		return ret;
+	// The inode is read again under its lock, a directory's may be changing
+	lock_inodes(&inode.ino, 1);
+	if(readi(inode.ino, &inode) < 0)
+	{
+		unlock_inodes(&inode.ino, 1);
+		return -ENOENT;
+	}
+	// Step 2: Set the access and modification times, UTIME_NOW and UTIME_OMIT as in utimensat()
+	time_t now = time(NULL);
+	if(tv[0].tv_nsec != UTIME_OMIT)
+		inode.atime = tv[0].tv_nsec == UTIME_NOW ? now : tv[0].tv_sec;
+	if(tv[1].tv_nsec != UTIME_OMIT)
+		inode.mtime = tv[1].tv_nsec == UTIME_NOW ? now : tv[1].tv_sec;
+	inode.ctime = now;
+	ret = writei(inode.ino, &inode);
+	unlock_inodes(&inode.ino, 1);
+	return ret;
+}
 
+static int do_chmod(const char *path, mode_t mode) {
+
+	// Step 1: The control files keep their fixed modes
+	if(ctl_file(path))
+		return -EPERM;
+	struct inode inode;
+	int ret = get_node_by_path(path, ROOT_INO, &inode);
+	if(ret < 0)
+		return ret;
+	// The inode is read again under its lock, a directory's may be changing
+	lock_inodes(&inode.ino, 1);
+	if(readi(inode.ino, &inode) < 0)
+	{
+		unlock_inodes(&inode.ino, 1);
+		return -ENOENT;
+	}
+	// Step 2: Replace the permission bits, the file type stays
+	inode.mode = (inode.mode & S_IFMT) | (mode & 07777);
+	inode.ctime = time(NULL);
+	ret = writei(inode.ino, &inode);
+	unlock_inodes(&inode.ino, 1);
+	return ret;
+}
 
-int main(int argc, char *argv[]) {
-	int fuse_stat;
-	//struct inode* i_buf = (struct inode*) malloc(sizeof(struct inode));
-	getcwd(diskfile_path, PATH_MAX);
-	strcat(diskfile_path, "/DISKFILE");
 
-	fuse_stat = fuse_main(argc, argv, &tfs_ope, NULL);
-	// printf("BLOCKS: %ld\n",i_calls+d_calls);
-	return fuse_stat;
-	//return 0;
+/* 
+ * Free space, answered from the counts kept in block 0
+ */
+static int do_statfs(struct statvfs *stbuf) {
+	memset(stbuf, 0, sizeof(*stbuf));
+	stbuf->f_bsize = BLOCK_SIZE;
+	stbuf->f_frsize = BLOCK_SIZE;
+	stbuf->f_blocks = superblock->max_dnum;
+	stbuf->f_bfree = superblock->free_blocks;
+	stbuf->f_bavail = superblock->free_blocks;
+	stbuf->f_files = superblock->max_inum - ROOT_INO;
+	stbuf->f_ffree = superblock->free_inodes;
+	stbuf->f_favail = superblock->free_inodes;
+	stbuf->f_namemax = MAX_NAME_LEN;
+	return 0;
 }
 
+/* 
+ * Timed entry points: every call is counted and timed on its way in and
+ * out, so the operations above stay free of bookkeeping. They also hold
+ * fs_lock for reading, which keeps them off a file while defrag moves it,
+ * and give back the scratch memory the call used. The arguments after the
+ * call are what the op trace records of it.
+ */
+#define TIMED(op, call, ...) \
+	struct optrace_args args = { __VA_ARGS__ }; \
+	uint64_t start = stats_begin(op); \
+	trace_enter(op); \
+	struct scratch_mark mark = scratch_mark(); \
+	pthread_rwlock_rdlock(&fs_lock); \
+	log_call_begin(); \
+	int ret = call; \
+	log_call_end(); \
+	pthread_rwlock_unlock(&fs_lock); \
+	scratch_release(mark); \
+	trace_leave(); \
+	stats_end(op, start, ret); \
+	if(optrace_enabled) \
+	{ \
+		if(args.filep != NULL) \
+			args.file = ret == 0 ? (*args.filep)->id : 0; \
+		optrace_record(op, &args, start, ret); \
+	} \
+	return ret;
+
+int tfs_getattr(const char *path, struct stat *stbuf)
+{ TIMED(OP_GETATTR, do_getattr(path, stbuf), .path = path) }
+int tfs_opendir(const char *path)
+{ TIMED(OP_OPENDIR, do_opendir(path), .path = path) }
+int tfs_readdir(const char *path, tfs_filler_t filler, void *ctx)
+{ TIMED(OP_READDIR, do_readdir(path, filler, ctx), .path = path) }
+int tfs_mkdir(const char *path, mode_t mode)
+{ TIMED(OP_MKDIR, do_mkdir(path, mode), .path = path, .mode = mode) }
+int tfs_rmdir(const char *path)
+{ TIMED(OP_RMDIR, do_rmdir(path), .path = path) }
+int tfs_unlink(const char *path)
+{ TIMED(OP_UNLINK, do_unlink(path), .path = path) }
+int tfs_rename(const char *from, const char *to)
+{ TIMED(OP_RENAME, do_rename(from, to), .path = from, .path2 = to) }
+int tfs_link(const char *from, const char *to)
+{ TIMED(OP_LINK, do_link(from, to), .path = from, .path2 = to) }
+int tfs_chmod(const char *path, mode_t mode)
+{ TIMED(OP_CHMOD, do_chmod(path, mode), .path = path, .mode = mode) }
+int tfs_utimens(const char *path, const struct timespec tv[2])
+{ TIMED(OP_UTIMENS, do_utimens(path, tv), .path = path) }
+int tfs_truncate(const char *path, off_t size)
+{ TIMED(OP_TRUNCATE, do_truncate(path, size), .path = path, .offset = size) }
+int tfs_statfs(struct statvfs *stbuf)
+{ TIMED(OP_STATFS, do_statfs(stbuf)) }
+int tfs_open(const char *path, int flags, mode_t mode, struct tfs_file **file)
+{ TIMED((flags & O_CREAT) ? OP_CREATE : OP_OPEN, do_open(path, flags, mode, file), .path = path, .flags = flags, .mode = mode, .filep = file) }
+int tfs_pread(struct tfs_file *file, void *buf, size_t size, off_t offset)
+{ TIMED(OP_READ, do_pread(file, buf, size, offset), .file = file->id, .offset = offset, .size = size) }
+int tfs_pwrite(struct tfs_file *file, const void *buf, size_t size, off_t offset)
+{ TIMED(OP_WRITE, do_pwrite(file, buf, size, offset), .file = file->id, .offset = offset, .size = size) }
+int tfs_close(struct tfs_file *file)
+{ TIMED(OP_RELEASE, do_close(file), .file = file->id) }
+int tfs_fsync(struct tfs_file *file, int datasync)
+{ TIMED(OP_FSYNC, do_fsync(file, datasync), .file = file->id) }
+
+int tfs_direct_io(const struct tfs_file *file) {
+	return file->ctl != NULL;
+}
@@ -9,17 +9,31 @@
  *
  */
 
+#include <stdint.h>
 #include <linux/limits.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #ifndef _TFS_H
 #define _TFS_H
 
 #define MAGIC_NUM 0x5C3A
+/*
+ * on-disk format version: 2 has the compact inode and variable-length
+ * dirents, 3 the inode table watermark in the group descriptors, 4 the
+ * fragment maps of packed small files
+ */
+#define TFS_VERSION 4
 #define MAX_INUM 1024
 #define MAX_DNUM 16384
 
+#define NUM_GROUPS 8				/* block groups tfs_mkfs() lays out */
+#define ROOT_INO 2					/* inodes 0 and 1 are reserved */
+#define NUM_DIRECT 16
+#define NUM_INDIRECT 8
+#define PTRS_PER_BLK (BLOCK_SIZE/sizeof(int))
+
 
 struct superblock {
 	uint32_t	magic_num;			/* magic number */
@@ -29,40 +43,332 @@ struct superblock {
 	uint32_t	d_bitmap_blk;		/* start address of data block bitmap */
 	uint32_t	i_start_blk;		/* start address of inode region */
 	uint32_t	d_start_blk;		/* start address of data block region */
+	uint32_t	n_groups;			/* block groups */
+	uint32_t	inodes_per_group;
+	uint32_t	blocks_per_group;	/* data blocks per group */
+	uint32_t	group_blks;			/* blocks a group spans, bitmaps and inodes included */
+	uint32_t	version;			/* TFS_VERSION, 0 on images from before versions */
+	uint32_t	state;				/* TFS_CLEAN while unmounted cleanly */
+	uint32_t	free_inodes;		/* free counts, exact only in a clean image */
+	uint32_t	free_blocks;
+};
+
+/*
+ * Free inodes and data blocks of one group. The table of n_groups of them
+ * follows the superblock in block 0, as ext2's group descriptors do. tfs
+ * keeps block 0 in memory, updates the counts as it allocates and frees,
+ * and writes them back at unmount; a mount marks the image not clean until
+ * then, and counts of an image that is not clean are recounted from the
+ * bitmaps.
+ * Only the first itable_init blocks of a group's inode table have ever been
+ * written, the rest hold no valid inode whatever the disk has there, so
+ * mkfs never zeroes the inode tables. The inode allocator zeroes the block
+ * a new inode lands in when it is past the watermark, and writes block 0
+ * with the watermark raised before the inode is used.
+ * frag_map names the group's fragment map, see PACKED_ADDR, by its data
+ * bitmap bit plus one, 0 for a group without one.
+ */
+struct group_desc {
+	uint16_t	free_inodes;
+	uint16_t	free_blocks;
+	uint16_t	itable_init;		/* inode table blocks initialized, from the first */
+	uint16_t	frag_map;			/* data bit of the fragment map + 1, 0 for none */
 };
 
+#define TFS_CLEAN 1
+/* block 0 holds a group descriptor and a reference table address per group */
+#define MAX_GROUPS ((BLOCK_SIZE - sizeof(struct superblock)) / (sizeof(struct group_desc) + sizeof(uint32_t)))
+
+/*
+ * Data blocks a clone shares between files carry a reference count, the
+ * number of owners beyond the first, so a block no clone touched counts 0.
+ * A group's counts are one byte per block in a data block of the group's
+ * own, allocated by the first clone that shares one of its blocks. Block 0
+ * keeps the table addresses after the MAX_GROUPS descriptors, 0 for a group
+ * without one. Only the first BLOCK_SIZE blocks of a group can be shared,
+ * and a block MAX_REFS owners beyond the first share is copied instead.
+ */
+#define MAX_REFS 255
+
+/* 128 bytes, 32 to an inode table block */
 struct inode {
 	uint16_t	ino;				/* inode number */
 	uint16_t	valid;				/* validity of the inode */
 	uint32_t	size;				/* size of the file */
-	uint32_t	type;				/* type of the file */
-	uint32_t	link;				/* link count */
-	int			direct_ptr[16];		/* direct pointer to data block */
-	int			indirect_ptr[8];	/* indirect pointer to data block */
-	struct stat	vstat;				/* inode stat */
+	uint16_t	mode;				/* type and permission bits */
+	uint16_t	link;				/* link count */
+	int32_t		direct_ptr[16];		/* direct pointer to data block */
+	int32_t		indirect_ptr[8];	/* indirect pointer to data block */
+	uint32_t	atime;				/* access, modification and change times, in seconds */
+	uint32_t	mtime;
+	uint32_t	ctime;
+	uint32_t	uid;				/* owner, taken from the creating process */
+	uint32_t	gid;
 };
 
+/*
+ * Directory entries are variable length, as in ext2. The records of a
+ * directory block chain through rec_len and cover the whole block; a
+ * record with ino 0 is free space. Names are not NUL terminated.
+ */
 struct dirent {
-	uint16_t ino;					/* inode number of the directory entry */
-	uint16_t valid;					/* validity of the directory entry */
-	char name[252];					/* name of the directory entry */
+	uint16_t	ino;				/* inode number of the directory entry, 0 if unused */
+	uint16_t	rec_len;			/* bytes to the next record */
+	uint8_t		name_len;
+	uint8_t		file_type;			/* FT_REG or FT_DIR */
+	char		name[];				/* name of the directory entry */
+};
+
+#define FT_REG 1
+#define FT_DIR 2
+#define MAX_NAME_LEN 255
+
+/*
+ * On-disk layout, all addresses are block numbers:
+ *	superblock | group 0 | group 1 | ... | group n_groups-1
+ * and every group, group_blks long, is laid out as
+ *	inode bitmap | data bitmap | inode slice | data blocks
+ * The i_bitmap_blk .. d_start_blk fields of the superblock describe group 0,
+ * group g sits g * group_blks blocks further on. Inode ino lives in group
+ * ino / inodes_per_group, and bit n of group g's data bitmap is block
+ * grp_d_start(g) + n.
+ * The direct and indirect pointers hold absolute block numbers. Unused
+ * direct and indirect pointers are -1, unused slots in an indirect page are 0.
+ */
+
+/*
+ * File data may be kept in compressed clusters of CLUSTER_BLKS blocks,
+ * aligned to CLUSTER_BLKS in the file, so a cluster never straddles the
+ * direct pointers and an indirect page. The first pointer of a compressed
+ * cluster is COMPRESSED_ADDR and the next ones name the blocks holding a
+ * cluster_hdr and the compressed bytes; the rest are unused. A cluster that
+ * would not save a block stays raw.
+ */
+#define CLUSTER_BLKS 4
+#define COMPRESSED_ADDR (-2)
+#define CLUSTER_MAGIC 0x5A534654		/* "TFSZ" */
+
+struct cluster_hdr {
+	uint32_t	magic;
+	uint32_t	clen;				/* compressed bytes after the header */
+};
+
+/*
+ * A regular file of at most PACK_MAX bytes may be packed: kept in a run of
+ * FRAG_SIZE byte units of a fragment block, a data block several small
+ * files share. Its first direct pointer is PACKED_ADDR, the second the
+ * fragment block and the third the run's first unit; the run is as many
+ * units long as the size needs and the other pointers are unused. Which
+ * units are in use is kept in the group's fragment map, a data block of
+ * the group holding a mask per data block, bit u for unit u. A block whose
+ * mask is 0 is no fragment block. Only the first FRAG_MAP_BLKS data blocks
+ * of a group can be fragment blocks.
+ */
+#define FRAG_SIZE 256
+#define FRAGS_PER_BLK (BLOCK_SIZE / FRAG_SIZE)
+#define FRAG_MAP_BLKS (BLOCK_SIZE / sizeof(uint16_t))
+#define PACK_MAX (3 * BLOCK_SIZE / 4)
+#define PACKED_ADDR (-3)
+
+/*
+ * A log-structured write mode appends every block tfs writes to a log, in
+ * segments, and writes the blocks to their home addresses only when the
+ * log fills up (a checkpoint). The log is reserved inode LOG_INO, one run
+ * of LOG_BLKS data blocks starting at direct_ptr[0]. Its first block is a
+ * log_hdr, the rest a circular area of segments: a log_seg summary naming
+ * the home address of each of the n blocks that follow it. A segment that
+ * does not fit before the end of the area goes at its start. The segments
+ * past a checkpoint start at hdr.start and carry seq hdr.seq, hdr.seq + 1,
+ * and so on; the first one missing, stale or failing its checksum ends the
+ * log.
+ */
+#define LOG_INO 1
+#define LOG_BLKS 1024
+#define SEG_BLKS 32
+#define LOG_MAGIC 0x474C4654			/* "TFLG" */
+
+struct log_hdr {
+	uint32_t	magic;
+	uint32_t	seq;				/* seq of the first segment past the checkpoint */
+	uint32_t	start;				/* its position in the area */
 };
 
+struct log_seg {
+	uint32_t	magic;
+	uint32_t	seq;
+	uint32_t	n;					/* blocks in the segment, 1 to SEG_BLKS */
+	uint32_t	csum;				/* log_csum() of the summary and the blocks */
+	uint32_t	home[SEG_BLKS];
+};
+
+/*
+ * The dedup index is kept on disk only while tfs is not mounted. At a clean
+ * unmount the fingerprint of every indexed data block is written to a run
+ * of data blocks owned by the reserved inode DEDUP_INO, direct_ptr[0] its
+ * first block and size the bytes of dedup_entry records. The next mount
+ * reads the run back and frees it.
+ */
+#define DEDUP_INO 0
+
+struct dedup_entry {
+	uint64_t	hash;				/* dedup_hash() of the block's contents */
+	uint32_t	blk;
+	uint32_t	pad;
+};
+#define INODE_SIZE sizeof(struct inode)
+#define NUM_INODES (BLOCK_SIZE/INODE_SIZE)
+/* each bitmap is a single block, so a group holds at most this many inodes or blocks */
+#define MAX_BITMAP_BITS (BLOCK_SIZE*8)
+/* inode numbers and the superblock's counts are 16 bits wide */
+#define MAX_TOTAL 65535
+
+/* record length of an entry with a name_len byte name, records are 4 byte aligned */
+#define DIRENT_LEN(name_len) ((sizeof(struct dirent) + (name_len) + 3) & ~3)
+#define NEXT_DIRENT(d) ((struct dirent *)((char *)(d) + (d)->rec_len))
+
 
 /*
  * bitmap operations
  */
 typedef unsigned char* bitmap_t;
-void set_bitmap(bitmap_t b, int i) {
+static inline void set_bitmap(bitmap_t b, int i) {
     b[i / 8] |= 1 << (i & 7);
 }
 
-void unset_bitmap(bitmap_t b, int i) {
+static inline void unset_bitmap(bitmap_t b, int i) {
     b[i / 8] &= ~(1 << (i & 7));
 }
 
-uint8_t get_bitmap(bitmap_t b, int i) {
+static inline uint8_t get_bitmap(bitmap_t b, int i) {
     return b[i / 8] & (1 << (i & 7)) ? 1 : 0;
 }
 
+/*
+ * block group geometry
+ */
+static inline uint32_t grp_i_bitmap(const struct superblock *sb, uint32_t g) {
+	return sb->i_bitmap_blk + g * sb->group_blks;
+}
+
+static inline uint32_t grp_d_bitmap(const struct superblock *sb, uint32_t g) {
+	return sb->d_bitmap_blk + g * sb->group_blks;
+}
+
+static inline uint32_t grp_i_start(const struct superblock *sb, uint32_t g) {
+	return sb->i_start_blk + g * sb->group_blks;
+}
+
+static inline uint32_t grp_d_start(const struct superblock *sb, uint32_t g) {
+	return sb->d_start_blk + g * sb->group_blks;
+}
+
+static inline struct group_desc *sb_groups(struct superblock *sb) {
+	return (struct group_desc *)(sb + 1);
+}
+
+static inline uint32_t *sb_ref_blks(struct superblock *sb) {
+	return (uint32_t *)(sb_groups(sb) + MAX_GROUPS);
+}
+
+static inline int is_packed(const struct inode *inode) {
+	return inode->direct_ptr[0] == PACKED_ADDR;
+}
+
+/* units a packed file of size bytes takes, and the mask of such a run from unit on */
+static inline uint32_t frag_units(uint32_t size) {
+	return (size + FRAG_SIZE - 1) / FRAG_SIZE;
+}
+
+static inline uint16_t frag_run_mask(uint32_t unit, uint32_t n) {
+	return ((1u << n) - 1) << unit;
+}
+
+static inline uint32_t ino_group(const struct superblock *sb, uint32_t ino) {
+	return ino / sb->inodes_per_group;
+}
+
+/* inode table block holding ino, and its slot in that block */
+static inline uint32_t ino_blk(const struct superblock *sb, uint32_t ino) {
+	return grp_i_start(sb, ino_group(sb, ino)) + ino % sb->inodes_per_group / NUM_INODES;
+}
+
+static inline uint32_t ino_slot(const struct superblock *sb, uint32_t ino) {
+	return ino % sb->inodes_per_group % NUM_INODES;
+}
+
+/* whether the inode table block holding ino is below its group's watermark, sb is all of block 0 */
+static inline int ino_initialized(struct superblock *sb, uint32_t ino) {
+	return ino % sb->inodes_per_group / NUM_INODES < sb_groups(sb)[ino_group(sb, ino)].itable_init;
+}
+
+/* group whose data area holds block blk, or -1 for any other block */
+static inline int blk_group(const struct superblock *sb, int64_t blk) {
+	if (blk < sb->i_bitmap_blk)
+		return -1;
+	uint32_t g = (blk - sb->i_bitmap_blk) / sb->group_blks;
+	if (g >= sb->n_groups || blk < grp_d_start(sb, g))
+		return -1;
+	return g;
+}
+
+/*
+ * Data blocks numbered across groups, g * blocks_per_group + bit, for
+ * tools that keep one array over every data block
+ */
+static inline uint32_t dblk_index(const struct superblock *sb, uint32_t blk) {
+	uint32_t g = blk_group(sb, blk);
+	return g * sb->blocks_per_group + blk - grp_d_start(sb, g);
+}
+
+static inline uint32_t dblk_at(const struct superblock *sb, uint32_t idx) {
+	return grp_d_start(sb, idx / sb->blocks_per_group) + idx % sb->blocks_per_group;
+}
+
+/*
+ * on-disk format helpers shared by tfs and the offline tools (format.c)
+ */
+void tfs_layout(struct superblock *sb, uint32_t n_groups, uint32_t inodes_per_group, uint32_t blocks_per_group);
+void init_inode(struct inode *inode, uint16_t ino, uint16_t mode);
+uint32_t file_blocks(uint32_t data_blocks);
+void dirblk_init(void *blk);
+int dirblk_bad(const void *blk, const struct dirent *d);
+struct dirent *dirblk_find(void *blk, const char *name, size_t name_len);
+struct dirent *dirblk_add(void *blk, uint16_t ino, const char *name, size_t name_len, uint8_t file_type);
+int dirblk_remove(void *blk, const char *name, size_t name_len);
+int dirblk_empty(void *blk);
+uint32_t log_csum(const struct log_seg *seg, const void *const *blks);
+int log_replay(uint32_t log_blk, uint32_t end, struct log_hdr *hdr,
+	void (*rd)(uint32_t blk, void *buf), void (*wr)(uint32_t blk, const void *buf));
+
+/*
+ * tfs.c state used by the online defragmenter (defrag.c), the cloner
+ * (clone.c), the cluster compressor (compress.c), dedup (dedup.c), the
+ * prefetch (prefetch.c) and tail packing (frag.c). FUSE callbacks hold
+ * fs_lock for reading, a file being moved holds it for writing.
+ */
+extern struct superblock *superblock;
+extern pthread_rwlock_t fs_lock;
+int readi(uint16_t ino, struct inode *inode);
+int writei(uint16_t ino, struct inode *inode);
+void lock_inodes(const uint16_t *inos, int n);
+void unlock_inodes(const uint16_t *inos, int n);
+void lock_inode(uint16_t ino);
+void unlock_inode(uint16_t ino);
+int get_node_by_path(const char *path, uint16_t ino, struct inode *inode);
+int new_node(const char *path, mode_t mode, struct inode *inode);
+int get_avail_blkno(uint16_t owner);
+int claim_blk_below(uint32_t g, uint32_t limit);
+void claim_blk_run(uint32_t g, uint32_t bit, uint32_t n);
+int claim_free_run(uint32_t n);
+int set_file_blk(struct inode *inode, int idx, int blk);
+void free_blkno(int blkno);
+void free_blk_list(const int *blks, int n);
+int blk_refs(int blk);
+int share_blk(int blk);
+int share_blk_if(int blk, int (*check)(int blk, void *arg), void *arg);
+void lock_blk_group(int blk);
+void unlock_blk_group(int blk);
+void flush_refs();
+void write_sb();
+
 #endif
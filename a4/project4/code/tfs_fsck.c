@@ -0,0 +1,868 @@
+/*
+ *  Copyright (C) 2020 CS416 Rutgers CS
+ *	Tiny File System
+ *	File:	tfs_fsck.c
+ *
+ *	Offline consistency checker for a TFS DISKFILE. The inode table,
+ *	indirect pages and directory blocks are each read with large
+ *	sequential preads split across threads, so a check is bound by disk
+ *	bandwidth rather than by following one pointer at a time.
+ *
+ *	usage: tfs_fsck [-n|-y] [-j threads] [DISKFILE]
+ *		-n	check only (default)
+ *		-y	repair: replay the log, free orphaned inodes and blocks, drop
+ *			bad directory entries, fix link counts, directory sizes,
+ *			reference counts, fragment maps, both bitmaps and the free
+ *			counts; a packed file whose run is bad or taken is emptied
+ *
+ *	Exit status as e2fsck: 0 clean, 1 errors corrected, 4 errors left
+ *	uncorrected, 8 operational error.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "block.h"
+#include "tfs.h"
+
+/* blocks coalesced into one pread */
+#define RUN_BLOCKS 256
+
+#define OWNER_NONE 0
+#define OWNER_DUP UINT32_MAX
+#define OWNER_REFS (UINT32_MAX - 1)	/* a group's reference table */
+#define OWNER_LOG (UINT32_MAX - 2)	/* the log's run */
+#define OWNER_DEDUP (UINT32_MAX - 3)	/* the dedup index's run */
+#define OWNER_FRAGMAP (UINT32_MAX - 4)	/* a group's fragment map */
+#define OWNER_FRAG (UINT32_MAX - 5)	/* a fragment block, packed files share it */
+
+struct edge {
+	uint32_t	parent;				/* directory inode */
+	uint32_t	blk;				/* directory block holding the entry */
+	uint32_t	off;				/* byte offset of the entry in the block */
+	uint32_t	ino;
+	char		name[MAX_NAME_LEN + 1];
+};
+
+struct edge_vec {
+	struct edge	*e;
+	size_t		n;
+	size_t		cap;
+};
+
+struct blk_vec {
+	uint32_t	*b;
+	uint32_t	*ino;				/* owner of each block */
+	size_t		n;
+	size_t		cap;
+};
+
+/* One slice of a sorted block list handed to a reader thread */
+struct read_job {
+	pthread_t	tid;
+	int			id;
+	const uint32_t	*blocks;
+	size_t		lo;
+	size_t		hi;
+	void		(*fn)(int id, size_t idx, uint32_t blk, char *data);
+};
+
+static int diskfile = -1;
+static int nthreads;
+static int repair;
+static struct superblock sb;
+static struct inode *inodes;		/* the whole inode table */
+static uint32_t *owner;				/* data block -> owning inode, per data bitmap bit */
+static uint16_t *claims;			/* data block -> pointers to it */
+static struct blk_vec *indirect;	/* per thread: indirect pages found */
+static struct blk_vec *dirblks;		/* per thread: directory blocks found */
+static struct edge_vec *edges;		/* per thread: directory entries found */
+static struct blk_vec all_indirect, all_dirblks;
+static uint64_t bytes_read;
+static int errors, fixed;
+
+static char *iblk_dirty;			/* inode table blocks to write back */
+
+/* the scan passes report from several threads at once */
+#define problem(...) do { __atomic_fetch_add(&errors, 1, __ATOMIC_RELAXED); printf(__VA_ARGS__); } while (0)
+#define corrected() __atomic_fetch_add(&fixed, 1, __ATOMIC_RELAXED)
+
+static void *xrealloc(void *p, size_t n) {
+	p = realloc(p, n);
+	if (p == NULL) {
+		perror("tfs_fsck");
+		exit(8);
+	}
+	return p;
+}
+
+static void blk_push(struct blk_vec *v, uint32_t blk, uint32_t ino) {
+	if (v->n == v->cap) {
+		v->cap = v->cap ? v->cap * 2 : 1024;
+		v->b = xrealloc(v->b, v->cap * sizeof(uint32_t));
+		v->ino = xrealloc(v->ino, v->cap * sizeof(uint32_t));
+	}
+	v->b[v->n] = blk;
+	v->ino[v->n] = ino;
+	v->n++;
+}
+
+static void edge_push(struct edge_vec *v, const struct edge *e) {
+	if (v->n == v->cap) {
+		v->cap = v->cap ? v->cap * 2 : 1024;
+		v->e = xrealloc(v->e, v->cap * sizeof(struct edge));
+	}
+	v->e[v->n++] = *e;
+}
+
+static int is_data_blk(int64_t blk) {
+	return blk_group(&sb, blk) >= 0;
+}
+
+/* inode table blocks per group */
+static uint32_t islice;
+
+/* Index of the inode table block holding ino, in the order pass 1 reads them */
+static size_t iblk_idx(uint32_t ino) {
+	return ino_group(&sb, ino) * islice + ino % sb.inodes_per_group / NUM_INODES;
+}
+
+/* Record that ino uses data block blk, remembering blocks claimed twice */
+static void claim(uint32_t blk, uint32_t ino) {
+	uint32_t *o = &owner[dblk_index(&sb, blk)];
+	__atomic_fetch_add(&claims[dblk_index(&sb, blk)], 1, __ATOMIC_RELAXED);
+	uint32_t expected = OWNER_NONE;
+	if (!__atomic_compare_exchange_n(o, &expected, ino, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		__atomic_store_n(o, OWNER_DUP, __ATOMIC_RELAXED);
+}
+
+static void *reader(void *arg) {
+	struct read_job *job = arg;
+	char *buf = malloc(RUN_BLOCKS * BLOCK_SIZE);
+	size_t i = job->lo;
+	while (i < job->hi) {
+		// extend the run while the blocks are consecutive on disk
+		size_t n = 1;
+		while (i + n < job->hi && n < RUN_BLOCKS && job->blocks[i + n] == job->blocks[i] + n)
+			n++;
+		ssize_t ret = pread(diskfile, buf, n * BLOCK_SIZE, (off_t)job->blocks[i] * BLOCK_SIZE);
+		if (ret < 0) {
+			perror("pread");
+			exit(8);
+		}
+		// blocks past the end of a sparse image read back as zeros
+		if (ret < n * BLOCK_SIZE)
+			memset(buf + ret, 0, n * BLOCK_SIZE - ret);
+		__atomic_fetch_add(&bytes_read, ret, __ATOMIC_RELAXED);
+		for (size_t k = 0; k < n; k++)
+			job->fn(job->id, i + k, job->blocks[i + k], buf + k * BLOCK_SIZE);
+		i += n;
+	}
+	free(buf);
+	return NULL;
+}
+
+/* Read every block of a sorted list, split evenly across the threads */
+static void read_blocks(const uint32_t *blocks, size_t n, void (*fn)(int, size_t, uint32_t, char *)) {
+	struct read_job jobs[nthreads];
+	for (int t = 0; t < nthreads; t++) {
+		jobs[t].id = t;
+		jobs[t].blocks = blocks;
+		jobs[t].lo = n * t / nthreads;
+		jobs[t].hi = n * (t + 1) / nthreads;
+		jobs[t].fn = fn;
+		pthread_create(&jobs[t].tid, NULL, reader, &jobs[t]);
+	}
+	for (int t = 0; t < nthreads; t++)
+		pthread_join(jobs[t].tid, NULL);
+}
+
+static void write_block(uint32_t blk, const void *data) {
+	if (pwrite(diskfile, data, BLOCK_SIZE, (off_t)blk * BLOCK_SIZE) != BLOCK_SIZE) {
+		perror("pwrite");
+		exit(8);
+	}
+}
+
+static void read_block(uint32_t blk, void *data) {
+	memset(data, 0, BLOCK_SIZE);
+	if (pread(diskfile, data, BLOCK_SIZE, (off_t)blk * BLOCK_SIZE) < 0) {
+		perror("pread");
+		exit(8);
+	}
+}
+
+/* a compressed cluster's marker belongs in the first slot of a cluster of a file */
+static int is_cluster_slot(const struct inode *in, int slot) {
+	return S_ISREG(in->mode) && slot % CLUSTER_BLKS == 0;
+}
+
+/* whether a packed file's run lies in a fragment block and nothing else is set */
+static int packed_ok(const struct inode *in) {
+	if (!S_ISREG(in->mode) || in->size == 0 || in->size > PACK_MAX || !is_data_blk(in->direct_ptr[1]))
+		return 0;
+	uint32_t g = blk_group(&sb, in->direct_ptr[1]);
+	if (in->direct_ptr[1] - grp_d_start(&sb, g) >= FRAG_MAP_BLKS || in->direct_ptr[2] < 0
+		|| in->direct_ptr[2] + frag_units(in->size) > FRAGS_PER_BLK)
+		return 0;
+	for (int i = 3; i < NUM_DIRECT; i++) {
+		if (in->direct_ptr[i] != -1)
+			return 0;
+	}
+	for (int j = 0; j < NUM_INDIRECT; j++) {
+		if (in->indirect_ptr[j] != -1)
+			return 0;
+	}
+	return 1;
+}
+
+/* leave a packed file empty, when its run cannot be trusted */
+static void empty_packed(struct inode *in, uint32_t ino) {
+	memset(in->direct_ptr, -1, sizeof(in->direct_ptr));
+	memset(in->indirect_ptr, -1, sizeof(in->indirect_ptr));
+	in->size = 0;
+	iblk_dirty[iblk_idx(ino)] = 1;
+	corrected();
+}
+
+/*
+ * Pass 1: the inode table. Copies every inode into memory, checks its
+ * pointers, and collects the indirect pages and directory blocks to read next.
+ * Only the blocks below each group's watermark are read, the inodes past it
+ * stay zero.
+ */
+static void scan_inodes(int id, size_t pos, uint32_t blk, char *data) {
+	struct inode *table = (struct inode *)data;
+	size_t idx = (blk - sb.i_start_blk) / sb.group_blks * islice + (blk - sb.i_start_blk) % sb.group_blks;
+	uint32_t first = idx % islice * NUM_INODES;
+	for (int slot = 0; slot < NUM_INODES; slot++) {
+		if (first + slot >= sb.inodes_per_group)
+			break;
+		uint32_t ino = idx / islice * sb.inodes_per_group + first + slot;
+		struct inode *in = &inodes[ino];
+		*in = table[slot];
+		if (!in->valid || ino < ROOT_INO)
+			continue;
+		// a packed file's fragment block is claimed once for all its files, after pass 4
+		if (is_packed(in) && S_ISREG(in->mode)) {
+			if (!packed_ok(in)) {
+				problem("inode %u: bad packed run (block %d unit %d, size %u)\n", ino,
+					in->direct_ptr[1], in->direct_ptr[2], in->size);
+				if (repair)
+					empty_packed(in, ino);
+			}
+			continue;
+		}
+		for (int i = 0; i < NUM_DIRECT; i++) {
+			if (in->direct_ptr[i] == -1 || (in->direct_ptr[i] == COMPRESSED_ADDR && is_cluster_slot(in, i)))
+				continue;
+			if (!is_data_blk(in->direct_ptr[i])) {
+				problem("inode %u: direct pointer %d out of range (%d)\n", ino, i, in->direct_ptr[i]);
+				if (repair) {
+					in->direct_ptr[i] = -1;
+					iblk_dirty[idx] = 1;
+					corrected();
+				}
+				continue;
+			}
+			claim(in->direct_ptr[i], ino);
+			if (S_ISDIR(in->mode))
+				blk_push(&dirblks[id], in->direct_ptr[i], ino);
+		}
+		for (int j = 0; j < NUM_INDIRECT; j++) {
+			if (in->indirect_ptr[j] == -1)
+				continue;
+			if (!is_data_blk(in->indirect_ptr[j])) {
+				problem("inode %u: indirect pointer %d out of range (%d)\n", ino, j, in->indirect_ptr[j]);
+				if (repair) {
+					in->indirect_ptr[j] = -1;
+					iblk_dirty[idx] = 1;
+					corrected();
+				}
+				continue;
+			}
+			claim(in->indirect_ptr[j], ino);
+			blk_push(&indirect[id], in->indirect_ptr[j], ino);
+		}
+	}
+}
+
+/* Pass 2: indirect pages */
+static void scan_indirect(int id, size_t idx, uint32_t blk, char *data) {
+	int *page = (int *)data;
+	uint32_t ino = all_indirect.ino[idx];
+	for (int k = 0; k < PTRS_PER_BLK; k++) {
+		if (page[k] == 0 || (page[k] == COMPRESSED_ADDR && is_cluster_slot(&inodes[ino], k)))
+			continue;
+		if (!is_data_blk(page[k])) {
+			problem("inode %u: indirect page %u slot %d out of range (%d)\n", ino, blk, k, page[k]);
+			continue;
+		}
+		claim(page[k], ino);
+	}
+}
+
+/*
+ * Pass 3: directory blocks, every live entry becomes an edge of the tree.
+ * A record chain that runs off the block or through a record too short for
+ * its name ends there; repair turns the rest of the block into free space.
+ */
+static void scan_dirs(int id, size_t idx, uint32_t blk, char *data) {
+	struct dirent *prev = NULL;
+	struct edge e;
+	e.parent = all_dirblks.ino[idx];
+	e.blk = blk;
+	for (uint32_t off = 0; off < BLOCK_SIZE; ) {
+		struct dirent *d = (struct dirent *)(data + off);
+		if (off + sizeof(struct dirent) > BLOCK_SIZE || d->rec_len == 0 || d->rec_len % 4
+			|| off + d->rec_len > BLOCK_SIZE || d->rec_len < DIRENT_LEN(d->name_len)) {
+			problem("directory %u: block %u: bad record length %u at offset %u\n",
+				e.parent, blk, off + sizeof(struct dirent) > BLOCK_SIZE ? 0 : d->rec_len, off);
+			if (repair) {
+				if (prev != NULL) {
+					prev->rec_len = BLOCK_SIZE - ((char *)prev - data);
+				} else {
+					d->ino = 0;
+					d->rec_len = BLOCK_SIZE;
+					d->name_len = 0;
+				}
+				write_block(blk, data);
+				corrected();
+			}
+			break;
+		}
+		if (d->ino != 0) {
+			e.off = off;
+			e.ino = d->ino;
+			memcpy(e.name, d->name, d->name_len);
+			e.name[d->name_len] = '\0';
+			edge_push(&edges[id], &e);
+		}
+		prev = d;
+		off += d->rec_len;
+	}
+}
+
+static int by_blk(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : (x > y);
+}
+
+/* Merge the per-thread block lists into one list sorted by block number */
+static void merge_sorted(struct blk_vec *per_thread, struct blk_vec *out) {
+	size_t n = 0;
+	for (int t = 0; t < nthreads; t++)
+		n += per_thread[t].n;
+	uint64_t *pairs = malloc((n ? n : 1) * sizeof(uint64_t));
+	size_t k = 0;
+	for (int t = 0; t < nthreads; t++) {
+		for (size_t i = 0; i < per_thread[t].n; i++)
+			pairs[k++] = (uint64_t)per_thread[t].b[i] << 32 | per_thread[t].ino[i];
+	}
+	qsort(pairs, n, sizeof(uint64_t), by_blk);
+	memset(out, 0, sizeof(*out));
+	for (size_t i = 0; i < n; i++)
+		blk_push(out, pairs[i] >> 32, (uint32_t)pairs[i]);
+	free(pairs);
+}
+
+static void skip_block(uint32_t blk, const void *data) {
+}
+
+/*
+ * Replay the log, if the image has one, with -y. A log that cannot be
+ * read is dropped and its run left to pass 6 to free. Returns the log's
+ * first block, 0 for none.
+ */
+static uint32_t check_log(const char *path) {
+	char block[BLOCK_SIZE];
+	read_block(ino_blk(&sb, LOG_INO), block);
+	struct inode *in = (struct inode *)block + ino_slot(&sb, LOG_INO);
+	if (!in->valid)
+		return 0;
+	int32_t blk = in->direct_ptr[0];
+	struct log_hdr hdr;
+	const char *bad = NULL;
+	if (blk_group(&sb, blk) < 0 || blk_group(&sb, (int64_t)blk + LOG_BLKS - 1) != blk_group(&sb, blk))
+		bad = "log inode points out of the data area";
+	else {
+		char hdr_block[BLOCK_SIZE];
+		read_block(blk, hdr_block);
+		memcpy(&hdr, hdr_block, sizeof(hdr));
+		if (hdr.magic != LOG_MAGIC || hdr.start >= LOG_BLKS - 1)
+			bad = "log header is bad";
+	}
+	if (bad != NULL) {
+		problem("%s (block %d)\n", bad, blk);
+		if (repair) {
+			memset(in, 0, INODE_SIZE);
+			write_block(ino_blk(&sb, LOG_INO), block);
+			corrected();
+		}
+		return 0;
+	}
+	uint32_t end = sb.i_bitmap_blk + sb.n_groups * sb.group_blks;
+	if (!repair) {
+		int n = log_replay(blk, end, &hdr, read_block, skip_block);
+		if (n > 0) {
+			problem("%s: log holds %d segments not written home, -y replays them\n", path, n);
+			exit(4);
+		}
+		return blk;
+	}
+	int n = log_replay(blk, end, &hdr, read_block, write_block);
+	if (n > 0) {
+		fsync(diskfile);
+		memset(block, 0, BLOCK_SIZE);
+		memcpy(block, &hdr, sizeof(hdr));
+		write_block(blk, block);
+		printf("replayed %d log segments\n", n);
+	}
+	return blk;
+}
+
+/*
+ * The dedup index a clean unmount left, which the next mount reads and
+ * frees. An index that points out of the data area is dropped with -y.
+ * Returns its first block, and the blocks it spans in *n_blks.
+ */
+static uint32_t check_dedup(uint32_t *n_blks) {
+	char block[BLOCK_SIZE];
+	read_block(ino_blk(&sb, DEDUP_INO), block);
+	struct inode *in = (struct inode *)block + ino_slot(&sb, DEDUP_INO);
+	*n_blks = 0;
+	if (!in->valid)
+		return 0;
+	uint32_t per_blk = BLOCK_SIZE / sizeof(struct dedup_entry);
+	uint32_t n = (in->size / sizeof(struct dedup_entry) + per_blk - 1) / per_blk;
+	int32_t blk = in->direct_ptr[0];
+	if (n == 0 || blk_group(&sb, blk) < 0 || blk_group(&sb, (int64_t)blk + n - 1) != blk_group(&sb, blk)) {
+		problem("dedup index inode points out of the data area (block %d)\n", blk);
+		if (repair) {
+			memset(in, 0, INODE_SIZE);
+			write_block(ino_blk(&sb, DEDUP_INO), block);
+			corrected();
+		}
+		return 0;
+	}
+	*n_blks = n;
+	return blk;
+}
+
+static void usage(const char *prog) {
+	fprintf(stderr, "usage: %s [-n|-y] [-j threads] [DISKFILE]\n", prog);
+	exit(8);
+}
+
+int main(int argc, char **argv) {
+	const char *path = "DISKFILE";
+	struct timeval start, end;
+	int c;
+
+	nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	while ((c = getopt(argc, argv, "nyj:")) != -1) {
+		switch (c) {
+		case 'n': repair = 0; break;
+		case 'y': repair = 1; break;
+		case 'j': nthreads = atoi(optarg); break;
+		default: usage(argv[0]);
+		}
+	}
+	if (optind < argc)
+		path = argv[optind];
+	if (nthreads < 1)
+		nthreads = 1;
+	gettimeofday(&start, NULL);
+
+	diskfile = open(path, repair ? O_RDWR : O_RDONLY);
+	if (diskfile < 0) {
+		perror(path);
+		exit(8);
+	}
+	char block[BLOCK_SIZE], sb_block[BLOCK_SIZE];
+	read_block(0, sb_block);
+	memcpy(&sb, sb_block, sizeof(sb));
+	if (sb.magic_num != MAGIC_NUM) {
+		fprintf(stderr, "%s: bad magic number 0x%x, not a tfs image\n", path, sb.magic_num);
+		exit(8);
+	}
+	if (sb.version != TFS_VERSION) {
+		fprintf(stderr, "%s: on-disk format version %u, tfs_fsck checks version %d\n", path, sb.version, TFS_VERSION);
+		exit(8);
+	}
+	islice = (sb.inodes_per_group + NUM_INODES - 1) / NUM_INODES;
+	if (sb.inodes_per_group == 0 || sb.blocks_per_group == 0 || sb.n_groups > MAX_GROUPS
+		|| sb.inodes_per_group > MAX_BITMAP_BITS || sb.blocks_per_group > MAX_BITMAP_BITS
+		|| sb.max_inum != sb.n_groups * sb.inodes_per_group || sb.max_dnum != sb.n_groups * sb.blocks_per_group
+		|| sb.i_start_blk + islice > sb.d_start_blk
+		|| sb.group_blks != sb.d_start_blk - sb.i_bitmap_blk + sb.blocks_per_group) {
+		fprintf(stderr, "%s: superblock geometry is inconsistent\n", path);
+		exit(8);
+	}
+
+	// segments in the log past its checkpoint are newer than the blocks they replace
+	uint32_t log_blk = check_log(path);
+	read_block(0, sb_block);
+	memcpy(&sb, sb_block, sizeof(sb));
+
+	inodes = calloc(sb.max_inum, INODE_SIZE);
+	owner = calloc(sb.max_dnum, sizeof(uint32_t));
+	claims = calloc(sb.max_dnum, sizeof(uint16_t));
+	indirect = calloc(nthreads, sizeof(struct blk_vec));
+	dirblks = calloc(nthreads, sizeof(struct blk_vec));
+	edges = calloc(nthreads, sizeof(struct edge_vec));
+
+	// the groups' reference tables, a table that is out of range is ignored
+	uint32_t *ref_blks = sb_ref_blks((struct superblock *)sb_block);
+	uint8_t **refs = calloc(sb.n_groups, sizeof(uint8_t *));
+	char *refs_dirty = calloc(sb.n_groups, 1);
+	for (uint32_t g = 0; g < sb.n_groups; g++) {
+		if (ref_blks[g] == 0)
+			continue;
+		if (!is_data_blk(ref_blks[g])) {
+			problem("group %u: reference table out of range (%u)\n", g, ref_blks[g]);
+			if (repair) {
+				ref_blks[g] = 0;
+				corrected();
+			}
+			continue;
+		}
+		refs[g] = malloc(BLOCK_SIZE);
+		read_block(ref_blks[g], refs[g]);
+		claim(ref_blks[g], OWNER_REFS);
+	}
+	for (uint32_t i = 0; log_blk != 0 && i < LOG_BLKS; i++)
+		claim(log_blk + i, OWNER_LOG);
+	uint32_t dedup_blks, dedup_blk = check_dedup(&dedup_blks);
+	for (uint32_t i = 0; i < dedup_blks; i++)
+		claim(dedup_blk + i, OWNER_DEDUP);
+
+	// the groups' fragment maps, a map that is out of range is rebuilt after pass 5
+	struct group_desc *desc = sb_groups((struct superblock *)sb_block);
+	uint16_t **frag_maps = calloc(sb.n_groups, sizeof(uint16_t *));
+	char *frag_maps_dirty = calloc(sb.n_groups, 1);
+	for (uint32_t g = 0; g < sb.n_groups; g++) {
+		if (desc[g].frag_map == 0)
+			continue;
+		if (desc[g].frag_map > sb.blocks_per_group) {
+			problem("group %u: fragment map out of range (bit %u)\n", g, desc[g].frag_map - 1);
+			if (repair) {
+				desc[g].frag_map = 0;
+				corrected();
+			}
+			continue;
+		}
+		frag_maps[g] = malloc(BLOCK_SIZE);
+		read_block(grp_d_start(&sb, g) + desc[g].frag_map - 1, frag_maps[g]);
+		claim(grp_d_start(&sb, g) + desc[g].frag_map - 1, OWNER_FRAGMAP);
+	}
+
+	// Pass 1: inode table, as far as each group's watermark
+	size_t n_iblks = sb.n_groups * islice, n_init = 0;
+	iblk_dirty = calloc(n_iblks, 1);
+	uint32_t *iblks = malloc(n_iblks * sizeof(uint32_t));
+	for (uint32_t g = 0; g < sb.n_groups; g++) {
+		// the block of the root and the reserved inodes is always initialized
+		uint32_t lo = g == 0 ? 1 : 0;
+		if (desc[g].itable_init < lo || desc[g].itable_init > islice) {
+			problem("group %u: inode table watermark %u, the table has %u blocks\n", g, desc[g].itable_init, islice);
+			if (repair)
+				corrected();
+			// what lies past the last inode the bitmap has in use is taken for garbage
+			read_block(grp_i_bitmap(&sb, g), block);
+			uint32_t last = sb.inodes_per_group;
+			while (last > 0 && !get_bitmap((bitmap_t)block, last - 1))
+				last--;
+			desc[g].itable_init = (last + NUM_INODES - 1) / NUM_INODES;
+			if (desc[g].itable_init < lo)
+				desc[g].itable_init = lo;
+		}
+		for (uint32_t b = 0; b < desc[g].itable_init; b++)
+			iblks[n_init++] = grp_i_start(&sb, g) + b;
+	}
+	read_blocks(iblks, n_init, scan_inodes);
+	free(iblks);
+
+	// Pass 2 and 3: indirect pages and directory blocks, in disk order
+	merge_sorted(indirect, &all_indirect);
+	read_blocks(all_indirect.b, all_indirect.n, scan_indirect);
+	merge_sorted(dirblks, &all_dirblks);
+	read_blocks(all_dirblks.b, all_dirblks.n, scan_dirs);
+
+	// Pass 4: walk the tree from the root over the entries found
+	if (!inodes[ROOT_INO].valid || !S_ISDIR(inodes[ROOT_INO].mode)) {
+		fprintf(stderr, "root inode %d is not a valid directory, giving up\n", ROOT_INO);
+		exit(4);
+	}
+	uint32_t *children = calloc(sb.max_inum, sizeof(uint32_t));	/* entries naming each inode */
+	char *reachable = calloc(sb.max_inum, 1);
+	struct edge **edge_list;
+	size_t total_edges = 0;
+	for (int t = 0; t < nthreads; t++)
+		total_edges += edges[t].n;
+	edge_list = malloc((total_edges ? total_edges : 1) * sizeof(struct edge *));
+	size_t k = 0;
+	for (int t = 0; t < nthreads; t++) {
+		for (size_t i = 0; i < edges[t].n; i++)
+			edge_list[k++] = &edges[t].e[i];
+	}
+
+	// drop entries that name a free or out of range inode
+	for (size_t i = 0; i < total_edges; i++) {
+		struct edge *e = edge_list[i];
+		if (e->ino < ROOT_INO || e->ino >= sb.max_inum || !inodes[e->ino].valid) {
+			problem("directory %u: entry '%s' points to free inode %u\n", e->parent, e->name, e->ino);
+			if (repair) {
+				read_block(e->blk, block);
+				((struct dirent *)(block + e->off))->ino = 0;
+				write_block(e->blk, block);
+				corrected();
+			}
+			edge_list[i] = NULL;
+		}
+	}
+
+	// breadth-first from the root, repeated sweeps over the edge list are
+	// cheap next to the I/O, and no edge is followed twice
+	reachable[ROOT_INO] = 1;
+	int grew = 1;
+	while (grew) {
+		grew = 0;
+		for (size_t i = 0; i < total_edges; i++) {
+			struct edge *e = edge_list[i];
+			if (e == NULL || !reachable[e->parent])
+				continue;
+			edge_list[i] = NULL;
+			children[e->ino]++;
+			if (S_ISDIR(inodes[e->ino].mode) && children[e->ino] > 1)
+				problem("directory %u is linked more than once ('%s' in %u)\n", e->ino, e->name, e->parent);
+			if (!reachable[e->ino]) {
+				reachable[e->ino] = 1;
+				grew = 1;
+			}
+		}
+	}
+
+	// Pass 5: inodes and the inode bitmaps
+	char *i_bitmaps = malloc(sb.n_groups * BLOCK_SIZE), *d_bitmaps = malloc(sb.n_groups * BLOCK_SIZE);
+	char *i_bitmap_dirty = calloc(sb.n_groups, 1), *d_bitmap_dirty = calloc(sb.n_groups, 1);
+	for (uint32_t g = 0; g < sb.n_groups; g++) {
+		read_block(grp_i_bitmap(&sb, g), i_bitmaps + g * BLOCK_SIZE);
+		read_block(grp_d_bitmap(&sb, g), d_bitmaps + g * BLOCK_SIZE);
+	}
+	uint32_t n_files = 0, n_dirs = 0, n_blocks = 0;
+
+	for (uint32_t ino = ROOT_INO; ino < sb.max_inum; ino++) {
+		struct inode *in = &inodes[ino];
+		if (in->valid && !reachable[ino]) {
+			problem("inode %u: orphaned (not reachable from the root)\n", ino);
+			if (repair) {
+				in->valid = 0;
+				iblk_dirty[iblk_idx(ino)] = 1;
+				corrected();
+			}
+		}
+		int live = in->valid && reachable[ino];
+		if (live) {
+			if (S_ISDIR(in->mode))
+				n_dirs++;
+			else
+				n_files++;
+			if (!S_ISDIR(in->mode) && in->link != children[ino]) {
+				problem("inode %u: link count %u, %u entries name it\n", ino, in->link, children[ino]);
+				if (repair) {
+					in->link = children[ino];
+					iblk_dirty[iblk_idx(ino)] = 1;
+					corrected();
+				}
+			}
+			// a directory's size counts the blocks it has
+			uint32_t dir_size = 0;
+			for (int i = 0; i < NUM_DIRECT; i++)
+				dir_size += in->direct_ptr[i] != -1 ? BLOCK_SIZE : 0;
+			if (S_ISDIR(in->mode) && in->size != dir_size) {
+				problem("directory %u: size %u, expected %u\n", ino, in->size, dir_size);
+				if (repair) {
+					in->size = dir_size;
+					iblk_dirty[iblk_idx(ino)] = 1;
+					corrected();
+				}
+			}
+		}
+		uint32_t g = ino_group(&sb, ino), bit = ino % sb.inodes_per_group;
+		bitmap_t i_bitmap = (bitmap_t)(i_bitmaps + g * BLOCK_SIZE);
+		if (get_bitmap(i_bitmap, bit) != live) {
+			problem("inode bitmap: inode %u is %s but marked %s\n", ino,
+				live ? "in use" : "free", live ? "free" : "in use");
+			if (repair) {
+				if (live)
+					set_bitmap(i_bitmap, bit);
+				else
+					unset_bitmap(i_bitmap, bit);
+				i_bitmap_dirty[g] = 1;
+				corrected();
+			}
+		}
+	}
+
+	// Pass 5b: the runs of the live packed files against the fragment maps,
+	// a run that overlaps one found before empties its file
+	uint16_t *frag_want = calloc(sb.max_dnum, sizeof(uint16_t));
+	for (uint32_t ino = ROOT_INO; ino < sb.max_inum; ino++) {
+		struct inode *in = &inodes[ino];
+		if (!in->valid || !reachable[ino] || !is_packed(in) || !packed_ok(in))
+			continue;
+		uint32_t idx = dblk_index(&sb, in->direct_ptr[1]);
+		uint16_t run = frag_run_mask(in->direct_ptr[2], frag_units(in->size));
+		if (frag_want[idx] & run) {
+			problem("inode %u: packed run overlaps another in block %d\n", ino, in->direct_ptr[1]);
+			if (repair)
+				empty_packed(in, ino);
+			continue;
+		}
+		if (frag_want[idx] == 0)
+			claim(in->direct_ptr[1], OWNER_FRAG);
+		frag_want[idx] |= run;
+	}
+	for (uint32_t g = 0; g < sb.n_groups; g++) {
+		uint32_t limit = sb.blocks_per_group < FRAG_MAP_BLKS ? sb.blocks_per_group : FRAG_MAP_BLKS;
+		for (uint32_t bit = 0; bit < limit; bit++) {
+			uint16_t want = frag_want[g * sb.blocks_per_group + bit];
+			uint16_t have = frag_maps[g] != NULL ? frag_maps[g][bit] : 0;
+			if (want == have)
+				continue;
+			problem("block %u: fragment map 0x%04x, packed files use 0x%04x\n",
+				grp_d_start(&sb, g) + bit, have, want);
+			if (!repair)
+				continue;
+			// a group that lost its map gets a new one in a block nothing claims
+			if (frag_maps[g] == NULL) {
+				uint32_t free_bit = 0;
+				while (free_bit < sb.blocks_per_group && owner[g * sb.blocks_per_group + free_bit] != OWNER_NONE)
+					free_bit++;
+				if (free_bit == sb.blocks_per_group)
+					continue;
+				frag_maps[g] = calloc(1, BLOCK_SIZE);
+				desc[g].frag_map = free_bit + 1;
+				claim(grp_d_start(&sb, g) + free_bit, OWNER_FRAGMAP);
+			}
+			frag_maps[g][bit] = want;
+			frag_maps_dirty[g] = 1;
+			corrected();
+		}
+	}
+
+	// Pass 6: the data bitmap against the blocks the live inodes reach
+	for (uint32_t idx = 0; idx < sb.max_dnum; idx++) {
+		uint32_t o = owner[idx];
+		int live = o == OWNER_DUP || o == OWNER_REFS || o == OWNER_LOG || o == OWNER_DEDUP
+			|| o == OWNER_FRAGMAP || o == OWNER_FRAG || (o != OWNER_NONE && inodes[o].valid && reachable[o]);
+		uint32_t g = idx / sb.blocks_per_group, bit = idx % sb.blocks_per_group;
+		// a block may have as many owners as its reference count allows
+		uint32_t shared = refs[g] != NULL && bit < BLOCK_SIZE ? refs[g][bit] : 0;
+		uint32_t expected = claims[idx] > 1 ? claims[idx] - 1 : 0;
+		if (shared != expected) {
+			problem("block %u: %u owners, reference count %u\n", dblk_at(&sb, idx), claims[idx], shared);
+			if (repair && refs[g] != NULL && bit < BLOCK_SIZE && expected <= MAX_REFS) {
+				refs[g][bit] = expected;
+				refs_dirty[g] = 1;
+				corrected();
+			}
+		}
+		n_blocks += live;
+		bitmap_t d_bitmap = (bitmap_t)(d_bitmaps + g * BLOCK_SIZE);
+		if (get_bitmap(d_bitmap, bit) != live) {
+			problem("data bitmap: block %u is %s but marked %s\n", dblk_at(&sb, idx),
+				live ? "in use" : "free", live ? "free" : "in use");
+			if (repair) {
+				if (live)
+					set_bitmap(d_bitmap, bit);
+				else
+					unset_bitmap(d_bitmap, bit);
+				d_bitmap_dirty[g] = 1;
+				corrected();
+			}
+		}
+	}
+
+	// Pass 7: the free counts in block 0, which are exact only in a clean image
+	uint32_t free_inodes = 0, free_blocks = 0;
+	for (uint32_t g = 0; g < sb.n_groups; g++) {
+		uint32_t fi = 0, fb = 0;
+		for (uint32_t bit = g == 0 ? ROOT_INO : 0; bit < sb.inodes_per_group; bit++)
+			fi += !get_bitmap((bitmap_t)(i_bitmaps + g * BLOCK_SIZE), bit);
+		for (uint32_t bit = 0; bit < sb.blocks_per_group; bit++)
+			fb += !get_bitmap((bitmap_t)(d_bitmaps + g * BLOCK_SIZE), bit);
+		if (sb.state == TFS_CLEAN && (desc[g].free_inodes != fi || desc[g].free_blocks != fb)) {
+			problem("group %u: free counts %u inodes, %u blocks, expected %u, %u\n", g,
+				desc[g].free_inodes, desc[g].free_blocks, fi, fb);
+			if (repair)
+				corrected();
+		}
+		desc[g].free_inodes = fi;
+		desc[g].free_blocks = fb;
+		free_inodes += fi;
+		free_blocks += fb;
+	}
+	if (sb.state == TFS_CLEAN && (sb.free_inodes != free_inodes || sb.free_blocks != free_blocks)) {
+		problem("superblock: free counts %u inodes, %u blocks, expected %u, %u\n",
+			sb.free_inodes, sb.free_blocks, free_inodes, free_blocks);
+		if (repair)
+			corrected();
+	}
+	if (sb.state != TFS_CLEAN)
+		printf("%s: not cleanly unmounted, free counts %s\n", path,
+			repair ? "rewritten" : "will be recounted at mount");
+
+	if (repair) {
+		sb.state = TFS_CLEAN;
+		sb.free_inodes = free_inodes;
+		sb.free_blocks = free_blocks;
+		memcpy(sb_block, &sb, sizeof(sb));
+		write_block(0, sb_block);
+		for (size_t b = 0; b < n_iblks; b++) {
+			if (!iblk_dirty[b])
+				continue;
+			struct inode *table = (struct inode *)block;
+			uint32_t g = b / islice, first = b % islice * NUM_INODES;
+			read_block(grp_i_start(&sb, g) + b % islice, block);
+			for (int slot = 0; slot < NUM_INODES && first + slot < sb.inodes_per_group; slot++)
+				table[slot] = inodes[g * sb.inodes_per_group + first + slot];
+			write_block(grp_i_start(&sb, g) + b % islice, block);
+		}
+		for (uint32_t g = 0; g < sb.n_groups; g++) {
+			if (refs_dirty[g])
+				write_block(ref_blks[g], refs[g]);
+			if (frag_maps_dirty[g])
+				write_block(grp_d_start(&sb, g) + desc[g].frag_map - 1, frag_maps[g]);
+			if (i_bitmap_dirty[g])
+				write_block(grp_i_bitmap(&sb, g), i_bitmaps + g * BLOCK_SIZE);
+			if (d_bitmap_dirty[g])
+				write_block(grp_d_bitmap(&sb, g), d_bitmaps + g * BLOCK_SIZE);
+		}
+		fsync(diskfile);
+	}
+	close(diskfile);
+
+	gettimeofday(&end, NULL);
+	double secs = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+	printf("%s: %u files, %u directories, %u/%u data blocks, %d threads\n",
+		path, n_files, n_dirs, n_blocks, sb.max_dnum, nthreads);
+	printf("%s: read %.1f MB in %.3f s (%.1f MB/s)\n", path, bytes_read / 1048576.0, secs,
+		secs > 0 ? bytes_read / 1048576.0 / secs : 0.0);
+	if (errors == 0) {
+		printf("%s: clean\n", path);
+		return 0;
+	}
+	printf("%s: %d problems, %d fixed\n", path, errors, fixed);
+	return fixed == errors ? 1 : 4;
+}
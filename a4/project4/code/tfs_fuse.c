@@ -0,0 +1,154 @@
+/*
+ *  Copyright (C) 2020 CS416 Rutgers CS
+ *	Tiny File System
+ *	File:	tfs_fuse.c
+ *
+ *	The FUSE daemon: mounts an image through libtfs and passes every
+ *	callback on to it. The libtfs handle of an open file lives in fi->fh.
+ */
+
+
+#define FUSE_USE_VERSION 26
+#define _GNU_SOURCE
+
+#include <fuse.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+
+#include "libtfs.h"
+
+/*
+ * Every change to the tree and to attributes goes through this mount, and the
+ * kernel drops what it cached itself when it sends one, so it may keep names
+ * and attributes for a while. The defragmenter moves blocks but changes no
+ * attribute or byte of data.
+ */
+#define CACHE_OPTS "-oattr_timeout=60,entry_timeout=60"
+
+char diskfile_path[PATH_MAX];
+
+static void *fs_init(struct fuse_conn_info *conn) {
+#ifdef FUSE_CAP_BIG_WRITES
+	// Let the kernel hand over writes larger than a page in one call
+	if(conn->capable & FUSE_CAP_BIG_WRITES)
+		conn->want |= FUSE_CAP_BIG_WRITES;
+#endif
+	if(tfs_mount(diskfile_path) < 0)
+		exit(EXIT_FAILURE);
+	return NULL;
+}
+
+static void fs_destroy(void *userdata) {
+	tfs_unmount();
+}
+
+/*
+ * New files and directories belong to the process that asked for them
+ */
+static void set_cred() {
+	struct fuse_context* ctx = fuse_get_context();
+	tfs_set_cred(ctx->uid, ctx->gid);
+}
+
+static struct tfs_file *file_of(struct fuse_file_info *fi) {
+	return (struct tfs_file *)(uintptr_t)fi->fh;
+}
+
+static int fs_getattr(const char *path, struct stat *stbuf)
+{ return tfs_getattr(path, stbuf); }
+static int fs_opendir(const char *path, struct fuse_file_info *fi)
+{ return tfs_opendir(path); }
+static int fs_readdir(const char *path, void *buffer, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
+{ return tfs_readdir(path, filler, buffer); }
+static int fs_releasedir(const char *path, struct fuse_file_info *fi)
+{ return 0; }
+static int fs_mkdir(const char *path, mode_t mode)
+{ set_cred(); return tfs_mkdir(path, mode); }
+static int fs_rmdir(const char *path)
+{ return tfs_rmdir(path); }
+static int fs_unlink(const char *path)
+{ return tfs_unlink(path); }
+static int fs_rename(const char *from, const char *to)
+{ return tfs_rename(from, to); }
+static int fs_link(const char *from, const char *to)
+{ return tfs_link(from, to); }
+static int fs_chmod(const char *path, mode_t mode)
+{ return tfs_chmod(path, mode); }
+static int fs_utimens(const char *path, const struct timespec tv[2])
+{ return tfs_utimens(path, tv); }
+static int fs_truncate(const char *path, off_t size)
+{ return tfs_truncate(path, size); }
+static int fs_statfs(const char *path, struct statvfs *stbuf)
+{ return tfs_statfs(stbuf); }
+static int fs_flush(const char *path, struct fuse_file_info *fi)
+{ return 0; }
+
+static int fs_open_flags(const char *path, int flags, mode_t mode, struct fuse_file_info *fi) {
+	struct tfs_file* file;
+	int ret = tfs_open(path, flags, mode, &file);
+	if(ret < 0)
+		return ret;
+	fi->fh = (uint64_t)(uintptr_t)file;
+	// the kernel must not trust the size getattr gives a control file
+	fi->direct_io = tfs_direct_io(file);
+	return 0;
+}
+
+static int fs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{ set_cred(); return fs_open_flags(path, fi->flags | O_CREAT | O_EXCL, mode, fi); }
+static int fs_open(const char *path, struct fuse_file_info *fi)
+{ return fs_open_flags(path, fi->flags, 0, fi); }
+static int fs_read(const char *path, char *buffer, size_t size, off_t offset, struct fuse_file_info *fi)
+{ return tfs_pread(file_of(fi), buffer, size, offset); }
+static int fs_write(const char *path, const char *buffer, size_t size, off_t offset, struct fuse_file_info *fi)
+{ return tfs_pwrite(file_of(fi), buffer, size, offset); }
+static int fs_release(const char *path, struct fuse_file_info *fi)
+{ return tfs_close(file_of(fi)); }
+static int fs_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{ return tfs_fsync(file_of(fi), datasync); }
+
+
+static struct fuse_operations tfs_ope = {
+	.init		= fs_init,
+	.destroy	= fs_destroy,
+
+	.getattr	= fs_getattr,
+	.readdir	= fs_readdir,
+	.opendir	= fs_opendir,
+	.releasedir	= fs_releasedir,
+	.mkdir		= fs_mkdir,
+	.rmdir		= fs_rmdir,
+
+	.create		= fs_create,
+	.open		= fs_open,
+	.read 		= fs_read,
+	.write		= fs_write,
+	.unlink		= fs_unlink,
+
+	.truncate   = fs_truncate,
+	.flush      = fs_flush,
+	.utimens    = fs_utimens,
+	.statfs     = fs_statfs,
+	.chmod      = fs_chmod,
+	.rename     = fs_rename,
+	.link       = fs_link,
+	.fsync      = fs_fsync,
+	.release	= fs_release
+};
+
+
+int main(int argc, char *argv[]) {
+	int fuse_stat;
+	getcwd(diskfile_path, PATH_MAX);
+	strcat(diskfile_path, "/DISKFILE");
+
+	// the cache timeouts go first so a -o on the command line overrides them
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	fuse_opt_insert_arg(&args, 1, CACHE_OPTS);
+	fuse_stat = fuse_main(args.argc, args.argv, &tfs_ope, NULL);
+	fuse_opt_free_args(&args);
+	return fuse_stat;
+}
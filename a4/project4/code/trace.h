@@ -0,0 +1,58 @@
+/*
+ *  Copyright (C) 2020 CS416 Rutgers CS
+ *	Tiny File System
+ *	File:	trace.h
+ *
+ */
+
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <stdint.h>
+
+/* set TFS_TRACE=<file> in the environment of tfs to record block I/O */
+#define TRACE_ENV "TFS_TRACE"
+#define TRACE_MAGIC 0x54465354		/* "TFST" */
+#define TRACE_VERSION 2
+/* ring capacity in records, must be a power of two (24MB) */
+#define TRACE_RING_SIZE (1 << 20)
+
+#define TRACE_READ 0
+#define TRACE_WRITE 1
+
+struct trace_rec {
+	uint64_t	ts_ns;				/* ns since tracing started */
+	uint32_t	block;				/* block number passed to bio_read/bio_write */
+	uint32_t	call;				/* id of the FUSE call that issued the I/O */
+	uint16_t	ino;				/* inode the call was working on */
+	uint8_t		rw;					/* TRACE_READ or TRACE_WRITE */
+	uint8_t		fuse_op;			/* enum tfs_op of the originating call */
+	uint32_t	seq;				/* slot sequence, lets the dump skip torn slots */
+};
+
+/* the trace file is a header followed by nrecs records, oldest first */
+struct trace_hdr {
+	uint32_t	magic;
+	uint32_t	version;
+	uint64_t	nrecs;
+	uint64_t	dropped;			/* records overwritten before the dump */
+	uint32_t	i_bitmap_blk;		/* layout, so the analyzer can tell metadata from data */
+	uint32_t	d_bitmap_blk;
+	uint32_t	i_start_blk;
+	uint32_t	d_start_blk;
+	uint32_t	group_blks;			/* version 2 on: block groups repeat the layout this often */
+	uint32_t	reserved;
+};
+
+extern int trace_enabled;
+
+int trace_init(const char *path, const struct trace_hdr *layout);
+void trace_record(int block, int rw);
+void trace_dump();
+
+/* per-thread attribution of block I/O to the FUSE call that caused it */
+void trace_enter(int fuse_op);
+void trace_leave();
+void trace_ino(uint16_t ino);
+
+#endif